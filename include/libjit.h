@@ -100,6 +100,10 @@ enum e_jit_errors {
     JIT_ERROR_VREG_NOT_FOUND,
     JIT_ERROR_REG_BUSY,
     JIT_ERROR_VREG_INVALID,
+    JIT_ERROR_MMAP,
+    JIT_ERROR_NOT_FOUND,
+    JIT_ERROR_RELOC_RANGE,
+    JIT_ERROR_BAD_LABEL,
     JIT_MAX,
 };
 
@@ -108,11 +112,38 @@ enum e_jit_errors {
 
 enum e_jit_flags {
     JIT_FLAG_NONE = 0,
+    /* Assign host registers for the whole block from its live ranges before
+     * emitting it, instead of on the fly. */
+    JIT_FLAG_LINEAR_SCAN = (1 << 0),
+    /* Emit every instruction with its plain encoding, without looking at
+     * its neighbours for a shorter one. */
+    JIT_FLAG_NO_PEEPHOLE = (1 << 1),
+    /* Keep to the baseline x86-64 instructions even on hosts with BMI2:
+     * shifts by a register go through cl. */
+    JIT_FLAG_NO_BMI2 = (1 << 2),
     JIT_FLAG_MAX = (1 << 31),
 };
 
 typedef uint32_t jit_flags;
 
+/* Verbosity of the trace messages passed to the sink: each level includes
+ * the ones before it. */
+enum e_jit_trace_level {
+    JIT_TRACE_NONE = 0,
+    /* Things the library could not do. */
+    JIT_TRACE_ERROR,
+    /* Bytes emitted for each instruction. */
+    JIT_TRACE_EMIT,
+    /* Register allocation decisions. */
+    JIT_TRACE_ALLOC,
+};
+
+typedef enum e_jit_trace_level jit_trace_level;
+
+/* Receives one trace message, newline-terminated. */
+typedef void (*jit_trace_fn)(void *ctx, jit_trace_level level,
+        const char *msg);
+
 enum e_jit_operand {
     JIT_OPERAND_INVALID = -1,
     JIT_OPERAND_REG = 0,
@@ -120,6 +151,7 @@ enum e_jit_operand {
     JIT_OPERAND_REGPTR,
     JIT_OPERAND_IMMPTR,
     JIT_OPERAND_IMMDISP,
+    JIT_OPERAND_LABEL,
 };
 
 typedef enum e_jit_operand jit_operand;
@@ -168,12 +200,59 @@ enum e_jit_op {
     JIT_OP_RET  = 15,
     JIT_OP_PUSH = 16,
     JIT_OP_POP  = 17,
+    JIT_OP_CMP  = 18,
+    /* DIV is signed; these are unsigned division and the two remainders,
+     * signed with the sign of the dividend. A zero divisor, or INT_MIN
+     * divided by -1, traps as the hardware division would; 8 and 16-bit
+     * operations divide the extended operands, so there only the zero
+     * divisor does. Multiplication and division leave the flags undefined. */
+    JIT_OP_DIVU = 19,
+    JIT_OP_REM  = 20,
+    JIT_OP_REMU = 21,
+    /* Zero- and sign-extend the low opsz bytes of in1 into all of out. */
+    JIT_OP_MOVZX = 22,
+    JIT_OP_MOVSX = 23,
+    /* Without branching, on a condition as for JUMP_IF: out = 1 if it holds
+     * and 0 if not, or out = in1 only if it holds. */
+    JIT_OP_SET_IF = 24,
+    JIT_OP_MOVE_IF = 25,
+    /* Set the flags as the operation in out (ADD, SUB, AND, OR or XOR) on
+     * in1 and in2 would, see jit_guest_flags_get. */
+    JIT_OP_FLAGS = 26,
+    /* Leave the block for the guest address in1, like RET but returning
+     * in1, unless a jit_blockcache sends it straight on to the block it
+     * holds for in1. */
+    JIT_OP_EXIT = 27,
     
     JIT_NUM_OPS,
 };
 
 typedef enum e_jit_op jit_op;
 
+/* Conditions of JUMP_IF, SET_IF and MOVE_IF, on the flags set by the last
+ * CMP (or arithmetic operation). After CMP a, b they read as "a cond b"; the
+ * U ones compare as unsigned. On their own, EQ is the zero flag, LTU the
+ * carry (a borrow, after SUB), NEG the sign and OV the overflow flag. */
+enum e_jit_cond {
+    JIT_COND_EQ = 0,
+    JIT_COND_NE,
+    JIT_COND_LT,
+    JIT_COND_LE,
+    JIT_COND_GT,
+    JIT_COND_GE,
+    JIT_COND_LTU,
+    JIT_COND_LEU,
+    JIT_COND_GTU,
+    JIT_COND_GEU,
+    JIT_COND_NEG,
+    JIT_COND_NNEG,
+    JIT_COND_OV,
+    JIT_COND_NOV,
+    JIT_NUM_CONDS,
+};
+
+typedef enum e_jit_cond jit_cond;
+
 struct jit_ptr {
     jit_reg base;
     jit_reg index;
@@ -195,6 +274,8 @@ union u_jit_operand_union {
     int32_t *m8ptr;
     
     void *ptr;
+
+    jit_label label;
 };
 
 typedef union u_jit_operand_union jit_operand_union;
@@ -216,6 +297,9 @@ struct jit_instr {
     struct jit_instr *next;
 };
 
+/* Operations act on the low opsz bytes of their operands. Those narrower than
+ * 64 bits leave the rest of the output unspecified; MOVZX and MOVSX widen a
+ * value. Immediates of 64-bit operations are taken whole, from imm64. */
 enum e_jit_opsz {
     JIT_8BIT = 1,
     JIT_16BIT = 2,
@@ -228,7 +312,7 @@ enum e_jit_opsz {
     (i)->in1.reg=a; (i)->out.reg=b; (i)->opsz=s
 #define MOVE_I_R(i,a,b,s) (i)->op=JIT_OP_MOVE; \
     (i)->in1_type=JIT_OPERAND_IMM; (i)->out_type=JIT_OPERAND_REG; \
-    (i)->in1.imm32=a; (i)->out.reg=b; (i)->opsz=s
+    (i)->in1.imm64=a; (i)->out.reg=b; (i)->opsz=s
 #define MOVE_ID_R(i,a,b,s) (i)->op=JIT_OP_MOVE; \
     (i)->in1_type=JIT_OPERAND_IMMDISP; (i)->out_type=JIT_OPERAND_REG; \
     (i)->in1.ptr=a; (i)->out.reg=b; (i)->opsz=s
@@ -238,6 +322,8 @@ enum e_jit_opsz {
 #define MOVE_R_M(i,a,b,s) (i)->op=JIT_OP_MOVE; \
     (i)->in1_type=JIT_OPERAND_REG; (i)->out_type=JIT_OPERAND_IMMPTR; \
     (i)->in1.reg=a; (i)->out.m32ptr=b; (i)->opsz=s
+/* Register pointers address [b + n * s + o]; either register may be
+ * JIT_REG_INVALID, and s is 1, 2, 4 or 8 (0 meaning 1). */
 #define MOVE_RP_R(i,b,n,s,o,r,z) (i)->op=JIT_OP_MOVE; \
     (i)->in1_type=JIT_OPERAND_REGPTR; (i)->out_type=JIT_OPERAND_REG; \
     (i)->in1.regptr.base=b; (i)->in1.regptr.index=n; \
@@ -250,6 +336,16 @@ enum e_jit_opsz {
     (i)->out.regptr.scale=s; (i)->out.regptr.offset=o; \
     (i)->opsz=z
 
+/* out = in1 zero- or sign-extended from s bytes, in a register or memory. */
+#define MOVZX_R_R(i,a,b,s) MOVE_R_R((i),(a),(b),(s)); (i)->op=JIT_OP_MOVZX
+#define MOVZX_M_R(i,a,b,s) MOVE_M_R((i),(a),(b),(s)); (i)->op=JIT_OP_MOVZX
+#define MOVSX_R_R(i,a,b,s) MOVE_R_R((i),(a),(b),(s)); (i)->op=JIT_OP_MOVSX
+#define MOVSX_M_R(i,a,b,s) MOVE_M_R((i),(a),(b),(s)); (i)->op=JIT_OP_MOVSX
+#define MOVZX_RP_R(i,b,n,s,o,r,z) MOVE_RP_R((i),(b),(n),(s),(o),(r),(z)); \
+    (i)->op=JIT_OP_MOVZX
+#define MOVSX_RP_R(i,b,n,s,o,r,z) MOVE_RP_R((i),(b),(n),(s),(o),(r),(z)); \
+    (i)->op=JIT_OP_MOVSX
+
 #define CALL_M(i,a,s) (i)->op=JIT_OP_CALL; \
     (i)->in1_type=JIT_OPERAND_IMMPTR; (i)->in1.m32ptr=a; (i)->opsz=s
 
@@ -260,13 +356,75 @@ enum e_jit_opsz {
 
 #define RET(i) (i)->op=JIT_OP_RET
 
+/* Leave for guest address a, as an immediate or in a register. */
+#define EXIT_I(i,a) (i)->op=JIT_OP_EXIT; \
+    (i)->in1_type=JIT_OPERAND_IMM; (i)->in1.imm64=a; (i)->opsz=JIT_64BIT
+#define EXIT_R(i,a) (i)->op=JIT_OP_EXIT; \
+    (i)->in1_type=JIT_OPERAND_REG; (i)->in1.reg=a; (i)->opsz=JIT_64BIT
+
+/* Compare in1 with in2 (CMP_R_R), or in2 with the immediate (CMP_I_R). */
+#define CMP_R_R(i,a,b,s) (i)->op=JIT_OP_CMP; \
+    (i)->in1_type=(i)->in2_type=JIT_OPERAND_REG; \
+    (i)->in1.reg=a; (i)->in2.reg=b; (i)->opsz=s
+#define CMP_I_R(i,a,b,s) (i)->op=JIT_OP_CMP; \
+    (i)->in1_type=JIT_OPERAND_IMM; (i)->in2_type=JIT_OPERAND_REG; \
+    (i)->in1.imm64=a; (i)->in2.reg=b; (i)->opsz=s
+
+/* Jump to a label, always or if condition c holds. A forward jump can be
+ * added before its target, then pointed at it with JUMP_TO once known. */
+#define JUMP(i,l) (i)->op=JIT_OP_JUMP; \
+    (i)->in1_type=JIT_OPERAND_LABEL; (i)->in1.label=l
+#define JUMP_IF(i,c,l) (i)->op=JIT_OP_JUMP_IF; \
+    (i)->in1_type=JIT_OPERAND_LABEL; (i)->in1.label=l; \
+    (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c
+#define JUMP_TO(i,l) (i)->in1.label=l
+
+/* Set out to whether condition c holds, as 0 or 1 in all of its s bytes. */
+#define SET_IF(i,c,r,s) (i)->op=JIT_OP_SET_IF; \
+    (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c; \
+    (i)->out_type=JIT_OPERAND_REG; (i)->out.reg=r; (i)->opsz=s
+/* Move in1 (a register, immediate or memory) to out if condition c holds,
+ * leaving out as it was otherwise. Memory is read either way. */
+#define MOVE_IF_R_R(i,c,a,b,s) MOVE_R_R((i),(a),(b),(s)); \
+    (i)->op=JIT_OP_MOVE_IF; (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c
+#define MOVE_IF_I_R(i,c,a,b,s) MOVE_I_R((i),(a),(b),(s)); \
+    (i)->op=JIT_OP_MOVE_IF; (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c
+#define MOVE_IF_M_R(i,c,a,b,s) MOVE_M_R((i),(a),(b),(s)); \
+    (i)->op=JIT_OP_MOVE_IF; (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c
+#define MOVE_IF_RP_R(i,c,b,n,x,o,r,z) MOVE_RP_R((i),(b),(n),(x),(o),(r),(z)); \
+    (i)->op=JIT_OP_MOVE_IF; (i)->in2_type=JIT_OPERAND_IMM; (i)->in2.imm32=c
+
 #define OP_R_R_R(i,o,a,b,c,s) (i)->op=(o); \
     (i)->in1_type=(i)->in2_type=(i)->out_type=JIT_OPERAND_REG; \
     (i)->in1.reg=a; (i)->in2.reg=b; (i)->out.reg=c; (i)->opsz=s
 #define OP_I_R_R(i,o,a,b,c,s) (i)->op=(o); \
     (i)->in1_type=JIT_OPERAND_IMM; \
     (i)->in2_type=(i)->out_type=JIT_OPERAND_REG; \
-    (i)->in1.imm32=a; (i)->in2.reg=b; (i)->out.reg=c; (i)->opsz=s
+    (i)->in1.imm64=a; (i)->in2.reg=b; (i)->out.reg=c; (i)->opsz=s
+
+/* ADD, SUB, AND, OR, XOR and CMP may have one operand in memory, M at an
+ * address: an input, read from there, or the output when it is also that
+ * input, which updates it in place (for SUB, only as the left side). Any of
+ * them can be made a register pointer instead with OPND_RP. */
+#define OP_M_R_R(i,o,a,b,c,s) OP_R_R_R((i),(o),0,(b),(c),(s)); \
+    (i)->in1_type=JIT_OPERAND_IMMPTR; (i)->in1.m32ptr=a
+#define OP_R_M_R(i,o,a,b,c,s) OP_R_R_R((i),(o),(a),0,(c),(s)); \
+    (i)->in2_type=JIT_OPERAND_IMMPTR; (i)->in2.m32ptr=b
+#define OP_I_M_R(i,o,a,b,c,s) OP_I_R_R((i),(o),(a),0,(c),(s)); \
+    (i)->in2_type=JIT_OPERAND_IMMPTR; (i)->in2.m32ptr=b
+#define OP_M_R_M(i,o,a,b,s) OP_M_R_R((i),(o),(a),(b),0,(s)); \
+    (i)->out_type=JIT_OPERAND_IMMPTR; (i)->out.m32ptr=a
+#define OP_I_M_M(i,o,a,b,s) OP_I_M_R((i),(o),(a),(b),0,(s)); \
+    (i)->out_type=JIT_OPERAND_IMMPTR; (i)->out.m32ptr=b
+#define CMP_M_R(i,a,b,s) CMP_R_R((i),0,(b),(s)); \
+    (i)->in1_type=JIT_OPERAND_IMMPTR; (i)->in1.m32ptr=a
+#define CMP_R_M(i,a,b,s) CMP_R_R((i),(a),0,(s)); \
+    (i)->in2_type=JIT_OPERAND_IMMPTR; (i)->in2.m32ptr=b
+#define CMP_I_M(i,a,b,s) CMP_I_R((i),(a),0,(s)); \
+    (i)->in2_type=JIT_OPERAND_IMMPTR; (i)->in2.m32ptr=b
+#define OPND_RP(i,k,b,n,s,o) (i)->k##_type=JIT_OPERAND_REGPTR; \
+    (i)->k.regptr.base=b; (i)->k.regptr.index=n; \
+    (i)->k.regptr.scale=s; (i)->k.regptr.offset=o
 
 #define ADD_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_ADD,(a),(b),(c),(s))
 #define ADD_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_ADD,(a),(b),(c),(s))
@@ -280,11 +438,52 @@ enum e_jit_opsz {
 #define SHR_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_SHR,(a),(b),(c),(s))
 #define SAR_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_SAR,(a),(b),(c),(s))
 #define SHL_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_SHL,(a),(b),(c),(s))
+#define MUL_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_MUL,(a),(b),(c),(s))
+#define MUL_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_MUL,(a),(b),(c),(s))
+#define DIV_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_DIV,(a),(b),(c),(s))
+#define DIV_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_DIV,(a),(b),(c),(s))
+#define DIVU_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_DIVU,(a),(b),(c),(s))
+#define DIVU_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_DIVU,(a),(b),(c),(s))
+#define REM_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_REM,(a),(b),(c),(s))
+#define REM_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_REM,(a),(b),(c),(s))
+#define REMU_R_R_R(i,a,b,c,s) OP_R_R_R((i),JIT_OP_REMU,(a),(b),(c),(s))
+#define REMU_I_R_R(i,a,b,c,s) OP_I_R_R((i),JIT_OP_REMU,(a),(b),(c),(s))
+
+
+/* An EXIT to a guest address known when emitting: the offset in the block of
+ * the rel32 of a jmp to the code that returns the address. Pointing it at
+ * the address's block instead chains the two. */
+struct jit_exit {
+    size_t off;
+    uint64_t pc;
+};
 
+/* An entry of the table EXITs to a register look their next block up in:
+ * the code for guest address pc, if pc hashes to the entry. */
+struct jit_block_entry {
+    uint64_t pc;
+    void *code;
+};
+
+/* Which entry of a table of mask + 1 guest address pc goes in. */
+#define JIT_BLOCK_HASH_SHIFT 12
+#define JIT_BLOCK_HASH(pc,mask) (((pc) ^ ((pc) >> JIT_BLOCK_HASH_SHIFT)) & \
+        (mask))
 
 struct jit_emitter;
+struct jit_instr_slab;
+struct jit_ir;
+struct jit_liveness;
+struct jit_cfg;
 
 struct jit_state {
+    /* Options passed to jit_create. */
+    jit_flags flags;
+    /* Trace messages up to trace_level go to trace_fn, see jit_set_trace. */
+    jit_trace_level trace_level;
+    jit_trace_fn trace_fn;
+    void *trace_ctx;
+
     /* Number of instructions in the basic block.*/
     size_t blk_ni;
     /* Number of bytes in the basic block. */
@@ -295,17 +494,49 @@ struct jit_state {
     uint8_t *p_bufstart;
     /* Pointer to current location in code buffer. */
     uint8_t *p_bufcur;
+    /* Pointer past the end of the code buffer, or NULL if unbounded. */
+    uint8_t *p_bufend;
+    /* Address the block will execute from, if not p_bufstart. */
+    uint8_t *p_bufexec;
+    /* Buffer allocated by the library once the caller's one overflowed. */
+    uint8_t *p_bufown;
+
+    /* Offsets of rel32 fields in the block that refer to absolute addresses,
+     * and so must be adjusted whenever the code moves. */
+    size_t *p_relocs;
+    size_t nrelocs;
+    size_t nrelocs_alloc;
+    /* Set once a rel32 field could not be recorded: the block can neither
+     * be completed nor copied. */
+    jit_error reloc_error;
+
+    /* The block's EXITs to immediate addresses. */
+    struct jit_exit *p_exits;
+    size_t nexits;
+    size_t nexits_alloc;
+    /* Table EXITs to a register look in, or NULL to always return, and its
+     * number of entries less one. */
+    struct jit_block_entry *p_exit_table;
+    uint64_t exit_table_mask;
 
     /* Current highest jit register index. */
     int32_t regcur;
     /* Last instruction added. */
     struct jit_instr *p_icur;
 
-    /* Internal book-keeping. */
-    struct jit_instr *p_ipool;
-    size_t nipool;
+    /* Internal book-keeping: slabs of instructions, the one currently
+     * being filled, and how many of its entries are in use. */
+    struct jit_instr_slab *p_slabs;
+    struct jit_instr_slab *p_slabcur;
     size_t nicur;
 
+    /* Compact, index-based copy of the instructions for analysis passes. */
+    struct jit_ir *p_ir;
+    /* Live ranges of the block's registers, see jit_liveness(). */
+    struct jit_liveness *p_live;
+    /* Basic blocks of the instructions, when they contain jumps. */
+    struct jit_cfg *p_cfg;
+
     struct jit_emitter *p_emitter;
 };
 
@@ -324,13 +555,41 @@ jit_error jit_create(struct jit_state **s, jit_flags flags);
 jit_error jit_destroy(struct jit_state *s);
 
 
-/* Set the jit state to start a block and provide the output code buffer. */
+/* Send trace messages up to level to fn, or to stderr if fn is NULL. New
+ * states only trace errors. A library built with TRACE=0 (-DJIT_NO_TRACE)
+ * produces no messages at all. */
+
+jit_error jit_set_trace(struct jit_state *s, jit_trace_level level,
+        jit_trace_fn fn, void *ctx);
+
+
+/* Set the jit state to start a block and provide the output code buffer.
+ * The buffer is assumed to be large enough for the whole block. */
 
 jit_error jit_begin_block(struct jit_state *s, void *buf);
 
+/* As above, with a buffer of size bytes. Should the block not fit, emission
+ * carries on in a library-owned buffer (p_bufstart then points to it, until
+ * the next jit_begin_block), which jit_copy_block can move to its final
+ * place. */
+
+jit_error jit_begin_block_sized(struct jit_state *s, void *buf, size_t size);
+
+/* As above, but the code written to buf will be executed from address exec,
+ * e.g. the executable view of a jit_codecache block. */
+
+jit_error jit_begin_block_mapped(struct jit_state *s, void *buf, void *exec,
+        size_t size);
+
 jit_error jit_end_block(struct jit_state *s);
 
 
+/* Discard the current block's instructions and registers, so the state can
+ * build the next block. Memory is kept for reuse rather than freed. */
+
+jit_error jit_reset_block(struct jit_state *s);
+
+
 /* Allocate a new reg and return its index. */
 
 jit_reg jit_reg_new(struct jit_state *s);
@@ -339,34 +598,255 @@ jit_reg jit_reg_new_fixed(struct jit_state *s,
         int32_t map);
 jit_error jit_set_reg_mapping(struct jit_state *s,
         jit_reg r, int32_t map);
+/* Release the host register pinned to r, making it allocatable again. */
+jit_error jit_clear_reg_mapping(struct jit_state *s, jit_reg r);
+/* Whether r is pinned to a host register. */
+int jit_reg_is_fixed(struct jit_state *s, jit_reg r);
 
 
 /* Append a given instruction to the state's instrcution sequence. */
 
 struct jit_instr* jit_instr_new(struct jit_state *s);
 
+/* Label of the next instruction to be added, as a jump target. A label
+ * taken after the last instruction points past the end of the block. */
 jit_label jit_label_here(struct jit_state *s);
 
 jit_error jit_create_emitter(struct jit_state *s);
 
 jit_error jit_destroy_emitter(struct jit_state *s);
 
+/* Forget all register mappings, fixed ones included. */
+jit_error jit_reset_emitter(struct jit_state *s);
+
+/* Snapshot the emitter's register allocation state, and put it back (which
+ * also releases the snapshot). */
+jit_error jit_save_emitter(struct jit_state *s, struct jit_emitter **saved);
+jit_error jit_restore_emitter(struct jit_state *s, struct jit_emitter *saved);
+
 /* Return start and end of a register's liveness (or life). */
 jit_error jit_reg_life(struct jit_state *s, jit_reg reg, size_t *start, size_t *end);
 
+/* Fold arithmetic on registers known to hold a constant, and turn register
+ * operands known to be constant into immediates. Optional; run it after
+ * adding the instructions and before emitting them. */
+jit_error jit_opt_fold(struct jit_state *s);
+
+/* Turn into NOPs the instructions whose only effect is a register value or
+ * flags nothing reads. Registers pinned to a host register, memory, the
+ * stack and calls count as read. Optional, like jit_opt_fold, which leaves
+ * work for it. */
+jit_error jit_opt_dce(struct jit_state *s);
+
+/* Number the values computed along straight-line code, and turn recomputing
+ * one still held in a register (loads included, until the next store or
+ * call) into a move from it. Reads of a copy go to the original instead, so
+ * that jit_opt_dce can then drop the moves. */
+jit_error jit_opt_cse(struct jit_state *s);
+
+/* Drop the FLAGS of jit_guest_flags_get where the flags are still those the
+ * operation defining the guest flags left, so that jit_opt_dce can then drop
+ * the copies of its operands. Optional, like jit_opt_fold. */
+jit_error jit_opt_flags(struct jit_state *s);
+
+/* Guest flags, for front ends translating a CPU whose arithmetic defines
+ * carry, zero, sign and overflow flags. Rather than being computed after
+ * every operation, they are kept as the last operation defining them and
+ * copies of its operands, and only computed when read. */
+struct jit_guest_flags {
+    /* Virtual registers holding the copies. */
+    jit_reg a;
+    jit_reg b;
+    /* The operation, as ADD, SUB, AND, OR or XOR, and its size; JIT_OP_NOP
+     * while no instruction of the block has defined the flags. */
+    jit_op op;
+    size_t opsz;
+};
+
+/* The guest flags in memory, between blocks. */
+struct jit_guest_flags_record {
+    int32_t op;
+    int32_t opsz;
+    int64_t a;
+    int64_t b;
+};
+
+/* Guest flags as computed by jit_guest_flags_eval. */
+#define JIT_GUEST_CARRY    (1 << 0)
+#define JIT_GUEST_ZERO     (1 << 1)
+#define JIT_GUEST_NEG      (1 << 2)
+#define JIT_GUEST_OVERFLOW (1 << 3)
+
+/* Start tracking guest flags in the block, allocating their registers. */
+jit_error jit_guest_flags_init(struct jit_state *s, struct jit_guest_flags *f);
+
+/* Make the last instruction added, an ADD, SUB, CMP, AND, OR or XOR, define
+ * the guest flags. Copies of its operands are added before it, which moves
+ * it to after them. */
+jit_error jit_guest_flags_set(struct jit_state *s, struct jit_guest_flags *f);
+
+/* Add a FLAGS that sets the flags to the guest flags, for JUMP_IF, SET_IF or
+ * MOVE_IF to read next. Fails with JIT_ERROR_NOT_FOUND if the block has not
+ * defined them. */
+jit_error jit_guest_flags_get(struct jit_state *s, struct jit_guest_flags *f);
+
+/* Add stores of the guest flags to r, for the block's exit. Nothing is stored
+ * if the block has not defined them, which leaves those of an earlier one. */
+jit_error jit_guest_flags_store(struct jit_state *s, struct jit_guest_flags *f,
+        struct jit_guest_flags_record *r);
+
+/* Compute the JIT_GUEST_ flags of a record. */
+uint32_t jit_guest_flags_eval(const struct jit_guest_flags_record *r);
+
+/* Run the analyses emission depends on (with JIT_FLAG_LINEAR_SCAN, register
+ * allocation), and complete the stack frame once the block is emitted.
+ * jit_emit_all and jit_measure_all do this themselves; they only need calling
+ * around jit_emit_instr. */
+jit_error jit_prepare_emit(struct jit_state *s);
+jit_error jit_finish_emit(struct jit_state *s);
+
 jit_error jit_emit_all(struct jit_state *s);
 
+/* Compute the exact number of bytes jit_emit_all would produce, spill and
+ * restore code included, without writing the block. exec is where the block
+ * is expected to run from, as it decides between near and far encodings. */
+jit_error jit_measure_all(struct jit_state *s, void *exec, size_t *nbytes);
+
+/* The emission pass of jit_measure_all, for a block already prepared. If ends
+ * is not NULL, it receives the offset at which each instruction ends. */
+jit_error jit_measure_instrs(struct jit_state *s, void *exec, size_t *nbytes,
+        uint32_t *ends);
+
+/* Copy the emitted block to dst, to be executed from exec (which may be the
+ * same address), fixing up its position-dependent encodings. */
+jit_error jit_copy_block(struct jit_state *s, void *dst, void *exec);
+
+/* Record the rel32 field at p as referring to an absolute address. A failure
+ * is also kept in s->reloc_error, for emitters that cannot return it. */
+jit_error jit_add_reloc(struct jit_state *s, uint8_t *p);
+
+/* Record the rel32 field at p as that of the jmp of an EXIT to pc. */
+jit_error jit_add_exit(struct jit_state *s, uint8_t *p, uint64_t pc);
+
+/* Make room for at least n more bytes of code, moving the block if needed. */
+jit_error jit_reserve_bytes(struct jit_state *s, size_t n);
+
+/* Append n bytes of code that were emitted out of line as if at p_bufcur,
+ * their rel32 fields already recorded. */
+jit_error jit_append_tail(struct jit_state *s, const uint8_t *tail, size_t n);
+
 jit_error jit_emit_instr(struct jit_state *s, struct jit_instr *i);
 
 jit_error jit_emit_move(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_arith(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_muldiv(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_movx(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_call(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_cmp(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_jump(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_jump_if(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_set_if(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_move_if(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_flags(struct jit_state *s, struct jit_instr *i);
+jit_error jit_emit_exit(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_ret(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_push(struct jit_state *s, struct jit_instr *i);
 jit_error jit_emit_pop(struct jit_state *s, struct jit_instr *i);
 
+
+/* Library-owned executable memory. Each region is a memfd mapped twice, RW
+ * for the emitter and RX for execution, so publishing a block needs no
+ * mprotect. region_size of 0 selects a default of 1 MiB. */
+
+struct jit_codecache;
+
+jit_error jit_codecache_create(struct jit_codecache **c, size_t region_size);
+
+jit_error jit_codecache_destroy(struct jit_codecache *c);
+
+
+/* Carve a block of at least size bytes out of the cache; *rx receives its
+ * executable address. */
+
+jit_error jit_codecache_alloc(struct jit_codecache *c, size_t size, void **rx);
+
+/* Give a block back to the cache. Freeing one twice fails an assertion, or
+ * without assertions returns JIT_ERROR_NOT_FOUND. */
+
+jit_error jit_codecache_free(struct jit_codecache *c, void *rx);
+
+
+/* Return the writable alias of an executable address in the cache. */
+
+void* jit_codecache_rw(struct jit_codecache *c, void *rx);
+
+/* Return the executable address the next fresh allocation would likely get,
+ * to use as the exec argument of jit_measure_all. */
+
+void* jit_codecache_top(struct jit_codecache *c);
+
+
+/* Translated blocks of a binary translator, by guest address, in a code
+ * cache. Blocks end in EXITs, and are called with no arguments, returning
+ * the guest address to go on from. An EXIT to an immediate jumps straight
+ * to the block for it once there is one, and one to a register does when
+ * the address hits in a table of ntable entries (a power of two, 0 for a
+ * default of 4096). */
+
+struct jit_blockcache;
+
+jit_error jit_blockcache_create(struct jit_blockcache **bc,
+        struct jit_codecache *c, size_t ntable);
+
+/* Give back the code of every block to the code cache, and make the pages
+ * it protected writable again. */
+jit_error jit_blockcache_destroy(struct jit_blockcache *bc);
+
+
+/* Emit the block of s into the cache as that of guest address pc, replacing
+ * any block already there, and chain it to and from the blocks it has EXITs
+ * to and those with EXITs to it. *code receives its address. */
+
+jit_error jit_blockcache_add(struct jit_blockcache *bc, struct jit_state *s,
+        uint64_t pc, void **code);
+
+/* Return the code of the block for pc, or NULL. */
+
+void* jit_blockcache_lookup(struct jit_blockcache *bc, uint64_t pc);
+
+/* Drop the block for pc, after pointing the EXITs chained to it back at the
+ * code returning to the caller. Its code is only given back on the next
+ * jit_blockcache_add, so a block may drop itself (from a CALL) and return. */
+
+jit_error jit_blockcache_invalidate(struct jit_blockcache *bc, uint64_t pc);
+
+
+/* Self-modifying guests. The block for pc was translated from the len guest
+ * bytes at src, as mapped in the host: a write to any of them drops it, and
+ * only blocks whose bytes are written get dropped. A later watch of the same
+ * block replaces its range. */
+
+jit_error jit_blockcache_watch(struct jit_blockcache *bc, uint64_t pc,
+        void *src, size_t len);
+
+/* Drop every block watching one of the len bytes at addr: the write barrier
+ * for guest memory written in software, or by the kernel (a read(2) into a
+ * protected page fails with EFAULT rather than faulting). */
+
+jit_error jit_blockcache_invalidate_range(struct jit_blockcache *bc,
+        void *addr, size_t len);
+
+/* Write-protect the pages watched, now and from then on, and catch writes to
+ * them with a SIGSEGV handler taking over the one before, which still gets
+ * every other fault. A write drops all the blocks on its page, which is
+ * then left writable until a block watches it again, and goes through. The
+ * block doing the write runs to its end, with the code from before.
+ *
+ * Guest memory should be mapped in whole pages of its own: anything else
+ * sharing them takes faults, and writes there drop blocks needlessly. */
+
+jit_error jit_blockcache_protect(struct jit_blockcache *bc);
+
 #ifdef __CPLUSPLUS
 }
 #endif
@@ -29,11 +29,20 @@ extern "C" {
 #include <string.h>
 
 #include "libjit.h"
+#include "jit_ir.h"
 
 #define FAILPATH(err) {e=(err);goto l_exit;}
 
-#define __JIT_POOL_ALLOC 1024
+#define __JIT_SLAB_INSTRS 256
+#define __JIT_MEASURE_SCRATCH 1024
 
+/* Instructions are carved out of fixed-size slabs, chained together. Slabs
+ * never move, so instruction pointers stay valid for the life of a block,
+ * and are kept across jit_reset_block so that they can be reused. */
+struct jit_instr_slab {
+    struct jit_instr_slab *next;
+    struct jit_instr is[__JIT_SLAB_INSTRS];
+};
 
 jit_error
 jit_create(struct jit_state **s, jit_flags flags)
@@ -48,13 +57,8 @@ jit_create(struct jit_state **s, jit_flags flags)
     if(*s == NULL) {
         FAILPATH(JIT_ERROR_MALLOC);
     }
-
-    (*s)->p_ipool = (struct jit_instr *) calloc(__JIT_POOL_ALLOC,
-            sizeof(struct jit_instr));
-    if((*s)->p_ipool == NULL) {
-        FAILPATH(JIT_ERROR_MALLOC);
-    }
-    (*s)->nipool = __JIT_POOL_ALLOC;
+    (*s)->flags = flags;
+    (*s)->trace_level = JIT_TRACE_ERROR;
 
     e = jit_create_emitter(*s);
 
@@ -66,7 +70,17 @@ jit_error
 jit_destroy(struct jit_state *s)
 {
     jit_destroy_emitter(s);
-    free(s->p_ipool);
+    free(s->p_bufown);
+    free(s->p_relocs);
+    free(s->p_exits);
+    jit_ir_destroy(s->p_ir);
+    jit_liveness_destroy(s->p_live);
+    jit_cfg_destroy(s->p_cfg);
+    while(s->p_slabs != NULL) {
+        struct jit_instr_slab *next = s->p_slabs->next;
+        free(s->p_slabs);
+        s->p_slabs = next;
+    }
     free(s);
 
     return JIT_SUCCESS;
@@ -98,18 +112,32 @@ jit_instr_new(struct jit_state *s)
 {
     struct jit_instr *i = NULL;
 
-    // Grow the pool if needed.
-    if(s->nicur == s->nipool) {
-        s->nipool += __JIT_POOL_ALLOC;
-        s->p_ipool = (struct jit_instr *) realloc(s->p_ipool,
-                s->nipool * __JIT_POOL_ALLOC);
-        if(s->p_ipool == NULL) {
-            goto l_exit;
+    // Move on to the next slab if needed, recycling one from a previous
+    // block when there is one.
+    if(s->p_slabcur == NULL || s->nicur == __JIT_SLAB_INSTRS) {
+        struct jit_instr_slab *slab = s->p_slabcur ? s->p_slabcur->next :
+            s->p_slabs;
+        if(slab == NULL) {
+            slab = (struct jit_instr_slab *) malloc(
+                    sizeof(struct jit_instr_slab));
+            if(slab == NULL) {
+                goto l_exit;
+            }
+            slab->next = NULL;
+            if(s->p_slabcur) {
+                s->p_slabcur->next = slab;
+            } else {
+                s->p_slabs = slab;
+            }
         }
+        s->p_slabcur = slab;
+        s->nicur = 0;
     }
 
     //printf("creating instr %zu\n", s->blk_ni);
-    i = &s->p_ipool[s->nicur];
+    i = &s->p_slabcur->is[s->nicur];
+    memset(i, 0, sizeof(struct jit_instr));
+    i->in1_type = i->in2_type = i->out_type = JIT_OPERAND_INVALID;
     if(s->p_icur) {
         s->p_icur->next = i; 
     }
@@ -137,18 +165,219 @@ jit_begin_block(struct jit_state *s, void *buf)
 {
     jit_error e = JIT_SUCCESS;
 
-    s->p_bufstart = s->p_bufcur = (uint8_t *) buf;
-    s->blk_ni = s->blk_nb = 0;
-    s->blk_is = s->p_ipool;
+    s->p_bufstart = s->p_bufcur = s->p_bufexec = (uint8_t *) buf;
+    s->p_bufend = NULL;
+    s->blk_nb = 0;
+    s->nrelocs = 0;
+    s->reloc_error = JIT_SUCCESS;
+    s->nexits = 0;
+
+    free(s->p_bufown);
+    s->p_bufown = NULL;
     
     return e;
 }
 
 jit_error
-jit_end_block(struct jit_state *s)
+jit_begin_block_sized(struct jit_state *s, void *buf, size_t size)
+{
+    jit_error e = jit_begin_block(s, buf);
+
+    s->p_bufend = s->p_bufstart + size;
+
+    return e;
+}
+
+jit_error
+jit_begin_block_mapped(struct jit_state *s, void *buf, void *exec,
+        size_t size)
+{
+    jit_error e = jit_begin_block_sized(s, buf, size);
+
+    s->p_bufexec = (uint8_t *) exec;
+
+    return e;
+}
+
+jit_error
+jit_add_reloc(struct jit_state *s, uint8_t *p)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(s->nrelocs == s->nrelocs_alloc) {
+        size_t n = s->nrelocs_alloc ? 2 * s->nrelocs_alloc : 16;
+        size_t *r = (size_t *) realloc(s->p_relocs, n * sizeof(size_t));
+        if(r == NULL) {
+            s->reloc_error = JIT_ERROR_MALLOC;
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+        s->p_relocs = r;
+        s->nrelocs_alloc = n;
+    }
+    s->p_relocs[s->nrelocs++] = (size_t)(p - s->p_bufstart);
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_add_exit(struct jit_state *s, uint8_t *p, uint64_t pc)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(s->nexits == s->nexits_alloc) {
+        size_t n = s->nexits_alloc ? 2 * s->nexits_alloc : 8;
+        struct jit_exit *x = (struct jit_exit *) realloc(s->p_exits,
+                n * sizeof(struct jit_exit));
+        if(x == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+        s->p_exits = x;
+        s->nexits_alloc = n;
+    }
+    s->p_exits[s->nexits].off = (size_t)(p - s->p_bufstart);
+    s->p_exits[s->nexits].pc = pc;
+    s->nexits++;
+
+l_exit:
+    return e;
+}
+
+/* Adjust the rel32 fields lying in [from, to) of a block copied to dst, which
+ * used to execute at old_exec and will now execute at new_exec. */
+static jit_error
+jit_apply_relocs(struct jit_state *s, uint8_t *dst, size_t from, size_t to,
+        uint8_t *old_exec, uint8_t *new_exec)
+{
+    jit_error e = JIT_SUCCESS;
+    int64_t delta = (int64_t)(old_exec - new_exec);
+    size_t n;
+
+    for(n = 0; n < s->nrelocs; n++) {
+        int32_t *field;
+        int64_t disp;
+        if(s->p_relocs[n] < from || s->p_relocs[n] >= to) {
+            continue;
+        }
+        field = (int32_t *)(dst + s->p_relocs[n]);
+        disp = (int64_t)*field + delta;
+        if(disp < INT32_MIN || disp > INT32_MAX) {
+            FAILPATH(JIT_ERROR_RELOC_RANGE);
+        }
+        *field = (int32_t)disp;
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_reserve_bytes(struct jit_state *s, size_t n)
+{
+    jit_error e = JIT_SUCCESS;
+    size_t used, size;
+    uint8_t *buf;
+
+    if(s->p_bufend == NULL || (size_t)(s->p_bufend - s->p_bufcur) >= n) {
+        goto l_exit;
+    }
+
+    // Slow path: move what was emitted so far to a larger buffer of our own.
+    used = s->p_bufcur - s->p_bufstart;
+    size = 2 * (s->p_bufend - s->p_bufstart);
+    if(size < used + n) {
+        size = used + n;
+    }
+    if(size < 4096) {
+        size = 4096;
+    }
+    buf = (uint8_t *) malloc(size);
+    if(buf == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    memcpy(buf, s->p_bufstart, used);
+    e = jit_apply_relocs(s, buf, 0, used, s->p_bufexec, buf);
+    if(FAILURE(e)) {
+        free(buf);
+        goto l_exit;
+    }
+
+    free(s->p_bufown);
+    s->p_bufown = s->p_bufstart = s->p_bufexec = buf;
+    s->p_bufcur = buf + used;
+    s->p_bufend = buf + size;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_append_tail(struct jit_state *s, const uint8_t *tail, size_t n)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *old_exec = s->p_bufexec;
+    size_t used = s->p_bufcur - s->p_bufstart;
+
+    e = jit_reserve_bytes(s, n);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    memcpy(s->p_bufcur, tail, n);
+    if(s->p_bufexec != old_exec) {
+        e = jit_apply_relocs(s, s->p_bufstart, used, used + n, old_exec,
+                s->p_bufexec);
+    }
+    s->p_bufcur += n;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_copy_block(struct jit_state *s, void *dst, void *exec)
 {
     jit_error e = JIT_SUCCESS;
+    size_t used = s->p_bufcur - s->p_bufstart;
 
+    if(dst == NULL || exec == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(FAILURE(s->reloc_error)) {
+        FAILPATH(s->reloc_error);
+    }
+
+    memmove(dst, s->p_bufstart, used);
+    e = jit_apply_relocs(s, (uint8_t *)dst, 0, used, s->p_bufexec,
+            (uint8_t *)exec);
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_reset_block(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+
+    s->blk_is = s->p_icur = NULL;
+    s->blk_ni = s->blk_nb = 0;
+    s->p_slabcur = NULL;
+    s->nicur = 0;
+    s->regcur = 0;
+
+    e = jit_reset_emitter(s);
+
+    return e;
+}
+
+jit_error
+jit_end_block(struct jit_state *s)
+{
+    jit_error e = jit_finish_emit(s);
+
+    if(SUCCESS(e)) {
+        e = s->reloc_error;
+    }
     return e;
 }
 
@@ -156,59 +385,129 @@ jit_error
 jit_reg_life(struct jit_state *s, jit_reg reg, size_t *start,
         size_t *end)
 {
-    struct jit_instr *i = NULL;
+    struct jit_liveness *l;
     jit_error e = JIT_SUCCESS;
-    size_t n, first, last;
 
     if(s == NULL || start == NULL || end == NULL) {
         FAILPATH(JIT_ERROR_NULL_PTR);
     }
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_liveness(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    l = s->p_live;
 
-    for(i = s->blk_is, n = 0, first = SIZE_MAX, last = SIZE_MAX;
-            i != NULL;
-            i = i->next, n++) {
-        if(i->out_type == JIT_OPERAND_REG && i->out.reg == reg) {
-            if(first == SIZE_MAX) {
-                first = n;
-                last = n;
-            } else {
-                break;
-            }
-        }
+    // The first range runs from the first definition to the last use of
+    // the value it defines.
+    if(reg < 0 || (uint32_t)reg >= l->nregs || l->first[reg] == JIT_LIVE_NONE) {
+        FAILPATH(JIT_ERROR_VREG_NOT_FOUND);
+    }
+    *start = l->ranges[l->first[reg]].start;
+    *end = l->ranges[l->first[reg]].end;
 
-        if(i->in1_type == JIT_OPERAND_REG && i->in1.reg == reg) {
-            last = n;
-        }
-        if(i->in2_type == JIT_OPERAND_REG && i->in2.reg == reg) {
-            last = n;
+l_exit:
+    return e;
+}
+
+jit_error
+jit_emit_all(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i = s->blk_is;
+
+    e = jit_prepare_emit(s);
+    while(e == JIT_SUCCESS && i != NULL) {
+        e = jit_emit_instr(s, i);
+        if(e != JIT_SUCCESS) {
+            break;
         }
+        i = i->next;
     }
-    if(first == SIZE_MAX) {
-        FAILPATH(JIT_ERROR_VREG_NOT_FOUND);
+    if(e == JIT_SUCCESS) {
+        e = jit_finish_emit(s);
     }
+    return e;
+}
 
-    *start = first;
-    *end = last;
+jit_error
+jit_measure_all(struct jit_state *s, void *exec, size_t *nbytes)
+{
+    jit_error e = JIT_SUCCESS;
 
-    printf("register %d: live from insn %zu to %zu\n", reg, first, last);
+    if(nbytes == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    e = jit_prepare_emit(s);
+    if(SUCCESS(e)) {
+        e = jit_measure_instrs(s, exec, nbytes, NULL);
+    }
 
 l_exit:
     return e;
 }
 
 jit_error
-jit_emit_all(struct jit_state *s)
+jit_measure_instrs(struct jit_state *s, void *exec, size_t *nbytes,
+        uint32_t *ends)
 {
     jit_error e = JIT_SUCCESS;
     struct jit_instr *i = s->blk_is;
+    struct jit_emitter *saved = NULL;
+    uint8_t scratch[__JIT_MEASURE_SCRATCH];
+    uint8_t *bufstart = s->p_bufstart;
+    uint8_t *bufcur = s->p_bufcur;
+    uint8_t *bufend = s->p_bufend;
+    uint8_t *bufexec = s->p_bufexec;
+    size_t blk_nb = s->blk_nb;
+    size_t nrelocs = s->nrelocs;
+    jit_error reloc_error = s->reloc_error;
+    size_t nexits = s->nexits;
+    size_t total = 0;
+    uint32_t n = 0;
+
+    e = jit_save_emitter(s, &saved);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
 
+    // Run the real selection and register allocation logic, but let every
+    // instruction land in the same scratch area, placed as if it followed
+    // the ones before it so that displacements come out the same size.
+    s->p_bufend = NULL;
+    s->p_bufexec = (uint8_t *) exec;
     while(i != NULL) {
+        s->p_bufstart = scratch - total;
+        s->p_bufcur = scratch;
         e = jit_emit_instr(s, i);
-        if(e != JIT_SUCCESS) {
+        if(FAILURE(e)) {
             break;
         }
+        total += s->p_bufcur - scratch;
+        if(ends != NULL) {
+            ends[n++] = (uint32_t)total;
+        }
+        s->nrelocs = nrelocs;
+        s->nexits = nexits;
         i = i->next;
     }
+    if(nbytes != NULL) {
+        *nbytes = total;
+    }
+
+    jit_restore_emitter(s, saved);
+    s->p_bufstart = bufstart;
+    s->p_bufcur = bufcur;
+    s->p_bufend = bufend;
+    s->p_bufexec = bufexec;
+    s->blk_nb = blk_nb;
+    s->nrelocs = nrelocs;
+    s->reloc_error = reloc_error;
+    s->nexits = nexits;
+
+l_exit:
     return e;
 }
 
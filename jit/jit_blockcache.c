@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libjit.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+#define __JIT_BLOCKCACHE_DEFAULT_TABLE 4096
+
+struct jit_block;
+
+/* A direct EXIT of a block, filed under the address it leaves for. */
+struct jit_block_exit {
+    uint64_t target;
+    /* Executable address of the rel32 of its jmp. */
+    uint8_t *site;
+    /* Block it is chained to, or NULL while it returns. */
+    struct jit_block *to;
+    struct jit_block_exit *next;
+};
+
+struct jit_block {
+    uint64_t pc;
+    uint8_t *code;
+    /* Next in its hash list, or in the dead list once invalidated. */
+    struct jit_block *next;
+    struct jit_block_exit *exits;
+    size_t nexits;
+    /* Guest bytes it was translated from, len 0 if not watched. */
+    uint8_t *src;
+    size_t len;
+    int dead;
+};
+
+/* One block watching a guest page. */
+struct jit_page_ref {
+    struct jit_block *b;
+    struct jit_page_ref *next;
+};
+
+/* A page holding guest bytes some block was translated from, and whether
+ * it is write-protected. */
+struct jit_guest_page {
+    uintptr_t addr;
+    int prot;
+    struct jit_page_ref *refs;
+    struct jit_guest_page *next;
+};
+
+/* Blocks, exits and guest pages hash into lists of the same number of
+ * buckets as the table has entries.
+ *
+ * Invalidated blocks are only unlinked, and wait in the dead list for the
+ * next jit_blockcache_add to free them: that way invalidating needs no
+ * allocator, as in the fault handler, and a block whose code is being run
+ * when it is invalidated can still return. */
+struct jit_blockcache {
+    struct jit_codecache *c;
+    struct jit_block_entry *table;
+    uint64_t mask;
+    struct jit_block **blocks;
+    struct jit_block_exit **exits;
+    struct jit_guest_page **pages;
+    uintptr_t pagesize;
+    struct jit_block *dead;
+    /* Whether watched pages are write-protected, and the next cache that
+     * has them so. */
+    int protect;
+    struct jit_blockcache *pnext;
+};
+
+#define PAGE_HASH(bc,a) (((a) / (bc)->pagesize) & (bc)->mask)
+
+/* Caches with write-protected pages, for the fault handler to look in,
+ * and the SIGSEGV action it took over. */
+static struct jit_blockcache *g_protected;
+static struct sigaction g_old_segv;
+static int g_segv_installed;
+
+/* Make entry k of the table miss for every address, with one that hashes
+ * elsewhere. */
+static void
+jit_blockcache_clear_entry(struct jit_blockcache *bc, uint64_t k)
+{
+    uint64_t pc = k + 1;
+
+    while(JIT_BLOCK_HASH(pc, bc->mask) == k) {
+        pc++;
+    }
+    bc->table[k].pc = pc;
+    bc->table[k].code = NULL;
+}
+
+/* Point the jmp of x at to, or back at the return that follows it. */
+static void
+jit_blockcache_patch(struct jit_blockcache *bc, struct jit_block_exit *x,
+        struct jit_block *to)
+{
+    int64_t d = 0;
+    int32_t d32;
+
+    if(to != NULL) {
+        d = (int64_t)(to->code - (x->site + sizeof(int32_t)));
+        if(d < INT32_MIN || d > INT32_MAX) {
+            // Out of reach: keep going through the caller.
+            to = NULL;
+            d = 0;
+        }
+    }
+    d32 = (int32_t)d;
+    memcpy(jit_codecache_rw(bc->c, x->site), &d32, sizeof(int32_t));
+    x->to = to;
+}
+
+static struct jit_block *
+jit_blockcache_find(struct jit_blockcache *bc, uint64_t pc)
+{
+    struct jit_block *b = bc->blocks[JIT_BLOCK_HASH(pc, bc->mask)];
+
+    while(b != NULL && b->pc != pc) {
+        b = b->next;
+    }
+    return b;
+}
+
+/* Return the link to the page at addr, which holds NULL if there is no such
+ * page yet. */
+static struct jit_guest_page **
+jit_blockcache_page(struct jit_blockcache *bc, uintptr_t addr)
+{
+    struct jit_guest_page **pp = &bc->pages[PAGE_HASH(bc, addr)];
+
+    while(*pp != NULL && (*pp)->addr != addr) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static jit_error
+jit_blockcache_set_prot(struct jit_blockcache *bc, struct jit_guest_page *pg,
+        int prot)
+{
+    if(mprotect((void *)pg->addr, bc->pagesize,
+                prot ? PROT_READ : PROT_READ | PROT_WRITE) != 0) {
+        return JIT_ERROR_MMAP;
+    }
+    pg->prot = prot;
+    return JIT_SUCCESS;
+}
+
+/* Take b off the pages it watches, dropping those left with no block and
+ * making them writable again. */
+static void
+jit_blockcache_unwatch(struct jit_blockcache *bc, struct jit_block *b)
+{
+    struct jit_guest_page **pp, *pg;
+    struct jit_page_ref **pr, *r;
+    uintptr_t a, end;
+
+    if(b->len == 0) {
+        return;
+    }
+    end = (uintptr_t)b->src + b->len;
+    for(a = (uintptr_t)b->src & ~(bc->pagesize - 1); a < end;
+            a += bc->pagesize) {
+        pp = jit_blockcache_page(bc, a);
+        if((pg = *pp) == NULL) {
+            continue;
+        }
+        for(pr = &pg->refs; *pr != NULL; ) {
+            r = *pr;
+            if(r->b == b) {
+                *pr = r->next;
+                free(r);
+            } else {
+                pr = &r->next;
+            }
+        }
+        if(pg->refs == NULL) {
+            if(pg->prot) {
+                jit_blockcache_set_prot(bc, pg, 0);
+            }
+            *pp = pg->next;
+            free(pg);
+        }
+    }
+    b->len = 0;
+}
+
+/* Make b unreachable, after pointing the EXITs chained to it back at the
+ * code returning to the caller, and move it to the dead list. */
+static void
+jit_blockcache_unlink(struct jit_blockcache *bc, struct jit_block *b)
+{
+    uint64_t h = JIT_BLOCK_HASH(b->pc, bc->mask), k;
+    struct jit_block **pb;
+    struct jit_block_exit **px, *x;
+    size_t n;
+
+    if(bc->table[h].code == b->code) {
+        jit_blockcache_clear_entry(bc, h);
+    }
+    for(x = bc->exits[h]; x != NULL; x = x->next) {
+        if(x->to == b) {
+            jit_blockcache_patch(bc, x, NULL);
+        }
+    }
+    for(n = 0; n < b->nexits; n++) {
+        k = JIT_BLOCK_HASH(b->exits[n].target, bc->mask);
+        for(px = &bc->exits[k]; *px != &b->exits[n]; px = &(*px)->next) {
+        }
+        *px = b->exits[n].next;
+    }
+    for(pb = &bc->blocks[h]; *pb != b; pb = &(*pb)->next) {
+    }
+    *pb = b->next;
+
+    b->dead = 1;
+    b->next = bc->dead;
+    bc->dead = b;
+}
+
+static void
+jit_blockcache_free_block(struct jit_blockcache *bc, struct jit_block *b)
+{
+    jit_blockcache_unwatch(bc, b);
+    jit_codecache_free(bc->c, b->code);
+    free(b->exits);
+    free(b);
+}
+
+static void
+jit_blockcache_sweep(struct jit_blockcache *bc)
+{
+    struct jit_block *b;
+
+    while((b = bc->dead) != NULL) {
+        bc->dead = b->next;
+        jit_blockcache_free_block(bc, b);
+    }
+}
+
+/* A write to a protected page: drop every block on it, since the bytes
+ * written are not known, and let the write through. Anything else goes to
+ * the action there was before. */
+static void
+jit_blockcache_segv(int sig, siginfo_t *si, void *uc)
+{
+    struct jit_blockcache *bc;
+    struct jit_guest_page *pg;
+    uintptr_t a = (uintptr_t)si->si_addr;
+    int handled = 0;
+
+    for(bc = g_protected; bc != NULL; bc = bc->pnext) {
+        pg = *jit_blockcache_page(bc, a & ~(bc->pagesize - 1));
+        if(pg != NULL && pg->prot) {
+            jit_blockcache_invalidate_range(bc, (void *)pg->addr,
+                    bc->pagesize);
+            jit_blockcache_set_prot(bc, pg, 0);
+            handled = 1;
+        }
+    }
+    if(handled) {
+        return;
+    }
+
+    if(g_old_segv.sa_flags & SA_SIGINFO) {
+        g_old_segv.sa_sigaction(sig, si, uc);
+    } else if(g_old_segv.sa_handler == SIG_DFL ||
+            g_old_segv.sa_handler == SIG_IGN) {
+        // Fault again on return, with the default action.
+        signal(SIGSEGV, SIG_DFL);
+    } else {
+        g_old_segv.sa_handler(sig);
+    }
+}
+
+jit_error
+jit_blockcache_create(struct jit_blockcache **bc, struct jit_codecache *c,
+        size_t ntable)
+{
+    jit_error e = JIT_SUCCESS;
+    uint64_t k;
+
+    if(bc == NULL || c == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(ntable == 0) {
+        ntable = __JIT_BLOCKCACHE_DEFAULT_TABLE;
+    }
+    // The mask is an imm32 of the lookup code, and entry k + 1 must differ.
+    if(ntable < 2 || (ntable & (ntable - 1)) || ntable > ((size_t)1 << 30)) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    *bc = (struct jit_blockcache *) calloc(1, sizeof(struct jit_blockcache));
+    if(*bc == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    (*bc)->c = c;
+    (*bc)->mask = ntable - 1;
+    (*bc)->table = (struct jit_block_entry *) malloc(ntable *
+            sizeof(struct jit_block_entry));
+    (*bc)->blocks = (struct jit_block **) calloc(ntable,
+            sizeof(struct jit_block *));
+    (*bc)->exits = (struct jit_block_exit **) calloc(ntable,
+            sizeof(struct jit_block_exit *));
+    (*bc)->pages = (struct jit_guest_page **) calloc(ntable,
+            sizeof(struct jit_guest_page *));
+    (*bc)->pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    if((*bc)->table == NULL || (*bc)->blocks == NULL || (*bc)->exits == NULL ||
+            (*bc)->pages == NULL) {
+        jit_blockcache_destroy(*bc);
+        *bc = NULL;
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    for(k = 0; k < ntable; k++) {
+        jit_blockcache_clear_entry(*bc, k);
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_blockcache_destroy(struct jit_blockcache *bc)
+{
+    struct jit_blockcache **pbc;
+    struct jit_block *b, *next;
+    uint64_t k;
+
+    if(bc == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    for(pbc = &g_protected; *pbc != NULL; pbc = &(*pbc)->pnext) {
+        if(*pbc == bc) {
+            *pbc = bc->pnext;
+            break;
+        }
+    }
+    jit_blockcache_sweep(bc);
+    for(k = 0; bc->blocks != NULL && k <= bc->mask; k++) {
+        for(b = bc->blocks[k]; b != NULL; b = next) {
+            next = b->next;
+            jit_blockcache_free_block(bc, b);
+        }
+    }
+    free(bc->table);
+    free(bc->blocks);
+    free(bc->exits);
+    free(bc->pages);
+    free(bc);
+
+    return JIT_SUCCESS;
+}
+
+/* Emit the block of s into the code cache, measured first so that it
+ * normally lands in place; one that still outgrows its chunk is copied to
+ * a bigger one. */
+static jit_error
+jit_blockcache_emit(struct jit_blockcache *bc, struct jit_state *s,
+        void **code)
+{
+    jit_error e = JIT_SUCCESS;
+    size_t nb, need;
+    void *at = jit_codecache_top(bc->c);
+    void *rx = NULL;
+
+    // A freed chunk is preferred to the top, and the size of the code
+    // depends on where it goes: measure again at the chunk given, and take
+    // a bigger one until it fits.
+    e = jit_measure_all(s, at, &nb);
+    while(SUCCESS(e)) {
+        e = jit_codecache_alloc(bc->c, nb, &rx);
+        if(FAILURE(e) || rx == at) {
+            break;
+        }
+        at = rx;
+        e = jit_measure_all(s, at, &need);
+        if(FAILURE(e) || need <= nb) {
+            break;
+        }
+        jit_codecache_free(bc->c, rx);
+        rx = NULL;
+        nb = need;
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    e = jit_begin_block_mapped(s, jit_codecache_rw(bc->c, rx), rx, nb);
+    if(SUCCESS(e)) {
+        e = jit_emit_all(s);
+    }
+    if(SUCCESS(e)) {
+        e = jit_end_block(s);
+    }
+    if(SUCCESS(e) && s->p_bufexec != rx) {
+        jit_codecache_free(bc->c, rx);
+        e = jit_codecache_alloc(bc->c, s->blk_nb, &rx);
+        if(FAILURE(e)) {
+            rx = NULL;
+            goto l_exit;
+        }
+        e = jit_copy_block(s, jit_codecache_rw(bc->c, rx), rx);
+    }
+
+l_exit:
+    if(FAILURE(e) && rx != NULL) {
+        jit_codecache_free(bc->c, rx);
+        rx = NULL;
+    }
+    *code = rx;
+    return e;
+}
+
+jit_error
+jit_blockcache_add(struct jit_blockcache *bc, struct jit_state *s,
+        uint64_t pc, void **code)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_block *b = NULL;
+    struct jit_block_exit *x;
+    uint64_t h = 0;
+    size_t n;
+
+    if(bc == NULL || s == NULL || code == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    jit_blockcache_invalidate(bc, pc);
+    jit_blockcache_sweep(bc);
+
+    b = (struct jit_block *) calloc(1, sizeof(struct jit_block));
+    if(b == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    s->p_exit_table = bc->table;
+    s->exit_table_mask = bc->mask;
+    e = jit_blockcache_emit(bc, s, (void **)&b->code);
+    s->p_exit_table = NULL;
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    b->pc = pc;
+    b->nexits = s->nexits;
+    if(b->nexits > 0) {
+        b->exits = (struct jit_block_exit *) calloc(b->nexits,
+                sizeof(struct jit_block_exit));
+        if(b->exits == NULL) {
+            jit_codecache_free(bc->c, b->code);
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+
+    h = JIT_BLOCK_HASH(pc, bc->mask);
+    b->next = bc->blocks[h];
+    bc->blocks[h] = b;
+    bc->table[h].pc = pc;
+    bc->table[h].code = b->code;
+
+    // Chain the new block's exits to the blocks already there, then the
+    // exits already waiting for it to the new block.
+    for(n = 0; n < b->nexits; n++) {
+        x = &b->exits[n];
+        x->target = s->p_exits[n].pc;
+        x->site = b->code + s->p_exits[n].off;
+        x->next = bc->exits[JIT_BLOCK_HASH(x->target, bc->mask)];
+        bc->exits[JIT_BLOCK_HASH(x->target, bc->mask)] = x;
+        jit_blockcache_patch(bc, x, jit_blockcache_find(bc, x->target));
+    }
+    for(x = bc->exits[h]; x != NULL; x = x->next) {
+        if(x->target == pc && x->to == NULL) {
+            jit_blockcache_patch(bc, x, b);
+        }
+    }
+    *code = b->code;
+    b = NULL;
+
+l_exit:
+    if(b != NULL) {
+        free(b->exits);
+        free(b);
+    }
+    return e;
+}
+
+void *
+jit_blockcache_lookup(struct jit_blockcache *bc, uint64_t pc)
+{
+    struct jit_block *b = jit_blockcache_find(bc, pc);
+
+    return b != NULL ? b->code : NULL;
+}
+
+jit_error
+jit_blockcache_invalidate(struct jit_blockcache *bc, uint64_t pc)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_block *b;
+
+    if(bc == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    b = jit_blockcache_find(bc, pc);
+    if(b == NULL) {
+        FAILPATH(JIT_ERROR_NOT_FOUND);
+    }
+    jit_blockcache_unlink(bc, b);
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_blockcache_watch(struct jit_blockcache *bc, uint64_t pc, void *src,
+        size_t len)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_block *b = NULL;
+    struct jit_guest_page **pp, *pg;
+    struct jit_page_ref *r;
+    uintptr_t a, end;
+
+    if(bc == NULL || src == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    b = jit_blockcache_find(bc, pc);
+    if(b == NULL) {
+        FAILPATH(JIT_ERROR_NOT_FOUND);
+    }
+    jit_blockcache_unwatch(bc, b);
+    b->src = (uint8_t *)src;
+    b->len = len;
+
+    end = (uintptr_t)src + len;
+    for(a = (uintptr_t)src & ~(bc->pagesize - 1); a < end;
+            a += bc->pagesize) {
+        pp = jit_blockcache_page(bc, a);
+        if((pg = *pp) == NULL) {
+            pg = *pp = (struct jit_guest_page *) calloc(1,
+                    sizeof(struct jit_guest_page));
+            if(pg == NULL) {
+                FAILPATH(JIT_ERROR_MALLOC);
+            }
+            pg->addr = a;
+        }
+        r = (struct jit_page_ref *) malloc(sizeof(struct jit_page_ref));
+        if(r == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+        r->b = b;
+        r->next = pg->refs;
+        pg->refs = r;
+        if(bc->protect && !pg->prot) {
+            e = jit_blockcache_set_prot(bc, pg, 1);
+            if(FAILURE(e)) {
+                goto l_exit;
+            }
+        }
+    }
+
+l_exit:
+    if(FAILURE(e) && b != NULL) {
+        jit_blockcache_unwatch(bc, b);
+    }
+    return e;
+}
+
+jit_error
+jit_blockcache_invalidate_range(struct jit_blockcache *bc, void *addr,
+        size_t len)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_guest_page *pg;
+    struct jit_page_ref *r;
+    struct jit_block *b;
+    uintptr_t a, start = (uintptr_t)addr, end = start + len;
+
+    if(bc == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    for(a = start & ~(bc->pagesize - 1); a < end; a += bc->pagesize) {
+        pg = *jit_blockcache_page(bc, a);
+        for(r = pg != NULL ? pg->refs : NULL; r != NULL; r = r->next) {
+            b = r->b;
+            if(!b->dead && (uintptr_t)b->src < end &&
+                    start < (uintptr_t)b->src + b->len) {
+                jit_blockcache_unlink(bc, b);
+            }
+        }
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_blockcache_protect(struct jit_blockcache *bc)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_guest_page *pg;
+    struct sigaction sa;
+    uint64_t k;
+
+    if(bc == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(bc->protect) {
+        goto l_exit;
+    }
+    if(!g_segv_installed) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = jit_blockcache_segv;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(SIGSEGV, &sa, &g_old_segv) != 0) {
+            FAILPATH(JIT_ERROR_UNKNOWN);
+        }
+        g_segv_installed = 1;
+    }
+    bc->protect = 1;
+    bc->pnext = g_protected;
+    g_protected = bc;
+
+    for(k = 0; k <= bc->mask; k++) {
+        for(pg = bc->pages[k]; pg != NULL; pg = pg->next) {
+            if(!pg->prot) {
+                e = jit_blockcache_set_prot(bc, pg, 1);
+                if(FAILURE(e)) {
+                    goto l_exit;
+                }
+            }
+        }
+    }
+
+l_exit:
+    return e;
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
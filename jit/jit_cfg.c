@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libjit.h"
+#include "jit_ir.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+static jit_error
+jit_cfg_grow(struct jit_cfg *c, uint32_t ninstrs)
+{
+    jit_error e = JIT_SUCCESS;
+    uint32_t nalloc = c->ninstrs_alloc ? c->ninstrs_alloc : 64;
+    void *p;
+
+    while(nalloc < ninstrs) {
+        nalloc *= 2;
+    }
+    if(nalloc == c->ninstrs_alloc) {
+        goto l_exit;
+    }
+
+    // There are at most as many blocks as instructions, and two edges each.
+#define GROW(a,n) p = realloc((a), (n) * sizeof(*(a))); \
+    if(p == NULL) FAILPATH(JIT_ERROR_MALLOC); (a) = p
+    GROW(c->block_of, nalloc);
+    GROW(c->blocks, nalloc);
+    GROW(c->preds, 2 * nalloc);
+#undef GROW
+    c->ninstrs_alloc = c->nblocks_alloc = nalloc;
+    c->npreds_alloc = 2 * nalloc;
+
+l_exit:
+    return e;
+}
+
+static int
+jit_cfg_is_jump(uint8_t op)
+{
+    return op == JIT_OP_JUMP || op == JIT_OP_JUMP_IF;
+}
+
+jit_error
+jit_cfg_build(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_ir *ir = s->p_ir;
+    struct jit_cfg *c = s->p_cfg;
+    struct jit_cfg_block *b;
+    uint32_t n, k, t, nb;
+
+    if(ir == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(c == NULL) {
+        c = s->p_cfg = calloc(1, sizeof(struct jit_cfg));
+        if(c == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    e = jit_cfg_grow(c, ir->n + 1);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+
+    // Mark the first instruction of every block in block_of, then number
+    // the blocks in one pass.
+    memset(c->block_of, 0, (ir->n + 1) * sizeof(uint32_t));
+    c->block_of[0] = 1;
+    for(n = 0; n < ir->n; n++) {
+        if(jit_cfg_is_jump(ir->op[n])) {
+            t = (uint32_t)ir->val[JIT_IR_IN1][n];
+            if(ir->kind[JIT_IR_IN1][n] != JIT_OPERAND_LABEL || t > ir->n) {
+                FAILPATH(JIT_ERROR_BAD_LABEL);
+            }
+            c->block_of[t] = 1;
+            c->block_of[n + 1] = 1;
+        } else if(ir->op[n] == JIT_OP_RET || ir->op[n] == JIT_OP_EXIT) {
+            c->block_of[n + 1] = 1;
+        }
+    }
+    nb = 0;
+    for(n = 0; n < ir->n; n++) {
+        if(c->block_of[n]) {
+            if(nb > 0) {
+                c->blocks[nb - 1].end = n;
+            }
+            c->blocks[nb].start = n;
+            nb++;
+        }
+        c->block_of[n] = nb - 1;
+    }
+    if(nb > 0) {
+        c->blocks[nb - 1].end = ir->n;
+    }
+    c->nblocks = nb;
+
+    // Successors: the next block unless the last instruction never falls
+    // through, and the target of a jump. Label ir->n is past the end, and
+    // leaves the graph.
+    for(k = 0; k < nb; k++) {
+        b = &c->blocks[k];
+        n = b->end - 1;
+        b->nsucc = 0;
+        b->npred = 0;
+        if(ir->op[n] != JIT_OP_JUMP && ir->op[n] != JIT_OP_RET &&
+                ir->op[n] != JIT_OP_EXIT && k + 1 < nb) {
+            b->succ[b->nsucc++] = k + 1;
+        }
+        if(jit_cfg_is_jump(ir->op[n])) {
+            t = (uint32_t)ir->val[JIT_IR_IN1][n];
+            if(t < ir->n && (b->nsucc == 0 || b->succ[0] != c->block_of[t])) {
+                b->succ[b->nsucc++] = c->block_of[t];
+            }
+        }
+    }
+
+    // Predecessors, as one run of preds per block.
+    for(k = 0; k < nb; k++) {
+        for(n = 0; n < c->blocks[k].nsucc; n++) {
+            c->blocks[c->blocks[k].succ[n]].npred++;
+        }
+    }
+    for(k = 0, t = 0; k < nb; k++) {
+        c->blocks[k].pred = t;
+        t += c->blocks[k].npred;
+        c->blocks[k].npred = 0;
+    }
+    for(k = 0; k < nb; k++) {
+        for(n = 0; n < c->blocks[k].nsucc; n++) {
+            b = &c->blocks[c->blocks[k].succ[n]];
+            c->preds[b->pred + b->npred++] = k;
+        }
+    }
+
+l_exit:
+    return e;
+}
+
+void
+jit_cfg_destroy(struct jit_cfg *c)
+{
+    if(c == NULL) {
+        return;
+    }
+    free(c->blocks);
+    free(c->preds);
+    free(c->block_of);
+    free(c);
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
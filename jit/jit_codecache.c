@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libjit.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+#define __JIT_CODECACHE_ALIGN 16
+#define __JIT_CODECACHE_DEFAULT_REGION (1 << 20)
+#define __JIT_CODECACHE_MIN_SPLIT 64
+#define __JIT_CODECACHE_HEAP_GAP (512 << 20)
+
+#define ALIGN_UP(x,a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* A region is one memfd mapped twice: once writable for the emitter and once
+ * executable for the code. Both views share the same offsets. */
+struct jit_code_region {
+    struct jit_code_region *next;
+    uint8_t *rw;
+    uint8_t *rx;
+    size_t size;
+    size_t used;
+};
+
+/* Every block handed out is preceded by this header, stored in the writable
+ * view. The header is padded so that the code itself stays aligned. Free
+ * chunks are kept in address order, so that neighbours can be merged. */
+struct jit_code_chunk {
+    size_t size;
+    struct jit_code_chunk *next;
+};
+
+#define __JIT_CHUNK_HDR ALIGN_UP(sizeof(struct jit_code_chunk), \
+        __JIT_CODECACHE_ALIGN)
+#define CHUNK_END(k) ((uint8_t *)(k) + __JIT_CHUNK_HDR + (k)->size)
+
+struct jit_codecache {
+    struct jit_code_region *p_regions;
+    struct jit_code_chunk *p_free;
+    size_t region_size;
+};
+
+/* Ask for regions just below the program's heap, so that calls and data
+ * accesses from generated code can mostly use rel32 encodings. The kernel
+ * is free to ignore the hint; the emitter copes with far targets. */
+static void *
+jit_codecache_hint(struct jit_codecache *c, size_t size)
+{
+    uintptr_t base;
+
+    if(c->p_regions != NULL) {
+        base = (uintptr_t)c->p_regions->rx;
+    } else {
+        void *h = malloc(1);
+        base = (uintptr_t)h - __JIT_CODECACHE_HEAP_GAP;
+        free(h);
+    }
+    if(base < size + __JIT_CODECACHE_HEAP_GAP) {
+        return NULL;
+    }
+    return (void *)((base - size) & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+}
+
+static jit_error
+jit_codecache_new_region(struct jit_codecache *c, size_t size)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_code_region *r = NULL;
+    int fd = -1;
+
+    r = (struct jit_code_region *) calloc(1, sizeof(struct jit_code_region));
+    if(r == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    r->rw = r->rx = MAP_FAILED;
+    r->size = ALIGN_UP(size, sysconf(_SC_PAGESIZE));
+
+    fd = memfd_create("libjit-codecache", MFD_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, r->size) != 0) {
+        FAILPATH(JIT_ERROR_MMAP);
+    }
+    r->rw = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    r->rx = mmap(jit_codecache_hint(c, r->size), r->size,
+            PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    if(r->rw == MAP_FAILED || r->rx == MAP_FAILED) {
+        FAILPATH(JIT_ERROR_MMAP);
+    }
+
+    r->next = c->p_regions;
+    c->p_regions = r;
+
+l_exit:
+    if(fd >= 0) {
+        close(fd);
+    }
+    if(FAILURE(e) && r != NULL) {
+        if(r->rw != MAP_FAILED) munmap(r->rw, r->size);
+        if(r->rx != MAP_FAILED) munmap(r->rx, r->size);
+        free(r);
+    }
+    return e;
+}
+
+/* Find the region holding address p in either its rx or its rw view. */
+static struct jit_code_region *
+jit_codecache_find_region(struct jit_codecache *c, void *p, int rw)
+{
+    struct jit_code_region *r;
+
+    for(r = c->p_regions; r != NULL; r = r->next) {
+        uint8_t *base = rw ? r->rw : r->rx;
+        if((uint8_t *)p >= base && (uint8_t *)p < base + r->size) {
+            break;
+        }
+    }
+    return r;
+}
+
+jit_error
+jit_codecache_create(struct jit_codecache **c, size_t region_size)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(c == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+
+    *c = (struct jit_codecache *) calloc(1, sizeof(struct jit_codecache));
+    if(*c == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    (*c)->region_size = region_size ? region_size :
+        __JIT_CODECACHE_DEFAULT_REGION;
+
+    e = jit_codecache_new_region(*c, (*c)->region_size);
+    if(FAILURE(e)) {
+        free(*c);
+        *c = NULL;
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_codecache_destroy(struct jit_codecache *c)
+{
+    struct jit_code_region *r, *next;
+
+    if(c == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+
+    for(r = c->p_regions; r != NULL; r = next) {
+        next = r->next;
+        munmap(r->rw, r->size);
+        munmap(r->rx, r->size);
+        free(r);
+    }
+    free(c);
+
+    return JIT_SUCCESS;
+}
+
+jit_error
+jit_codecache_alloc(struct jit_codecache *c, size_t size, void **rx)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_code_chunk **pp, *chunk = NULL;
+    struct jit_code_region *r;
+
+    if(c == NULL || rx == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    size = ALIGN_UP(size ? size : 1, __JIT_CODECACHE_ALIGN);
+
+    // Reuse a freed chunk first, splitting off the tail if it is big enough
+    // to be worth keeping.
+    for(pp = &c->p_free; *pp != NULL; pp = &(*pp)->next) {
+        if((*pp)->size >= size) {
+            chunk = *pp;
+            *pp = chunk->next;
+            if(chunk->size - size >= __JIT_CHUNK_HDR + __JIT_CODECACHE_MIN_SPLIT) {
+                struct jit_code_chunk *tail = (struct jit_code_chunk *)
+                    ((uint8_t *)chunk + __JIT_CHUNK_HDR + size);
+                tail->size = chunk->size - size - __JIT_CHUNK_HDR;
+                tail->next = *pp;
+                *pp = tail;
+                chunk->size = size;
+            }
+            break;
+        }
+    }
+
+    // Otherwise bump-allocate from the newest region, adding one if needed.
+    if(chunk == NULL) {
+        r = c->p_regions;
+        if(r == NULL || r->size - r->used < __JIT_CHUNK_HDR + size) {
+            size_t rsize = c->region_size;
+            if(rsize < __JIT_CHUNK_HDR + size) {
+                rsize = __JIT_CHUNK_HDR + size;
+            }
+            e = jit_codecache_new_region(c, rsize);
+            if(FAILURE(e)) {
+                goto l_exit;
+            }
+            r = c->p_regions;
+        }
+        chunk = (struct jit_code_chunk *)(r->rw + r->used);
+        chunk->size = size;
+        r->used += __JIT_CHUNK_HDR + size;
+    }
+
+    chunk->next = NULL;
+    r = jit_codecache_find_region(c, chunk, 1);
+    *rx = r->rx + ((uint8_t *)chunk - r->rw) + __JIT_CHUNK_HDR;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_codecache_free(struct jit_codecache *c, void *rx)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_code_region *r;
+    struct jit_code_chunk **pp, **pprev = NULL, *chunk, *next;
+    uint8_t *rw;
+    int twice;
+
+    if(c == NULL || rx == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    r = jit_codecache_find_region(c, rx, 0);
+    if(r == NULL) {
+        FAILPATH(JIT_ERROR_NOT_FOUND);
+    }
+    rw = r->rw + ((uint8_t *)rx - r->rx);
+    chunk = (struct jit_code_chunk *)(rw - __JIT_CHUNK_HDR);
+
+    for(pp = &c->p_free; *pp != NULL && *pp < chunk; pp = &(*pp)->next) {
+        pprev = pp;
+    }
+    // Freed already, the chunk is on the list, part of the free chunk before
+    // it, or past the top of its region.
+    twice = *pp == chunk || (uint8_t *)chunk >= r->rw + r->used ||
+        (pprev != NULL && (uint8_t *)chunk < CHUNK_END(*pprev));
+    assert(!twice);
+    if(twice) {
+        FAILPATH(JIT_ERROR_NOT_FOUND);
+    }
+    chunk->next = *pp;
+    *pp = chunk;
+
+    // Merge with the free neighbours in the same region, then give a chunk
+    // ending at the top of the region back to it.
+    next = chunk->next;
+    if(next != NULL && (uint8_t *)next < r->rw + r->size &&
+            CHUNK_END(chunk) == (uint8_t *)next) {
+        chunk->size += __JIT_CHUNK_HDR + next->size;
+        chunk->next = next->next;
+    }
+    if(pprev != NULL && (uint8_t *)*pprev >= r->rw &&
+            CHUNK_END(*pprev) == (uint8_t *)chunk) {
+        (*pprev)->size += __JIT_CHUNK_HDR + chunk->size;
+        (*pprev)->next = chunk->next;
+        chunk = *pprev;
+        pp = pprev;
+    }
+    if(CHUNK_END(chunk) == r->rw + r->used) {
+        r->used = (uint8_t *)chunk - r->rw;
+        *pp = chunk->next;
+    }
+
+l_exit:
+    return e;
+}
+
+void *
+jit_codecache_rw(struct jit_codecache *c, void *rx)
+{
+    struct jit_code_region *r = jit_codecache_find_region(c, rx, 0);
+
+    if(r == NULL) {
+        return NULL;
+    }
+    return r->rw + ((uint8_t *)rx - r->rx);
+}
+
+void *
+jit_codecache_top(struct jit_codecache *c)
+{
+    struct jit_code_region *r = c->p_regions;
+
+    return r->rx + r->used + __JIT_CHUNK_HDR;
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libjit.h"
+#include "jit_ir.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+/* An immediate of an opsz-byte operation, sign-extended. */
+static int64_t
+jit_guest_flags_imm(jit_operand_union *v, size_t opsz)
+{
+    switch(opsz) {
+        case JIT_8BIT: return v->imm8;
+        case JIT_16BIT: return v->imm16;
+        case JIT_64BIT: return v->imm64;
+        default: return v->imm32;
+    }
+}
+
+/* Make i a copy of operand v of an opsz-byte operation into register r.
+ * Memory is read at the operation's size, the rest whole. */
+static void
+jit_guest_flags_copy(struct jit_instr *i, jit_operand kind,
+        jit_operand_union *v, size_t opsz, jit_reg r)
+{
+    size_t sz = (opsz == JIT_64BIT) ? JIT_64BIT : JIT_32BIT;
+
+    memset(&i->in1, 0, sizeof(jit_operand_union));
+    memset(&i->in2, 0, sizeof(jit_operand_union));
+    i->op = JIT_OP_MOVE;
+    i->in1_type = kind;
+    i->in2_type = JIT_OPERAND_INVALID;
+    i->out_type = JIT_OPERAND_REG;
+    i->out.reg = r;
+    if(kind == JIT_OPERAND_IMM) {
+        if(sz == JIT_64BIT) {
+            i->in1.imm64 = jit_guest_flags_imm(v, opsz);
+        } else {
+            i->in1.imm32 = (int32_t)jit_guest_flags_imm(v, opsz);
+        }
+        i->opsz = sz;
+    } else if(kind == JIT_OPERAND_REG) {
+        i->in1.reg = v->reg;
+        i->opsz = sz;
+    } else {
+        i->in1 = *v;
+        i->opsz = opsz;
+    }
+}
+
+jit_error
+jit_guest_flags_init(struct jit_state *s, struct jit_guest_flags *f)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(s == NULL || f == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    f->a = jit_reg_new(s);
+    f->b = jit_reg_new(s);
+    if(f->a == JIT_REG_INVALID || f->b == JIT_REG_INVALID) {
+        FAILPATH(JIT_ERROR_NO_MORE_VREGS);
+    }
+    f->op = JIT_OP_NOP;
+    f->opsz = JIT_32BIT;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_guest_flags_set(struct jit_state *s, struct jit_guest_flags *f)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr op, *i;
+    jit_operand_union *va, *vb;
+    jit_operand ka, kb;
+
+    if(s == NULL || f == NULL || s->p_icur == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    i = s->p_icur;
+    switch(i->op) {
+        case JIT_OP_ADD: case JIT_OP_SUB: case JIT_OP_AND: case JIT_OP_OR:
+        case JIT_OP_XOR: case JIT_OP_CMP:
+            break;
+        default:
+            FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    op = *i;
+
+    jit_instr_operands(&op, &ka, &va, &kb, &vb);
+    if(ka == JIT_OPERAND_INVALID || kb == JIT_OPERAND_INVALID) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    // The operation's own place, which labels may point at, takes the first
+    // copy, and the operation goes after the second.
+    jit_guest_flags_copy(i, ka, va, op.opsz, f->a);
+    i = jit_instr_new(s);
+    if(i == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    jit_guest_flags_copy(i, kb, vb, op.opsz, f->b);
+    i = jit_instr_new(s);
+    if(i == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    op.next = NULL;
+    *i = op;
+
+    f->op = (op.op == JIT_OP_CMP) ? JIT_OP_SUB : op.op;
+    f->opsz = op.opsz;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_guest_flags_get(struct jit_state *s, struct jit_guest_flags *f)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+
+    if(s == NULL || f == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(f->op == JIT_OP_NOP) {
+        FAILPATH(JIT_ERROR_NOT_FOUND);
+    }
+    i = jit_instr_new(s);
+    if(i == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    i->op = JIT_OP_FLAGS;
+    i->in1_type = i->in2_type = JIT_OPERAND_REG;
+    i->in1.reg = f->a;
+    i->in2.reg = f->b;
+    i->out_type = JIT_OPERAND_IMM;
+    i->out.imm32 = f->op;
+    i->opsz = f->opsz;
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_guest_flags_store(struct jit_state *s, struct jit_guest_flags *f,
+        struct jit_guest_flags_record *r)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i[4];
+    jit_reg t;
+    size_t k;
+
+    if(s == NULL || f == NULL || r == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(f->op == JIT_OP_NOP) {
+        goto l_exit;
+    }
+    t = jit_reg_new(s);
+    if(t == JIT_REG_INVALID) {
+        FAILPATH(JIT_ERROR_NO_MORE_VREGS);
+    }
+    for(k = 0; k < 4; k++) {
+        i[k] = jit_instr_new(s);
+        if(i[k] == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    // op and opsz are stored together, as one 64-bit word.
+    MOVE_I_R(i[0], (int64_t)f->op | (int64_t)f->opsz << 32, t, JIT_64BIT);
+    MOVE_R_M(i[1], t, (int32_t *)&r->op, JIT_64BIT);
+    MOVE_R_M(i[2], f->a, (int32_t *)&r->a, JIT_64BIT);
+    MOVE_R_M(i[3], f->b, (int32_t *)&r->b, JIT_64BIT);
+
+l_exit:
+    return e;
+}
+
+uint32_t
+jit_guest_flags_eval(const struct jit_guest_flags_record *r)
+{
+    uint64_t mask, sign, a, b, res;
+    uint32_t flags = 0;
+
+    if(r->op == JIT_OP_NOP) {
+        return 0;
+    }
+    mask = (r->opsz >= JIT_64BIT) ? ~(uint64_t)0 :
+        ((uint64_t)1 << (8 * r->opsz)) - 1;
+    sign = (uint64_t)1 << (8 * (r->opsz >= JIT_64BIT ? JIT_64BIT : r->opsz)
+            - 1);
+    a = (uint64_t)r->a & mask;
+    b = (uint64_t)r->b & mask;
+
+    switch(r->op) {
+        case JIT_OP_ADD:
+            res = (a + b) & mask;
+            if(res < a) flags |= JIT_GUEST_CARRY;
+            if((a ^ res) & (b ^ res) & sign) flags |= JIT_GUEST_OVERFLOW;
+            break;
+        case JIT_OP_SUB:
+            res = (a - b) & mask;
+            if(a < b) flags |= JIT_GUEST_CARRY;
+            if((a ^ b) & (a ^ res) & sign) flags |= JIT_GUEST_OVERFLOW;
+            break;
+        case JIT_OP_AND: res = a & b; break;
+        case JIT_OP_OR:  res = a | b; break;
+        case JIT_OP_XOR: res = a ^ b; break;
+        default: return 0;
+    }
+    if(res == 0) flags |= JIT_GUEST_ZERO;
+    if(res & sign) flags |= JIT_GUEST_NEG;
+
+    return flags;
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libjit.h"
+#include "jit_ir.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+#define __JIT_IR_MIN_ALLOC 256
+
+static jit_error
+jit_ir_grow(struct jit_ir *ir, uint32_t n)
+{
+    jit_error e = JIT_SUCCESS;
+    uint32_t nalloc = ir->nalloc ? ir->nalloc : __JIT_IR_MIN_ALLOC;
+    size_t k;
+    void *p;
+
+    while(nalloc < n) {
+        nalloc *= 2;
+    }
+    if(nalloc == ir->nalloc) {
+        goto l_exit;
+    }
+
+#define GROW(a) p = realloc((a), nalloc * sizeof(*(a))); \
+    if(p == NULL) FAILPATH(JIT_ERROR_MALLOC); (a) = p
+    GROW(ir->op);
+    GROW(ir->opsz);
+    for(k = 0; k < JIT_IR_NSLOTS; k++) {
+        GROW(ir->kind[k]);
+        GROW(ir->val[k]);
+    }
+#undef GROW
+    ir->nalloc = nalloc;
+
+l_exit:
+    return e;
+}
+
+/* Store one operand, spilling it to the aux table if it does not fit. */
+static jit_error
+jit_ir_put(struct jit_ir *ir, uint32_t n, int k, jit_operand kind,
+        jit_operand_union *v, size_t opsz)
+{
+    jit_error e = JIT_SUCCESS;
+
+    ir->kind[k][n] = (int8_t)kind;
+    switch(kind) {
+        case JIT_OPERAND_REG:
+            ir->val[k][n] = v->reg;
+            break;
+        case JIT_OPERAND_LABEL:
+            ir->val[k][n] = (int32_t)v->label;
+            break;
+        case JIT_OPERAND_IMM:
+            if(opsz != JIT_64BIT) {
+                ir->val[k][n] = v->imm32;
+                break;
+            }
+            // Fall through: 64-bit immediates go to the aux table.
+        case JIT_OPERAND_REGPTR:
+        case JIT_OPERAND_IMMPTR:
+        case JIT_OPERAND_IMMDISP:
+            if(ir->naux == ir->naux_alloc) {
+                uint32_t nalloc = ir->naux_alloc ? 2 * ir->naux_alloc : 64;
+                jit_operand_union *p = realloc(ir->aux,
+                        nalloc * sizeof(jit_operand_union));
+                if(p == NULL) {
+                    FAILPATH(JIT_ERROR_MALLOC);
+                }
+                ir->aux = p;
+                ir->naux_alloc = nalloc;
+            }
+            ir->aux[ir->naux] = *v;
+            ir->val[k][n] = (int32_t)ir->naux++;
+            break;
+        default:
+            ir->val[k][n] = 0;
+            break;
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_ir_build(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_ir *ir = s->p_ir;
+    struct jit_instr *i;
+    uint32_t n;
+
+    if(ir == NULL) {
+        ir = s->p_ir = (struct jit_ir *) calloc(1, sizeof(struct jit_ir));
+        if(ir == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    e = jit_ir_grow(ir, (uint32_t)s->blk_ni);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+
+    ir->naux = 0;
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++) {
+        ir->op[n] = (uint8_t)i->op;
+        ir->opsz[n] = (uint8_t)i->opsz;
+        e = jit_ir_put(ir, n, JIT_IR_IN1, i->in1_type, &i->in1, i->opsz);
+        if(SUCCESS(e)) {
+            e = jit_ir_put(ir, n, JIT_IR_IN2, i->in2_type, &i->in2, i->opsz);
+        }
+        if(SUCCESS(e)) {
+            e = jit_ir_put(ir, n, JIT_IR_OUT, i->out_type, &i->out, i->opsz);
+        }
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+    }
+    ir->n = n;
+
+l_exit:
+    return e;
+}
+
+void
+jit_ir_destroy(struct jit_ir *ir)
+{
+    size_t k;
+
+    if(ir == NULL) {
+        return;
+    }
+    free(ir->op);
+    free(ir->opsz);
+    for(k = 0; k < JIT_IR_NSLOTS; k++) {
+        free(ir->kind[k]);
+        free(ir->val[k]);
+    }
+    free(ir->aux);
+    free(ir);
+}
+
+static void
+jit_ir_get_operand(struct jit_ir *ir, uint32_t n, int k, jit_operand *kind,
+        jit_operand_union *v, size_t opsz)
+{
+    *kind = (jit_operand)ir->kind[k][n];
+    memset(v, 0, sizeof(jit_operand_union));
+    switch(*kind) {
+        case JIT_OPERAND_REG:
+            v->reg = ir->val[k][n];
+            break;
+        case JIT_OPERAND_LABEL:
+            v->label = (jit_label)ir->val[k][n];
+            break;
+        case JIT_OPERAND_IMM:
+            if(opsz != JIT_64BIT) {
+                v->imm32 = ir->val[k][n];
+                break;
+            }
+            // Fall through.
+        case JIT_OPERAND_REGPTR:
+        case JIT_OPERAND_IMMPTR:
+        case JIT_OPERAND_IMMDISP:
+            *v = ir->aux[ir->val[k][n]];
+            break;
+        default:
+            break;
+    }
+}
+
+void
+jit_ir_get(struct jit_ir *ir, uint32_t n, struct jit_instr *i)
+{
+    i->op = (jit_op)ir->op[n];
+    i->opsz = ir->opsz[n];
+    jit_ir_get_operand(ir, n, JIT_IR_IN1, &i->in1_type, &i->in1, i->opsz);
+    jit_ir_get_operand(ir, n, JIT_IR_IN2, &i->in2_type, &i->in2, i->opsz);
+    jit_ir_get_operand(ir, n, JIT_IR_OUT, &i->out_type, &i->out, i->opsz);
+    i->next = NULL;
+}
+
+void
+jit_instr_operands(struct jit_instr *i, jit_operand *ka,
+        jit_operand_union **va, jit_operand *kb, jit_operand_union **vb)
+{
+    if(i->in1_type == JIT_OPERAND_IMM) {
+        *ka = i->in2_type; *va = &i->in2;
+        *kb = i->in1_type; *vb = &i->in1;
+    } else {
+        *ka = i->in1_type; *va = &i->in1;
+        *kb = i->in2_type; *vb = &i->in2;
+    }
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _JIT_IR_H_
+#define _JIT_IR_H_
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include "libjit.h"
+
+/* Operand slots of an instruction, as indexes into the jit_ir arrays. */
+enum e_jit_ir_slot {
+    JIT_IR_IN1 = 0,
+    JIT_IR_IN2 = 1,
+    JIT_IR_OUT = 2,
+    JIT_IR_NSLOTS,
+};
+
+/* The block's instructions laid out as dense arrays indexed by instruction
+ * number, for the analysis passes to scan (in either direction) without
+ * chasing pointers.
+ *
+ * Registers, labels and 32-bit immediates are stored inline in val. Anything
+ * wider, i.e. pointers, register pointers and 64-bit immediates, lives in the
+ * aux table, and val holds its index there. */
+struct jit_ir {
+    /* Number of instructions, and capacity of the arrays. */
+    uint32_t n;
+    uint32_t nalloc;
+
+    uint8_t *op;
+    uint8_t *opsz;
+    int8_t *kind[JIT_IR_NSLOTS];
+    int32_t *val[JIT_IR_NSLOTS];
+
+    jit_operand_union *aux;
+    uint32_t naux;
+    uint32_t naux_alloc;
+};
+
+/* (Re)build the compact form of the state's instruction list in s->p_ir.
+ * Needs re-running after instructions are added or edited. */
+jit_error jit_ir_build(struct jit_state *s);
+
+void jit_ir_destroy(struct jit_ir *ir);
+
+/* Expand instruction n of the compact IR back into a jit_instr. */
+void jit_ir_get(struct jit_ir *ir, uint32_t n, struct jit_instr *i);
+
+/* The operands of binary operation i in the order it applies them, a op b:
+ * I_R_R computes in2 op imm, the others in1 op in2. */
+void jit_instr_operands(struct jit_instr *i, jit_operand *ka,
+        jit_operand_union **va, jit_operand *kb, jit_operand_union **vb);
+
+/* A basic block: instructions [start, end) of the jit_state, entered only at
+ * start and left only after end - 1. */
+struct jit_cfg_block {
+    uint32_t start;
+    uint32_t end;
+    /* Successors, fall-through first, as block indexes. */
+    uint32_t succ[2];
+    uint32_t nsucc;
+    /* Predecessors, as a run of the preds array. */
+    uint32_t pred;
+    uint32_t npred;
+};
+
+/* The control flow graph of the instructions, split at jumps, returns and
+ * jump targets. Blocks are in instruction order; block 0 is the entry. */
+struct jit_cfg {
+    struct jit_cfg_block *blocks;
+    uint32_t nblocks;
+    uint32_t nblocks_alloc;
+    uint32_t *preds;
+    uint32_t npreds_alloc;
+    /* Block of each instruction. */
+    uint32_t *block_of;
+    uint32_t ninstrs_alloc;
+};
+
+/* Compute s->p_cfg from s->p_ir. Jumps must target a label in the block. */
+jit_error jit_cfg_build(struct jit_state *s);
+
+void jit_cfg_destroy(struct jit_cfg *c);
+
+#define JIT_LIVE_NONE UINT32_MAX
+
+/* One live range of a virtual register, from the instruction defining it
+ * (or where it becomes live) to its last use, both inclusive. A register
+ * defined several times gets one range per definition. */
+struct jit_live_range {
+    jit_reg reg;
+    uint32_t start;
+    uint32_t end;
+    /* Next range of the same register, in instruction order. */
+    uint32_t next;
+    /* Whether the value is live along a jump or into a jump target: it then
+     * has this single range, and must stay in one place throughout. */
+    int cross;
+};
+
+/* Live ranges of every virtual register of the block. Implicit uses and
+ * definitions by CALL and RET are not modelled: registers with a fixed
+ * mapping are pinned to their host register for the whole block anyway. */
+struct jit_liveness {
+    /* Number of virtual registers covered. */
+    uint32_t nregs;
+    uint32_t nregs_alloc;
+    /* Per register: index of its first range, or JIT_LIVE_NONE. */
+    uint32_t *first;
+    /* Per register, while computing: index of the range being extended. */
+    uint32_t *open;
+
+    struct jit_live_range *ranges;
+    uint32_t nranges;
+    uint32_t nranges_alloc;
+};
+
+/* Compute s->p_live from s->p_ir in a single backward walk, and for code
+ * with jumps, iterate to a fixed point over the blocks of s->p_cfg. */
+jit_error jit_liveness(struct jit_state *s);
+
+void jit_liveness_destroy(struct jit_liveness *l);
+
+/* Return the range of register r covering instruction n, or NULL. */
+struct jit_live_range* jit_live_range_at(struct jit_liveness *l, jit_reg r,
+        uint32_t n);
+
+/* Whether operand slot k of instruction n is the virtual register r. */
+#define JIT_IR_IS_REG(ir,n,k,r) ((ir)->kind[k][n] == JIT_OPERAND_REG && \
+        (ir)->val[k][n] == (r))
+
+/* Whether op reads the flags, and whether it reads its output register as
+ * well as writing it. */
+#define JIT_OP_READS_FLAGS(op) ((op) == JIT_OP_JUMP_IF || \
+        (op) == JIT_OP_SET_IF || (op) == JIT_OP_MOVE_IF)
+#define JIT_OP_READS_OUT(op) ((op) == JIT_OP_MOVE_IF)
+
+#ifdef __CPLUSPLUS
+}
+#endif
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libjit.h"
+#include "jit_ir.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+static jit_error
+jit_live_new_range(struct jit_liveness *l, jit_reg r, uint32_t n)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_live_range *lr;
+
+    if(l->nranges == l->nranges_alloc) {
+        uint32_t nalloc = l->nranges_alloc ? 2 * l->nranges_alloc : 256;
+        lr = realloc(l->ranges, nalloc * sizeof(struct jit_live_range));
+        if(lr == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+        l->ranges = lr;
+        l->nranges_alloc = nalloc;
+    }
+
+    // Ranges are created from the end of the block backwards, so pushing to
+    // the front keeps each register's list in instruction order.
+    lr = &l->ranges[l->nranges];
+    lr->reg = r;
+    lr->start = lr->end = n;
+    lr->cross = 0;
+    lr->next = l->first[r];
+    l->first[r] = l->open[r] = l->nranges++;
+
+l_exit:
+    return e;
+}
+
+/* Register r is defined by instruction n. */
+static jit_error
+jit_live_def(struct jit_liveness *l, jit_reg r, uint32_t n)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(r < 0 || (uint32_t)r >= l->nregs) {
+        goto l_exit;
+    }
+    if(l->open[r] == JIT_LIVE_NONE) {
+        // Never read afterwards: the value still needs somewhere to go.
+        e = jit_live_new_range(l, r, n);
+    } else {
+        l->ranges[l->open[r]].start = n;
+    }
+    l->open[r] = JIT_LIVE_NONE;
+
+l_exit:
+    return e;
+}
+
+/* Register r is read by instruction n. */
+static jit_error
+jit_live_use(struct jit_liveness *l, jit_reg r, uint32_t n)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(r < 0 || (uint32_t)r >= l->nregs || l->open[r] != JIT_LIVE_NONE) {
+        goto l_exit;
+    }
+    // Read and written by the same instruction (e.g. add r, r): keep one
+    // range rather than splitting it at every update.
+    if(l->first[r] != JIT_LIVE_NONE && l->ranges[l->first[r]].start == n) {
+        l->open[r] = l->first[r];
+    } else {
+        e = jit_live_new_range(l, r, n);
+    }
+
+l_exit:
+    return e;
+}
+
+static jit_error
+jit_live_use_operand(struct jit_liveness *l, struct jit_ir *ir, uint32_t n,
+        int k)
+{
+    jit_error e = JIT_SUCCESS;
+
+    if(ir->kind[k][n] == JIT_OPERAND_REG) {
+        e = jit_live_use(l, ir->val[k][n], n);
+    } else if(ir->kind[k][n] == JIT_OPERAND_REGPTR) {
+        struct jit_ptr *p = &ir->aux[ir->val[k][n]].regptr;
+        e = jit_live_use(l, p->base, n);
+        if(SUCCESS(e)) {
+            e = jit_live_use(l, p->index, n);
+        }
+    }
+    return e;
+}
+
+#define BIT_SET(v,r) ((v)[(r) / 32] |= 1u << ((r) % 32))
+#define BIT_TEST(v,r) ((v)[(r) / 32] & (1u << ((r) % 32)))
+
+/* Record in gen the registers instruction n reads before its block writes
+ * them, and in kill those it writes. */
+static void
+jit_live_gen_kill(struct jit_liveness *l, struct jit_ir *ir, uint32_t n,
+        uint32_t *gen, uint32_t *kill)
+{
+    int def = (ir->op[n] == JIT_OP_POP) ? JIT_IR_IN1 : JIT_IR_OUT;
+    jit_reg use[2 * JIT_IR_NSLOTS];
+    int k, nuse = 0;
+
+    for(k = JIT_IR_IN1; k < JIT_IR_NSLOTS; k++) {
+        if(ir->kind[k][n] == JIT_OPERAND_REG &&
+                (k != def || JIT_OP_READS_OUT(ir->op[n]))) {
+            use[nuse++] = ir->val[k][n];
+        } else if(ir->kind[k][n] == JIT_OPERAND_REGPTR) {
+            struct jit_ptr *p = &ir->aux[ir->val[k][n]].regptr;
+            use[nuse++] = p->base;
+            use[nuse++] = p->index;
+        }
+    }
+    for(k = 0; k < nuse; k++) {
+        if(use[k] >= 0 && (uint32_t)use[k] < l->nregs &&
+                !BIT_TEST(kill, use[k])) {
+            BIT_SET(gen, use[k]);
+        }
+    }
+    if(ir->kind[def][n] == JIT_OPERAND_REG && ir->val[def][n] >= 0 &&
+            (uint32_t)ir->val[def][n] < l->nregs) {
+        BIT_SET(kill, ir->val[def][n]);
+    }
+}
+
+/* With jumps, a value can be live where the straight-line walk does not see
+ * it: into a loop head from its back edge, or across a jump over code. Find
+ * the registers live in and out of each block, and give every one of them
+ * a single range spanning all the blocks it is live through. */
+static jit_error
+jit_live_across(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_liveness *l = s->p_live;
+    struct jit_ir *ir = s->p_ir;
+    struct jit_cfg *c;
+    struct jit_cfg_block *b;
+    uint32_t *sets = NULL, *gen, *kill, *in, *out;
+    uint32_t *remap = NULL, *lo, *hi;
+    uint32_t nw = (l->nregs + 31) / 32;
+    uint32_t nb, n, k, w, r, m, v;
+    int changed;
+
+    e = jit_cfg_build(s);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    c = s->p_cfg;
+    nb = c->nblocks;
+    if(nb < 2 || nw == 0) {
+        goto l_exit;
+    }
+
+    sets = calloc(4 * (size_t)nb * nw, sizeof(uint32_t));
+    remap = malloc((l->nranges + 2 * (size_t)l->nregs) * sizeof(uint32_t));
+    if(sets == NULL || remap == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    gen = sets;
+    kill = gen + nb * nw;
+    in = kill + nb * nw;
+    out = in + nb * nw;
+    lo = remap + l->nranges;
+    hi = lo + l->nregs;
+
+    for(k = 0; k < nb; k++) {
+        for(n = c->blocks[k].start; n < c->blocks[k].end; n++) {
+            jit_live_gen_kill(l, ir, n, gen + k * nw, kill + k * nw);
+        }
+    }
+
+    // in = gen | (out & ~kill), out = union of the successors' in. Sets only
+    // grow, so visiting the blocks backwards until nothing changes does.
+    do {
+        changed = 0;
+        for(k = nb; k-- > 0; ) {
+            b = &c->blocks[k];
+            for(n = 0; n < b->nsucc; n++) {
+                for(w = 0; w < nw; w++) {
+                    out[k * nw + w] |= in[b->succ[n] * nw + w];
+                }
+            }
+            for(w = 0; w < nw; w++) {
+                v = gen[k * nw + w] | (out[k * nw + w] & ~kill[k * nw + w]);
+                if(v != in[k * nw + w]) {
+                    in[k * nw + w] = v;
+                    changed = 1;
+                }
+            }
+        }
+    } while(changed);
+
+    // The span of each register live across an edge, from the block
+    // boundaries it is live at and from the ranges found so far.
+    for(r = 0; r < l->nregs; r++) {
+        lo[r] = JIT_LIVE_NONE;
+        hi[r] = 0;
+    }
+    for(k = 0; k < nb; k++) {
+        b = &c->blocks[k];
+        for(r = 0; r < l->nregs; r++) {
+            if(BIT_TEST(in + k * nw, r)) {
+                lo[r] = (b->start < lo[r]) ? b->start : lo[r];
+                hi[r] = (b->start > hi[r]) ? b->start : hi[r];
+            }
+            if(BIT_TEST(out + k * nw, r)) {
+                lo[r] = (b->end - 1 < lo[r]) ? b->end - 1 : lo[r];
+                hi[r] = (b->end - 1 > hi[r]) ? b->end - 1 : hi[r];
+            }
+        }
+    }
+    for(r = 0; r < l->nranges; r++) {
+        struct jit_live_range *lr = &l->ranges[r];
+        if(lo[lr->reg] != JIT_LIVE_NONE) {
+            lo[lr->reg] = (lr->start < lo[lr->reg]) ? lr->start : lo[lr->reg];
+            hi[lr->reg] = (lr->end > hi[lr->reg]) ? lr->end : hi[lr->reg];
+        }
+    }
+
+    // Keep one range for each of those registers, and compact the rest.
+    for(r = 0, m = 0; r < l->nranges; r++) {
+        jit_reg reg = l->ranges[r].reg;
+        if(lo[reg] != JIT_LIVE_NONE && l->first[reg] != r) {
+            remap[r] = JIT_LIVE_NONE;
+            continue;
+        }
+        remap[r] = m;
+        l->ranges[m++] = l->ranges[r];
+    }
+    l->nranges = m;
+    for(r = 0; r < l->nranges; r++) {
+        struct jit_live_range *lr = &l->ranges[r];
+        if(lo[lr->reg] != JIT_LIVE_NONE) {
+            lr->start = lo[lr->reg];
+            lr->end = hi[lr->reg];
+            lr->next = JIT_LIVE_NONE;
+            lr->cross = 1;
+        } else if(lr->next != JIT_LIVE_NONE) {
+            lr->next = remap[lr->next];
+        }
+    }
+    for(r = 0; r < l->nregs; r++) {
+        if(l->first[r] != JIT_LIVE_NONE) {
+            l->first[r] = remap[l->first[r]];
+        }
+    }
+
+l_exit:
+    free(sets);
+    free(remap);
+    return e;
+}
+
+jit_error
+jit_liveness(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_liveness *l = s->p_live;
+    struct jit_ir *ir = s->p_ir;
+    uint32_t n, r;
+
+    if(ir == NULL) {
+        FAILPATH(JIT_ERROR_NULL_PTR);
+    }
+    if(l == NULL) {
+        l = s->p_live = calloc(1, sizeof(struct jit_liveness));
+        if(l == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    if(l->nregs_alloc < (uint32_t)s->regcur) {
+        uint32_t *first = realloc(l->first, s->regcur * sizeof(uint32_t));
+        uint32_t *open = first ? realloc(l->open,
+                s->regcur * sizeof(uint32_t)) : NULL;
+        if(first) l->first = first;
+        if(open == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+        l->open = open;
+        l->nregs_alloc = s->regcur;
+    }
+    l->nregs = s->regcur;
+    l->nranges = 0;
+    for(r = 0; r < l->nregs; r++) {
+        l->first[r] = l->open[r] = JIT_LIVE_NONE;
+    }
+
+    // A register's value is dead just before the instruction defining it,
+    // and live from any read back to the definition that reaches it.
+    for(n = ir->n; n-- > 0; ) {
+        // POP writes its only operand; everything else writes out.
+        int def = (ir->op[n] == JIT_OP_POP) ? JIT_IR_IN1 : JIT_IR_OUT;
+        int k;
+
+        if(ir->kind[def][n] == JIT_OPERAND_REG) {
+            e = jit_live_def(l, ir->val[def][n], n);
+        } else {
+            e = jit_live_use_operand(l, ir, n, def);
+        }
+        for(k = JIT_IR_IN1; SUCCESS(e) && k < JIT_IR_NSLOTS; k++) {
+            if(k != def || JIT_OP_READS_OUT(ir->op[n])) {
+                e = jit_live_use_operand(l, ir, n, k);
+            }
+        }
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+    }
+
+    // Whatever is still open is live on entry to the block.
+    for(r = 0; r < l->nregs; r++) {
+        if(l->open[r] != JIT_LIVE_NONE) {
+            l->ranges[l->open[r]].start = 0;
+            l->open[r] = JIT_LIVE_NONE;
+        }
+    }
+
+    for(n = 0; n < ir->n; n++) {
+        if(ir->op[n] == JIT_OP_JUMP || ir->op[n] == JIT_OP_JUMP_IF) {
+            e = jit_live_across(s);
+            break;
+        }
+    }
+
+l_exit:
+    return e;
+}
+
+void
+jit_liveness_destroy(struct jit_liveness *l)
+{
+    if(l == NULL) {
+        return;
+    }
+    free(l->first);
+    free(l->open);
+    free(l->ranges);
+    free(l);
+}
+
+struct jit_live_range*
+jit_live_range_at(struct jit_liveness *l, jit_reg r, uint32_t n)
+{
+    uint32_t k;
+
+    if(r < 0 || (uint32_t)r >= l->nregs) {
+        return NULL;
+    }
+    for(k = l->first[r]; k != JIT_LIVE_NONE; k = l->ranges[k].next) {
+        if(l->ranges[k].start <= n && n <= l->ranges[k].end) {
+            return &l->ranges[k];
+        }
+        if(l->ranges[k].start > n) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
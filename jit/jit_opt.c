@@ -0,0 +1,922 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libjit.h"
+#include "jit_ir.h"
+
+#define FAILPATH(err) {e=(err);goto l_exit;}
+
+/* Registers holding a known 32-bit value at the current instruction. */
+struct jit_consts {
+    uint8_t *known;
+    int32_t *val;
+    uint32_t nregs;
+};
+
+#define KNOWN(c,r) ((r) >= 0 && (uint32_t)(r) < (c)->nregs && (c)->known[r])
+
+/* res = a op b, as the x86 32-bit forms compute it. Divisions that would
+ * trap are left to do so at run time. */
+static int
+jit_fold_op(jit_op op, int32_t a, int32_t b, int32_t *res)
+{
+    uint32_t x = (uint32_t)a, y = (uint32_t)b;
+
+    if((op == JIT_OP_DIV || op == JIT_OP_DIVU || op == JIT_OP_REM ||
+                op == JIT_OP_REMU) && (b == 0 || (a == INT32_MIN && b == -1))) {
+        return 0;
+    }
+    switch(op) {
+        case JIT_OP_ADD: *res = (int32_t)(x + y); break;
+        case JIT_OP_SUB: *res = (int32_t)(x - y); break;
+        case JIT_OP_AND: *res = (int32_t)(x & y); break;
+        case JIT_OP_OR:  *res = (int32_t)(x | y); break;
+        case JIT_OP_XOR: *res = (int32_t)(x ^ y); break;
+        case JIT_OP_SHL: *res = (int32_t)(x << (y & 31)); break;
+        case JIT_OP_SHR: *res = (int32_t)(x >> (y & 31)); break;
+        case JIT_OP_SAR: *res = a >> (y & 31); break;
+        case JIT_OP_MUL: *res = (int32_t)(x * y); break;
+        case JIT_OP_DIV: *res = a / b; break;
+        case JIT_OP_DIVU: *res = (int32_t)(x / y); break;
+        case JIT_OP_REM: *res = a % b; break;
+        case JIT_OP_REMU: *res = (int32_t)(x % y); break;
+        default: return 0;
+    }
+    return 1;
+}
+
+static int
+jit_opt_sets_flags(int op)
+{
+    switch(op) {
+        case JIT_OP_ADD: case JIT_OP_SUB: case JIT_OP_AND: case JIT_OP_OR:
+        case JIT_OP_XOR: case JIT_OP_SHL: case JIT_OP_SHR: case JIT_OP_SAR:
+        case JIT_OP_MUL: case JIT_OP_CMP: case JIT_OP_DIV:
+        case JIT_OP_DIVU: case JIT_OP_REM: case JIT_OP_REMU: case JIT_OP_FLAGS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Whether something reads the flags instruction i leaves. */
+static int
+jit_opt_flags_read(struct jit_instr *i)
+{
+    for(i = i->next; i != NULL; i = i->next) {
+        if(JIT_OP_READS_FLAGS(i->op) || i->op == JIT_OP_JUMP) {
+            return 1;
+        }
+        if(jit_opt_sets_flags(i->op) || i->op == JIT_OP_CALL ||
+                i->op == JIT_OP_RET || i->op == JIT_OP_EXIT) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int
+jit_fold_commutes(jit_op op)
+{
+    return op == JIT_OP_ADD || op == JIT_OP_AND || op == JIT_OP_OR ||
+        op == JIT_OP_XOR || op == JIT_OP_MUL;
+}
+
+/* Rewrite instruction i with what is known before it. Unless keep_flags is
+ * set, a result known outright replaces the operation. */
+static void
+jit_fold_instr(struct jit_consts *c, struct jit_instr *i, int keep_flags)
+{
+    int32_t res;
+    jit_reg r1, r2;
+
+    if(i->opsz != JIT_32BIT || i->out_type != JIT_OPERAND_REG) {
+        return;
+    }
+    if(i->op == JIT_OP_MOVE) {
+        if(i->in1_type == JIT_OPERAND_REG && KNOWN(c, i->in1.reg)) {
+            i->in1_type = JIT_OPERAND_IMM;
+            i->in1.imm32 = c->val[i->in1.reg];
+        }
+        return;
+    }
+    if(!jit_fold_op(i->op, 0, 1, &res) || i->in2_type != JIT_OPERAND_REG) {
+        return;
+    }
+
+    // R_R_R computes out = in1 op in2, and I_R_R out = in2 op in1. A known
+    // register operand becomes the immediate, swapping them if need be.
+    if(i->in1_type == JIT_OPERAND_REG) {
+        r1 = i->in1.reg;
+        r2 = i->in2.reg;
+        if(KNOWN(c, r2) && !KNOWN(c, r1)) {
+            i->in1_type = JIT_OPERAND_IMM;
+            i->in1.imm32 = c->val[r2];
+            i->in2.reg = r1;
+            return;
+        }
+        if(KNOWN(c, r1) && !KNOWN(c, r2)) {
+            if(jit_fold_commutes(i->op)) {
+                i->in1_type = JIT_OPERAND_IMM;
+                i->in1.imm32 = c->val[r1];
+            }
+            return;
+        }
+        if(!KNOWN(c, r1) ||
+                !jit_fold_op(i->op, c->val[r1], c->val[r2], &res)) {
+            return;
+        }
+    } else if(i->in1_type == JIT_OPERAND_IMM && KNOWN(c, i->in2.reg)) {
+        if(!jit_fold_op(i->op, c->val[i->in2.reg], i->in1.imm32, &res)) {
+            return;
+        }
+    } else {
+        return;
+    }
+
+    // Both known: the result is, unless the flags are wanted too.
+    if(keep_flags) {
+        return;
+    }
+    i->op = JIT_OP_MOVE;
+    i->in1_type = JIT_OPERAND_IMM;
+    i->in1.imm32 = res;
+    i->in2_type = JIT_OPERAND_INVALID;
+}
+
+jit_error
+jit_opt_fold(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_consts c;
+    struct jit_instr *i;
+    uint8_t *target = NULL;
+    size_t n;
+
+    if(s == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    c.nregs = (uint32_t)s->regcur;
+    c.known = calloc(c.nregs + 1, 1);
+    c.val = malloc((c.nregs + 1) * sizeof(int32_t));
+    target = calloc(s->blk_ni + 1, 1);
+    if(c.known == NULL || c.val == NULL || target == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+
+    // Values are only tracked along straight-line code: nothing is known
+    // where other paths join in.
+    for(i = s->blk_is; i != NULL; i = i->next) {
+        if((i->op == JIT_OP_JUMP || i->op == JIT_OP_JUMP_IF) &&
+                i->in1_type == JIT_OPERAND_LABEL &&
+                i->in1.label <= s->blk_ni) {
+            target[i->in1.label] = 1;
+        }
+    }
+
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++) {
+        if(target[n]) {
+            memset(c.known, 0, c.nregs);
+        }
+        jit_fold_instr(&c, i, jit_opt_sets_flags(i->op) &&
+                jit_opt_flags_read(i));
+
+        if(i->op == JIT_OP_CALL) {
+            // The callee may change any register pinned to a host one.
+            memset(c.known, 0, c.nregs);
+        } else if(i->op == JIT_OP_POP) {
+            if(i->in1_type == JIT_OPERAND_REG && i->in1.reg >= 0 &&
+                    (uint32_t)i->in1.reg < c.nregs) {
+                c.known[i->in1.reg] = 0;
+            }
+        } else if(i->out_type == JIT_OPERAND_REG && i->out.reg >= 0 &&
+                (uint32_t)i->out.reg < c.nregs) {
+            c.known[i->out.reg] = i->op == JIT_OP_MOVE &&
+                i->opsz == JIT_32BIT && i->in1_type == JIT_OPERAND_IMM;
+            c.val[i->out.reg] = i->in1.imm32;
+        }
+    }
+
+l_exit:
+    free(c.known);
+    free(c.val);
+    free(target);
+    return e;
+}
+
+/* Liveness as the dead code pass sees it: one bit per register, and one
+ * more for the flags. */
+struct jit_dce {
+    struct jit_ir *ir;
+    uint32_t nregs;
+    uint32_t nw;
+    uint8_t *fixed;
+};
+
+#define BIT_SET(v,r) ((v)[(r) / 32] |= 1u << ((r) % 32))
+#define BIT_CLR(v,r) ((v)[(r) / 32] &= ~(1u << ((r) % 32)))
+#define BIT_TEST(v,r) ((v)[(r) / 32] & (1u << ((r) % 32)))
+
+static void
+jit_dce_use(struct jit_dce *d, uint32_t *live, jit_reg r)
+{
+    if(r >= 0 && (uint32_t)r < d->nregs) {
+        BIT_SET(live, r);
+    }
+}
+
+/* Step live back over instruction n, unless may_remove is set and n can go
+ * instead, which is returned. */
+static int
+jit_dce_step(struct jit_dce *d, uint32_t *live, uint32_t n, int may_remove)
+{
+    struct jit_ir *ir = d->ir;
+    uint8_t op = ir->op[n];
+    int def = (op == JIT_OP_POP) ? JIT_IR_IN1 : JIT_IR_OUT;
+    int flags = jit_opt_sets_flags(op);
+    int whole = ir->opsz[n] >= JIT_32BIT;
+    jit_reg out = JIT_REG_INVALID;
+    int k;
+
+    if(op == JIT_OP_NOP) {
+        return 0;
+    }
+    if(ir->kind[def][n] == JIT_OPERAND_REG) {
+        out = ir->val[def][n];
+    }
+
+    // Pure: only writes a register that is not pinned, and maybe the flags.
+    if(may_remove && (op == JIT_OP_MOVE || op == JIT_OP_MOVZX ||
+                op == JIT_OP_MOVSX || op == JIT_OP_SET_IF ||
+                op == JIT_OP_MOVE_IF || flags) && op != JIT_OP_DIV &&
+            op != JIT_OP_DIVU && op != JIT_OP_REM && op != JIT_OP_REMU &&
+            (op == JIT_OP_CMP || op == JIT_OP_FLAGS ||
+             (out >= 0 && (uint32_t)out < d->nregs && !d->fixed[out] &&
+              !BIT_TEST(live, out))) &&
+            !(flags && BIT_TEST(live, d->nregs))) {
+        return 1;
+    }
+
+    // A partial write keeps the rest of the register. Extensions size their
+    // source, and write all of the output; MOVE_IF may keep all of it.
+    if(op == JIT_OP_MOVZX || op == JIT_OP_MOVSX) {
+        whole = 1;
+    } else if(JIT_OP_READS_OUT(op)) {
+        whole = 0;
+    }
+    if(out >= 0 && (uint32_t)out < d->nregs && whole) {
+        BIT_CLR(live, out);
+    }
+    if(flags || op == JIT_OP_CALL) {
+        BIT_CLR(live, d->nregs);
+    }
+    if(JIT_OP_READS_FLAGS(op)) {
+        BIT_SET(live, d->nregs);
+    }
+    for(k = JIT_IR_IN1; k < JIT_IR_NSLOTS; k++) {
+        if(ir->kind[k][n] == JIT_OPERAND_REG &&
+                (k != def || !whole)) {
+            jit_dce_use(d, live, ir->val[k][n]);
+        } else if(ir->kind[k][n] == JIT_OPERAND_REGPTR) {
+            struct jit_ptr *p = &ir->aux[ir->val[k][n]].regptr;
+            jit_dce_use(d, live, p->base);
+            jit_dce_use(d, live, p->index);
+        }
+    }
+    return 0;
+}
+
+jit_error
+jit_opt_dce(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_dce d;
+    struct jit_cfg *c;
+    struct jit_instr **is = NULL, *i;
+    uint32_t *sets = NULL, *in, *out, *live;
+    uint32_t nb, k, n, w, r;
+    int changed, removed;
+
+    memset(&d, 0, sizeof(d));
+    if(s == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_cfg_build(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    d.ir = s->p_ir;
+    d.nregs = (uint32_t)s->regcur;
+    d.nw = (d.nregs + 1 + 31) / 32;
+    c = s->p_cfg;
+    nb = c->nblocks;
+
+    is = malloc((d.ir->n + 1) * sizeof(struct jit_instr *));
+    d.fixed = malloc(d.nregs + 1);
+    sets = malloc((2 * (size_t)nb + 1) * d.nw * sizeof(uint32_t));
+    if(is == NULL || d.fixed == NULL || sets == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++) {
+        is[n] = i;
+    }
+    for(r = 0; r < d.nregs; r++) {
+        d.fixed[r] = (uint8_t)jit_reg_is_fixed(s, (jit_reg)r);
+    }
+    in = sets;
+    out = in + nb * d.nw;
+    live = out + nb * d.nw;
+
+    // Removing an instruction can make the ones feeding it dead, including
+    // in other blocks: start over until nothing goes.
+    do {
+        memset(in, 0, 2 * nb * d.nw * sizeof(uint32_t));
+        do {
+            changed = 0;
+            for(k = nb; k-- > 0; ) {
+                struct jit_cfg_block *b = &c->blocks[k];
+                for(n = 0; n < b->nsucc; n++) {
+                    for(w = 0; w < d.nw; w++) {
+                        out[k * d.nw + w] |= in[b->succ[n] * d.nw + w];
+                    }
+                }
+                memcpy(live, out + k * d.nw, d.nw * sizeof(uint32_t));
+                for(n = b->end; n-- > b->start; ) {
+                    jit_dce_step(&d, live, n, 0);
+                }
+                for(w = 0; w < d.nw; w++) {
+                    if(live[w] != in[k * d.nw + w]) {
+                        in[k * d.nw + w] = live[w];
+                        changed = 1;
+                    }
+                }
+            }
+        } while(changed);
+
+        removed = 0;
+        for(k = 0; k < nb; k++) {
+            struct jit_cfg_block *b = &c->blocks[k];
+            memcpy(live, out + k * d.nw, d.nw * sizeof(uint32_t));
+            for(n = b->end; n-- > b->start; ) {
+                if(jit_dce_step(&d, live, n, 1)) {
+                    i = is[n];
+                    i->op = d.ir->op[n] = JIT_OP_NOP;
+                    i->in1_type = i->in2_type = i->out_type =
+                        JIT_OPERAND_INVALID;
+                    removed = 1;
+                }
+            }
+        }
+    } while(removed);
+
+l_exit:
+    free(is);
+    free(d.fixed);
+    free(sets);
+    return e;
+}
+
+/* One operand of a value, registers qualified with their version. */
+struct jit_cse_opnd {
+    int64_t kind;
+    uint64_t a;
+    uint64_t b;
+    uint64_t c;
+};
+
+/* What a value is computed from. Compared bytewise, so built zeroed. Values
+ * read from memory also carry the number of stores seen so far. */
+struct jit_cse_key {
+    int32_t op;
+    int32_t opsz;
+    uint32_t gen;
+    uint32_t epoch;
+    struct jit_cse_opnd in[2];
+};
+
+/* A value and the register that holds it, while that version lasts. */
+struct jit_cse_entry {
+    struct jit_cse_key key;
+    jit_reg holder;
+    uint32_t hver;
+    int used;
+};
+
+/* A register known to hold a copy of another. */
+struct jit_cse_copy {
+    jit_reg src;
+    uint32_t sver;
+    uint32_t ver;
+    uint32_t gen;
+};
+
+struct jit_cse {
+    uint32_t nregs;
+    /* Bumped at every write of a register. */
+    uint32_t *ver;
+    uint8_t *fixed;
+    struct jit_cse_copy *copy;
+    /* Bumped where nothing can be assumed, and at every store. */
+    uint32_t gen;
+    uint32_t epoch;
+
+    struct jit_cse_entry *table;
+    uint32_t mask;
+};
+
+#define TRACKED(c,r) ((r) >= 0 && (uint32_t)(r) < (c)->nregs)
+
+/* Register r, or the one it is a valid copy of. */
+static jit_reg
+jit_cse_source(struct jit_cse *c, jit_reg r)
+{
+    struct jit_cse_copy *cp;
+
+    if(!TRACKED(c, r)) {
+        return r;
+    }
+    cp = &c->copy[r];
+    if(cp->gen == c->gen && cp->ver == c->ver[r] && TRACKED(c, cp->src) &&
+            cp->sver == c->ver[cp->src]) {
+        return cp->src;
+    }
+    return r;
+}
+
+static void
+jit_cse_reg(struct jit_cse *c, jit_reg r, uint64_t *v)
+{
+    *v = (uint32_t)r;
+    if(TRACKED(c, r)) {
+        *v |= (uint64_t)c->ver[r] << 32;
+    }
+}
+
+/* Fill o from an operand, returning whether it reads memory. */
+static int
+jit_cse_opnd(struct jit_cse *c, jit_operand kind, jit_operand_union *v,
+        struct jit_cse_opnd *o)
+{
+    o->kind = kind;
+    switch(kind) {
+        case JIT_OPERAND_REG:
+            jit_cse_reg(c, v->reg, &o->a);
+            break;
+        case JIT_OPERAND_IMM:
+            o->a = (uint32_t)v->imm32;
+            break;
+        case JIT_OPERAND_IMMPTR:
+            o->a = (uintptr_t)v->ptr;
+            return 1;
+        case JIT_OPERAND_IMMDISP:
+            o->a = (uintptr_t)v->ptr;
+            break;
+        case JIT_OPERAND_REGPTR:
+            jit_cse_reg(c, v->regptr.base, &o->a);
+            jit_cse_reg(c, v->regptr.index, &o->b);
+            o->c = ((uint64_t)(uint32_t)v->regptr.scale << 32) |
+                (uint32_t)v->regptr.offset;
+            return 1;
+        default:
+            break;
+    }
+    return 0;
+}
+
+/* Build the key of the value instruction i computes, or return 0 if it is
+ * not one this pass tracks. */
+static int
+jit_cse_key(struct jit_cse *c, struct jit_instr *i, struct jit_cse_key *k)
+{
+    struct jit_cse_opnd t;
+    int32_t res;
+    int mem;
+
+    if(i->opsz != JIT_32BIT || i->out_type != JIT_OPERAND_REG) {
+        return 0;
+    }
+    memset(k, 0, sizeof(*k));
+    k->op = i->op;
+    k->opsz = (int32_t)i->opsz;
+    k->gen = c->gen;
+    if(i->op == JIT_OP_MOVE) {
+        // Loads and addresses: moves from registers and immediates are
+        // already as cheap as what would replace them.
+        if(i->in1_type != JIT_OPERAND_IMMPTR &&
+                i->in1_type != JIT_OPERAND_REGPTR &&
+                i->in1_type != JIT_OPERAND_IMMDISP) {
+            return 0;
+        }
+        mem = jit_cse_opnd(c, i->in1_type, &i->in1, &k->in[0]);
+    } else if(jit_fold_op(i->op, 0, 1, &res) &&
+            i->in2_type == JIT_OPERAND_REG &&
+            (i->in1_type == JIT_OPERAND_REG ||
+             i->in1_type == JIT_OPERAND_IMM)) {
+        mem = jit_cse_opnd(c, i->in1_type, &i->in1, &k->in[0]);
+        mem |= jit_cse_opnd(c, i->in2_type, &i->in2, &k->in[1]);
+        // Order the operands of a R_R_R that commutes.
+        if(jit_fold_commutes(i->op) && i->in1_type == JIT_OPERAND_REG &&
+                k->in[0].a > k->in[1].a) {
+            t = k->in[0];
+            k->in[0] = k->in[1];
+            k->in[1] = t;
+        }
+    } else {
+        return 0;
+    }
+    if(mem) {
+        k->epoch = c->epoch + 1;
+    }
+    return 1;
+}
+
+static uint32_t
+jit_cse_hash(struct jit_cse_key *k)
+{
+    const uint8_t *p = (const uint8_t *)k;
+    uint32_t h = 2166136261u;
+    size_t n;
+
+    for(n = 0; n < sizeof(*k); n++) {
+        h = (h ^ p[n]) * 16777619u;
+    }
+    return h;
+}
+
+/* Find the slot of key k, or the free one it would go in. */
+static struct jit_cse_entry *
+jit_cse_lookup(struct jit_cse *c, struct jit_cse_key *k)
+{
+    uint32_t h = jit_cse_hash(k) & c->mask;
+
+    while(c->table[h].used && memcmp(&c->table[h].key, k, sizeof(*k))) {
+        h = (h + 1) & c->mask;
+    }
+    return &c->table[h];
+}
+
+static void
+jit_cse_insert(struct jit_cse *c, struct jit_cse_key *k, jit_reg holder)
+{
+    struct jit_cse_entry *ent;
+
+    if(!TRACKED(c, holder)) {
+        return;
+    }
+    ent = jit_cse_lookup(c, k);
+    ent->key = *k;
+    ent->holder = holder;
+    ent->hver = c->ver[holder];
+    ent->used = 1;
+}
+
+static void
+jit_cse_def(struct jit_cse *c, jit_reg r)
+{
+    if(TRACKED(c, r)) {
+        c->ver[r]++;
+    }
+}
+
+/* Read registers through the copies they are of. */
+static void
+jit_cse_forward(struct jit_cse *c, struct jit_instr *i)
+{
+    int32_t res;
+
+    if(i->opsz != JIT_32BIT || !(i->op == JIT_OP_MOVE ||
+                i->op == JIT_OP_CMP || jit_fold_op(i->op, 0, 1, &res))) {
+        return;
+    }
+    if(i->in1_type == JIT_OPERAND_REG) {
+        i->in1.reg = jit_cse_source(c, i->in1.reg);
+    }
+    if(i->in2_type == JIT_OPERAND_REG) {
+        i->in2.reg = jit_cse_source(c, i->in2.reg);
+    }
+}
+
+jit_error
+jit_opt_cse(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_cse c;
+    struct jit_cse_key k;
+    struct jit_cse_entry *ent;
+    struct jit_instr *i;
+    uint8_t *target = NULL;
+    uint32_t cap, r;
+    size_t n;
+    int numbered;
+
+    memset(&c, 0, sizeof(c));
+    if(s == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    for(cap = 16; cap < 2 * (s->blk_ni + 1); cap *= 2) {
+    }
+    c.nregs = (uint32_t)s->regcur;
+    c.mask = cap - 1;
+    c.ver = calloc(c.nregs + 1, sizeof(uint32_t));
+    c.fixed = malloc(c.nregs + 1);
+    c.copy = calloc(c.nregs + 1, sizeof(struct jit_cse_copy));
+    c.table = calloc(cap, sizeof(struct jit_cse_entry));
+    target = calloc(s->blk_ni + 1, 1);
+    if(c.ver == NULL || c.fixed == NULL || c.copy == NULL ||
+            c.table == NULL || target == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    for(r = 0; r < c.nregs; r++) {
+        c.fixed[r] = (uint8_t)jit_reg_is_fixed(s, (jit_reg)r);
+    }
+
+    // As for folding, values only carry along straight-line code. Copies
+    // and values of generation 0 are never valid.
+    for(i = s->blk_is; i != NULL; i = i->next) {
+        if((i->op == JIT_OP_JUMP || i->op == JIT_OP_JUMP_IF) &&
+                i->in1_type == JIT_OPERAND_LABEL &&
+                i->in1.label <= s->blk_ni) {
+            target[i->in1.label] = 1;
+        }
+    }
+
+    c.gen = 1;
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++) {
+        if(target[n]) {
+            c.gen++;
+        }
+        jit_cse_forward(&c, i);
+
+        numbered = jit_cse_key(&c, i, &k);
+        if(numbered) {
+            ent = jit_cse_lookup(&c, &k);
+            if(ent->used && TRACKED(&c, ent->holder) &&
+                    c.ver[ent->holder] == ent->hver &&
+                    !(jit_opt_sets_flags(i->op) && jit_opt_flags_read(i))) {
+                if(ent->holder == i->out.reg) {
+                    // Already there.
+                    i->op = JIT_OP_NOP;
+                    i->in1_type = i->in2_type = i->out_type =
+                        JIT_OPERAND_INVALID;
+                    continue;
+                }
+                i->op = JIT_OP_MOVE;
+                i->in1_type = JIT_OPERAND_REG;
+                i->in1.reg = ent->holder;
+                i->in2_type = JIT_OPERAND_INVALID;
+                numbered = 0;
+            }
+        }
+
+        switch(i->op) {
+            case JIT_OP_CALL:
+                c.gen++;
+                break;
+            case JIT_OP_PUSH:
+            case JIT_OP_POP:
+                // The stack pointer moves, and the stack is memory.
+                c.epoch++;
+                for(r = 0; r < c.nregs; r++) {
+                    if(c.fixed[r]) {
+                        c.ver[r]++;
+                    }
+                }
+                if(i->op == JIT_OP_POP && i->in1_type == JIT_OPERAND_REG) {
+                    jit_cse_def(&c, i->in1.reg);
+                }
+                break;
+            default:
+                break;
+        }
+        if(i->op == JIT_OP_PUSH || i->op == JIT_OP_POP ||
+                i->op == JIT_OP_CALL) {
+            continue;
+        }
+
+        if(i->out_type == JIT_OPERAND_REG) {
+            jit_cse_def(&c, i->out.reg);
+            if(numbered) {
+                jit_cse_insert(&c, &k, i->out.reg);
+            } else if(i->op == JIT_OP_MOVE && i->opsz == JIT_32BIT &&
+                    i->in1_type == JIT_OPERAND_REG &&
+                    TRACKED(&c, i->out.reg) && TRACKED(&c, i->in1.reg) &&
+                    i->in1.reg != i->out.reg) {
+                struct jit_cse_copy *cp = &c.copy[i->out.reg];
+                cp->src = i->in1.reg;
+                cp->sver = c.ver[i->in1.reg];
+                cp->ver = c.ver[i->out.reg];
+                cp->gen = c.gen;
+            }
+        } else if(i->out_type == JIT_OPERAND_IMMPTR ||
+                i->out_type == JIT_OPERAND_REGPTR) {
+            // Any store may alias any load. What was just stored can be
+            // loaded back from the register, though.
+            c.epoch++;
+            if(i->op == JIT_OP_MOVE && i->opsz == JIT_32BIT &&
+                    i->in1_type == JIT_OPERAND_REG) {
+                memset(&k, 0, sizeof(k));
+                k.op = JIT_OP_MOVE;
+                k.opsz = JIT_32BIT;
+                k.gen = c.gen;
+                k.epoch = c.epoch + 1;
+                jit_cse_opnd(&c, i->out_type, &i->out, &k.in[0]);
+                jit_cse_insert(&c, &k, i->in1.reg);
+            }
+        }
+    }
+
+l_exit:
+    free(c.ver);
+    free(c.fixed);
+    free(c.copy);
+    free(c.table);
+    free(target);
+    return e;
+}
+
+#define JIT_OPT_IS_MEM(k) ((k) == JIT_OPERAND_REGPTR || \
+        (k) == JIT_OPERAND_IMMPTR || (k) == JIT_OPERAND_IMMDISP)
+
+/* The immediate of instruction i, sign-extended from its size. */
+static int64_t
+jit_opt_imm(struct jit_instr *i, jit_operand_union *v)
+{
+    switch(i->opsz) {
+        case JIT_8BIT: return v->imm8;
+        case JIT_16BIT: return v->imm16;
+        case JIT_64BIT: return v->imm64;
+        default: return v->imm32;
+    }
+}
+
+/* Whether copy c moved operand v of instruction i. */
+static int
+jit_opt_copy_of(struct jit_instr *c, struct jit_instr *i, jit_operand kind,
+        jit_operand_union *v)
+{
+    if(c->op != JIT_OP_MOVE || c->in1_type != kind) {
+        return 0;
+    }
+    switch(kind) {
+        case JIT_OPERAND_REG:
+            return c->in1.reg == v->reg;
+        case JIT_OPERAND_IMM:
+            return jit_opt_imm(c, &c->in1) == jit_opt_imm(i, v);
+        case JIT_OPERAND_REGPTR:
+        case JIT_OPERAND_IMMPTR:
+        case JIT_OPERAND_IMMDISP:
+            return c->opsz == i->opsz &&
+                !memcmp(&c->in1, v, sizeof(jit_operand_union));
+        default:
+            return 0;
+    }
+}
+
+static int
+jit_opt_writes(struct jit_instr *i, jit_reg r)
+{
+    return (i->out_type == JIT_OPERAND_REG && i->out.reg == r) ||
+        (i->op == JIT_OP_POP && i->in1_type == JIT_OPERAND_REG &&
+         i->in1.reg == r);
+}
+
+/* Whether i reads or writes r as a register operand. */
+static int
+jit_opt_mentions(struct jit_instr *i, jit_reg r)
+{
+    return (i->in1_type == JIT_OPERAND_REG && i->in1.reg == r) ||
+        (i->in2_type == JIT_OPERAND_REG && i->in2.reg == r) ||
+        (i->out_type == JIT_OPERAND_REG && i->out.reg == r);
+}
+
+jit_error
+jit_opt_flags(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_ir *ir;
+    struct jit_cfg *c;
+    struct jit_instr **is = NULL, *i;
+    struct jit_instr fi, di, ca, cb, t;
+    jit_operand ka, kb;
+    jit_operand_union *va, *vb;
+    uint32_t n, d, m, start;
+
+    if(s == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_cfg_build(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    ir = s->p_ir;
+    c = s->p_cfg;
+
+    is = malloc((ir->n + 1) * sizeof(struct jit_instr *));
+    if(is == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++) {
+        is[n] = i;
+    }
+
+    for(n = 0; n < ir->n; n++) {
+        if(ir->op[n] != JIT_OP_FLAGS) {
+            continue;
+        }
+        jit_ir_get(ir, n, &fi);
+
+        // The operation defining the guest flags must be the last to set
+        // the flags, in the same block, right after the two copies.
+        start = c->blocks[c->block_of[n]].start;
+        for(d = n; d-- > start; ) {
+            if(jit_opt_sets_flags(ir->op[d]) || ir->op[d] == JIT_OP_CALL ||
+                    ir->op[d] == JIT_OP_RET) {
+                break;
+            }
+        }
+        if(d >= n || d < start + 2) {
+            continue;
+        }
+        jit_ir_get(ir, d, &di);
+        if(!(di.op == (jit_op)fi.out.imm32 || (di.op == JIT_OP_CMP &&
+                        fi.out.imm32 == JIT_OP_SUB)) || di.opsz != fi.opsz) {
+            continue;
+        }
+        // A SUB or CMP on memory may set the carry the other way round.
+        if((di.op == JIT_OP_SUB || di.op == JIT_OP_CMP) &&
+                (JIT_OPT_IS_MEM(di.in1_type) || JIT_OPT_IS_MEM(di.in2_type) ||
+                 JIT_OPT_IS_MEM(di.out_type))) {
+            continue;
+        }
+        if(jit_opt_mentions(&di, fi.in1.reg) ||
+                jit_opt_mentions(&di, fi.in2.reg)) {
+            continue;
+        }
+
+        jit_instr_operands(&di, &ka, &va, &kb, &vb);
+        jit_ir_get(ir, d - 2, &ca);
+        jit_ir_get(ir, d - 1, &cb);
+        if(!jit_opt_writes(&ca, fi.in1.reg) ||
+                !jit_opt_writes(&cb, fi.in2.reg) ||
+                !jit_opt_copy_of(&ca, &di, ka, va) ||
+                !jit_opt_copy_of(&cb, &di, kb, vb)) {
+            continue;
+        }
+        for(m = d + 1; m < n; m++) {
+            jit_ir_get(ir, m, &t);
+            if(jit_opt_writes(&t, fi.in1.reg) ||
+                    jit_opt_writes(&t, fi.in2.reg)) {
+                break;
+            }
+        }
+        if(m < n) {
+            continue;
+        }
+
+        i = is[n];
+        i->op = ir->op[n] = JIT_OP_NOP;
+        i->in1_type = i->in2_type = i->out_type = JIT_OPERAND_INVALID;
+    }
+
+l_exit:
+    free(is);
+    return e;
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "libjit.h"
+#include "jit_trace.h"
+
+#define __JIT_TRACE_MAX 256
+
+jit_error
+jit_set_trace(struct jit_state *s, jit_trace_level level, jit_trace_fn fn,
+        void *ctx)
+{
+    if(s == NULL) {
+        return JIT_ERROR_NULL_PTR;
+    }
+    s->trace_level = level;
+    s->trace_fn = fn;
+    s->trace_ctx = ctx;
+
+    return JIT_SUCCESS;
+}
+
+void
+jit_trace(struct jit_state *s, jit_trace_level level, const char *fmt, ...)
+{
+    char msg[__JIT_TRACE_MAX];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    if(s->trace_fn != NULL) {
+        s->trace_fn(s->trace_ctx, level, msg);
+    } else {
+        fputs(msg, stderr);
+    }
+}
+
+void
+jit_trace_bytes(struct jit_state *s, const char *name, const uint8_t *p,
+        size_t n)
+{
+    char msg[__JIT_TRACE_MAX];
+    size_t len, k;
+
+    len = snprintf(msg, sizeof(msg), "> %s:\t", name);
+    for(k = 0; k < n && len + 4 < sizeof(msg); k++) {
+        len += snprintf(msg + len, sizeof(msg) - len, "%02x ", p[k]);
+    }
+    snprintf(msg + len, sizeof(msg) - len, "\n");
+
+    if(s->trace_fn != NULL) {
+        s->trace_fn(s->trace_ctx, JIT_TRACE_EMIT, msg);
+    } else {
+        fputs(msg, stderr);
+    }
+}
+
+#ifdef __CPLUSPLUS
+}
+#endif
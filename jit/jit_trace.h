@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _JIT_TRACE_H_
+#define _JIT_TRACE_H_
+
+#ifdef __CPLUSPLUS
+extern "C" {
+#endif
+
+#include "libjit.h"
+
+/* Whether messages of the given level are wanted. With JIT_NO_TRACE, the
+ * tracing calls and the formatting of their arguments compile away. */
+#ifdef JIT_NO_TRACE
+#define JIT_TRACE_ON(s,lvl) 0
+#else
+#define JIT_TRACE_ON(s,lvl) ((s)->trace_level >= (lvl))
+#endif
+
+#define JIT_TRACE(s,lvl,...) do { \
+    if(JIT_TRACE_ON((s),(lvl))) jit_trace((s),(lvl),__VA_ARGS__); \
+} while(0)
+
+/* Format a message and hand it to the state's sink. */
+void jit_trace(struct jit_state *s, jit_trace_level level, const char *fmt,
+        ...) __attribute__((format(printf, 3, 4)));
+
+/* Trace the n bytes at p, emitted for the named instruction. */
+void jit_trace_bytes(struct jit_state *s, const char *name, const uint8_t *p,
+        size_t n);
+
+#ifdef __CPLUSPLUS
+}
+#endif
+
+#endif
@@ -20,7 +20,11 @@
  * THE SOFTWARE.
  */
 
+#include <cpuid.h>
+
 #include "jit_x86_64.h"
+#include "jit_ir.h"
+#include "jit_trace.h"
 
 static const jit_host_reg g_regmap[] = {
     JIT_HOST_REG_INVALID,
@@ -29,7 +33,14 @@ static const jit_host_reg g_regmap[] = {
 
 static const char *g_opsz[JIT_NUM_OPS] = {
     "nop", "mov", "add", "sub", "mul", "div", "shl", "shr", "sar", "and",
-    "or", "xor", "call", "jump", "jx", "ret"
+    "or", "xor", "call", "jump", "jx", "ret", "push", "pop", "cmp", "divu",
+    "rem", "remu", "movzx", "movsx", "setx", "cmovx",
+    "flags", "exit"
+};
+
+static const int g_condmap[JIT_NUM_CONDS] = {
+    CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE, CC_B, CC_BE, CC_A, CC_AE,
+    CC_S, CC_NS, CC_O, CC_NO,
 };
 
 static const char *g_hostregsz[NUM_HOST_REGS] = {
@@ -37,6 +48,9 @@ static const char *g_hostregsz[NUM_HOST_REGS] = {
     "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
 };
 
+/* Encoders by op and operand size, for the register and immediate forms of
+ * the ALU operations, shifts and comparisons. Anything missing has no
+ * single instruction form. */
 static const pfn_e_r_to_r g_e_r_to_r[JIT_NUM_OPS] = {
     NULL,
     jit_emit__mov_reg32_to_reg,
@@ -46,7 +60,47 @@ static const pfn_e_r_to_r g_e_r_to_r[JIT_NUM_OPS] = {
     jit_emit__and_reg32_to_reg,
     jit_emit__or_reg32_to_reg,
     jit_emit__xor_reg32_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_reg32_to_reg,
+};
+
+static const pfn_e_r_to_r g_e_r_to_r64[JIT_NUM_OPS] = {
+    NULL,
+    jit_emit__mov_reg64_to_reg,
+    jit_emit__add_reg64_to_reg,
+    jit_emit__sub_reg64_to_reg,
+    NULL, NULL, NULL, NULL, NULL,
+    jit_emit__and_reg64_to_reg,
+    jit_emit__or_reg64_to_reg,
+    jit_emit__xor_reg64_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_reg64_to_reg,
+};
+
+static const pfn_e_r_to_r g_e_r_to_r16[JIT_NUM_OPS] = {
+    NULL,
+    jit_emit__mov_reg16_to_reg,
+    jit_emit__add_reg16_to_reg,
+    jit_emit__sub_reg16_to_reg,
+    NULL, NULL, NULL, NULL, NULL,
+    jit_emit__and_reg16_to_reg,
+    jit_emit__or_reg16_to_reg,
+    jit_emit__xor_reg16_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_reg16_to_reg,
+};
+
+static const pfn_e_r_to_r g_e_r_to_r8[JIT_NUM_OPS] = {
+    NULL,
+    jit_emit__mov_reg8_to_reg,
+    jit_emit__add_reg8_to_reg,
+    jit_emit__sub_reg8_to_reg,
     NULL, NULL, NULL, NULL, NULL,
+    jit_emit__and_reg8_to_reg,
+    jit_emit__or_reg8_to_reg,
+    jit_emit__xor_reg8_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_reg8_to_reg,
 };
 
 static const pfn_e_imm32_to_r g_e_imm32_to_r[JIT_NUM_OPS] = {
@@ -61,37 +115,112 @@ static const pfn_e_imm32_to_r g_e_imm32_to_r[JIT_NUM_OPS] = {
     jit_emit__and_imm32_to_reg,
     jit_emit__or_imm32_to_reg,
     jit_emit__xor_imm32_to_reg,
-    NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_imm32_to_reg,
 };
 
-static const pfn_e_imm16_to_r g_e_imm16_to_r[JIT_NUM_OPS] = {
+/* The immediate is sign-extended to 64 bits. */
+static const pfn_e_imm32_to_r g_e_imm32_to_r64[JIT_NUM_OPS] = {
     NULL,
+    jit_emit__mov_imm32_to_reg64,
+    jit_emit__add_imm32_to_reg64,
+    jit_emit__sub_imm32_to_reg64,
+    NULL, NULL,
+    jit_emit__shl_imm32_to_reg64,
+    jit_emit__shr_imm32_to_reg64,
+    jit_emit__sar_imm32_to_reg64,
+    jit_emit__and_imm32_to_reg64,
+    jit_emit__or_imm32_to_reg64,
+    jit_emit__xor_imm32_to_reg64,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_imm32_to_reg64,
+};
+
+static const pfn_e_imm16_to_r g_e_imm16_to_r[JIT_NUM_OPS] = {
     NULL,
+    jit_emit__mov_imm16_to_reg,
     jit_emit__add_imm16_to_reg,
-    NULL,
+    jit_emit__sub_imm16_to_reg,
     NULL, NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL, NULL, NULL, NULL, NULL,
+    jit_emit__shl_imm16_to_reg,
+    jit_emit__shr_imm16_to_reg,
+    jit_emit__sar_imm16_to_reg,
+    jit_emit__and_imm16_to_reg,
+    jit_emit__or_imm16_to_reg,
+    jit_emit__xor_imm16_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_imm16_to_reg,
 };
 
 static const pfn_e_imm8_to_r g_e_imm8_to_r[JIT_NUM_OPS] = {
     NULL,
-    NULL,
+    jit_emit__mov_imm8_to_reg,
     jit_emit__add_imm8_to_reg,
-    NULL,
+    jit_emit__sub_imm8_to_reg,
     NULL, NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL, NULL, NULL, NULL, NULL,
+    jit_emit__shl_imm8_to_reg,
+    jit_emit__shr_imm8_to_reg,
+    jit_emit__sar_imm8_to_reg,
+    jit_emit__and_imm8_to_reg,
+    jit_emit__or_imm8_to_reg,
+    jit_emit__xor_imm8_to_reg,
+    NULL, NULL, NULL, NULL, NULL, NULL,
+    jit_emit__cmp_imm8_to_reg,
+};
+
+/* Loads of 8, 16, 32 and 64 bits filling the whole register, zero- then
+ * sign-extending, RIP-relative and from [base]. */
+static const pfn_e_m_to_r g_e_m_to_r[2][4] = {
+    {
+        jit_emit__movzx_m8_to_reg, jit_emit__movzx_m16_to_reg,
+        jit_emit__mov_m32_to_reg, jit_emit__mov_m64_to_reg,
+    }, {
+        jit_emit__movsx_m8_to_reg64, jit_emit__movsx_m16_to_reg64,
+        jit_emit__movsxd_m32_to_reg64, jit_emit__mov_m64_to_reg,
+    },
+};
+
+static const pfn_e_ind_to_r g_e_ind_to_r[2][4] = {
+    {
+        jit_emit__movzx_ind8_to_reg, jit_emit__movzx_ind16_to_reg,
+        jit_emit__mov_ind32_to_reg, jit_emit__mov_ind64_to_reg,
+    }, {
+        jit_emit__movsx_ind8_to_reg64, jit_emit__movsx_ind16_to_reg64,
+        jit_emit__movsxd_ind32_to_reg64, jit_emit__mov_ind64_to_reg,
+    },
+};
+
+/* The same from [base + index << scale + offset], and the stores there. */
+static const pfn_e_regptr_to_r g_e_regptr_to_r[2][4] = {
+    {
+        jit_emit__movzx_regptr8_to_reg, jit_emit__movzx_regptr16_to_reg,
+        jit_emit__mov_regptr32_to_reg, jit_emit__mov_regptr64_to_reg,
+    }, {
+        jit_emit__movsx_regptr8_to_reg64, jit_emit__movsx_regptr16_to_reg64,
+        jit_emit__movsxd_regptr32_to_reg64, jit_emit__mov_regptr64_to_reg,
+    },
+};
+
+static const pfn_e_r_to_regptr g_e_r_to_regptr[4] = {
+    jit_emit__mov_reg8_to_regptr, jit_emit__mov_reg16_to_regptr,
+    jit_emit__mov_reg32_to_regptr, jit_emit__mov_reg64_to_regptr,
+};
+
+/* Register to register moves of 8, 16, 32 and 64 bits filling the whole
+ * register, zero- then sign-extending. */
+static const pfn_e_r_to_r g_e_r_to_r_ext[2][4] = {
+    {
+        jit_emit__movzx_reg8_to_reg, jit_emit__movzx_reg16_to_reg,
+        jit_emit__mov_reg32_to_reg, jit_emit__mov_reg64_to_reg,
+    }, {
+        jit_emit__movsx_reg8_to_reg64, jit_emit__movsx_reg16_to_reg64,
+        jit_emit__movsxd_reg32_to_reg64, jit_emit__mov_reg64_to_reg,
+    },
+};
+
+static uint8_t* (* const g_e_neg[4])(uint8_t *p, jit_host_reg reg) = {
+    jit_emit__neg_reg8, jit_emit__neg_reg16,
+    jit_emit__neg_reg32, jit_emit__neg_reg64,
 };
 
 static const int32_t p_scalemap[] = {
@@ -102,126 +231,609 @@ static const int32_t p_scalemap[] = {
     3               // 8
 };
 
+/* The encoders compute RIP-relative displacements against the write pointer;
+ * shift the target by the distance to the execution view so that they are
+ * still correct when the block runs from a different mapping. */
+static void*
+jit_rip_target(struct jit_state *s, void *m)
+{
+    return (uint8_t *)m - (s->p_bufexec - s->p_bufstart);
+}
+
+/* Whether m is within reach of a rel32 displacement from the current position,
+ * as seen from where the block will execute. */
+static int
+jit_rip_reachable(struct jit_state *s, void *m)
+{
+    int64_t d = (int64_t)(uintptr_t)m -
+        (int64_t)(uintptr_t)(s->p_bufexec + (s->p_bufcur - s->p_bufstart));
+    return d > (int64_t)INT32_MIN + 64 && d < (int64_t)INT32_MAX - 64;
+}
+
+/* Index of an operand size in the tables by size. */
+static int
+jit_opsz_index(size_t opsz)
+{
+    switch(opsz) {
+        case JIT_8BIT: return 0;
+        case JIT_16BIT: return 1;
+        case JIT_64BIT: return 3;
+        default: return 2;
+    }
+}
+
+/* The register to register form of op on opsz bytes, or NULL. */
+static pfn_e_r_to_r
+jit_e_r_to_r(jit_op op, size_t opsz)
+{
+    static const pfn_e_r_to_r *tables[4] = {
+        g_e_r_to_r8, g_e_r_to_r16, g_e_r_to_r, g_e_r_to_r64,
+    };
+
+    if(op < 0 || op >= JIT_NUM_OPS) {
+        return NULL;
+    }
+    return tables[jit_opsz_index(opsz)][op];
+}
+
+/* The immediate of instruction i, at its size. */
+static int64_t
+jit_instr_imm(struct jit_instr *i)
+{
+    switch(i->opsz) {
+        case JIT_8BIT: return i->in1.imm8;
+        case JIT_16BIT: return i->in1.imm16;
+        case JIT_64BIT: return i->in1.imm64;
+        default: return i->in1.imm32;
+    }
+}
+
+/* Emit reg = reg op imm on opsz bytes (cmp reg, imm for CMP). A 64-bit
+ * immediate out of the sign-extended imm32 range goes through the scratch
+ * register. Return whether op has such a form. */
+static int
+jit_emit_imm_op(struct jit_state *s, jit_op op, size_t opsz, int64_t imm,
+        jit_host_reg reg)
+{
+    pfn_e_r_to_r f;
+
+    if(op < 0 || op >= JIT_NUM_OPS) {
+        return 0;
+    }
+    switch(opsz) {
+        case JIT_8BIT:
+            if(g_e_imm8_to_r[op] == NULL) return 0;
+            s->p_bufcur = g_e_imm8_to_r[op](s->p_bufcur, (int8_t)imm, reg);
+            return 1;
+        case JIT_16BIT:
+            if(g_e_imm16_to_r[op] == NULL) return 0;
+            s->p_bufcur = g_e_imm16_to_r[op](s->p_bufcur, (int16_t)imm, reg);
+            return 1;
+        case JIT_64BIT:
+            if(imm >= INT32_MIN && imm <= INT32_MAX) {
+                if(g_e_imm32_to_r64[op] == NULL) return 0;
+                s->p_bufcur = g_e_imm32_to_r64[op](s->p_bufcur, (int32_t)imm,
+                        reg);
+                return 1;
+            }
+            f = jit_e_r_to_r(op, opsz);
+            if(f == NULL) return 0;
+            s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, imm,
+                    JIT_SCRATCH_REG);
+            s->p_bufcur = f(s->p_bufcur, JIT_SCRATCH_REG, reg);
+            return 1;
+        default:
+            if(g_e_imm32_to_r[op] == NULL) return 0;
+            s->p_bufcur = g_e_imm32_to_r[op](s->p_bufcur, (int32_t)imm, reg);
+            return 1;
+    }
+}
+
+/* Load from / store to an absolute address, RIP-relative when in reach and
+ * through the scratch register otherwise. Loads fill the whole register,
+ * zero-extending or, with sign set, sign-extending. */
+static void
+jit_emit_loadx_m(struct jit_state *s, void *m, jit_host_reg reg, size_t opsz,
+        int sign)
+{
+    int k = jit_opsz_index(opsz);
+
+    sign = !!sign;
+    if(jit_rip_reachable(s, m)) {
+        s->p_bufcur = g_e_m_to_r[sign][k](s->p_bufcur, jit_rip_target(s, m),
+                reg);
+        jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+        return;
+    }
+
+    s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, (int64_t)m,
+            JIT_SCRATCH_REG);
+    s->p_bufcur = g_e_ind_to_r[sign][k](s->p_bufcur, JIT_SCRATCH_REG, reg);
+}
+
+void
+jit_emit_load_m(struct jit_state *s, void *m, jit_host_reg reg, size_t opsz)
+{
+    jit_emit_loadx_m(s, m, reg, opsz, 0);
+}
+
+void
+jit_emit_store_m(struct jit_state *s, jit_host_reg reg, void *m, size_t opsz)
+{
+    if(jit_rip_reachable(s, m)) {
+        switch(opsz) {
+            case JIT_64BIT:
+                s->p_bufcur = jit_emit__mov_reg64_to_m(s->p_bufcur, reg,
+                        jit_rip_target(s, m));
+                break;
+            case JIT_32BIT:
+                s->p_bufcur = jit_emit__mov_reg32_to_m(s->p_bufcur, reg,
+                        jit_rip_target(s, m));
+                break;
+            case JIT_16BIT:
+                s->p_bufcur = jit_emit__mov_reg16_to_m(s->p_bufcur, reg,
+                        jit_rip_target(s, m));
+                break;
+            case JIT_8BIT:
+                s->p_bufcur = jit_emit__mov_reg8_to_m(s->p_bufcur, reg,
+                        jit_rip_target(s, m));
+                break;
+        }
+        jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+        return;
+    }
+
+    s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, (int64_t)m,
+            JIT_SCRATCH_REG);
+    switch(opsz) {
+        case JIT_64BIT:
+            s->p_bufcur = jit_emit__mov_reg64_to_ind(s->p_bufcur, reg,
+                    JIT_SCRATCH_REG);
+            break;
+        case JIT_32BIT:
+            s->p_bufcur = jit_emit__mov_reg32_to_ind(s->p_bufcur, reg,
+                    JIT_SCRATCH_REG);
+            break;
+        case JIT_16BIT:
+            s->p_bufcur = jit_emit__mov_reg16_to_ind(s->p_bufcur, reg,
+                    JIT_SCRATCH_REG);
+            break;
+        case JIT_8BIT:
+            s->p_bufcur = jit_emit__mov_reg8_to_ind(s->p_bufcur, reg,
+                    JIT_SCRATCH_REG);
+            break;
+    }
+}
+
+static int
+jit_host_has_bmi2(void)
+{
+    unsigned int a, b, c, d;
+
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return !!(b & bit_BMI2);
+}
+
 jit_error
 jit_create_emitter(struct jit_state *s)
 {
     jit_error e = JIT_SUCCESS;
-    size_t n;
 
     s->p_emitter = calloc(1, sizeof(struct jit_emitter));
     if(s->p_emitter == NULL) {
         FAILPATH(JIT_ERROR_MALLOC);
     }
-    for(n = 0; n < NUM_HOST_REGS; n++) {
-        s->p_emitter->host_regmap[n] = JIT_HOST_REG_INVALID;
-    }
+    e = jit_reset_emitter(s);
+    s->p_emitter->has_bmi2 = !(s->flags & JIT_FLAG_NO_BMI2) &&
+        jit_host_has_bmi2();
 
 l_exit:
     return e;
 }
 
+jit_error
+jit_reset_emitter(struct jit_state *s)
+{
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_emitter keep = *em;
+    size_t n;
+
+    // Start afresh, but hold on to the allocations.
+    memset(em, 0, sizeof(struct jit_emitter));
+    em->linscan = keep.linscan;
+    em->branches = keep.branches;
+    if(em->branches != NULL) {
+        em->branches->any = 0;
+    }
+    em->jump_patches = keep.jump_patches;
+    em->njump_patches_alloc = keep.njump_patches_alloc;
+    em->frame_patches = keep.frame_patches;
+    em->nframe_patches_alloc = keep.nframe_patches_alloc;
+    em->vreg_host = keep.vreg_host;
+    em->vreg_slot = keep.vreg_slot;
+    em->nvreg_alloc = keep.nvreg_alloc;
+    em->free_slots = keep.free_slots;
+    em->nfree_slots_alloc = keep.nfree_slots_alloc;
+    em->has_bmi2 = keep.has_bmi2;
+    for(n = 0; n < em->nvreg_alloc; n++) {
+        em->vreg_host[n] = JIT_HOST_REG_INVALID;
+        em->vreg_slot[n] = -1;
+    }
+    em->frame_size = -1;
+    em->mov_end = SIZE_MAX;
+
+    for(n = 0; n < NUM_HOST_REGS; n++) {
+        em->host_regmap[n] = JIT_HOST_REG_INVALID;
+        em->callee_slot[n] = -1;
+    }
+    em->host_regmap[JIT_SCRATCH_REG] = JIT_REG_SCRATCH;
+    em->host_busy |= (1 << JIT_SCRATCH_REG);
+    em->host_free = ((1 << NUM_HOST_REGS) - 1) &
+        ~((1 << JIT_SCRATCH_REG) | (1 << rsp));
+
+    return JIT_SUCCESS;
+}
+
+static void
+jit_free_emitter_arrays(struct jit_emitter *em)
+{
+    free(em->frame_patches);
+    free(em->jump_patches);
+    free(em->vreg_host);
+    free(em->vreg_slot);
+    free(em->free_slots);
+}
+
 jit_error
 jit_destroy_emitter(struct jit_state *s)
 {
+    jit_linscan_destroy(s->p_emitter->linscan);
+    if(s->p_emitter->branches != NULL) {
+        free(s->p_emitter->branches->target);
+        free(s->p_emitter->branches->flags_live);
+        free(s->p_emitter->branches->jshort);
+        free(s->p_emitter->branches->lab_off);
+        free(s->p_emitter->branches);
+    }
+    jit_free_emitter_arrays(s->p_emitter);
     free(s->p_emitter);
 
     return JIT_SUCCESS;
 }
 
+static void*
+jit_dup_array(const void *p, size_t size)
+{
+    void *q = malloc(size ? size : 1);
+
+    if(q != NULL && size) {
+        memcpy(q, p, size);
+    }
+    return q;
+}
+
+jit_error
+jit_save_emitter(struct jit_state *s, struct jit_emitter **saved)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_emitter *c;
+
+    *saved = c = malloc(sizeof(struct jit_emitter));
+    if(c == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    memcpy(c, em, sizeof(struct jit_emitter));
+
+    // The linear scan result and the jump targets are not modified by
+    // emission, and are shared.
+    c->frame_patches = jit_dup_array(em->frame_patches,
+            em->nframe_patches_alloc * sizeof(size_t));
+    c->jump_patches = jit_dup_array(em->jump_patches,
+            em->njump_patches_alloc * sizeof(struct jit_jump_patch));
+    c->vreg_host = jit_dup_array(em->vreg_host,
+            em->nvreg_alloc * sizeof(int8_t));
+    c->vreg_slot = jit_dup_array(em->vreg_slot,
+            em->nvreg_alloc * sizeof(int32_t));
+    c->free_slots = jit_dup_array(em->free_slots,
+            em->nfree_slots_alloc * sizeof(int32_t));
+    if(!c->frame_patches || !c->jump_patches || !c->vreg_host ||
+            !c->vreg_slot || !c->free_slots) {
+        jit_free_emitter_arrays(c);
+        free(c);
+        *saved = NULL;
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_restore_emitter(struct jit_state *s, struct jit_emitter *saved)
+{
+    jit_free_emitter_arrays(s->p_emitter);
+    memcpy(s->p_emitter, saved, sizeof(struct jit_emitter));
+    free(saved);
+
+    return JIT_SUCCESS;
+}
+
+/* Make room in the per-vreg tables for registers below n. */
+static jit_error
+jit_grow_vregs(struct jit_emitter *em, uint32_t n)
+{
+    jit_error e = JIT_SUCCESS;
+    uint32_t nalloc = em->nvreg_alloc ? em->nvreg_alloc : 64;
+    int8_t *host;
+    int32_t *slot;
+
+    if(n <= em->nvreg_alloc) {
+        goto l_exit;
+    }
+    while(nalloc < n) {
+        nalloc *= 2;
+    }
+    host = realloc(em->vreg_host, nalloc * sizeof(int8_t));
+    if(host != NULL) {
+        em->vreg_host = host;
+    }
+    slot = realloc(em->vreg_slot, nalloc * sizeof(int32_t));
+    if(slot != NULL) {
+        em->vreg_slot = slot;
+    }
+    if(host == NULL || slot == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    for(; em->nvreg_alloc < nalloc; em->nvreg_alloc++) {
+        host[em->nvreg_alloc] = JIT_HOST_REG_INVALID;
+        slot[em->nvreg_alloc] = -1;
+    }
+
+l_exit:
+    return e;
+}
+
+/* Point host register h at reg (possibly JIT_REG_INVALID), keeping the
+ * reverse map and the free mask in step. reg must fit in the tables. */
+static void
+jit_map_host_reg(struct jit_emitter *em, jit_host_reg h, jit_reg reg)
+{
+    jit_reg old = em->host_regmap[h];
+
+    if(old >= 0 && (uint32_t)old < em->nvreg_alloc) {
+        em->vreg_host[old] = JIT_HOST_REG_INVALID;
+    }
+    em->host_regmap[h] = reg;
+    if(reg >= 0) {
+        em->vreg_host[reg] = (int8_t)h;
+        em->host_free &= ~(1 << h);
+        em->host_agemap[h] = 0;
+    } else if(h != rsp && reg == JIT_REG_INVALID) {
+        em->host_free |= 1 << h;
+    }
+}
+
 jit_error
 jit_set_reg_mapping(struct jit_state *s, jit_reg reg, int32_t map)
 {
-    jit_error e = (s->p_emitter->host_regmap[map] == 
-            JIT_REG_INVALID) ?
-        JIT_SUCCESS : JIT_ERROR_REG_BUSY;
-    if(e == JIT_SUCCESS) {
-        s->p_emitter->host_regmap[g_regmap[map]] = reg;
-        s->p_emitter->host_busy |= (1 << g_regmap[map]);
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    jit_host_reg h;
+
+    if(reg < 0 || map <= JIT_REGMAP_NONE || map > JIT_REGMAP_SP) {
+        FAILPATH(JIT_ERROR_VREG_INVALID);
+    }
+    h = g_regmap[map];
+    if(em->host_regmap[h] != JIT_REG_INVALID) {
+        FAILPATH(JIT_ERROR_REG_BUSY);
+    }
+    e = jit_grow_vregs(em, (uint32_t)reg + 1);
+    if(FAILURE(e)) {
+        goto l_exit;
     }
+    jit_map_host_reg(em, h, reg);
+    em->host_busy |= (1 << h);
+
+l_exit:
     return e;
 }
 
 jit_error
 jit_clear_reg_mapping(struct jit_state *s, jit_reg reg)
 {
-    jit_error e = (reg != JIT_REG_INVALID) ?
-        JIT_SUCCESS : JIT_ERROR_VREG_INVALID;
-    if(e == JIT_SUCCESS) {
-        s->p_emitter->host_busy &= ~(1 << reg);
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    jit_host_reg h;
+
+    if(reg < 0) {
+        FAILPATH(JIT_ERROR_VREG_INVALID);
+    }
+    if((uint32_t)reg >= em->nvreg_alloc ||
+            em->vreg_host[reg] == JIT_HOST_REG_INVALID) {
+        FAILPATH(JIT_ERROR_VREG_NOT_FOUND);
     }
+    h = em->vreg_host[reg];
+    em->host_busy &= ~(1 << h);
+    jit_map_host_reg(em, h, JIT_REG_INVALID);
+
+l_exit:
     return e;
 }
 
+int
+jit_reg_is_fixed(struct jit_state *s, jit_reg reg)
+{
+    struct jit_emitter *em = s->p_emitter;
+    jit_host_reg h;
+
+    if(reg < 0 || (uint32_t)reg >= em->nvreg_alloc) {
+        return 0;
+    }
+    h = em->vreg_host[reg];
+    return h != JIT_HOST_REG_INVALID && (em->host_busy & (1 << h));
+}
+
+/* Offset from rsp of spill slot k. */
+static int32_t
+jit_slot_disp(struct jit_state *s, int32_t k)
+{
+    return s->p_emitter->push_depth + 8 * k;
+}
+
+void
+jit_emit_spill(struct jit_state *s, jit_host_reg reg, int32_t slot)
+{
+    s->p_bufcur = jit_emit__mov_reg64_to_disp(s->p_bufcur, reg, rsp,
+            jit_slot_disp(s, slot));
+}
+
+void
+jit_emit_reload(struct jit_state *s, int32_t slot, jit_host_reg reg)
+{
+    s->p_bufcur = jit_emit__mov_disp64_to_reg(s->p_bufcur, rsp,
+            jit_slot_disp(s, slot), reg);
+}
+
+static void
+jit_free_slot(struct jit_state *s, int32_t *slot)
+{
+    struct jit_emitter *em = s->p_emitter;
+
+    if(em->nfree_slots == em->nfree_slots_alloc) {
+        uint32_t n = em->nfree_slots_alloc ? 2 * em->nfree_slots_alloc : 16;
+        int32_t *p = realloc(em->free_slots, n * sizeof(int32_t));
+        if(p == NULL) {
+            return;
+        }
+        em->free_slots = p;
+        em->nfree_slots_alloc = n;
+    }
+    em->free_slots[em->nfree_slots++] = *slot;
+    *slot = -1;
+}
+
+static int32_t
+jit_new_slot(struct jit_state *s)
+{
+    struct jit_emitter *em = s->p_emitter;
+
+    return em->nfree_slots > 0 ? em->free_slots[--em->nfree_slots] :
+        (int32_t)em->nslots++;
+}
+
+/* Whether the value of reg may still be read at or after instruction n. */
+static int
+jit_vreg_needed(struct jit_state *s, jit_reg reg, uint32_t n)
+{
+    struct jit_liveness *l = s->p_live;
+    uint32_t k;
+
+    if(!s->p_emitter->live || reg < 0 || (uint32_t)reg >= l->nregs) {
+        return 1;
+    }
+    for(k = l->first[reg]; k != JIT_LIVE_NONE; k = l->ranges[k].next) {
+        if(l->ranges[k].end >= n) {
+            // A range opening at n is a fresh definition, bar live-ins.
+            return l->ranges[k].start < n || l->ranges[k].start == 0;
+        }
+    }
+    return 0;
+}
+
 jit_host_reg
 jit_get_mapped_host_reg(struct jit_state *s, jit_reg reg, jit_reg_access a)
 {
     int n;
+    struct jit_emitter *em = s->p_emitter;
     jit_host_reg hostreg = JIT_HOST_REG_INVALID;
-    jit_reg *regmap = s->p_emitter->host_regmap;
-    jit_reg_age *agemap = s->p_emitter->host_agemap;
+    jit_reg_age *agemap = em->host_agemap;
     jit_reg evicted = JIT_REG_INVALID;
-    int64_t *spill = s->p_emitter->spill_vreg;
+    int32_t *slot;
     
     if(reg == JIT_REG_INVALID) {
         goto l_exit;
     }
+    if(JIT_LINSCAN_ON(s)) {
+        hostreg = jit_linscan_host_reg(s, reg);
+        goto l_exit;
+    }
+    if(reg < 0 || FAILURE(jit_grow_vregs(em, (uint32_t)reg + 1))) {
+        goto l_exit;
+    }
 
     // First, check if virtual register is already mapped to a host reg.
-    for(n = 0; n < NUM_HOST_REGS; n++) {
-        if(regmap[n] == reg) {
-            hostreg = n;
-            goto l_exit;
-        }
+    // Touching it makes it the youngest, so that the other operands of the
+    // instruction do not evict it.
+    hostreg = em->vreg_host[reg];
+    if(hostreg != JIT_HOST_REG_INVALID) {
+        agemap[hostreg] = 0;
+        goto l_exit;
     }
 
-    // Virtual register not yet mapped; try to find a spare host register
-    if(hostreg == JIT_HOST_REG_INVALID) {
-        for(n = 0; n < NUM_HOST_REGS; n++) {
-            if(regmap[n] == JIT_REG_INVALID) {
-                regmap[n] = reg;
-                hostreg = n;
-                printf(GRAY("  vreg %d not mapped, using %s (host reg %d)\n"),
-                        reg, g_hostregsz[n], n);
-                goto l_spillcheck;
-            }
+    // Virtual register not yet mapped; try to find a spare host register.
+    // rsp is never handed out: the spill slots are addressed from it.
+    if(em->host_free) {
+        n = __builtin_ctz(em->host_free);
+        jit_map_host_reg(em, n, reg);
+        hostreg = n;
+        JIT_TRACE(s, JIT_TRACE_ALLOC, "  vreg %d not mapped, using %s\n",
+                reg, g_hostregsz[n]);
+        // The caller's value of a callee-saved register is kept in the
+        // frame until the block returns.
+        if((JIT_CALLEE_SAVED & (1 << n)) && em->callee_slot[n] < 0) {
+            em->callee_slot[n] = jit_new_slot(s);
+            jit_emit_spill(s, n, em->callee_slot[n]);
         }
+        goto l_spillcheck;
     }
 
     // All the slots are taken: evict the oldest one, if they are not all
-    // mapped to specific slots, and spill it so its value is saved
-    if(hostreg == JIT_HOST_REG_INVALID) {
+    // mapped to specific slots, and spill it so its value is saved, unless
+    // it is not needed any more.
+    {
         int oldest = -1;
         int maxage = -1;
         for(n = 0; n < NUM_HOST_REGS; n++) {
-            if(agemap[n] > maxage &&
-                    !(s->p_emitter->host_busy & (1 << n))) {
+            if(agemap[n] > maxage && n != rsp &&
+                    !(em->host_busy & (1 << n))) {
                 oldest = n;
                 maxage = agemap[n];
             }
         }
         if(oldest != -1) {
-            evicted = regmap[oldest];
-            s->p_bufcur = jit_emit__mov_reg32_to_m(s->p_bufcur, oldest,
-                    (int32_t *)&spill[evicted]);
-            s->p_emitter->spill_busy |= (1 << evicted);
-            regmap[oldest] = reg;
+            evicted = em->host_regmap[oldest];
+            slot = &em->vreg_slot[evicted];
+            if(jit_vreg_needed(s, evicted, em->ni)) {
+                if(*slot < 0) {
+                    *slot = jit_new_slot(s);
+                }
+                jit_emit_spill(s, oldest, *slot);
+            }
+            jit_map_host_reg(em, oldest, reg);
             hostreg = oldest;
-            printf(GRAY("  vreg %d in %s (host reg %d): need evict/spill vreg %d\n"),
-                    reg, g_hostregsz[hostreg], hostreg, evicted);
+            JIT_TRACE(s, JIT_TRACE_ALLOC, "  vreg %d in %s: evicted vreg %d%s\n",
+                    reg, g_hostregsz[hostreg], evicted,
+                    *slot >= 0 ? ", spilled" : "");
         }
     }
 l_spillcheck:
-    if(a == JIT_ACCESS_W) {
+    // A value coming back from its slot releases it; so does overwriting it.
+    // With jumps, the slot is the value's home at every jump target, and is
+    // kept for the whole block.
+    slot = &em->vreg_slot[reg];
+    if(hostreg == JIT_HOST_REG_INVALID || *slot < 0) {
         goto l_exit;
     }
-    if(reg < NUM_SPILL_SLOTS && s->p_emitter->spill_busy & (1 << reg)) {
-        printf(GRAY("  vreg %d was spilled, restoring\n"), reg);
-        s->p_bufcur = jit_emit__mov_m32_to_reg(s->p_bufcur,
-                (int32_t *)&spill[reg], hostreg);
-        s->p_emitter->spill_busy &= ~(1 << reg);
-        s->p_emitter->host_agemap[hostreg] = 0;
-    } else if(reg >= NUM_SPILL_SLOTS) {
-        printf("error: could not check spill, too many vregs\n");
+    if(a != JIT_ACCESS_W) {
+        JIT_TRACE(s, JIT_TRACE_ALLOC, "  vreg %d was spilled, restoring\n",
+                reg);
+        jit_emit_reload(s, *slot, hostreg);
+    }
+    if(!JIT_HAS_BRANCHES(em)) {
+        jit_free_slot(s, slot);
     }
 
 l_exit:
@@ -232,16 +844,20 @@ jit_error
 jit_inc_reg_ages(struct jit_state *s, struct jit_instr *i)
 {
     jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    jit_reg used[3];
     size_t n;
 
     for(n = 0; n < NUM_HOST_REGS; n++) {
-        jit_reg vreg = s->p_emitter->host_regmap[n];
-        if((i->in1_type == JIT_OPERAND_REG && i->in1.reg == vreg) ||
-                (i->in2_type == JIT_OPERAND_REG && i->in2.reg == vreg) ||
-                (i->out_type == JIT_OPERAND_REG && i->out.reg == vreg)) {
-            s->p_emitter->host_agemap[n] = 0;
-        } else {
-            s->p_emitter->host_agemap[n] += 1;
+        em->host_agemap[n] += 1;
+    }
+    used[0] = (i->in1_type == JIT_OPERAND_REG) ? i->in1.reg : JIT_REG_INVALID;
+    used[1] = (i->in2_type == JIT_OPERAND_REG) ? i->in2.reg : JIT_REG_INVALID;
+    used[2] = (i->out_type == JIT_OPERAND_REG) ? i->out.reg : JIT_REG_INVALID;
+    for(n = 0; n < 3; n++) {
+        if(used[n] >= 0 && (uint32_t)used[n] < em->nvreg_alloc &&
+                em->vreg_host[used[n]] != JIT_HOST_REG_INVALID) {
+            em->host_agemap[em->vreg_host[used[n]]] = 0;
         }
     }
 
@@ -252,201 +868,1792 @@ struct jit_host_ptr
 jit_get_host_regptr(struct jit_state *s, struct jit_ptr *p)
 {
     struct jit_host_ptr hp;
-    hp.base = s->p_emitter->host_regmap[p->base];
-    hp.index = (p->base != JIT_REG_INVALID) ?
-        s->p_emitter->host_regmap[p->base] : JIT_HOST_REG_INVALID;
+    hp.base = jit_get_mapped_host_reg(s, p->base, JIT_ACCESS_R);
+    hp.index = s->p_emitter->index_folded ? JIT_HOST_REG_INVALID :
+        jit_get_mapped_host_reg(s, p->index, JIT_ACCESS_R);
     hp.scale = (p->scale >= 0 && p->scale <= 8) ? p_scalemap[p->scale] : -1;
     hp.offset = p->offset;
 
     return hp;
 }
 
-jit_error
-jit_emit_instr(struct jit_state *s, struct jit_instr *i)
+/* Map the memory operand p of a load or store to host registers, or fail if
+ * it cannot be addressed: the scale has to be 1, 2, 4 or 8 (0 standing for
+ * 1), and rsp can only be the index when it can swap places with the base. */
+static jit_error
+jit_get_host_memptr(struct jit_state *s, struct jit_ptr *p,
+        struct jit_host_ptr *hp)
 {
-    jit_error e = JIT_SUCCESS;
-    switch(i->op) {
-        case JIT_OP_MOVE:
-            e = jit_emit_move(s, i);
-            break;
-        case JIT_OP_ADD:
-        case JIT_OP_SUB:
-        case JIT_OP_AND:
-        case JIT_OP_OR:
-        case JIT_OP_XOR:
-        case JIT_OP_SHR:
-            e = jit_emit_arith(s, i);
-            break;
-        case JIT_OP_CALL:
-            e = jit_emit_call(s, i);
-            break;
-        case JIT_OP_RET:
-            e = jit_emit_ret(s, i);
-            break;
-        case JIT_OP_JUMP:
-            e = jit_emit_jump(s, i);
-            break;
-        case JIT_OP_JUMP_IF:
-            e = jit_emit_jump_if(s, i);
-            break;
-        case JIT_OP_PUSH:
-            e = jit_emit_push(s, i);
-            break;
+    *hp = jit_get_host_regptr(s, p);
+    if(p->index != JIT_REG_INVALID && p->scale != 0 && hp->scale < 0) {
+        JIT_TRACE(s, JIT_TRACE_ERROR, "error: invalid scale %d\n", p->scale);
+        return JIT_ERROR_UNKNOWN;
+    }
+    if(hp->index == rsp) {
+        if(hp->scale > 0 || hp->base == rsp) {
+            JIT_TRACE(s, JIT_TRACE_ERROR, "error: rsp cannot be an index\n");
+            return JIT_ERROR_UNKNOWN;
+        }
+        hp->index = hp->base;
+        hp->base = rsp;
+    }
+    return JIT_SUCCESS;
+}
+
+/* Bytes to reserve below the saved registers for nslots spill slots, such
+ * that rsp stays 16-byte aligned at calls. */
+static int32_t
+jit_frame_size(uint32_t nslots, uint32_t npushed, int has_call)
+{
+    int32_t size = 8 * nslots;
+
+    if(has_call && (8 + 8 * npushed + size) % 16 != 0) {
+        size += 8;
+    }
+    return size;
+}
+
+/* Emit add/sub rsp for the frame, or a placeholder to patch once the frame
+ * size is known, large enough to take the imm32 form. */
+static void
+jit_emit_frame_adjust(struct jit_state *s, int add)
+{
+    struct jit_emitter *em = s->p_emitter;
+    int32_t size = em->frame_size;
+
+    if(size == 0) {
+        return;
+    }
+    s->p_bufcur = add ?
+        jit_emit__add_imm32_to_reg64(s->p_bufcur, size < 0 ? INT32_MAX : size,
+                rsp) :
+        jit_emit__sub_imm32_to_reg64(s->p_bufcur, size < 0 ? INT32_MAX : size,
+                rsp);
+    if(size > 0) {
+        return;
+    }
+    if(em->nframe_patches == em->nframe_patches_alloc) {
+        uint32_t n = em->nframe_patches_alloc ?
+            2 * em->nframe_patches_alloc : 8;
+        size_t *p = realloc(em->frame_patches, n * sizeof(size_t));
+        if(p == NULL) {
+            return;
+        }
+        em->frame_patches = p;
+        em->nframe_patches_alloc = n;
+    }
+    em->frame_patches[em->nframe_patches++] =
+        (size_t)(s->p_bufcur - sizeof(int32_t) - s->p_bufstart);
+}
+
+static void
+jit_emit_prologue(struct jit_state *s)
+{
+    struct jit_emitter *em = s->p_emitter;
+    uint8_t *begin = s->p_bufcur;
+    int n;
+
+    if(JIT_LINSCAN_ON(s)) {
+        jit_linscan_prologue(s);
+    }
+    jit_emit_frame_adjust(s, 0);
+
+    // Callee-saved registers are otherwise saved the first time they are
+    // handed out, which may be on a path that is not taken.
+    if(!JIT_LINSCAN_ON(s) && JIT_HAS_BRANCHES(em)) {
+        for(n = 0; n < NUM_HOST_REGS; n++) {
+            if((JIT_CALLEE_SAVED & (1 << n)) && n != rsp &&
+                    !(em->host_busy & (1 << n))) {
+                em->callee_slot[n] = jit_new_slot(s);
+                jit_emit_spill(s, n, em->callee_slot[n]);
+            }
+        }
+    }
+
+    s->blk_nb += s->p_bufcur - begin;
+}
+
+/* Write every value the age-based allocator keeps in a register back to its
+ * slot, and forget the mapping. This is the state all the paths into a jump
+ * target agree on. */
+static void
+jit_flush_regs(struct jit_state *s)
+{
+    struct jit_emitter *em = s->p_emitter;
+    jit_reg reg;
+    int n;
+
+    for(n = 0; n < NUM_HOST_REGS; n++) {
+        reg = em->host_regmap[n];
+        if(reg < 0 || (em->host_busy & (1 << n))) {
+            continue;
+        }
+        if(em->vreg_slot[reg] < 0) {
+            em->vreg_slot[reg] = jit_new_slot(s);
+        }
+        jit_emit_spill(s, n, em->vreg_slot[reg]);
+        jit_map_host_reg(em, n, JIT_REG_INVALID);
+    }
+}
+
+/* Find the jumps of the block in s->p_ir, the instructions they target, and
+ * where the flags may still be read. */
+static jit_error
+jit_find_branches(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_ir *ir = s->p_ir;
+    struct jit_branches *b = em->branches;
+    uint32_t n, t;
+    int live;
+    void *p;
+
+    if(b == NULL) {
+        b = em->branches = calloc(1, sizeof(struct jit_branches));
+        if(b == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    if(ir->n + 1 > b->nalloc) {
+        uint32_t nalloc = b->nalloc ? b->nalloc : 64;
+        while(nalloc < ir->n + 1) {
+            nalloc *= 2;
+        }
+#define GROW(a) p = realloc((a), nalloc * sizeof(*(a))); \
+    if(p == NULL) FAILPATH(JIT_ERROR_MALLOC); (a) = p
+        GROW(b->target);
+        GROW(b->flags_live);
+        GROW(b->jshort);
+        GROW(b->lab_off);
+#undef GROW
+        b->nalloc = nalloc;
+    }
+    b->ninstrs = ir->n;
+    b->any = 0;
+    b->relaxing = 0;
+    memset(b->target, 0, ir->n + 1);
+    memset(b->jshort, 0, ir->n + 1);
+
+    for(n = 0; n < ir->n; n++) {
+        if(ir->op[n] != JIT_OP_JUMP && ir->op[n] != JIT_OP_JUMP_IF) {
+            continue;
+        }
+        t = (uint32_t)ir->val[JIT_IR_IN1][n];
+        if(ir->kind[JIT_IR_IN1][n] != JIT_OPERAND_LABEL || t > ir->n) {
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: jump %u to bad label %d\n", n,
+                    ir->val[JIT_IR_IN1][n]);
+            FAILPATH(JIT_ERROR_BAD_LABEL);
+        }
+        b->target[t] = 1;
+        b->any = 1;
+    }
+
+    // Backwards: a JUMP_IF, SET_IF or MOVE_IF reads the flags, and whatever
+    // sets them again ends that. A JUMP's target might read them.
+    for(n = ir->n, live = 0; n-- > 0; ) {
+        b->flags_live[n] = (uint8_t)live;
+        switch(ir->op[n]) {
+            case JIT_OP_JUMP:
+            case JIT_OP_JUMP_IF:
+            case JIT_OP_SET_IF:
+            case JIT_OP_MOVE_IF:
+                live = 1;
+                break;
+            case JIT_OP_ADD: case JIT_OP_SUB: case JIT_OP_AND:
+            case JIT_OP_OR: case JIT_OP_XOR: case JIT_OP_CMP:
+            case JIT_OP_FLAGS: case JIT_OP_CALL: case JIT_OP_RET:
+            case JIT_OP_EXIT:
+                live = 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+l_exit:
+    if(FAILURE(e) && b != NULL) {
+        b->any = 0;
+    }
+    return e;
+}
+
+/* Pick rel8 or rel32 for every jump. All start short; the ones whose target
+ * ends up out of reach are widened, which can push others out of reach, until
+ * none is. Only jumps change size in the process, so one dry run gives the
+ * size of everything else. */
+static jit_error
+jit_relax_branches(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_branches *b = s->p_emitter->branches;
+    struct jit_ir *ir = s->p_ir;
+    uint32_t nn = b->ninstrs + 1;
+    uint32_t *ends = NULL, *pre, *rest, *lab;
+    uint32_t n, start, pos;
+    int changed;
+
+    ends = malloc(4 * nn * sizeof(uint32_t));
+    if(ends == NULL) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+    pre = ends + nn;
+    rest = pre + nn;
+    lab = rest + nn;
+
+    for(n = 0; n < b->ninstrs; n++) {
+        b->jshort[n] = (ir->op[n] == JIT_OP_JUMP || ir->op[n] == JIT_OP_JUMP_IF);
+    }
+    b->relaxing = 1;
+    e = jit_measure_instrs(s, s->p_bufexec, NULL, ends);
+    b->relaxing = 0;
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+
+    // Split each instruction around its label: what comes before it (the
+    // prologue, register flushes), and the rest, short jumps left out.
+    for(n = 0, start = 0; n < b->ninstrs; n++) {
+        pre[n] = b->lab_off[n] - start;
+        rest[n] = ends[n] - b->lab_off[n] - (b->jshort[n] ? 2 : 0);
+        start = ends[n];
+    }
+
+    do {
+        changed = 0;
+        for(n = 0, pos = 0; n < b->ninstrs; n++) {
+            pos += pre[n];
+            lab[n] = pos;
+            pos += rest[n];
+            if(ir->op[n] == JIT_OP_JUMP || ir->op[n] == JIT_OP_JUMP_IF) {
+                pos += b->jshort[n] ? 2 : (ir->op[n] == JIT_OP_JUMP ? 5 : 6);
+            }
+            ends[n] = pos;
+        }
+        lab[n] = pos;
+        for(n = 0; n < b->ninstrs; n++) {
+            int64_t d;
+            if(!b->jshort[n]) {
+                continue;
+            }
+            d = (int64_t)lab[ir->val[JIT_IR_IN1][n]] - ends[n];
+            if(d < INT8_MIN || d > INT8_MAX) {
+                b->jshort[n] = 0;
+                changed = 1;
+            }
+        }
+    } while(changed);
+
+l_exit:
+    free(ends);
+    return e;
+}
+
+jit_error
+jit_prepare_emit(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    uint32_t n;
+
+    em->ni = 0;
+    em->mov_end = SIZE_MAX;
+    em->nsplit = 0;
+    em->nslots = 0;
+    em->push_depth = 0;
+    em->has_call = 0;
+    em->nframe_patches = 0;
+    em->nfree_slots = 0;
+    e = jit_grow_vregs(em, (uint32_t)s->regcur);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    for(n = 0; n < em->nvreg_alloc; n++) {
+        em->vreg_slot[n] = -1;
+    }
+    for(n = 0; n < NUM_HOST_REGS; n++) {
+        em->callee_slot[n] = -1;
+    }
+    em->frame_size = -1;
+    em->live = 0;
+    em->linscan_on = 0;
+    em->njump_patches = 0;
+
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_find_branches(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+
+    if(s->flags & JIT_FLAG_LINEAR_SCAN) {
+        e = jit_linear_scan(s);
+        if(SUCCESS(e)) {
+            struct jit_linscan *ls = em->linscan;
+            uint32_t saved, npushed = 0;
+            for(saved = ls->saved; saved; saved &= saved - 1) {
+                npushed++;
+            }
+            em->frame_size = jit_frame_size(ls->nslots, npushed,
+                    ls->has_call);
+            em->linscan_on = 1;
+        }
+    } else if(!JIT_HAS_BRANCHES(em)) {
+        // Liveness is only a hint to the age-based allocator, which spills
+        // everything it evicts without it. Its ranges assume straight-line
+        // code, so blocks with jumps go without.
+        e = jit_liveness(s);
+        em->live = SUCCESS(e);
+        e = JIT_SUCCESS;
+    }
+
+    if(SUCCESS(e) && JIT_HAS_BRANCHES(em)) {
+        e = jit_relax_branches(s);
+    }
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_finish_emit(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_branches *b = em->branches;
+    int32_t size = em->frame_size;
+    uint32_t n;
+
+    // Forward jumps: every label is known now.
+    if(em->njump_patches > 0) {
+        b->lab_off[b->ninstrs] = (uint32_t)(s->p_bufcur - s->p_bufstart);
+    }
+    for(n = 0; n < em->njump_patches; n++) {
+        struct jit_jump_patch *jp = &em->jump_patches[n];
+        uint8_t *p = s->p_bufstart + jp->off;
+        int64_t d = (int64_t)b->lab_off[jp->target] -
+            (int64_t)(jp->off + (jp->rel8 ? 1 : sizeof(int32_t)));
+        if(jp->rel8) {
+            if(d < INT8_MIN || d > INT8_MAX) {
+                JIT_TRACE(s, JIT_TRACE_ERROR,
+                        "error: jump to label %zu out of rel8 range\n",
+                        jp->target);
+                e = JIT_ERROR_RELOC_RANGE;
+            }
+            *(int8_t *)p = (int8_t)d;
+        } else {
+            int32_t d32 = (int32_t)d;
+            memcpy(p, &d32, sizeof(int32_t));
+        }
+    }
+    em->njump_patches = 0;
+
+    if(size < 0) {
+        size = jit_frame_size(em->nslots, 0, em->has_call);
+    }
+    // The instructions were traced with the placeholder: trace each add/sub
+    // again as patched.
+    for(n = 0; n < em->nframe_patches; n++) {
+        uint8_t *p = s->p_bufstart + em->frame_patches[n];
+        if(size == 0) {
+            // No frame after all: blank out the whole add/sub.
+            jit_emit__nop(p - 3, 7);
+        } else {
+            memcpy(p, &size, sizeof(int32_t));
+        }
+        if(JIT_TRACE_ON(s, JIT_TRACE_EMIT)) {
+            jit_trace_bytes(s, "frame", p - 3, 7);
+        }
+    }
+    em->nframe_patches = 0;
+
+    return e;
+}
+
+static jit_error
+jit_emit_instr_unchecked(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_branches *b = em->branches;
+
+    if(em->ni == 0) {
+        jit_emit_prologue(s);
+    }
+    if(JIT_HAS_BRANCHES(em) && em->ni < b->ninstrs) {
+        if(b->target[em->ni] && !JIT_LINSCAN_ON(s)) {
+            uint8_t *flush = s->p_bufcur;
+            jit_flush_regs(s);
+            s->blk_nb += s->p_bufcur - flush;
+        }
+        b->lab_off[em->ni] = (uint32_t)(s->p_bufcur - s->p_bufstart);
+        if(b->target[em->ni]) {
+            // Other paths come in here with their own register contents.
+            em->mov_end = SIZE_MAX;
+        }
+    }
+    if(JIT_LINSCAN_ON(s)) {
+        jit_linscan_begin_instr(s, i);
+    }
+    switch(i->op) {
+        case JIT_OP_MOVE:
+            e = jit_emit_move(s, i);
+            break;
+        case JIT_OP_ADD:
+        case JIT_OP_SUB:
+        case JIT_OP_AND:
+        case JIT_OP_OR:
+        case JIT_OP_XOR:
+        case JIT_OP_SHL:
+        case JIT_OP_SHR:
+        case JIT_OP_SAR:
+            e = jit_emit_arith(s, i);
+            break;
+        case JIT_OP_MUL:
+        case JIT_OP_DIV:
+        case JIT_OP_DIVU:
+        case JIT_OP_REM:
+        case JIT_OP_REMU:
+            e = jit_emit_muldiv(s, i);
+            break;
+        case JIT_OP_MOVZX:
+        case JIT_OP_MOVSX:
+            e = jit_emit_movx(s, i);
+            break;
+        case JIT_OP_CALL:
+            e = jit_emit_call(s, i);
+            break;
+        case JIT_OP_RET:
+            e = jit_emit_ret(s, i);
+            break;
+        case JIT_OP_JUMP:
+            e = jit_emit_jump(s, i);
+            break;
+        case JIT_OP_JUMP_IF:
+            e = jit_emit_jump_if(s, i);
+            break;
+        case JIT_OP_SET_IF:
+            e = jit_emit_set_if(s, i);
+            break;
+        case JIT_OP_MOVE_IF:
+            e = jit_emit_move_if(s, i);
+            break;
+        case JIT_OP_FLAGS:
+            e = jit_emit_flags(s, i);
+            break;
+        case JIT_OP_EXIT:
+            e = jit_emit_exit(s, i);
+            break;
+        case JIT_OP_PUSH:
+            e = jit_emit_push(s, i);
+            break;
         case JIT_OP_POP:
             e = jit_emit_pop(s, i);
             break;
+        case JIT_OP_CMP:
+            e = jit_emit_cmp(s, i);
+            break;
+        case JIT_OP_NOP:
+            break;
         default:
-            printf("error: emitter cannot handle op type %d\n", i->op);
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: emitter cannot handle op type %d\n", i->op);
             break;
     }
-    jit_inc_reg_ages(s, i);
-    return e;
+    if(JIT_LINSCAN_ON(s)) {
+        jit_linscan_end_instr(s, i);
+    } else {
+        jit_inc_reg_ages(s, i);
+    }
+    if(JIT_TRACE_ON(s, JIT_TRACE_EMIT)) {
+        jit_trace_bytes(s, (i->op >= 0 && i->op < JIT_NUM_OPS) ?
+                g_opsz[i->op] : "?", begin, s->p_bufcur - begin);
+    }
+    em->ni++;
+    return e;
+}
+
+jit_error
+jit_emit_instr(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t tail[JIT_MAX_INSTR_BYTES];
+    uint8_t *start = s->p_bufstart;
+    uint8_t *end = s->p_bufend;
+    size_t used;
+
+    if(end == NULL || (size_t)(end - s->p_bufcur) >= JIT_MAX_INSTR_BYTES) {
+        e = jit_emit_instr_unchecked(s, i);
+        goto l_exit;
+    }
+
+    // Close to the end of the buffer: emit to a scratch area standing in for
+    // the rest of the buffer, then append only what was actually produced.
+    used = s->p_bufcur - start;
+    s->p_bufstart = tail - used;
+    s->p_bufcur = tail;
+    s->p_bufend = NULL;
+    e = jit_emit_instr_unchecked(s, i);
+    used = s->p_bufcur - tail;
+    s->p_bufcur = start + (tail - s->p_bufstart);
+    s->p_bufstart = start;
+    s->p_bufend = end;
+    if(SUCCESS(e)) {
+        e = jit_append_tail(s, tail, used);
+    }
+
+l_exit:
+    // Emitters have no way to report a reloc that could not be recorded.
+    if(SUCCESS(e)) {
+        e = s->reloc_error;
+    }
+    return e;
+}
+
+/* Whether the instruction being emitted may clobber the flags, which lets
+ * it take a shorter encoding that does. */
+static int
+jit_flags_dead(struct jit_state *s)
+{
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_branches *b = em->branches;
+
+    return JIT_PEEPHOLE_ON(s) && b != NULL && em->ni < b->ninstrs &&
+        !b->flags_live[em->ni];
+}
+
+/* Whether host registers in and out already hold the same opsz bytes,
+ * through being one or the move just before. Moving back is redundant
+ * whatever the sizes, as the bits the first move did not copy are left
+ * unspecified in its destination. */
+static int
+jit_mov_redundant(struct jit_state *s, jit_host_reg in, jit_host_reg out,
+        size_t opsz)
+{
+    struct jit_emitter *em = s->p_emitter;
+    size_t off = s->p_bufcur - s->p_bufstart;
+
+    if(!JIT_PEEPHOLE_ON(s)) {
+        return 0;
+    }
+    return in == out || (off == em->mov_end &&
+            ((em->mov_src == in && em->mov_dst == out &&
+              opsz <= em->mov_opsz) ||
+             (em->mov_src == out && em->mov_dst == in)));
+}
+
+jit_error
+jit_emit_move(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_in = JIT_HOST_REG_INVALID;
+    jit_host_reg hostreg_out = JIT_HOST_REG_INVALID;
+    size_t opsz;
+
+    if(i->in1_type == JIT_OPERAND_IMM) {
+        if(i->out_type == JIT_OPERAND_REG) {
+            int64_t imm = jit_instr_imm(i);
+            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+            if(hostreg_out == JIT_HOST_REG_INVALID) {
+                JIT_TRACE(s, JIT_TRACE_ERROR,
+                        "error: jit reg. %d does not map to host reg.\n",
+                        i->out.reg);
+            }
+            if(imm == 0 && i->opsz >= JIT_32BIT && jit_flags_dead(s)) {
+                // Clears all 64 bits.
+                s->p_bufcur = jit_emit__xor_reg32_to_reg(s->p_bufcur,
+                        hostreg_out, hostreg_out);
+            } else if(i->opsz == JIT_64BIT && imm >= 0 && imm <= UINT32_MAX) {
+                // mov r32 zero-extends, in fewer bytes than the others.
+                s->p_bufcur = jit_emit__mov_imm32_to_reg(s->p_bufcur,
+                        (int32_t)imm, hostreg_out);
+            } else if(i->opsz == JIT_64BIT && (imm < INT32_MIN ||
+                        imm > INT32_MAX)) {
+                s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, imm,
+                        hostreg_out);
+            } else {
+                jit_emit_imm_op(s, JIT_OP_MOVE, i->opsz, imm, hostreg_out);
+            }
+        }
+    } else if(i->in1_type == JIT_OPERAND_REG) {
+        hostreg_in = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+        if(i->out_type == JIT_OPERAND_REG) {
+            // Move to self; we can short-circuit this
+            if(i->out.reg == i->in1.reg) {
+                goto l_exit;
+            }
+            // Narrower moves copy 32 bits, as the rest is unspecified and
+            // writing all of the register spares a merge.
+            opsz = (i->opsz == JIT_64BIT) ? JIT_64BIT : JIT_32BIT;
+            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+            if(!jit_mov_redundant(s, hostreg_in, hostreg_out, opsz)) {
+                s->p_bufcur = jit_e_r_to_r(JIT_OP_MOVE, opsz)(s->p_bufcur,
+                        hostreg_in, hostreg_out);
+                s->p_emitter->mov_end = s->p_bufcur - s->p_bufstart;
+                s->p_emitter->mov_src = hostreg_in;
+                s->p_emitter->mov_dst = hostreg_out;
+                s->p_emitter->mov_opsz = opsz;
+            }
+        } else if(i->out_type == JIT_OPERAND_IMMPTR) {
+            jit_emit_store_m(s, hostreg_in, i->out.ptr, i->opsz);
+        } else if(i->out_type == JIT_OPERAND_REGPTR) {
+            struct jit_host_ptr hp;
+            e = jit_get_host_memptr(s, &i->out.regptr, &hp);
+            if(FAILURE(e)) {
+                goto l_exit;
+            }
+            s->p_bufcur = g_e_r_to_regptr[jit_opsz_index(i->opsz)](
+                    s->p_bufcur, hostreg_in, &hp);
+        }
+    } else if(i->in1_type == JIT_OPERAND_IMMPTR) {
+        if(i->out_type == JIT_OPERAND_REG) {
+            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+            jit_emit_load_m(s, i->in1.ptr, hostreg_out, i->opsz);
+        }
+    } else if(i->in1_type == JIT_OPERAND_REGPTR) {
+        if(i->out_type == JIT_OPERAND_REG) {
+            struct jit_host_ptr hp;
+            e = jit_get_host_memptr(s, &i->in1.regptr, &hp);
+            if(FAILURE(e)) {
+                goto l_exit;
+            }
+            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+            s->p_bufcur = g_e_regptr_to_r[0][jit_opsz_index(i->opsz)](
+                    s->p_bufcur, &hp, hostreg_out);
+        }
+    } else if(i->in1_type == JIT_OPERAND_IMMDISP) {
+        if(i->out_type == JIT_OPERAND_REG) {
+            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+            if(jit_rip_reachable(s, i->in1.ptr)) {
+                s->p_bufcur = jit_emit__lea_immdisp32_to_reg(s->p_bufcur,
+                        jit_rip_target(s, i->in1.ptr), hostreg_out);
+                jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+            } else {
+                s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur,
+                        (int64_t)i->in1.ptr, hostreg_out);
+            }
+        }
+    }
+
+
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_emit_movx(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    int sign = (i->op == JIT_OP_MOVSX);
+    jit_host_reg hostreg_in, hostreg_out;
+
+    if(i->out_type != JIT_OPERAND_REG) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    if(i->in1_type == JIT_OPERAND_REG) {
+        hostreg_in = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+        hostreg_out = jit_get_mapped_host_reg(s, i->out.reg,
+                i->in1.reg == i->out.reg ? JIT_ACCESS_RW : JIT_ACCESS_W);
+        if(i->opsz != JIT_64BIT || hostreg_in != hostreg_out) {
+            s->p_bufcur = g_e_r_to_r_ext[sign][jit_opsz_index(i->opsz)](
+                    s->p_bufcur, hostreg_in, hostreg_out);
+        }
+    } else if(i->in1_type == JIT_OPERAND_IMMPTR) {
+        hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+        jit_emit_loadx_m(s, i->in1.ptr, hostreg_out, i->opsz, sign);
+    } else if(i->in1_type == JIT_OPERAND_REGPTR) {
+        struct jit_host_ptr hp;
+        e = jit_get_host_memptr(s, &i->in1.regptr, &hp);
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+        hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+        s->p_bufcur = g_e_regptr_to_r[sign][jit_opsz_index(i->opsz)](
+                s->p_bufcur, &hp, hostreg_out);
+    } else {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* A memory operand of an ALU instruction: RIP-relative to m if it is set,
+ * [hp] otherwise. */
+struct jit_mem_opnd {
+    void *m;
+    struct jit_host_ptr hp;
+};
+
+static int
+jit_is_mem(jit_operand kind)
+{
+    return kind == JIT_OPERAND_IMMPTR || kind == JIT_OPERAND_REGPTR;
+}
+
+/* Whether two operands are the same place in memory. */
+static int
+jit_same_mem(jit_operand ka, jit_operand_union *a, jit_operand kb,
+        jit_operand_union *b)
+{
+    if(ka != kb) {
+        return 0;
+    }
+    if(ka == JIT_OPERAND_IMMPTR) {
+        return a->ptr == b->ptr;
+    }
+    return ka == JIT_OPERAND_REGPTR && a->regptr.base == b->regptr.base &&
+        a->regptr.index == b->regptr.index &&
+        a->regptr.scale == b->regptr.scale &&
+        a->regptr.offset == b->regptr.offset;
+}
+
+/* The opcode extension of op in the add/or/and/sub/xor/cmp group, which
+ * has forms on memory, or -1. */
+static int
+jit_grp1_ext(jit_op op)
+{
+    switch(op) {
+        case JIT_OP_ADD: return OX_ADD;
+        case JIT_OP_OR: return OX_OR;
+        case JIT_OP_AND: return OX_AND;
+        case JIT_OP_SUB: return OX_SUB;
+        case JIT_OP_XOR: return OX_XOR;
+        case JIT_OP_CMP: return OX_CMP;
+        default: return -1;
+    }
+}
+
+/* Map memory operand v of an ALU instruction whose register operands are
+ * in r1 and r2. An address out of reach of rip is put in a scratch register
+ * first, one that neither of them is. Only the linear scan puts operands in
+ * JIT_SCRATCH_REG, and JIT_SCRATCH_REG2 is then the emitter's as well. */
+static jit_error
+jit_get_host_mem(struct jit_state *s, jit_operand kind, jit_operand_union *v,
+        jit_host_reg r1, jit_host_reg r2, struct jit_mem_opnd *mo)
+{
+    jit_host_reg h = JIT_SCRATCH_REG;
+
+    mo->m = NULL;
+    if(kind == JIT_OPERAND_REGPTR) {
+        return jit_get_host_memptr(s, &v->regptr, &mo->hp);
+    }
+    if(jit_rip_reachable(s, v->ptr)) {
+        mo->m = v->ptr;
+        return JIT_SUCCESS;
+    }
+    if(r1 == h || r2 == h) {
+        h = JIT_SCRATCH_REG2;
+    }
+    if(r1 == h || r2 == h) {
+        JIT_TRACE(s, JIT_TRACE_ERROR, "error: %p is out of reach\n", v->ptr);
+        return JIT_ERROR_RELOC_RANGE;
+    }
+    s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, (int64_t)v->ptr, h);
+    mo->hp.base = h;
+    mo->hp.index = JIT_HOST_REG_INVALID;
+    mo->hp.scale = 0;
+    mo->hp.offset = 0;
+    return JIT_SUCCESS;
+}
+
+/* op reg, [mo] or op [mo], reg, for the opcode opc of either. */
+static void
+jit_emit_alu_mem(struct jit_state *s, size_t opsz, uint8_t opc,
+        jit_host_reg reg, struct jit_mem_opnd *mo)
+{
+    if(mo->m != NULL) {
+        s->p_bufcur = jit_emit__alu_m(s->p_bufcur, opsz, opc, reg,
+                jit_rip_target(s, mo->m));
+        jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+    } else {
+        s->p_bufcur = jit_emit__alu_regptr(s->p_bufcur, opsz, opc, reg,
+                &mo->hp);
+    }
+}
+
+/* op [mo], imm. Return 0 if imm does not fit the instruction. */
+static int
+jit_emit_imm_mem(struct jit_state *s, size_t opsz, int ox, int64_t imm,
+        struct jit_mem_opnd *mo)
+{
+    int32_t v = (opsz == JIT_8BIT) ? (int8_t)imm :
+        (opsz == JIT_16BIT) ? (int16_t)imm : (int32_t)imm;
+    size_t immsz = (opsz == JIT_8BIT || (v >= INT8_MIN && v <= INT8_MAX)) ?
+        1 : (opsz == JIT_16BIT) ? 2 : 4;
+
+    if(opsz == JIT_64BIT && v != imm) {
+        return 0;
+    }
+    if(mo->m != NULL) {
+        s->p_bufcur = jit_emit__grp1_imm_to_m(s->p_bufcur, opsz, ox, v,
+                jit_rip_target(s, mo->m));
+        jit_add_reloc(s, s->p_bufcur - immsz - sizeof(int32_t));
+    } else {
+        s->p_bufcur = jit_emit__grp1_imm_to_regptr(s->p_bufcur, opsz, ox, v,
+                &mo->hp);
+    }
+    return 1;
+}
+
+static void
+jit_emit_load_mem(struct jit_state *s, size_t opsz, struct jit_mem_opnd *mo,
+        jit_host_reg reg)
+{
+    if(mo->m != NULL) {
+        jit_emit_load_m(s, mo->m, reg, opsz);
+    } else {
+        s->p_bufcur = g_e_regptr_to_r[0][jit_opsz_index(opsz)](s->p_bufcur,
+                &mo->hp, reg);
+    }
+}
+
+/* A scratch register other than h. h is only ever JIT_SCRATCH_REG when the
+ * linear scan reloaded a spilled operand there, and JIT_SCRATCH_REG2 is then
+ * the emitter's own as well. */
+static jit_host_reg
+jit_scratch_other(jit_host_reg h)
+{
+    return (h == JIT_SCRATCH_REG) ? JIT_SCRATCH_REG2 : JIT_SCRATCH_REG;
+}
+
+/* The ALU operations with an operand in memory: either one input is, and
+ * is read straight from there, or the output is the same memory as an
+ * input, which is then updated in place. */
+static jit_error
+jit_emit_arith_mem(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    int ox = jit_grp1_ext(i->op);
+    int commutes = (i->op != JIT_OP_SUB);
+    pfn_e_r_to_r op_r = jit_e_r_to_r(i->op, i->opsz);
+    pfn_e_r_to_r mov_r = jit_e_r_to_r(JIT_OP_MOVE,
+            i->opsz == JIT_64BIT ? JIT_64BIT : JIT_32BIT);
+    jit_host_reg hr = JIT_HOST_REG_INVALID, out, t;
+    jit_reg_access a = JIT_ACCESS_W;
+    jit_operand mk;
+    jit_operand_union *mv;
+    jit_reg other = JIT_REG_INVALID;
+    struct jit_mem_opnd mo;
+    int mem_first = 0, loads_out, clobbers;
+
+    if(ox < 0) {
+        JIT_TRACE(s, JIT_TRACE_ERROR,
+                "error: no memory form for op %d\n", i->op);
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    if(jit_is_mem(i->out_type)) {
+        // out = out op in2, in1 op out for ops that commute, or out op imm.
+        if(jit_same_mem(i->in1_type, &i->in1, i->out_type, &i->out) &&
+                i->in2_type == JIT_OPERAND_REG) {
+            other = i->in2.reg;
+        } else if(jit_same_mem(i->in2_type, &i->in2, i->out_type, &i->out) &&
+                ((i->in1_type == JIT_OPERAND_REG && commutes) ||
+                 i->in1_type == JIT_OPERAND_IMM)) {
+            other = (i->in1_type == JIT_OPERAND_REG) ? i->in1.reg :
+                JIT_REG_INVALID;
+        } else {
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: op %d does not update its memory input\n",
+                    i->op);
+            FAILPATH(JIT_ERROR_UNKNOWN);
+        }
+        if(other != JIT_REG_INVALID) {
+            hr = jit_get_mapped_host_reg(s, other, JIT_ACCESS_R);
+        }
+        e = jit_get_host_mem(s, i->out_type, &i->out, hr,
+                JIT_HOST_REG_INVALID, &mo);
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+        if(other != JIT_REG_INVALID) {
+            jit_emit_alu_mem(s, i->opsz, 8 * ox + 1, hr, &mo);
+        } else if(!jit_emit_imm_mem(s, i->opsz, ox, jit_instr_imm(i), &mo)) {
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: no immediate form for op %d\n", i->op);
+            FAILPATH(JIT_ERROR_UNKNOWN);
+        }
+        goto l_exit;
+    }
+
+    // out = [m] op in2, in1 op [m], or [m] op imm.
+    if(i->out_type != JIT_OPERAND_REG) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    if(jit_is_mem(i->in1_type) && i->in2_type == JIT_OPERAND_REG) {
+        mk = i->in1_type;
+        mv = &i->in1;
+        other = i->in2.reg;
+        mem_first = 1;
+    } else if(jit_is_mem(i->in2_type) && (i->in1_type == JIT_OPERAND_REG ||
+                i->in1_type == JIT_OPERAND_IMM)) {
+        mk = i->in2_type;
+        mv = &i->in2;
+        if(i->in1_type == JIT_OPERAND_REG) {
+            other = i->in1.reg;
+        }
+    } else {
+        JIT_TRACE(s, JIT_TRACE_ERROR,
+                "error: op %d takes one memory operand\n", i->op);
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    // The output must come back from its slot if anything reads it.
+    if(i->out.reg == other || (mk == JIT_OPERAND_REGPTR &&
+                (i->out.reg == mv->regptr.base ||
+                 i->out.reg == mv->regptr.index))) {
+        a = JIT_ACCESS_RW;
+    }
+    if(other != JIT_REG_INVALID) {
+        hr = jit_get_mapped_host_reg(s, other, JIT_ACCESS_R);
+    }
+    out = jit_get_mapped_host_reg(s, i->out.reg, a);
+    // Loading memory straight into the output leaves it free to hold an
+    // address out of reach.
+    loads_out = other == JIT_REG_INVALID || (mem_first && hr != out);
+    e = jit_get_host_mem(s, mk, mv, hr, loads_out ? JIT_HOST_REG_INVALID : out,
+            &mo);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    // Whether writing the output before reading memory loses the address.
+    clobbers = mo.m == NULL && (out == mo.hp.base || out == mo.hp.index);
+
+    if(other == JIT_REG_INVALID) {
+        jit_emit_load_mem(s, i->opsz, &mo, out);
+        if(!jit_emit_imm_op(s, i->op, i->opsz, jit_instr_imm(i), out)) {
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: no immediate form for op %d\n", i->op);
+            FAILPATH(JIT_ERROR_UNKNOWN);
+        }
+    } else if(hr == out && (!mem_first || commutes)) {
+        jit_emit_alu_mem(s, i->opsz, 8 * ox + 3, out, &mo);
+    } else if(hr == out && !clobbers && jit_flags_dead(s)) {
+        // out = [m] - out, as -out + [m].
+        s->p_bufcur = g_e_neg[jit_opsz_index(i->opsz)](s->p_bufcur, out);
+        jit_emit_alu_mem(s, i->opsz, 8 * OX_ADD + 3, out, &mo);
+    } else if(hr == out) {
+        // out = [m] - out, in a scratch register loaded first.
+        t = jit_scratch_other(out);
+        jit_emit_load_mem(s, i->opsz, &mo, t);
+        s->p_bufcur = op_r(s->p_bufcur, out, t);
+        s->p_bufcur = mov_r(s->p_bufcur, t, out);
+    } else if(mem_first) {
+        jit_emit_load_mem(s, i->opsz, &mo, out);
+        s->p_bufcur = op_r(s->p_bufcur, hr, out);
+    } else if(!clobbers) {
+        s->p_bufcur = mov_r(s->p_bufcur, hr, out);
+        jit_emit_alu_mem(s, i->opsz, 8 * ox + 3, out, &mo);
+    } else if(commutes || jit_flags_dead(s)) {
+        // out = in1 op [m], loading [m] first as out is part of its address;
+        // for subtracting, as -[m] + in1.
+        jit_emit_load_mem(s, i->opsz, &mo, out);
+        if(!commutes) {
+            s->p_bufcur = g_e_neg[jit_opsz_index(i->opsz)](s->p_bufcur, out);
+            op_r = jit_e_r_to_r(JIT_OP_ADD, i->opsz);
+        }
+        s->p_bufcur = op_r(s->p_bufcur, hr, out);
+    } else if((t = jit_scratch_other(out)) != hr) {
+        // out = in1 - [m], with [m] loaded first into a scratch register.
+        jit_emit_load_mem(s, i->opsz, &mo, t);
+        s->p_bufcur = mov_r(s->p_bufcur, hr, out);
+        s->p_bufcur = op_r(s->p_bufcur, t, out);
+    } else {
+        // Both scratch registers are taken, so in1 is a reloaded copy of a
+        // spilled register and can be subtracted from in place.
+        jit_emit_alu_mem(s, i->opsz, 8 * ox + 3, hr, &mo);
+        s->p_bufcur = mov_r(s->p_bufcur, hr, out);
+    }
+
+l_exit:
+    return e;
+}
+
+/* Comparisons with an operand in memory: [m] - in2, in1 - [m] or
+ * [m] - imm. */
+static jit_error
+jit_emit_cmp_mem(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    jit_host_reg hr = JIT_HOST_REG_INVALID;
+    struct jit_mem_opnd mo;
+
+    if(jit_is_mem(i->in1_type) && i->in2_type == JIT_OPERAND_REG) {
+        hr = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
+        e = jit_get_host_mem(s, i->in1_type, &i->in1, hr,
+                JIT_HOST_REG_INVALID, &mo);
+        if(SUCCESS(e)) {
+            jit_emit_alu_mem(s, i->opsz, 8 * OX_CMP + 1, hr, &mo);
+        }
+    } else if(jit_is_mem(i->in2_type) && i->in1_type == JIT_OPERAND_REG) {
+        hr = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+        e = jit_get_host_mem(s, i->in2_type, &i->in2, hr,
+                JIT_HOST_REG_INVALID, &mo);
+        if(SUCCESS(e)) {
+            jit_emit_alu_mem(s, i->opsz, 8 * OX_CMP + 3, hr, &mo);
+        }
+    } else if(jit_is_mem(i->in2_type) && i->in1_type == JIT_OPERAND_IMM) {
+        e = jit_get_host_mem(s, i->in2_type, &i->in2, JIT_HOST_REG_INVALID,
+                JIT_HOST_REG_INVALID, &mo);
+        if(SUCCESS(e) && !jit_emit_imm_mem(s, i->opsz, OX_CMP,
+                    jit_instr_imm(i), &mo)) {
+            JIT_TRACE(s, JIT_TRACE_ERROR,
+                    "error: no immediate form for op %d\n", i->op);
+            e = JIT_ERROR_UNKNOWN;
+        }
+    } else {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+    return e;
+}
+
+/* Whether host register h holds nothing, so that it can be clobbered without
+ * saving it. Only the age-based allocator tells. */
+static int
+jit_host_reg_unused(struct jit_state *s, jit_host_reg h)
+{
+    return !JIT_LINSCAN_ON(s) && (s->p_emitter->host_free & (1 << h));
+}
+
+/* Emit a form that leaves the inputs alone, if there is one: lea for adding
+ * (and shifting left by up to 3), only where nothing reads the flags since
+ * lea does not set them, and with BMI2, shifts by a register. Return whether
+ * one was emitted. */
+static int
+jit_emit_arith3(struct jit_state *s, struct jit_instr *i, jit_host_reg in1,
+        jit_host_reg in2, jit_host_reg out)
+{
+    struct jit_host_ptr hp;
+    pfn_e_r_r_to_r shx = NULL;
+    int w = (i->opsz == JIT_64BIT);
+    int narrow = (i->opsz == JIT_8BIT || i->opsz == JIT_16BIT);
+    int64_t imm;
+
+    hp.base = hp.index = JIT_HOST_REG_INVALID;
+    hp.scale = 0;
+    hp.offset = 0;
+
+    if(i->in1_type == JIT_OPERAND_REG) {
+        switch(i->op) {
+            case JIT_OP_SHL:
+                shx = w ? jit_emit__shlx_reg64 : jit_emit__shlx_reg32;
+                break;
+            case JIT_OP_SHR:
+                shx = w ? jit_emit__shrx_reg64 : jit_emit__shrx_reg32;
+                break;
+            case JIT_OP_SAR:
+                shx = w ? jit_emit__sarx_reg64 : jit_emit__sarx_reg32;
+                break;
+            default:
+                break;
+        }
+        if(shx != NULL) {
+            // A shift by zero leaves the flags anyway, so nothing can
+            // rely on them after one by a register.
+            if(!s->p_emitter->has_bmi2) {
+                return 0;
+            }
+            // 8 and 16-bit shifts mask the count to 5 bits too, so they are
+            // 32-bit ones of the value extended as the shift needs. It is
+            // extended where it does not overwrite the count.
+            if(narrow && i->op != JIT_OP_SHL) {
+                jit_host_reg x = (out != in2) ? out : jit_scratch_other(in2);
+                if(i->op == JIT_OP_SHR) {
+                    s->p_bufcur = (i->opsz == JIT_8BIT ?
+                            jit_emit__movzx_reg8_to_reg :
+                            jit_emit__movzx_reg16_to_reg)(s->p_bufcur, in1,
+                            x);
+                } else {
+                    s->p_bufcur = (i->opsz == JIT_8BIT ?
+                            jit_emit__movsx_reg8_to_reg64 :
+                            jit_emit__movsx_reg16_to_reg64)(s->p_bufcur, in1,
+                            x);
+                }
+                in1 = x;
+            }
+            s->p_bufcur = shx(s->p_bufcur, in1, in2, out);
+            return 1;
+        }
+        if(narrow || i->op != JIT_OP_ADD || out == in1 || out == in2 ||
+                (in1 == rsp && in2 == rsp) || !jit_flags_dead(s)) {
+            return 0;
+        }
+        hp.base = (in2 == rsp) ? in2 : in1;
+        hp.index = (in2 == rsp) ? in1 : in2;
+    } else {
+        imm = jit_instr_imm(i);
+        if(narrow || out == in2 || !jit_flags_dead(s) || imm <= INT32_MIN ||
+                imm > INT32_MAX) {
+            return 0;
+        }
+        switch(i->op) {
+            case JIT_OP_ADD:
+                hp.base = in2;
+                hp.offset = (int32_t)imm;
+                break;
+            case JIT_OP_SUB:
+                hp.base = in2;
+                hp.offset = (int32_t)-imm;
+                break;
+            case JIT_OP_SHL:
+                if(in2 == rsp || imm < 1 || imm > 3) {
+                    return 0;
+                }
+                // [in2 + in2] needs no displacement, unlike [in2 * 2].
+                hp.base = (imm == 1) ? in2 : JIT_HOST_REG_INVALID;
+                hp.index = in2;
+                hp.scale = (imm == 1) ? 0 : (int32_t)imm;
+                break;
+            default:
+                return 0;
+        }
+    }
+    s->p_bufcur = (w ? jit_emit__lea_regptr64_to_reg :
+            jit_emit__lea_regptr32_to_reg)(s->p_bufcur, &hp, out);
+    return 1;
+}
+
+/* ho = hd shifted by hc, without BMI2: the count goes to cl, with rcx saved
+ * around the shift unless it is the output, as for the hardware division.
+ * The value is shifted in ho, or in a scratch register when ho is rcx or the
+ * count. */
+static uint8_t*
+jit_emit_shift_cl(struct jit_state *s, uint8_t *p, jit_op op, size_t opsz,
+        jit_host_reg hd, jit_host_reg hc, jit_host_reg ho)
+{
+    pfn_e_r_to_r mov = (opsz == JIT_64BIT) ? jit_emit__mov_reg64_to_reg :
+        jit_emit__mov_reg32_to_reg;
+    int ox = (op == JIT_OP_SHL) ? OX_SHL : (op == JIT_OP_SHR) ? OX_SHR : OX_SAR;
+    int save_cx = hc != rcx && ho != rcx && !jit_host_reg_unused(s, rcx);
+    jit_host_reg x = (ho != rcx && ho != hc) ? ho : jit_scratch_other(hc);
+
+    if(save_cx) p = jit_emit__push_reg(p, rcx);
+    if(hd != x) {
+        p = mov(p, hd, x);
+    }
+    if(hc != rcx) {
+        p = jit_emit__mov_reg32_to_reg(p, hc, rcx);
+    }
+    p = jit_emit__shift_cl_to_reg(p, opsz, ox, x);
+    if(x != ho) {
+        p = mov(p, x, ho);
+    }
+    if(save_cx) p = jit_emit__pop_reg(p, rcx);
+    return p;
+}
+
+jit_error
+jit_emit_arith(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_in1 = JIT_HOST_REG_INVALID;
+    jit_host_reg hostreg_in2 = JIT_HOST_REG_INVALID;
+    jit_host_reg hostreg_out = JIT_HOST_REG_INVALID;
+    pfn_e_r_to_r op_r = jit_e_r_to_r(i->op, i->opsz);
+    // Copies between registers: narrower values are copied as 32 bits.
+    pfn_e_r_to_r mov_r = jit_e_r_to_r(JIT_OP_MOVE,
+            i->opsz == JIT_64BIT ? JIT_64BIT : JIT_32BIT);
+    int64_t imm;
+
+    if(jit_is_mem(i->in1_type) || jit_is_mem(i->in2_type) ||
+            jit_is_mem(i->out_type)) {
+        e = jit_emit_arith_mem(s, i);
+        goto l_done;
+    }
+    if(i->out_type == JIT_OPERAND_REG) {
+        // An output that is also an input must come back from its slot.
+        jit_reg_access a = JIT_ACCESS_W;
+        if((i->in1_type == JIT_OPERAND_REG && i->in1.reg == i->out.reg) ||
+                (i->in2_type == JIT_OPERAND_REG && i->in2.reg == i->out.reg)) {
+            a = JIT_ACCESS_RW;
+        }
+        hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, a);
+        if(i->in2_type == JIT_OPERAND_REG) {
+            hostreg_in2 = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
+            if(i->in1_type == JIT_OPERAND_REG) {
+                jit_host_reg hr_in = JIT_HOST_REG_INVALID;
+                hostreg_in1 = jit_get_mapped_host_reg(s, i->in1.reg,
+                        JIT_ACCESS_R);
+                if(jit_emit_arith3(s, i, hostreg_in1, hostreg_in2,
+                            hostreg_out)) {
+                    goto l_done;
+                }
+                if(i->op == JIT_OP_SHL || i->op == JIT_OP_SHR ||
+                        i->op == JIT_OP_SAR) {
+                    s->p_bufcur = jit_emit_shift_cl(s, s->p_bufcur, i->op,
+                            i->opsz, hostreg_in1, hostreg_in2, hostreg_out);
+                    goto l_done;
+                }
+                if(op_r == NULL) {
+                    JIT_TRACE(s, JIT_TRACE_ERROR,
+                            "error: no register form for op %d\n", i->op);
+                    FAILPATH(JIT_ERROR_UNKNOWN);
+                }
+                if(hostreg_in1 != hostreg_out && hostreg_in2 != hostreg_out) {
+                    s->p_bufcur = mov_r(s->p_bufcur, hostreg_in1, hostreg_out);
+                    hr_in = hostreg_in2;
+                } else if(hostreg_in1 == hostreg_out) {
+                    hr_in = hostreg_in2;
+                } else if(i->op == JIT_OP_SUB && i->opsz == JIT_32BIT &&
+                        jit_flags_dead(s)) {
+                    // out = in1 - out, as -out + in1, which sets the carry
+                    // the other way round.
+                    s->p_bufcur = jit_emit__neg_reg32(s->p_bufcur,
+                            hostreg_out);
+                    s->p_bufcur = jit_emit__add_reg32_to_reg(s->p_bufcur,
+                            hostreg_in1, hostreg_out);
+                } else if(i->op == JIT_OP_SUB) {
+                    jit_host_reg x = jit_scratch_other(hostreg_in2);
+                    s->p_bufcur = mov_r(s->p_bufcur, hostreg_in1, x);
+                    s->p_bufcur = op_r(s->p_bufcur, hostreg_in2, x);
+                    s->p_bufcur = mov_r(s->p_bufcur, x, hostreg_out);
+                } else {
+                    hr_in = hostreg_in1;
+                }
+                if(hr_in != JIT_HOST_REG_INVALID) {
+                    s->p_bufcur = op_r(s->p_bufcur, hr_in, hostreg_out);
+                }
+            } else if(i->in1_type == JIT_OPERAND_IMM) {
+                if(jit_emit_arith3(s, i, JIT_HOST_REG_INVALID, hostreg_in2,
+                            hostreg_out)) {
+                    goto l_done;
+                }
+                // out = in2 op imm: start from in2.
+                if(hostreg_in2 != hostreg_out) {
+                    s->p_bufcur = mov_r(s->p_bufcur, hostreg_in2, hostreg_out);
+                }
+                imm = jit_instr_imm(i);
+                // inc and dec leave CF alone, so only when nothing reads the
+                // flags.
+                if(i->opsz == JIT_32BIT && (i->op == JIT_OP_ADD ||
+                            i->op == JIT_OP_SUB) && (imm == 1 || imm == -1) &&
+                        jit_flags_dead(s)) {
+                    s->p_bufcur = ((i->op == JIT_OP_ADD) == (imm == 1) ?
+                            jit_emit__inc_reg32 : jit_emit__dec_reg32)(
+                            s->p_bufcur, hostreg_out);
+                } else if(!jit_emit_imm_op(s, i->op, i->opsz, imm,
+                            hostreg_out)) {
+                    JIT_TRACE(s, JIT_TRACE_ERROR,
+                            "error: no immediate form for op %d\n", i->op);
+                    FAILPATH(JIT_ERROR_UNKNOWN);
+                }
+            }
+        }
+    }
+
+l_done:
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* div and idiv work on edx:eax, or rdx:rax on 64 bits. Whatever those hold
+ * is saved around them, unless it is the output. Narrower operands are
+ * extended to 32 bits first, the divisor in a scratch register, which it
+ * also goes to when it is in rax or rdx. */
+static uint8_t*
+jit_emit_hw_div(struct jit_state *s, uint8_t *p, jit_op op, size_t opsz,
+        jit_host_reg hd, jit_host_reg hv, jit_host_reg ho)
+{
+    int is_signed = (op == JIT_OP_DIV || op == JIT_OP_REM);
+    int narrow = (opsz < JIT_32BIT);
+    pfn_e_r_to_r ext = g_e_r_to_r_ext[is_signed && narrow][
+        jit_opsz_index(opsz)];
+    jit_host_reg res = (op == JIT_OP_DIV || op == JIT_OP_DIVU) ? rax : rdx;
+    int save_ax = ho != rax && !jit_host_reg_unused(s, rax);
+    int save_dx = ho != rdx && !jit_host_reg_unused(s, rdx);
+
+    if(save_ax) p = jit_emit__push_reg(p, rax);
+    if(save_dx) p = jit_emit__push_reg(p, rdx);
+    if(hv == rax || hv == rdx || narrow) {
+        p = ext(p, hv, jit_scratch_other(hd));
+        hv = jit_scratch_other(hd);
+    }
+    if(hd != rax || narrow) {
+        p = ext(p, hd, rax);
+    }
+    if(opsz == JIT_64BIT) {
+        if(is_signed) {
+            p = jit_emit__cqo(p);
+            p = jit_emit__idiv_reg64(p, hv);
+        } else {
+            p = jit_emit__xor_reg32_to_reg(p, rdx, rdx);
+            p = jit_emit__div_reg64(p, hv);
+        }
+    } else if(is_signed) {
+        p = jit_emit__cdq(p);
+        p = jit_emit__idiv_reg32(p, hv);
+    } else {
+        p = jit_emit__xor_reg32_to_reg(p, rdx, rdx);
+        p = jit_emit__div_reg32(p, hv);
+    }
+    if(ho != res) {
+        p = (opsz == JIT_64BIT ? jit_emit__mov_reg64_to_reg :
+                jit_emit__mov_reg32_to_reg)(p, res, ho);
+    }
+    if(save_dx) p = jit_emit__pop_reg(p, rdx);
+    if(save_ax) p = jit_emit__pop_reg(p, rax);
+    return p;
+}
+
+/* Magic number for unsigned division by d, not a power of two and below
+ * 2^31: x / d == (x * m) >> sh for every 32-bit x, with m below 2^33. */
+static void
+jit_magic_unsigned(uint32_t d, uint64_t *m, int *sh)
+{
+    int l = 32 - __builtin_clz(d - 1);
+
+    *sh = 32 + l;
+    *m = (((uint64_t)1 << *sh) / d) + 1;
+    while(!(*m & 1) && *sh > 32) {
+        *m >>= 1;
+        (*sh)--;
+    }
+}
+
+/* The same for every 64-bit x, not a power of two (Hacker's Delight,
+ * 10-10): x / d is the high half of x * m shifted right by sh. When m would
+ * need 65 bits, return 1 and its low 64 bits, with t that high half:
+ * x / d == (t + ((x - t) >> 1)) >> (sh - 1). */
+static int
+jit_magic_unsigned64(uint64_t d, uint64_t *m, int *sh)
+{
+    const uint64_t two63 = (uint64_t)1 << 63;
+    uint64_t nc = -1 - (-d) % d;
+    uint64_t q1 = two63 / nc, r1 = two63 - q1 * nc;
+    uint64_t q2 = (two63 - 1) / d, r2 = (two63 - 1) - q2 * d;
+    uint64_t delta;
+    int add = 0;
+    int p = 63;
+
+    do {
+        p++;
+        if(r1 >= nc - r1) {
+            q1 = 2 * q1 + 1;
+            r1 = 2 * r1 - nc;
+        } else {
+            q1 = 2 * q1;
+            r1 = 2 * r1;
+        }
+        if(r2 + 1 >= d - r2) {
+            add |= (q2 >= two63 - 1);
+            q2 = 2 * q2 + 1;
+            r2 = 2 * r2 + 1 - d;
+        } else {
+            add |= (q2 >= two63);
+            q2 = 2 * q2;
+            r2 = 2 * r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while(p < 128 && (q1 < delta || (q1 == delta && r1 == 0)));
+    *m = q2 + 1;
+    *sh = p - 64;
+    return add;
+}
+
+/* Magic number for signed division by ad on n bits, at least 3 and not a
+ * power of two (Hacker's Delight, 10-1): x / ad is the high half of x * m
+ * shifted right by sh, plus 1 if x < 0. m is taken as unsigned; it fits in
+ * n bits, but is negative as a signed one for some ad. */
+static void
+jit_magic_signed(uint64_t ad, int n, uint64_t *m, int *sh)
+{
+    const uint64_t two = (uint64_t)1 << (n - 1);
+    uint64_t anc = two - 1 - two % ad;
+    uint64_t q1 = two / anc, r1 = two - q1 * anc;
+    uint64_t q2 = two / ad, r2 = two - q2 * ad;
+    uint64_t delta;
+    int p = n - 1;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+    *m = q2 + 1;
+    *sh = p - n;
+}
+
+/* ho = hx op d, for a constant d: shifts for powers of two, multiplication
+ * by a magic number otherwise, and the hardware division when neither
+ * applies. */
+static uint8_t*
+jit_emit_div_imm(struct jit_state *s, uint8_t *p, jit_op op, jit_host_reg hx,
+        int32_t d, jit_host_reg ho)
+{
+    int is_signed = (op == JIT_OP_DIV || op == JIT_OP_REM);
+    int is_rem = (op == JIT_OP_REM || op == JIT_OP_REMU);
+    uint32_t ad = is_signed && d < 0 ? -(uint32_t)d : (uint32_t)d;
+    int k = ad ? __builtin_ctz(ad) : 0;
+    const jit_host_reg t = JIT_SCRATCH_REG;
+    uint64_t m;
+    int sh;
+
+    // The linear scan reloads a spilled dividend into t itself, and then
+    // gives the output the other scratch register: divide a copy in ho.
+    if(hx == t) {
+        p = jit_emit__mov_reg32_to_reg(p, hx, ho);
+        hx = ho;
+    }
+    if(ad == 1) {
+        if(is_rem) {
+            return jit_emit__mov_imm32_to_reg(p, 0, ho);
+        }
+        if(hx != ho) {
+            p = jit_emit__mov_reg32_to_reg(p, hx, ho);
+        }
+        return d < 0 ? jit_emit__neg_reg32(p, ho) : p;
+    }
+    if(ad == 0 || (is_signed && ad == 0x80000000u) ||
+            (!is_signed && ad > 0x80000000u)) {
+        p = jit_emit__mov_imm32_to_reg(p, d, t);
+        return jit_emit_hw_div(s, p, op, JIT_32BIT, hx, t, ho);
+    }
+
+    if((ad & (ad - 1)) == 0 && !is_signed) {
+        if(hx != ho) {
+            p = jit_emit__mov_reg32_to_reg(p, hx, ho);
+        }
+        return is_rem ? jit_emit__and_imm32_to_reg(p, (int32_t)(ad - 1), ho) :
+            jit_emit__shr_imm32_to_reg(p, k, ho);
+    }
+    if((ad & (ad - 1)) == 0) {
+        // Round towards zero: add 2^k - 1 to negative dividends first.
+        p = jit_emit__mov_reg32_to_reg(p, hx, t);
+        p = jit_emit__sar_imm32_to_reg(p, 31, t);
+        p = jit_emit__shr_imm32_to_reg(p, 32 - k, t);
+        p = jit_emit__add_reg32_to_reg(p, hx, t);
+        if(is_rem) {
+            p = jit_emit__and_imm32_to_reg(p, -(int32_t)ad, t);
+            if(hx != ho) {
+                p = jit_emit__mov_reg32_to_reg(p, hx, ho);
+            }
+            return jit_emit__sub_reg32_to_reg(p, t, ho);
+        }
+        p = jit_emit__sar_imm32_to_reg(p, k, t);
+        if(d < 0) {
+            p = jit_emit__neg_reg32(p, t);
+        }
+        return jit_emit__mov_reg32_to_reg(p, t, ho);
+    }
+
+    // The product is taken on 64 bits, with the dividend extended into the
+    // output register, where it stays for the remainder.
+    if(is_signed) {
+        jit_magic_signed(ad, 32, &m, &sh);
+        p = jit_emit__movsxd_reg32_to_reg64(p, hx, ho);
+        p = jit_emit__mov_imm32_to_reg(p, (int32_t)(uint32_t)m, t);
+        p = jit_emit__imul_reg64_to_reg(p, ho, t);
+        p = jit_emit__sar_imm32_to_reg64(p, 32 + sh, t);
+        p = jit_emit__bt_imm8_reg32(p, 31, ho);
+        p = jit_emit__grp1_imm32_to_reg(p, OX_ADC, 0, t);
+        if(d < 0) {
+            p = jit_emit__neg_reg32(p, t);
+        }
+    } else {
+        jit_magic_unsigned(ad, &m, &sh);
+        p = jit_emit__mov_reg32_to_reg(p, hx, ho);
+        p = jit_emit__mov_imm32_to_reg(p, (int32_t)(uint32_t)m, t);
+        p = jit_emit__imul_reg64_to_reg(p, ho, t);
+        if(m >> 32) {
+            // m has 33 bits: add x << 32 back in, halving both terms to
+            // stay within 64 bits.
+            p = jit_emit__shr_imm32_to_reg64(p, 1, t);
+            p = jit_emit__shl_imm32_to_reg64(p, 31, ho);
+            p = jit_emit__add_reg64_to_reg(p, ho, t);
+            p = jit_emit__shr_imm32_to_reg64(p, 31, ho);
+            sh--;
+        }
+        p = jit_emit__shr_imm32_to_reg64(p, sh, t);
+    }
+    if(is_rem) {
+        p = jit_emit__imul_imm32_reg_to_reg(p, d, t, t);
+        return jit_emit__sub_reg32_to_reg(p, t, ho);
+    }
+    return jit_emit__mov_reg32_to_reg(p, t, ho);
 }
 
-jit_error
-jit_emit_move(struct jit_state *s, struct jit_instr *i)
+/* The same on 64 bits. The magic numbers need the high half of a 128-bit
+ * product, which only the one-operand mul and imul give, in rdx:rax: those
+ * are saved as for the hardware division. */
+static uint8_t*
+jit_emit_div_imm64(struct jit_state *s, uint8_t *p, jit_op op,
+        jit_host_reg hx, int64_t d, jit_host_reg ho)
 {
-    size_t n;
-    jit_error e = JIT_SUCCESS;
-    uint8_t *begin = s->p_bufcur;
-    jit_host_reg hostreg_in = JIT_HOST_REG_INVALID;
-    jit_host_reg hostreg_out = JIT_HOST_REG_INVALID;
+    int is_signed = (op == JIT_OP_DIV || op == JIT_OP_REM);
+    int is_rem = (op == JIT_OP_REM || op == JIT_OP_REMU);
+    uint64_t ad = is_signed && d < 0 ? -(uint64_t)d : (uint64_t)d;
+    int k = ad ? __builtin_ctzll(ad) : 0;
+    const jit_host_reg t = JIT_SCRATCH_REG;
+    const uint64_t two63 = (uint64_t)1 << 63;
+    jit_host_reg x, q, o;
+    int save_ax, save_dx, sh;
+    uint64_t m;
 
-    if(i->in1_type == JIT_OPERAND_IMM) {
-        if(i->out_type == JIT_OPERAND_REG) {
-            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-            if(hostreg_out == JIT_HOST_REG_INVALID) {
-                fprintf(stderr, "error: jit reg. %d does not map to host reg.\n",
-                        i->out.reg);
+    if(hx == t) {
+        p = jit_emit__mov_reg64_to_reg(p, hx, ho);
+        hx = ho;
+    }
+    if(ad == 1) {
+        if(is_rem) {
+            return jit_emit__mov_imm32_to_reg(p, 0, ho);
+        }
+        if(hx != ho) {
+            p = jit_emit__mov_reg64_to_reg(p, hx, ho);
+        }
+        return d < 0 ? jit_emit__neg_reg64(p, ho) : p;
+    }
+    if(ad == 0 || (is_signed && ad == two63) || (!is_signed && ad > two63)) {
+        p = jit_emit__mov_imm64_to_reg(p, d, t);
+        return jit_emit_hw_div(s, p, op, JIT_64BIT, hx, t, ho);
+    }
+
+    if((ad & (ad - 1)) == 0 && !is_signed) {
+        if(hx != ho) {
+            p = jit_emit__mov_reg64_to_reg(p, hx, ho);
+        }
+        if(!is_rem) {
+            return jit_emit__shr_imm32_to_reg64(p, k, ho);
+        }
+        if(k < 32) {
+            return jit_emit__and_imm32_to_reg64(p, (int32_t)(ad - 1), ho);
+        }
+        p = jit_emit__shl_imm32_to_reg64(p, 64 - k, ho);
+        return jit_emit__shr_imm32_to_reg64(p, 64 - k, ho);
+    }
+    if((ad & (ad - 1)) == 0) {
+        p = jit_emit__mov_reg64_to_reg(p, hx, t);
+        p = jit_emit__sar_imm32_to_reg64(p, 63, t);
+        p = jit_emit__shr_imm32_to_reg64(p, 64 - k, t);
+        p = jit_emit__add_reg64_to_reg(p, hx, t);
+        if(is_rem) {
+            if(k < 32) {
+                p = jit_emit__and_imm32_to_reg64(p,
+                        (int32_t)-(int64_t)ad, t);
+            } else {
+                p = jit_emit__shr_imm32_to_reg64(p, k, t);
+                p = jit_emit__shl_imm32_to_reg64(p, k, t);
             }
-            switch(i->opsz) {
-                case JIT_32BIT:
-                    s->p_bufcur = jit_emit__mov_imm32_to_reg(s->p_bufcur,
-                            i->in1.imm32, hostreg_out);
-                    break;
-                case JIT_16BIT:
-                    s->p_bufcur = jit_emit__mov_imm16_to_reg(s->p_bufcur,
-                            i->in1.imm16, hostreg_out);
-                    break;
-                case JIT_8BIT:
-                    s->p_bufcur = jit_emit__mov_imm8_to_reg(s->p_bufcur,
-                            i->in1.imm8, hostreg_out);
-                    break;
+            if(hx != ho) {
+                p = jit_emit__mov_reg64_to_reg(p, hx, ho);
             }
+            return jit_emit__sub_reg64_to_reg(p, t, ho);
         }
-    } else if(i->in1_type == JIT_OPERAND_REG) {
-        hostreg_in = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
-        if(i->out_type == JIT_OPERAND_REG) {
-            // Move to self; we can short-circuit this
-            if(i->out.reg == i->in1.reg) {
-                goto l_exit;
-            }
-            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-            s->p_bufcur = jit_emit__mov_reg32_to_reg(s->p_bufcur,
-                    hostreg_in, hostreg_out);
-        } else if(i->out_type == JIT_OPERAND_IMMPTR) {
-            s->p_bufcur = jit_emit__mov_reg32_to_m(s->p_bufcur,
-                    hostreg_in, i->out.m32ptr);
+        p = jit_emit__sar_imm32_to_reg64(p, k, t);
+        if(d < 0) {
+            p = jit_emit__neg_reg64(p, t);
         }
-    } else if(i->in1_type == JIT_OPERAND_IMMPTR) {
-        if(i->out_type == JIT_OPERAND_REG) {
-            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-            switch(i->opsz) {
-                case JIT_32BIT:
-                    s->p_bufcur = jit_emit__mov_m32_to_reg(s->p_bufcur,
-                            i->in1.m32ptr, hostreg_out);
-                    break;
-                case JIT_16BIT:
-                    s->p_bufcur = jit_emit__mov_m16_to_reg(s->p_bufcur,
-                            i->in1.m32ptr, hostreg_out);
-                    break;
-                case JIT_8BIT:
-                    s->p_bufcur = jit_emit__mov_m8_to_reg(s->p_bufcur,
-                            i->in1.m8ptr, hostreg_out);
-                    break;
-            }
+        return jit_emit__mov_reg64_to_reg(p, t, ho);
+    }
+
+    // The dividend stays where it is, or in t if it is in rax or rdx.
+    save_ax = ho != rax && !jit_host_reg_unused(s, rax);
+    save_dx = ho != rdx && !jit_host_reg_unused(s, rdx);
+    if(save_ax) p = jit_emit__push_reg(p, rax);
+    if(save_dx) p = jit_emit__push_reg(p, rdx);
+    x = hx;
+    if(hx == rax || hx == rdx) {
+        p = jit_emit__mov_reg64_to_reg(p, hx, t);
+        x = t;
+    }
+    q = rdx;
+    if(is_signed) {
+        jit_magic_signed(ad, 64, &m, &sh);
+        p = jit_emit__mov_imm64_to_reg(p, (int64_t)m, rax);
+        p = jit_emit__imul_wide_reg64(p, x);
+        if(m & two63) {
+            p = jit_emit__add_reg64_to_reg(p, x, rdx);
         }
-    } else if(i->in1_type == JIT_OPERAND_REGPTR) {
-        if(i->out_type == JIT_OPERAND_REG) {
-            struct jit_host_ptr hp = jit_get_host_regptr(s, 
-                    &i->in1.regptr);
-            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-            s->p_bufcur = jit_emit__mov_regptr32_to_reg(s->p_bufcur,
-                    &hp, hostreg_out);
+        if(sh) {
+            p = jit_emit__sar_imm32_to_reg64(p, sh, rdx);
         }
-    } else if(i->in1_type == JIT_OPERAND_IMMDISP) {
-        if(i->out_type == JIT_OPERAND_REG) {
-            hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-            s->p_bufcur = jit_emit__lea_immdisp32_to_reg(s->p_bufcur,
-                    i->in1.ptr, hostreg_out);
+        p = jit_emit__mov_reg64_to_reg(p, x, rax);
+        p = jit_emit__shr_imm32_to_reg64(p, 63, rax);
+        p = jit_emit__add_reg64_to_reg(p, rax, rdx);
+        if(d < 0) {
+            p = jit_emit__neg_reg64(p, rdx);
+        }
+    } else {
+        int add = jit_magic_unsigned64(ad, &m, &sh);
+        p = jit_emit__mov_imm64_to_reg(p, (int64_t)m, rax);
+        p = jit_emit__mul_wide_reg64(p, x);
+        if(add) {
+            p = jit_emit__mov_reg64_to_reg(p, x, rax);
+            p = jit_emit__sub_reg64_to_reg(p, rdx, rax);
+            p = jit_emit__shr_imm32_to_reg64(p, 1, rax);
+            p = jit_emit__add_reg64_to_reg(p, rdx, rax);
+            q = rax;
+            sh--;
+        }
+        if(sh) {
+            p = jit_emit__shr_imm32_to_reg64(p, sh, q);
         }
     }
+    if(is_rem) {
+        o = (q == rax) ? rdx : rax;
+        if(d >= INT32_MIN && d <= INT32_MAX) {
+            p = jit_emit__imul_imm32_reg64_to_reg(p, (int32_t)d, q, q);
+        } else {
+            p = jit_emit__mov_imm64_to_reg(p, d, o);
+            p = jit_emit__imul_reg64_to_reg(p, o, q);
+        }
+        p = jit_emit__mov_reg64_to_reg(p, x, o);
+        p = jit_emit__sub_reg64_to_reg(p, q, o);
+        q = o;
+    }
+    if(ho != q) {
+        p = jit_emit__mov_reg64_to_reg(p, q, ho);
+    }
+    if(save_dx) p = jit_emit__pop_reg(p, rdx);
+    if(save_ax) p = jit_emit__pop_reg(p, rax);
+    return p;
+}
 
-    printf("> mov:\t");
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
-
-    s->blk_nb += (s->p_bufcur - begin);
+/* ho = hx * c on opsz bytes: shifts and lea where they do, imul otherwise.
+ * Below 32 bits, the low bits of the 32-bit product are the same. */
+static uint8_t*
+jit_emit_mul_imm(uint8_t *p, size_t opsz, jit_host_reg hx, int64_t c,
+        jit_host_reg ho)
+{
+    int w = (opsz == JIT_64BIT);
+    uint64_t uc = w ? (uint64_t)c : (uint32_t)c;
+    uint64_t odd = uc ? uc >> __builtin_ctzll(uc) : 0;
+    int k = uc ? __builtin_ctzll(uc) : 0;
+    struct jit_host_ptr hp;
 
-l_exit:
-    return e;
+    if(uc == 0) {
+        return jit_emit__mov_imm32_to_reg(p, 0, ho);
+    }
+    if(odd == 1 || c == -1) {
+        if(hx != ho) {
+            p = (w ? jit_emit__mov_reg64_to_reg :
+                    jit_emit__mov_reg32_to_reg)(p, hx, ho);
+        }
+        if(c == -1) {
+            return (w ? jit_emit__neg_reg64 : jit_emit__neg_reg32)(p, ho);
+        }
+        return !k ? p : w ? jit_emit__shl_imm32_to_reg64(p, k, ho) :
+            jit_emit__shl_imm32_to_reg(p, k, ho);
+    }
+    if((odd == 3 || odd == 5 || odd == 9) && hx != rsp) {
+        hp.base = hp.index = hx;
+        hp.scale = __builtin_ctzll(odd - 1);
+        hp.offset = 0;
+        p = (w ? jit_emit__lea_regptr64_to_reg :
+                jit_emit__lea_regptr32_to_reg)(p, &hp, ho);
+        return !k ? p : w ? jit_emit__shl_imm32_to_reg64(p, k, ho) :
+            jit_emit__shl_imm32_to_reg(p, k, ho);
+    }
+    if(!w) {
+        return jit_emit__imul_imm32_reg_to_reg(p, (int32_t)c, hx, ho);
+    }
+    if(c >= INT32_MIN && c <= INT32_MAX) {
+        return jit_emit__imul_imm32_reg64_to_reg(p, (int32_t)c, hx, ho);
+    }
+    if(hx == ho) {
+        p = jit_emit__mov_imm64_to_reg(p, c, JIT_SCRATCH_REG);
+        return jit_emit__imul_reg64_to_reg(p, JIT_SCRATCH_REG, ho);
+    }
+    p = jit_emit__mov_imm64_to_reg(p, c, ho);
+    return jit_emit__imul_reg64_to_reg(p, hx, ho);
 }
 
 jit_error
-jit_emit_arith(struct jit_state *s, struct jit_instr *i)
+jit_emit_muldiv(struct jit_state *s, struct jit_instr *i)
 {
-    size_t n;
     jit_error e = JIT_SUCCESS;
     uint8_t *begin = s->p_bufcur;
     jit_host_reg hostreg_in1 = JIT_HOST_REG_INVALID;
     jit_host_reg hostreg_in2 = JIT_HOST_REG_INVALID;
     jit_host_reg hostreg_out = JIT_HOST_REG_INVALID;
+    jit_reg_access a = JIT_ACCESS_W;
+    pfn_e_r_to_r mov = (i->opsz == JIT_64BIT) ? jit_emit__mov_reg64_to_reg :
+        jit_emit__mov_reg32_to_reg;
+    pfn_e_r_to_r imul = (i->opsz == JIT_64BIT) ?
+        jit_emit__imul_reg64_to_reg : jit_emit__imul_reg32_to_reg;
+    int is_signed = (i->op == JIT_OP_DIV || i->op == JIT_OP_REM);
+    int64_t d;
 
-    if(i->out_type == JIT_OPERAND_REG) {
-        hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
-        if(i->in2_type == JIT_OPERAND_REG) {
-            hostreg_in2 = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
-            if(i->in1_type == JIT_OPERAND_REG) {
-                jit_host_reg hr_in = JIT_HOST_REG_INVALID;
-                hostreg_in1 = jit_get_mapped_host_reg(s, i->in1.reg,
-                        JIT_ACCESS_R);
-                
-                if(hostreg_in1 != hostreg_out && hostreg_in2 != hostreg_out) {
-                    s->p_bufcur = jit_emit__mov_reg32_to_reg(s->p_bufcur,
-                            hostreg_in1, hostreg_out);
-                    hr_in = hostreg_in2;
-                } else if(hostreg_in1 == hostreg_out) {
-                    hr_in = hostreg_in2;
-                } else if(hostreg_in2 == hostreg_out) {
-                    hr_in = hostreg_in1;
-                }
-                s->p_bufcur = g_e_r_to_r[i->op](s->p_bufcur,
-                        hr_in, hostreg_out);
-            } else if(i->in1_type == JIT_OPERAND_IMM) {
-                switch(i->opsz) {
-                    case JIT_32BIT:
-                        s->p_bufcur = g_e_imm32_to_r[i->op](s->p_bufcur,
-                                i->in1.imm32, hostreg_out);
-                        break;
-                    case JIT_16BIT:
-                        s->p_bufcur = g_e_imm16_to_r[i->op](s->p_bufcur,
-                                i->in1.imm16, hostreg_out);
-                        break;
-                    case JIT_8BIT:
-                        s->p_bufcur = g_e_imm8_to_r[i->op](s->p_bufcur,
-                                i->in1.imm8, hostreg_out);
-                        break;
+    if(i->out_type != JIT_OPERAND_REG || i->in2_type != JIT_OPERAND_REG ||
+            (i->in1_type != JIT_OPERAND_REG &&
+             i->in1_type != JIT_OPERAND_IMM)) {
+        JIT_TRACE(s, JIT_TRACE_ERROR,
+                "error: no form of op %d for these operands\n", i->op);
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    if((i->in1_type == JIT_OPERAND_REG && i->in1.reg == i->out.reg) ||
+            i->in2.reg == i->out.reg) {
+        a = JIT_ACCESS_RW;
+    }
+    hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, a);
+    hostreg_in2 = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
+
+    if(i->in1_type == JIT_OPERAND_IMM) {
+        // out = in2 op imm.
+        d = jit_instr_imm(i);
+        if(i->op == JIT_OP_MUL) {
+            s->p_bufcur = jit_emit_mul_imm(s->p_bufcur, i->opsz, hostreg_in2,
+                    d, hostreg_out);
+        } else if(i->opsz == JIT_64BIT) {
+            s->p_bufcur = jit_emit_div_imm64(s, s->p_bufcur, i->op,
+                    hostreg_in2, d, hostreg_out);
+        } else {
+            // Narrower operations divide the extended dividend, in the
+            // output, by the extended divisor.
+            if(i->opsz < JIT_32BIT) {
+                if(!is_signed) {
+                    d &= (1 << (8 * i->opsz)) - 1;
                 }
+                s->p_bufcur = g_e_r_to_r_ext[is_signed][
+                    jit_opsz_index(i->opsz)](s->p_bufcur, hostreg_in2,
+                    hostreg_out);
+                hostreg_in2 = hostreg_out;
             }
+            s->p_bufcur = jit_emit_div_imm(s, s->p_bufcur, i->op,
+                    hostreg_in2, (int32_t)d, hostreg_out);
         }
+        goto l_done;
     }
 
-    printf("> %s:\t", g_opsz[i->op]);
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
+    hostreg_in1 = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+    if(i->op != JIT_OP_MUL) {
+        s->p_bufcur = jit_emit_hw_div(s, s->p_bufcur, i->op, i->opsz,
+                hostreg_in1, hostreg_in2, hostreg_out);
+    } else if(hostreg_out == hostreg_in1) {
+        s->p_bufcur = imul(s->p_bufcur, hostreg_in2, hostreg_out);
+    } else if(hostreg_out == hostreg_in2) {
+        s->p_bufcur = imul(s->p_bufcur, hostreg_in1, hostreg_out);
+    } else {
+        s->p_bufcur = mov(s->p_bufcur, hostreg_in1, hostreg_out);
+        s->p_bufcur = imul(s->p_bufcur, hostreg_in2, hostreg_out);
+    }
 
+l_done:
     s->blk_nb += (s->p_bufcur - begin);
 
 l_exit:
@@ -458,16 +2665,121 @@ jit_emit_call(struct jit_state *s, struct jit_instr *i)
 {
     jit_error e = JIT_SUCCESS;
     uint8_t *begin = s->p_bufcur;
-    size_t n;
     
+    s->p_emitter->has_call = 1;
     if(i->in1_type == JIT_OPERAND_IMMPTR) {
-        s->p_bufcur = jit_emit__call_m32(s->p_bufcur, i->in1.m32ptr);
+        if(jit_rip_reachable(s, i->in1.ptr)) {
+            s->p_bufcur = jit_emit__call_m32(s->p_bufcur,
+                    jit_rip_target(s, i->in1.ptr));
+            jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+        } else {
+            s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur,
+                    (int64_t)i->in1.ptr, JIT_SCRATCH_REG);
+            s->p_bufcur = jit_emit__call_reg(s->p_bufcur, JIT_SCRATCH_REG);
+        }
+    }
+
+
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_emit_cmp(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_in1, hostreg_in2;
+
+    if(jit_is_mem(i->in1_type) || jit_is_mem(i->in2_type)) {
+        e = jit_emit_cmp_mem(s, i);
+        goto l_done;
+    }
+    if(i->in2_type != JIT_OPERAND_REG) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    hostreg_in2 = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
+    if(i->in1_type == JIT_OPERAND_REG) {
+        hostreg_in1 = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+        s->p_bufcur = jit_e_r_to_r(JIT_OP_CMP, i->opsz)(s->p_bufcur,
+                hostreg_in2, hostreg_in1);
+    } else if(i->in1_type == JIT_OPERAND_IMM) {
+        jit_emit_imm_op(s, JIT_OP_CMP, i->opsz, jit_instr_imm(i), hostreg_in2);
+    } else {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+l_done:
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* Emit a jmp (cc < 0) or jcc to label t. Backward jumps know their target
+ * already; forward ones are patched by jit_finish_emit. */
+static jit_error
+jit_emit_branch(struct jit_state *s, int cc, jit_label t)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_branches *b = em->branches;
+    uint8_t *begin = s->p_bufcur;
+    int rel8, size;
+    int64_t d = 0;
+
+    if(!JIT_HAS_BRANCHES(em) || em->ni >= b->ninstrs || t > b->ninstrs) {
+        JIT_TRACE(s, JIT_TRACE_ERROR,
+                "error: jump to label %zu without jit_prepare_emit\n", t);
+        FAILPATH(JIT_ERROR_BAD_LABEL);
+    }
+
+    // The values in registers go back to their slots, where the target
+    // expects them. The flags survive the movs. The linear scan keeps
+    // values live across jumps in one place instead.
+    if(!JIT_LINSCAN_ON(s)) {
+        jit_flush_regs(s);
+    }
+
+    rel8 = b->jshort[em->ni];
+    if(t <= em->ni) {
+        size = rel8 ? 2 : (cc < 0 ? 5 : 6);
+        d = (int64_t)b->lab_off[t] - (s->p_bufcur - s->p_bufstart + size);
+        if(rel8 && (d < INT8_MIN || d > INT8_MAX) && !b->relaxing) {
+            // The layout moved from what the relaxation planned.
+            rel8 = 0;
+            d -= (cc < 0 ? 5 : 6) - size;
+        }
+    } else {
+        if(em->njump_patches == em->njump_patches_alloc) {
+            uint32_t n = em->njump_patches_alloc ?
+                2 * em->njump_patches_alloc : 8;
+            struct jit_jump_patch *p = realloc(em->jump_patches,
+                    n * sizeof(struct jit_jump_patch));
+            if(p == NULL) {
+                FAILPATH(JIT_ERROR_MALLOC);
+            }
+            em->jump_patches = p;
+            em->njump_patches_alloc = n;
+        }
     }
 
-    printf("> call:\t");
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
+    if(cc < 0) {
+        s->p_bufcur = rel8 ? jit_emit__jmp_rel8(s->p_bufcur, (int8_t)d) :
+            jit_emit__jmp_rel32(s->p_bufcur, (int32_t)d);
+    } else {
+        s->p_bufcur = rel8 ? jit_emit__jcc_rel8(s->p_bufcur, cc, (int8_t)d) :
+            jit_emit__jcc_rel32(s->p_bufcur, cc, (int32_t)d);
+    }
+    if(t > em->ni) {
+        struct jit_jump_patch *jp = &em->jump_patches[em->njump_patches++];
+        jp->off = (size_t)(s->p_bufcur - s->p_bufstart) -
+            (rel8 ? 1 : sizeof(int32_t));
+        jp->target = t;
+        jp->rel8 = rel8;
+    }
 
     s->blk_nb += (s->p_bufcur - begin);
 
@@ -478,28 +2790,270 @@ l_exit:
 jit_error
 jit_emit_jump(struct jit_state *s, struct jit_instr *i)
 {
-    return JIT_SUCCESS;
+    return jit_emit_branch(s, -1, i->in1.label);
+}
+
+/* The condition code of the condition in in2, or -1 if it is not one. */
+static int
+jit_instr_cc(struct jit_state *s, struct jit_instr *i)
+{
+    if(i->in2_type != JIT_OPERAND_IMM || i->in2.imm32 < 0 ||
+            i->in2.imm32 >= JIT_NUM_CONDS) {
+        JIT_TRACE(s, JIT_TRACE_ERROR, "error: bad condition %d\n",
+                i->in2.imm32);
+        return -1;
+    }
+    return g_condmap[i->in2.imm32];
 }
 
 jit_error
 jit_emit_jump_if(struct jit_state *s, struct jit_instr *i)
 {
-    return JIT_SUCCESS;
+    int cc = jit_instr_cc(s, i);
+
+    if(cc < 0) {
+        return JIT_ERROR_UNKNOWN;
+    }
+    return jit_emit_branch(s, cc, i->in1.label);
 }
 
+/* setcc, then zero-extended past the low byte: the flags cannot be cleared
+ * ahead of the comparison that sets them. */
 jit_error
-jit_emit_ret(struct jit_state *s, struct jit_instr *i)
+jit_emit_set_if(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_out;
+    int cc = jit_instr_cc(s, i);
+
+    if(cc < 0 || i->out_type != JIT_OPERAND_REG) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_W);
+    s->p_bufcur = jit_emit__setcc_reg8(s->p_bufcur, cc, hostreg_out);
+    if(i->opsz != JIT_8BIT) {
+        s->p_bufcur = jit_emit__movzx_reg8_to_reg(s->p_bufcur, hostreg_out,
+                hostreg_out);
+    }
+
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* cmovcc from a register, memory, or an immediate put in the scratch
+ * register, with a mov that leaves the flags alone. cmovcc has no 8-bit
+ * form, and the 32-bit one would read past a byte in memory: that byte is
+ * loaded into a scratch register first too, one the output is not in. */
+jit_error
+jit_emit_move_if(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_in = JIT_HOST_REG_INVALID, hostreg_out;
+    struct jit_mem_opnd mo;
+    int cc = jit_instr_cc(s, i);
+    int64_t imm;
+
+    if(cc < 0 || i->out_type != JIT_OPERAND_REG) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    if(i->in1_type == JIT_OPERAND_REG) {
+        hostreg_in = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+    }
+    hostreg_out = jit_get_mapped_host_reg(s, i->out.reg, JIT_ACCESS_RW);
+
+    switch(i->in1_type) {
+        case JIT_OPERAND_REG:
+            break;
+        case JIT_OPERAND_IMM:
+            imm = jit_instr_imm(i);
+            hostreg_in = JIT_SCRATCH_REG;
+            if(i->opsz == JIT_64BIT && (imm < INT32_MIN || imm > INT32_MAX)) {
+                s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, imm,
+                        hostreg_in);
+            } else if(i->opsz == JIT_64BIT && imm < 0) {
+                s->p_bufcur = jit_emit__mov_imm32_to_reg64(s->p_bufcur,
+                        (int32_t)imm, hostreg_in);
+            } else {
+                s->p_bufcur = jit_emit__mov_imm32_to_reg(s->p_bufcur,
+                        (int32_t)imm, hostreg_in);
+            }
+            break;
+        case JIT_OPERAND_IMMPTR:
+        case JIT_OPERAND_REGPTR:
+            e = jit_get_host_mem(s, i->in1_type, &i->in1, hostreg_out,
+                    JIT_HOST_REG_INVALID, &mo);
+            if(FAILURE(e)) {
+                goto l_exit;
+            }
+            if(i->opsz == JIT_8BIT) {
+                hostreg_in = jit_scratch_other(hostreg_out);
+                jit_emit_load_mem(s, JIT_8BIT, &mo, hostreg_in);
+                break;
+            }
+            if(mo.m != NULL) {
+                s->p_bufcur = jit_emit__cmovcc_m_to_reg(s->p_bufcur,
+                        i->opsz, cc, jit_rip_target(s, mo.m), hostreg_out);
+                jit_add_reloc(s, s->p_bufcur - sizeof(int32_t));
+            } else {
+                s->p_bufcur = jit_emit__cmovcc_regptr_to_reg(s->p_bufcur,
+                        i->opsz, cc, &mo.hp, hostreg_out);
+            }
+            goto l_done;
+        default:
+            FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    s->p_bufcur = jit_emit__cmovcc_reg_to_reg(s->p_bufcur, i->opsz, cc,
+            hostreg_in, hostreg_out);
+
+l_done:
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* Recompute the guest flags from the copies of the operands: a cmp for SUB,
+ * and for the others the operation itself on the scratch register. */
+jit_error
+jit_emit_flags(struct jit_state *s, struct jit_instr *i)
 {
     jit_error e = JIT_SUCCESS;
     uint8_t *begin = s->p_bufcur;
+    jit_host_reg hostreg_a, hostreg_b;
+    jit_op op = (jit_op)i->out.imm32;
+
+    if(i->in1_type != JIT_OPERAND_REG || i->in2_type != JIT_OPERAND_REG ||
+            i->out_type != JIT_OPERAND_IMM) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    hostreg_a = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+    hostreg_b = jit_get_mapped_host_reg(s, i->in2.reg, JIT_ACCESS_R);
+
+    switch(op) {
+        case JIT_OP_SUB:
+            s->p_bufcur = jit_e_r_to_r(JIT_OP_CMP, i->opsz)(s->p_bufcur,
+                    hostreg_b, hostreg_a);
+            break;
+        case JIT_OP_ADD:
+        case JIT_OP_AND:
+        case JIT_OP_OR:
+        case JIT_OP_XOR:
+            // Commutative, so either copy may already be in the scratch
+            // register after a reload.
+            if(hostreg_b == JIT_SCRATCH_REG) {
+                hostreg_b = hostreg_a;
+            } else if(hostreg_a != JIT_SCRATCH_REG) {
+                s->p_bufcur = jit_e_r_to_r(JIT_OP_MOVE, JIT_64BIT)(
+                        s->p_bufcur, hostreg_a, JIT_SCRATCH_REG);
+            }
+            s->p_bufcur = jit_e_r_to_r(op, i->opsz)(s->p_bufcur, hostreg_b,
+                    JIT_SCRATCH_REG);
+            break;
+        default:
+            FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+
+    s->blk_nb += (s->p_bufcur - begin);
+
+l_exit:
+    return e;
+}
+
+/* Put back the callee-saved registers and the stack pointer, as on entry. */
+static void
+jit_emit_epilogue(struct jit_state *s)
+{
     size_t n;
 
+    for(n = 0; n < NUM_HOST_REGS; n++) {
+        if(s->p_emitter->callee_slot[n] >= 0) {
+            jit_emit_reload(s, s->p_emitter->callee_slot[n], n);
+        }
+    }
+    jit_emit_frame_adjust(s, 1);
+    if(JIT_LINSCAN_ON(s)) {
+        jit_linscan_epilogue(s);
+    }
+}
+
+jit_error
+jit_emit_ret(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur;
+
+    jit_emit_epilogue(s);
     s->p_bufcur = jit_emit__ret(s->p_bufcur);
 
-    printf("> ret:\t");
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
+    s->blk_nb += (s->p_bufcur - begin);
+
+    return e;
+}
+
+/* The epilogue, then for an immediate address a jmp to the next instruction
+ * (see jit_add_exit) and a return of the address. A register's address goes
+ * to rax first, and is looked up in s->p_exit_table:
+ *     mov r11, rax; shr r11, JIT_BLOCK_HASH_SHIFT; xor r11, rax
+ *     and r11, mask; shl r11, 4
+ *     mov r10, table; add r11, r10; cmp rax, [r11]; jne 1f; jmp [r11 + 8]
+ * 1:  ret
+ * The next block starts with its own prologue, on the stack as it was on
+ * entry to this one. */
+jit_error
+jit_emit_exit(struct jit_state *s, struct jit_instr *i)
+{
+    jit_error e = JIT_SUCCESS;
+    uint8_t *begin = s->p_bufcur, *jne;
+    struct jit_host_ptr rp = {
+        JIT_SCRATCH_REG, JIT_HOST_REG_INVALID, 0, 0,
+    };
+    jit_host_reg hostreg;
+
+    if(i->in1_type == JIT_OPERAND_REG) {
+        hostreg = jit_get_mapped_host_reg(s, i->in1.reg, JIT_ACCESS_R);
+        if(hostreg != rax) {
+            s->p_bufcur = jit_emit__mov_reg64_to_reg(s->p_bufcur, hostreg,
+                    rax);
+        }
+    } else if(i->in1_type != JIT_OPERAND_IMM) {
+        FAILPATH(JIT_ERROR_UNKNOWN);
+    }
+    jit_emit_epilogue(s);
+
+    if(i->in1_type == JIT_OPERAND_IMM) {
+        s->p_bufcur = jit_emit__jmp_rel32(s->p_bufcur, 0);
+        e = jit_add_exit(s, s->p_bufcur - sizeof(int32_t),
+                (uint64_t)i->in1.imm64);
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+        s->p_bufcur = jit_emit__mov_imm64_to_reg(s->p_bufcur, i->in1.imm64,
+                rax);
+    } else if(s->p_exit_table != NULL) {
+        uint8_t *p = s->p_bufcur;
+        p = jit_emit__mov_reg64_to_reg(p, rax, JIT_SCRATCH_REG);
+        p = jit_emit__shr_imm32_to_reg64(p, JIT_BLOCK_HASH_SHIFT,
+                JIT_SCRATCH_REG);
+        p = jit_emit__xor_reg64_to_reg(p, rax, JIT_SCRATCH_REG);
+        p = jit_emit__and_imm32_to_reg64(p, (int32_t)s->exit_table_mask,
+                JIT_SCRATCH_REG);
+        p = jit_emit__shl_imm32_to_reg64(p, 4, JIT_SCRATCH_REG);
+        p = jit_emit__mov_imm64_to_reg(p, (int64_t)(uintptr_t)s->p_exit_table,
+                JIT_SCRATCH_REG2);
+        p = jit_emit__add_reg64_to_reg(p, JIT_SCRATCH_REG2, JIT_SCRATCH_REG);
+        p = jit_emit__alu_regptr(p, JIT_64BIT, 0x3b, rax, &rp);
+        jne = p;
+        p = jit_emit__jcc_rel8(p, CC_NE, 0);
+        rp.offset = sizeof(uint64_t);
+        p = jit_emit__jmp_regptr(p, &rp);
+        jne[1] = (uint8_t)(p - (jne + 2));
+        s->p_bufcur = p;
+    }
+    s->p_bufcur = jit_emit__ret(s->p_bufcur);
 
     s->blk_nb += (s->p_bufcur - begin);
 
@@ -512,16 +3066,12 @@ jit_emit_push(struct jit_state *s, struct jit_instr *i)
 {
     jit_error e = JIT_SUCCESS;
     uint8_t *begin = s->p_bufcur;
-    size_t n;
     jit_host_reg hostreg = jit_get_mapped_host_reg(s, i->in1.reg,
             JIT_ACCESS_R);
 
     s->p_bufcur = jit_emit__push_reg(s->p_bufcur, hostreg);
+    s->p_emitter->push_depth += 8;
 
-    printf("> push:\t");
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
 
     s->blk_nb += (s->p_bufcur - begin);
 
@@ -533,16 +3083,12 @@ jit_emit_pop(struct jit_state *s, struct jit_instr *i)
 {
     jit_error e = JIT_SUCCESS;
     uint8_t *begin = s->p_bufcur;
-    size_t n;
     jit_host_reg hostreg = jit_get_mapped_host_reg(s, i->in1.reg,
             JIT_ACCESS_W);
 
     s->p_bufcur = jit_emit__pop_reg(s->p_bufcur, hostreg);
+    s->p_emitter->push_depth -= 8;
 
-    printf("> pop:\t");
-    for(n = 0; n < (s->p_bufcur - begin); n++)
-        printf("%02x ", begin[n]);
-    printf("\n");
 
     s->blk_nb += (s->p_bufcur - begin);
 
@@ -29,13 +29,26 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libjit.h"
 
 #define FAILPATH(err) {e=(err);goto l_exit;}
 
 #define NUM_HOST_REGS 16
-#define NUM_SPILL_SLOTS 32
+
+/* Upper bound on the code a single jit instruction expands to, spill and
+ * restore code included. */
+#define JIT_MAX_INSTR_BYTES 512
+
+/* Host register reserved for the emitter's own use, e.g. to hold absolute
+ * addresses that are out of reach of a RIP-relative displacement. */
+#define JIT_SCRATCH_REG r11
+#define JIT_REG_SCRATCH ((jit_reg)-2)
+
+/* Second scratch register, kept free by the linear scan allocator to operate
+ * on spilled values. */
+#define JIT_SCRATCH_REG2 r10
 
 enum e_jit_host_reg {
     JIT_HOST_REG_INVALID = -1,
@@ -45,6 +58,13 @@ enum e_jit_host_reg {
 
 typedef enum e_jit_host_reg jit_host_reg;
 
+/* System V calling convention: registers a callee may clobber (bar the two
+ * scratch registers) and those it must preserve. */
+#define JIT_CALLER_SAVED ((1 << rax) | (1 << rcx) | (1 << rdx) | \
+        (1 << rsi) | (1 << rdi) | (1 << r8) | (1 << r9))
+#define JIT_CALLEE_SAVED ((1 << rbx) | (1 << rbp) | (1 << r12) | \
+        (1 << r13) | (1 << r14) | (1 << r15))
+
 enum e_jit_reg_access {
     JIT_ACCESS_R, JIT_ACCESS_W, JIT_ACCESS_RW,
 };
@@ -53,14 +73,154 @@ typedef enum e_jit_reg_access jit_reg_access;
 
 typedef int32_t jit_reg_age;
 
+/* Register operands of an instruction, as seen by the linear scan allocator:
+ * the three operand slots, then the base and index of a register pointer. */
+enum e_jit_linscan_opnd {
+    JIT_LS_IN1 = 0,
+    JIT_LS_IN2,
+    JIT_LS_OUT,
+    JIT_LS_BASE,
+    JIT_LS_INDEX,
+    JIT_LS_NOPNDS,
+};
+
+/* The result of jit_linear_scan, indexed by live range. A range lives in its
+ * host register, or in its spill slot from instruction spill_at onwards
+ * (from its start if host is invalid). */
+struct jit_linscan {
+    int8_t *host;
+    uint32_t *spill_at;
+    int32_t *slot;
+    uint32_t nranges_alloc;
+
+    /* Live range of each register operand of each instruction, or
+     * JIT_LIVE_NONE. */
+    uint32_t *opnd;
+    uint32_t nopnd_alloc;
+    uint32_t ninstrs;
+
+    /* Ranges moved to their slot midway, by increasing spill_at. */
+    uint32_t *splits;
+    uint32_t nsplits;
+
+    /* Callee-saved registers handed out, saved on entry. */
+    uint32_t saved;
+
+    /* Spill slots used, and whether the block makes calls. */
+    uint32_t nslots;
+    int has_call;
+};
+
+/* Where an operand of the instruction being emitted is to be found. */
+struct jit_linscan_loc {
+    jit_reg reg;
+    jit_host_reg host;
+    /* Spill slot the value lives in, or -1 if it is in the register. */
+    int32_t slot;
+    int written;
+};
+
+/* Whether registers come from jit_linear_scan rather than on the fly. */
+#define JIT_LINSCAN_ON(s) ((s)->p_emitter->linscan_on)
+
+/* Jumps of the block, indexed by instruction, and kept across resets like
+ * the linear scan result. Label n is the start of instruction n, after any
+ * code that only the fall-through path runs. */
+struct jit_branches {
+    /* Whether anything jumps to instruction n. */
+    uint8_t *target;
+    /* Whether the flags after instruction n may be read (by a JUMP_IF). */
+    uint8_t *flags_live;
+    /* Whether the jump at instruction n uses a rel8 displacement. */
+    uint8_t *jshort;
+    /* Offset of label n in the block, once emitted. */
+    uint32_t *lab_off;
+    uint32_t nalloc;
+    uint32_t ninstrs;
+    /* Whether the block has jumps at all, and whether they are being sized
+     * rather than emitted. */
+    int any;
+    int relaxing;
+};
+
+#define JIT_HAS_BRANCHES(em) ((em)->branches != NULL && (em)->branches->any)
+
+/* Whether shorter encodings may be picked from the context. */
+#define JIT_PEEPHOLE_ON(s) (!((s)->flags & JIT_FLAG_NO_PEEPHOLE))
+
+/* A forward jump whose displacement is filled in by jit_finish_emit. */
+struct jit_jump_patch {
+    size_t off;
+    jit_label target;
+    int rel8;
+};
+
 /* The x86_64 variant of the emitter reference in jit_state. */
 struct jit_emitter {
     jit_reg host_regmap[NUM_HOST_REGS];
     jit_reg_age host_agemap[NUM_HOST_REGS];
     uint32_t host_busy;
-
-    int64_t spill_vreg[NUM_SPILL_SLOTS];
-    uint32_t spill_busy;
+    /* Host registers mapped to nothing, rsp excepted, one bit each. */
+    uint32_t host_free;
+
+    /* The reverse of host_regmap, indexed by virtual register: its host
+     * register (or JIT_HOST_REG_INVALID), and its spill slot (or -1) with
+     * the age-based allocator. */
+    int8_t *vreg_host;
+    int32_t *vreg_slot;
+    uint32_t nvreg_alloc;
+
+    /* Index of the instruction being emitted. */
+    uint32_t ni;
+    /* The last register to register move, if nothing was emitted since:
+     * where it ends in the block (or SIZE_MAX), its registers and size. */
+    size_t mov_end;
+    jit_host_reg mov_src;
+    jit_host_reg mov_dst;
+    size_t mov_opsz;
+
+    /* Whether the host has BMI2 (for shlx and co.). */
+    int has_bmi2;
+
+    /* Stack frame, holding 8-byte spill slots addressed from rsp. push_depth
+     * is what PUSH instructions have added below them since. frame_size is
+     * -1 until known, in which case the prologue and epilogues carry a
+     * placeholder, at the offsets in frame_patches. */
+    uint32_t nslots;
+    int32_t push_depth;
+    int has_call;
+    int32_t frame_size;
+    size_t *frame_patches;
+    uint32_t nframe_patches;
+    uint32_t nframe_patches_alloc;
+
+    /* Age-based allocator: slots free for reuse, and whether s->p_live
+     * tells which values are still needed. */
+    int32_t *free_slots;
+    uint32_t nfree_slots;
+    uint32_t nfree_slots_alloc;
+    int live;
+    /* Slot holding the caller's value of each callee-saved register the
+     * age-based allocator has taken, or -1. */
+    int32_t callee_slot[NUM_HOST_REGS];
+
+    /* Jump targets, and the forward jumps still to resolve. */
+    struct jit_branches *branches;
+    struct jit_jump_patch *jump_patches;
+    uint32_t njump_patches;
+    uint32_t njump_patches_alloc;
+
+    /* Linear scan allocation of the block (kept across resets), whether it
+     * is in use, the next split to perform, and the current instruction's
+     * operands. */
+    struct jit_linscan *linscan;
+    int linscan_on;
+    uint32_t nsplit;
+    struct jit_linscan_loc locs[JIT_LS_NOPNDS];
+    uint32_t nlocs;
+    /* Whether the index of the instruction's register pointer was added into
+     * its base, for want of scratch registers. */
+    int index_folded;
 };
 
 /* A variant of jit_pointer using host registers. */
@@ -98,6 +258,22 @@ struct jit_host_ptr {
 #define OX_XOR 6
 #define OX_CMP 7
 
+/* Condition codes, as in Jcc and SETcc. */
+#define CC_O  0x0
+#define CC_NO 0x1
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_S  0x8
+#define CC_NS 0x9
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
 #define OX_ROL 0
 #define OX_ROR 1
 #define OX_RCL 2
@@ -113,6 +289,10 @@ typedef uint8_t* (*pfn_e_imm32_r_to_r)(uint8_t *p, int32_t imm, jit_host_reg rin
 typedef uint8_t* (*pfn_e_imm32_to_r)(uint8_t *p, int32_t imm, jit_host_reg rout);
 typedef uint8_t* (*pfn_e_imm16_to_r)(uint8_t *p, int16_t imm, jit_host_reg rout);
 typedef uint8_t* (*pfn_e_imm8_to_r)(uint8_t *p, int8_t imm, jit_host_reg rout);
+typedef uint8_t* (*pfn_e_m_to_r)(uint8_t *p, int32_t *m, jit_host_reg rout);
+typedef uint8_t* (*pfn_e_ind_to_r)(uint8_t *p, jit_host_reg base, jit_host_reg rout);
+typedef uint8_t* (*pfn_e_regptr_to_r)(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg rout);
+typedef uint8_t* (*pfn_e_r_to_regptr)(uint8_t *p, jit_host_reg rin, struct jit_host_ptr *rp);
 
 
 uint8_t* jit_emit__mov_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg reg);
@@ -126,7 +306,55 @@ uint8_t* jit_emit__mov_m16_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg);
 uint8_t* jit_emit__mov_m8_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg);
 uint8_t* jit_emit__lea_immdisp32_to_reg(uint8_t *p, void *m, jit_host_reg reg);
 uint8_t* jit_emit__mov_regptr32_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__rex_regptr(uint8_t *p, int w, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__regptr_operand(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__lea_regptr32_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__lea_regptr64_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__movsxd_reg32_to_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__mov_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regto);
+uint8_t* jit_emit__mov_imm64_to_reg(uint8_t *p, int64_t imm, jit_host_reg reg);
+uint8_t* jit_emit__mov_ind32_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__mov_ind16_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__mov_ind8_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg32_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base);
+uint8_t* jit_emit__mov_reg16_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base);
+uint8_t* jit_emit__mov_reg8_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base);
+uint8_t* jit_emit__mov_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__mov_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__mov_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__mov_m64_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg64_to_m(uint8_t *p, jit_host_reg reg, int32_t *m);
+uint8_t* jit_emit__movzx_m8_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__movzx_m16_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__movsx_m8_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__movsx_m16_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__movsxd_m32_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg);
+uint8_t* jit_emit__mov_ind64_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg64_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base);
+uint8_t* jit_emit__movzx_ind8_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__movzx_ind16_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__movsx_ind8_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__movsx_ind16_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__movsxd_ind32_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg);
+uint8_t* jit_emit__movzx_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__movzx_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__movsx_reg8_to_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__movsx_reg16_to_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__mov_disp64_to_reg(uint8_t *p, jit_host_reg base, int32_t disp, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg64_to_disp(uint8_t *p, jit_host_reg reg, jit_host_reg base, int32_t disp);
+uint8_t* jit_emit__memop_m(uint8_t *p, size_t opsz, uint16_t opc, jit_host_reg reg, void *m);
+uint8_t* jit_emit__regptr_op(uint8_t *p, size_t opsz, uint16_t opc, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__movzx_regptr8_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__movzx_regptr16_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__mov_regptr64_to_reg(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__movsx_regptr8_to_reg64(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__movsx_regptr16_to_reg64(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__movsxd_regptr32_to_reg64(uint8_t *p, struct jit_host_ptr *rp, jit_host_reg reg);
+uint8_t* jit_emit__mov_reg8_to_regptr(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__mov_reg16_to_regptr(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__mov_reg32_to_regptr(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__mov_reg64_to_regptr(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp);
 
 uint8_t* jit_emit__add_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regto);
 uint8_t* jit_emit__add_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regto);
@@ -134,6 +362,9 @@ uint8_t* jit_emit__add_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg
 uint8_t* jit_emit__add_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
 uint8_t* jit_emit__add_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
 uint8_t* jit_emit__add_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__add_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__inc_reg32(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__add_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 
 uint8_t* jit_emit__sub_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__sub_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
@@ -141,36 +372,140 @@ uint8_t* jit_emit__sub_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg
 uint8_t* jit_emit__sub_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
 uint8_t* jit_emit__sub_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
 uint8_t* jit_emit__sub_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__sub_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__sub_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmp_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmp_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__cmp_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmp_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmp_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmp_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__cmp_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__cmp_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__neg_reg32(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__neg_reg8(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__neg_reg16(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__neg_reg64(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__dec_reg32(uint8_t *p, jit_host_reg reg);
 
 uint8_t* jit_emit__and_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__and_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__and_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__and_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__and_imm16_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__and_imm8_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__and_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__and_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__and_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__and_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
 
 uint8_t* jit_emit__or_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__or_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__or_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__or_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__or_imm16_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__or_imm8_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__or_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__or_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__or_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__or_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
 
 uint8_t* jit_emit__xor_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__xor_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__xor_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
 uint8_t* jit_emit__xor_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__xor_imm16_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
-uint8_t* jit_emit__xor_imm8_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__xor_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__xor_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__xor_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__xor_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
 
 uint8_t* jit_emit__shl_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
 uint8_t* jit_emit__shr_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
 uint8_t* jit_emit__sar_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shlx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__shrx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__sarx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__shlx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__shrx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__sarx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount, jit_host_reg regout);
+uint8_t* jit_emit__shl_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shr_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__sar_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shl_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shr_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__sar_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shl_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shr_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__sar_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout);
+uint8_t* jit_emit__shift_cl_to_reg(uint8_t *p, size_t opsz, int ox, jit_host_reg regout);
+uint8_t* jit_emit__bt_imm8_reg32(uint8_t *p, int8_t imm, jit_host_reg regout);
+
+uint8_t* jit_emit__imul_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__imul_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__imul_imm32_reg_to_reg(uint8_t *p, int32_t imm, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__imul_imm32_reg64_to_reg(uint8_t *p, int32_t imm, jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__mul_wide_reg64(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__imul_wide_reg64(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__div_reg32(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__idiv_reg32(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__cdq(uint8_t *p);
+uint8_t* jit_emit__div_reg64(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__idiv_reg64(uint8_t *p, jit_host_reg reg);
+uint8_t* jit_emit__cqo(uint8_t *p);
 
 uint8_t* jit_emit__call_m32(uint8_t *p, void *m);
+uint8_t* jit_emit__call_reg(uint8_t *p, jit_host_reg reg);
 uint8_t* jit_emit__ret(uint8_t *p);
 uint8_t* jit_emit__push_reg(uint8_t *p, jit_host_reg regout);
 uint8_t* jit_emit__pop_reg(uint8_t *p, jit_host_reg regout);
+uint8_t* jit_emit__nop(uint8_t *p, size_t n);
+uint8_t* jit_emit__rex_opsz(uint8_t *p, size_t opsz, jit_host_reg reg,
+        jit_host_reg rm);
+uint8_t* jit_emit__alu_reg_to_reg(uint8_t *p, size_t opsz, uint8_t opc,
+        jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__grp1_imm32_to_reg(uint8_t *p, int ox, int32_t imm,
+        jit_host_reg regout);
+uint8_t* jit_emit__grp1_imm32_to_reg64(uint8_t *p, int ox, int32_t imm,
+        jit_host_reg regout);
+uint8_t* jit_emit__grp1_imm16_to_reg(uint8_t *p, int ox, int16_t imm,
+        jit_host_reg regout);
+uint8_t* jit_emit__grp1_imm8_to_reg(uint8_t *p, int ox, int8_t imm,
+        jit_host_reg regout);
+uint8_t* jit_emit__alu_regptr(uint8_t *p, size_t opsz, uint8_t opc,
+        jit_host_reg reg, struct jit_host_ptr *rp);
+uint8_t* jit_emit__alu_m(uint8_t *p, size_t opsz, uint8_t opc,
+        jit_host_reg reg, void *m);
+uint8_t* jit_emit__grp1_imm_to_regptr(uint8_t *p, size_t opsz, int ox,
+        int32_t imm, struct jit_host_ptr *rp);
+uint8_t* jit_emit__grp1_imm_to_m(uint8_t *p, size_t opsz, int ox,
+        int32_t imm, void *m);
+uint8_t* jit_emit__jmp_rel8(uint8_t *p, int8_t disp);
+uint8_t* jit_emit__jmp_rel32(uint8_t *p, int32_t disp);
+uint8_t* jit_emit__jcc_rel8(uint8_t *p, int cc, int8_t disp);
+uint8_t* jit_emit__jcc_rel32(uint8_t *p, int cc, int32_t disp);
+uint8_t* jit_emit__setcc_reg8(uint8_t *p, int cc, jit_host_reg regout);
+uint8_t* jit_emit__cmovcc_reg_to_reg(uint8_t *p, size_t opsz, int cc,
+        jit_host_reg regin, jit_host_reg regout);
+uint8_t* jit_emit__cmovcc_regptr_to_reg(uint8_t *p, size_t opsz, int cc,
+        struct jit_host_ptr *rp, jit_host_reg regout);
+uint8_t* jit_emit__cmovcc_m_to_reg(uint8_t *p, size_t opsz, int cc, void *m,
+        jit_host_reg regout);
+uint8_t* jit_emit__jmp_regptr(uint8_t *p, struct jit_host_ptr *rp);
+
+jit_host_reg jit_get_mapped_host_reg(struct jit_state *s, jit_reg reg,
+        jit_reg_access a);
+struct jit_host_ptr jit_get_host_regptr(struct jit_state *s,
+        struct jit_ptr *p);
+void jit_emit_load_m(struct jit_state *s, void *m, jit_host_reg reg,
+        size_t opsz);
+void jit_emit_store_m(struct jit_state *s, jit_host_reg reg, void *m,
+        size_t opsz);
+void jit_emit_spill(struct jit_state *s, jit_host_reg reg, int32_t slot);
+void jit_emit_reload(struct jit_state *s, int32_t slot, jit_host_reg reg);
+
+jit_error jit_linear_scan(struct jit_state *s);
+void jit_linscan_destroy(struct jit_linscan *ls);
+void jit_linscan_prologue(struct jit_state *s);
+void jit_linscan_begin_instr(struct jit_state *s, struct jit_instr *i);
+void jit_linscan_end_instr(struct jit_state *s, struct jit_instr *i);
+void jit_linscan_epilogue(struct jit_state *s);
+jit_host_reg jit_linscan_host_reg(struct jit_state *s, jit_reg reg);
 
 #ifdef __CPLUSPLUS
 }
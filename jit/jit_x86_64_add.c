@@ -27,7 +27,7 @@ uint8_t*
 jit_emit__add_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 {
     if(NEED_REX(regin) || NEED_REX(regout)) *p++ =
-        REX(0, NEED_REX(regin), 0, NEED_REX(regout));
+        REX(0, NEED_REX(regout), 0, NEED_REX(regin));
 	*p++ = 0x03;
 	*p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
     return p;
@@ -43,46 +43,48 @@ jit_emit__add_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 uint8_t*
 jit_emit__add_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 {
-    if(NEED_REX(regin) || NEED_REX(regout)) *p++ =
-        REX(0, NEED_REX(regin), 0, NEED_REX(regout));
-	*p++ = 0x02;
-	*p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
-    return p;
+    return jit_emit__alu_reg_to_reg(p, JIT_8BIT, 0x01, regin, regout);
 }
 
 uint8_t*
 jit_emit__add_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x81;
-    *p++ = MODRM(MOD_REGDIRECT, OX_ADD, HOSTREG(regout));
-    *(int32_t *)p = imm;
-    p += sizeof(int32_t);
-
-    return p;
+    return jit_emit__grp1_imm32_to_reg(p, OX_ADD, imm, regout);
 }
 
 uint8_t*
 jit_emit__add_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
 {
-    *p++ = 0x66;
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x81;
-    *p++ = MODRM(MOD_REGDIRECT, OX_ADD, HOSTREG(regout));
-    *(int16_t *)p = imm;
-    p += sizeof(int16_t);
-
-    return p;
+    return jit_emit__grp1_imm16_to_reg(p, OX_ADD, imm, regout);
 }
 
 uint8_t*
 jit_emit__add_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x80;
-    *p++ = MODRM(MOD_REGDIRECT, OX_ADD, HOSTREG(regout));
-    *(int8_t *)p++ = imm;
+    return jit_emit__grp1_imm8_to_reg(p, OX_ADD, imm, regout);
+}
+
+uint8_t*
+jit_emit__add_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm32_to_reg64(p, OX_ADD, imm, regout);
+}
+
+uint8_t*
+jit_emit__inc_reg32(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xff;
+    *p++ = MODRM(MOD_REGDIRECT, 0, HOSTREG(reg));
 
     return p;
 }
 
+uint8_t*
+jit_emit__add_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x03;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
@@ -35,11 +35,41 @@ jit_emit__and_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 uint8_t*
 jit_emit__and_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x81;
-    *p++ = MODRM(MOD_REGDIRECT, OX_AND, HOSTREG(regout));
-    *(int32_t *)p = imm;
-    p += sizeof(int32_t);
+    return jit_emit__grp1_imm32_to_reg(p, OX_AND, imm, regout);
+}
 
-    return p;
+uint8_t*
+jit_emit__and_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_16BIT, 0x21, regin, regout);
+}
+
+uint8_t*
+jit_emit__and_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_8BIT, 0x21, regin, regout);
+}
+
+uint8_t*
+jit_emit__and_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_64BIT, 0x21, regin, regout);
+}
+
+uint8_t*
+jit_emit__and_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm16_to_reg(p, OX_AND, imm, regout);
+}
+
+uint8_t*
+jit_emit__and_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm8_to_reg(p, OX_AND, imm, regout);
+}
+
+uint8_t*
+jit_emit__and_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm32_to_reg64(p, OX_AND, imm, regout);
 }
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "jit_x86_64.h"
+#include "jit_ir.h"
+
+static const jit_host_reg g_callee_saved[] = {
+    rbx, rbp, r12, r13, r14, r15,
+};
+
+#define NUM_CALLEE_SAVED (sizeof(g_callee_saved) / sizeof(g_callee_saved[0]))
+
+/* The ranges holding a spill slot are kept in a min-heap by end, so that
+ * slots are recycled as soon as their range is over. */
+static void
+jit_ls_heap_push(uint32_t *heap, uint32_t *n, uint32_t r,
+        struct jit_live_range *lr)
+{
+    uint32_t k = (*n)++;
+
+    while(k > 0 && lr[heap[(k - 1) / 2]].end > lr[r].end) {
+        heap[k] = heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    heap[k] = r;
+}
+
+static uint32_t
+jit_ls_heap_pop(uint32_t *heap, uint32_t *n, struct jit_live_range *lr)
+{
+    uint32_t top = heap[0];
+    uint32_t last = heap[--(*n)];
+    uint32_t k = 0, c;
+
+    while((c = 2 * k + 1) < *n) {
+        if(c + 1 < *n && lr[heap[c + 1]].end < lr[heap[c]].end) {
+            c++;
+        }
+        if(lr[heap[c]].end >= lr[last].end) {
+            break;
+        }
+        heap[k] = heap[c];
+        k = c;
+    }
+    heap[k] = last;
+
+    return top;
+}
+
+/* Range of register r covering instruction n, walking cur[r] forwards. */
+static uint32_t
+jit_ls_range(struct jit_liveness *l, uint32_t *cur, jit_reg r, uint32_t n)
+{
+    if(r < 0 || (uint32_t)r >= l->nregs) {
+        return JIT_LIVE_NONE;
+    }
+    while(cur[r] != JIT_LIVE_NONE && l->ranges[cur[r]].end < n) {
+        cur[r] = l->ranges[cur[r]].next;
+    }
+    return cur[r];
+}
+
+static jit_error
+jit_ls_grow(struct jit_linscan *ls, uint32_t nranges, uint32_t nopnd)
+{
+    jit_error e = JIT_SUCCESS;
+    void *p;
+
+#define GROW(a,n) p = realloc((a), (n) * sizeof(*(a))); \
+    if(p == NULL) FAILPATH(JIT_ERROR_MALLOC); (a) = p
+    if(nranges > ls->nranges_alloc) {
+        GROW(ls->host, nranges);
+        GROW(ls->spill_at, nranges);
+        GROW(ls->slot, nranges);
+        GROW(ls->splits, nranges);
+        ls->nranges_alloc = nranges;
+    }
+    if(nopnd > ls->nopnd_alloc) {
+        GROW(ls->opnd, nopnd);
+        ls->nopnd_alloc = nopnd;
+    }
+#undef GROW
+
+l_exit:
+    return e;
+}
+
+jit_error
+jit_linear_scan(struct jit_state *s)
+{
+    jit_error e = JIT_SUCCESS;
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_linscan *ls = em->linscan;
+    struct jit_liveness *l;
+    struct jit_live_range *lr;
+    struct jit_ir *ir;
+    uint32_t *order = NULL, *count = NULL, *calls = NULL, *cur = NULL;
+    uint32_t *heap = NULL, *freeslots = NULL;
+    int8_t *fixed = NULL;
+    uint32_t active[NUM_HOST_REGS];
+    uint32_t pool, freeregs, nheap = 0, nfree = 0;
+    uint32_t n, k, r, h;
+
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_liveness(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    ir = s->p_ir;
+    l = s->p_live;
+    lr = l->ranges;
+
+    if(ls == NULL) {
+        ls = em->linscan = calloc(1, sizeof(struct jit_linscan));
+        if(ls == NULL) {
+            FAILPATH(JIT_ERROR_MALLOC);
+        }
+    }
+    e = jit_ls_grow(ls, l->nranges, ir->n * JIT_LS_NOPNDS);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+
+    order = malloc((l->nranges + 1) * sizeof(uint32_t));
+    heap = malloc((l->nranges + 1) * sizeof(uint32_t));
+    freeslots = malloc((l->nranges + 1) * sizeof(uint32_t));
+    count = calloc(ir->n + 1, sizeof(uint32_t));
+    calls = malloc((ir->n + 1) * sizeof(uint32_t));
+    cur = malloc((l->nregs + 1) * sizeof(uint32_t));
+    fixed = malloc(l->nregs + 1);
+    if(!order || !heap || !freeslots || !count || !calls || !cur || !fixed) {
+        FAILPATH(JIT_ERROR_MALLOC);
+    }
+
+    // Registers with a fixed mapping keep it, and it is not handed out.
+    memset(fixed, JIT_HOST_REG_INVALID, l->nregs + 1);
+    for(h = 0; h < NUM_HOST_REGS; h++) {
+        jit_reg v = em->host_regmap[h];
+        if((em->host_busy & (1 << h)) && v >= 0 && (uint32_t)v < l->nregs) {
+            fixed[v] = (int8_t)h;
+        }
+    }
+    // Everything but rsp and the two scratch registers is handed out.
+    // Caller-saved registers are preferred; values that live across a call
+    // need a callee-saved one.
+    pool = (JIT_CALLER_SAVED | JIT_CALLEE_SAVED) & ~em->host_busy;
+
+    // calls[n] is the number of calls before instruction n.
+    calls[0] = 0;
+    for(n = 0; n < ir->n; n++) {
+        calls[n + 1] = calls[n] + (ir->op[n] == JIT_OP_CALL);
+    }
+
+    // Visit the ranges by increasing start; starts are instruction indexes,
+    // so a counting sort does.
+    for(r = 0; r < l->nranges; r++) {
+        count[lr[r].start + 1]++;
+    }
+    for(n = 0; n < ir->n; n++) {
+        count[n + 1] += count[n];
+    }
+    for(r = 0; r < l->nranges; r++) {
+        order[count[lr[r].start]++] = r;
+    }
+
+    for(h = 0; h < NUM_HOST_REGS; h++) {
+        active[h] = JIT_LIVE_NONE;
+    }
+    freeregs = pool;
+    ls->nsplits = ls->nslots = 0;
+    ls->saved = 0;
+    for(k = 0; k < l->nranges; k++) {
+        uint32_t pos, want, avail, victim;
+
+        r = order[k];
+        pos = lr[r].start;
+        ls->host[r] = JIT_HOST_REG_INVALID;
+        ls->spill_at[r] = JIT_LIVE_NONE;
+        ls->slot[r] = -1;
+        if(fixed[lr[r].reg] != JIT_HOST_REG_INVALID) {
+            ls->host[r] = fixed[lr[r].reg];
+            continue;
+        }
+
+        // Release the registers and slots of the ranges that are over.
+        for(h = 0; h < NUM_HOST_REGS; h++) {
+            if(active[h] != JIT_LIVE_NONE && lr[active[h]].end < pos) {
+                active[h] = JIT_LIVE_NONE;
+                freeregs |= 1 << h;
+            }
+        }
+        while(nheap > 0 && lr[heap[0]].end < pos) {
+            freeslots[nfree++] = ls->slot[jit_ls_heap_pop(heap, &nheap, lr)];
+        }
+
+        want = (calls[lr[r].end] > calls[pos + 1]) ?
+            pool & JIT_CALLEE_SAVED : pool;
+        avail = freeregs & want;
+        if(avail) {
+            if(avail & JIT_CALLER_SAVED) {
+                avail &= JIT_CALLER_SAVED;
+            }
+            for(h = 0; !(avail & (1 << h)); h++);
+        } else {
+            // Evict the eligible range that ends last, unless this one does:
+            // it is then kept in memory from here on.
+            victim = JIT_LIVE_NONE;
+            for(h = 0; h < NUM_HOST_REGS; h++) {
+                if((want & (1 << h)) && active[h] != JIT_LIVE_NONE &&
+                        (victim == JIT_LIVE_NONE ||
+                         lr[active[h]].end > lr[victim].end)) {
+                    victim = active[h];
+                }
+            }
+            if(victim == JIT_LIVE_NONE || lr[victim].end <= lr[r].end) {
+                victim = r;
+            } else {
+                h = ls->host[victim];
+                if(lr[victim].start == pos) {
+                    ls->host[victim] = JIT_HOST_REG_INVALID;
+                } else if(lr[victim].cross) {
+                    // A value live across a jump has to be in the same place
+                    // on both ends: it lives in memory all along instead,
+                    // in a slot nothing else had since it started.
+                    ls->host[victim] = JIT_HOST_REG_INVALID;
+                    ls->slot[victim] = ls->nslots++;
+                } else {
+                    ls->spill_at[victim] = pos;
+                    ls->splits[ls->nsplits++] = victim;
+                }
+            }
+            if(ls->slot[victim] < 0) {
+                ls->slot[victim] = nfree ? freeslots[--nfree] : ls->nslots++;
+            }
+            jit_ls_heap_push(heap, &nheap, victim, lr);
+            if(victim == r) {
+                continue;
+            }
+        }
+        active[h] = r;
+        freeregs &= ~(1 << h);
+        ls->host[r] = h;
+        ls->saved |= (1 << h) & JIT_CALLEE_SAVED;
+    }
+
+    // Note the range of every register operand, for the emitter.
+    for(r = 0; r < l->nregs; r++) {
+        cur[r] = l->first[r];
+    }
+    for(n = 0; n < ir->n; n++) {
+        uint32_t *o = &ls->opnd[n * JIT_LS_NOPNDS];
+        for(k = 0; k < JIT_LS_NOPNDS; k++) {
+            o[k] = JIT_LIVE_NONE;
+        }
+        for(k = JIT_IR_IN1; k < JIT_IR_NSLOTS; k++) {
+            if(ir->kind[k][n] == JIT_OPERAND_REG) {
+                o[k] = jit_ls_range(l, cur, ir->val[k][n], n);
+            } else if(ir->kind[k][n] == JIT_OPERAND_REGPTR) {
+                struct jit_ptr *p = &ir->aux[ir->val[k][n]].regptr;
+                o[JIT_LS_BASE] = jit_ls_range(l, cur, p->base, n);
+                o[JIT_LS_INDEX] = jit_ls_range(l, cur, p->index, n);
+            }
+        }
+    }
+    ls->ninstrs = ir->n;
+    ls->has_call = calls[ir->n] > 0;
+
+l_exit:
+    free(order);
+    free(heap);
+    free(freeslots);
+    free(count);
+    free(calls);
+    free(cur);
+    free(fixed);
+    return e;
+}
+
+void
+jit_linscan_destroy(struct jit_linscan *ls)
+{
+    if(ls == NULL) {
+        return;
+    }
+    free(ls->host);
+    free(ls->spill_at);
+    free(ls->slot);
+    free(ls->splits);
+    free(ls->opnd);
+    free(ls);
+}
+
+static int
+jit_ls_in_slot(struct jit_linscan *ls, uint32_t r, uint32_t n)
+{
+    return ls->host[r] == JIT_HOST_REG_INVALID ||
+        (ls->spill_at[r] != JIT_LIVE_NONE && n >= ls->spill_at[r]);
+}
+
+static struct jit_linscan_loc*
+jit_ls_find_loc(struct jit_emitter *em, jit_reg reg)
+{
+    uint32_t k;
+
+    for(k = 0; k < em->nlocs; k++) {
+        if(em->locs[k].reg == reg) {
+            return &em->locs[k];
+        }
+    }
+    return NULL;
+}
+
+static struct jit_linscan_loc*
+jit_ls_add_loc(struct jit_state *s, uint32_t r, uint32_t n)
+{
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_linscan *ls = em->linscan;
+    struct jit_linscan_loc *loc = &em->locs[em->nlocs++];
+
+    loc->reg = s->p_live->ranges[r].reg;
+    loc->host = ls->host[r];
+    loc->slot = jit_ls_in_slot(ls, r, n) ? ls->slot[r] : -1;
+    loc->written = 0;
+
+    return loc;
+}
+
+/* Save the callee-saved registers handed out, on entry to the block. */
+void
+jit_linscan_prologue(struct jit_state *s)
+{
+    struct jit_linscan *ls = s->p_emitter->linscan;
+    size_t k;
+
+    for(k = 0; k < NUM_CALLEE_SAVED; k++) {
+        if(ls->saved & (1 << g_callee_saved[k])) {
+            s->p_bufcur = jit_emit__push_reg(s->p_bufcur, g_callee_saved[k]);
+        }
+    }
+}
+
+/* Emit what has to happen before instruction i under the linear scan
+ * allocation: moving values evicted here to their slot, and loading spilled
+ * operands into scratch registers. */
+void
+jit_linscan_begin_instr(struct jit_state *s, struct jit_instr *i)
+{
+    static const int inputs[] = {
+        JIT_LS_IN1, JIT_LS_IN2, JIT_LS_BASE, JIT_LS_INDEX, JIT_LS_OUT,
+    };
+    static const jit_host_reg scratch[] = {
+        JIT_SCRATCH_REG2, JIT_SCRATCH_REG,
+    };
+    struct jit_emitter *em = s->p_emitter;
+    struct jit_linscan *ls = em->linscan;
+    uint8_t *begin = s->p_bufcur;
+    uint32_t n = em->ni;
+    uint32_t *o;
+    struct jit_linscan_loc *out = NULL, *share = NULL, *loc;
+    struct jit_linscan_loc *folded[2] = { NULL, NULL };
+    struct jit_ptr *p;
+    size_t k, nscratch = 0, nspilled = 0;
+    int out_only = 0;
+    int def = (i->op == JIT_OP_POP) ? JIT_LS_IN1 : JIT_LS_OUT;
+
+    em->nlocs = 0;
+    em->index_folded = 0;
+    if(n >= ls->ninstrs) {
+        return;
+    }
+    o = &ls->opnd[n * JIT_LS_NOPNDS];
+
+    while(em->nsplit < ls->nsplits &&
+            ls->spill_at[ls->splits[em->nsplit]] == n) {
+        uint32_t r = ls->splits[em->nsplit++];
+        jit_emit_spill(s, ls->host[r], ls->slot[r]);
+    }
+
+    // Inputs first, then the output, which may be one of them.
+    for(k = 0; k < sizeof(inputs) / sizeof(inputs[0]); k++) {
+        uint32_t r = o[inputs[k]];
+        if(r == JIT_LIVE_NONE) {
+            continue;
+        }
+        loc = jit_ls_find_loc(em, s->p_live->ranges[r].reg);
+        if(loc == NULL) {
+            loc = jit_ls_add_loc(s, r, n);
+            if(inputs[k] == def && !JIT_OP_READS_OUT(i->op)) {
+                out_only = 1;
+            }
+        }
+        if(inputs[k] == def) {
+            loc->written = 1;
+            out = loc;
+        } else if(loc->slot >= 0 && share == NULL &&
+                (inputs[k] == JIT_LS_IN1 || inputs[k] == JIT_LS_BASE)) {
+            share = loc;
+        }
+    }
+    if(out == NULL || out->slot < 0) {
+        out_only = 0;
+    }
+
+    // A spilled output is computed in a scratch register. It can reuse that
+    // of in1 or of the pointer base, which are read before it is written.
+    if(out_only && share == NULL) {
+        out->host = scratch[nscratch++];
+    }
+    // A register operand and the base and index of a register pointer all
+    // spilled would need a third one: add the index into the base first.
+    for(k = 0; k < em->nlocs; k++) {
+        if(em->locs[k].slot >= 0 && !(out_only && &em->locs[k] == out)) {
+            nspilled++;
+        }
+    }
+    p = (i->in1_type == JIT_OPERAND_REGPTR) ? &i->in1.regptr :
+        (i->in2_type == JIT_OPERAND_REGPTR) ? &i->in2.regptr :
+        (i->out_type == JIT_OPERAND_REGPTR) ? &i->out.regptr : NULL;
+    if(nspilled > 2 && p != NULL) {
+        struct jit_linscan_loc *base = jit_ls_find_loc(em, p->base);
+        struct jit_linscan_loc *index = jit_ls_find_loc(em, p->index);
+        struct jit_host_ptr hp;
+
+        base->host = scratch[0];
+        index->host = scratch[1];
+        jit_emit_reload(s, base->slot, base->host);
+        jit_emit_reload(s, index->slot, index->host);
+        hp = jit_get_host_regptr(s, p);
+        hp.offset = 0;
+        s->p_bufcur = jit_emit__lea_regptr64_to_reg(s->p_bufcur, &hp,
+                base->host);
+        // Should either be the output, it is computed there too.
+        index->host = base->host;
+        em->index_folded = 1;
+        folded[0] = base;
+        folded[1] = index;
+        nscratch = 1;
+    }
+    for(k = 0; k < em->nlocs; k++) {
+        loc = &em->locs[k];
+        if(loc->slot < 0 || (out_only && loc == out) ||
+                loc == folded[0] || loc == folded[1] ||
+                nscratch == sizeof(scratch) / sizeof(scratch[0])) {
+            continue;
+        }
+        loc->host = scratch[nscratch++];
+        jit_emit_reload(s, loc->slot, loc->host);
+    }
+    if(out_only && share != NULL) {
+        out->host = share->host;
+    }
+
+    s->blk_nb += s->p_bufcur - begin;
+}
+
+/* Write spilled outputs of the instruction just emitted back to their slot. */
+void
+jit_linscan_end_instr(struct jit_state *s, struct jit_instr *i)
+{
+    struct jit_emitter *em = s->p_emitter;
+    uint8_t *begin = s->p_bufcur;
+    uint32_t k;
+
+    for(k = 0; k < em->nlocs; k++) {
+        struct jit_linscan_loc *loc = &em->locs[k];
+        if(loc->slot >= 0 && loc->written) {
+            jit_emit_spill(s, loc->host, loc->slot);
+        }
+    }
+
+    s->blk_nb += s->p_bufcur - begin;
+}
+
+/* Restore the callee-saved registers handed out, before returning. */
+void
+jit_linscan_epilogue(struct jit_state *s)
+{
+    struct jit_linscan *ls = s->p_emitter->linscan;
+    size_t k;
+
+    for(k = NUM_CALLEE_SAVED; k-- > 0; ) {
+        if(ls->saved & (1 << g_callee_saved[k])) {
+            s->p_bufcur = jit_emit__pop_reg(s->p_bufcur, g_callee_saved[k]);
+        }
+    }
+}
+
+jit_host_reg
+jit_linscan_host_reg(struct jit_state *s, jit_reg reg)
+{
+    struct jit_linscan_loc *loc = jit_ls_find_loc(s->p_emitter, reg);
+
+    return loc ? loc->host : JIT_HOST_REG_INVALID;
+}
@@ -33,6 +33,15 @@ jit_emit__call_m32(uint8_t *p, void *m)
     return p;
 }
 
+uint8_t*
+jit_emit__call_reg(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xff;
+    *p++ = MODRM(MOD_REGDIRECT, 2, HOSTREG(reg));
+    return p;
+}
+
 uint8_t*
 jit_emit__ret(uint8_t *p)
 {
@@ -43,7 +52,7 @@ jit_emit__ret(uint8_t *p)
 uint8_t*
 jit_emit__push_reg(uint8_t *p, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
+    if(NEED_REX(regout)) *p++ = REX_B;
     *p++ = 0x50 + HOSTREG(regout);
     return p;
 }
@@ -51,7 +60,283 @@ jit_emit__push_reg(uint8_t *p, jit_host_reg regout)
 uint8_t*
 jit_emit__pop_reg(uint8_t *p, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
+    if(NEED_REX(regout)) *p++ = REX_B;
     *p++ = 0x58 + HOSTREG(regout);
     return p;
 }
+
+/* Fill n bytes (at most 9) with a single no-op instruction. */
+uint8_t*
+jit_emit__nop(uint8_t *p, size_t n)
+{
+    static const uint8_t nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+
+    if(n > 0 && n <= 9) {
+        memcpy(p, nops[n - 1], n);
+        p += n;
+    }
+    return p;
+}
+
+uint8_t*
+jit_emit__jmp_rel8(uint8_t *p, int8_t disp)
+{
+    *p++ = 0xeb;
+    *p++ = (uint8_t)disp;
+    return p;
+}
+
+uint8_t*
+jit_emit__jmp_rel32(uint8_t *p, int32_t disp)
+{
+    *p++ = 0xe9;
+    *(int32_t *)p = disp;
+    p += sizeof(int32_t);
+    return p;
+}
+
+uint8_t*
+jit_emit__jcc_rel8(uint8_t *p, int cc, int8_t disp)
+{
+    *p++ = 0x70 + cc;
+    *p++ = (uint8_t)disp;
+    return p;
+}
+
+uint8_t*
+jit_emit__jcc_rel32(uint8_t *p, int cc, int32_t disp)
+{
+    *p++ = 0x0f;
+    *p++ = 0x80 + cc;
+    *(int32_t *)p = disp;
+    p += sizeof(int32_t);
+    return p;
+}
+
+uint8_t*
+jit_emit__setcc_reg8(uint8_t *p, int cc, jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, JIT_8BIT, JIT_HOST_REG_INVALID, regout);
+    *p++ = 0x0f;
+    *p++ = 0x90 + cc;
+    *p++ = MODRM(MOD_REGDIRECT, 0, HOSTREG(regout));
+    return p;
+}
+
+/* cmovcc has no 8-bit form: the 32-bit one does for it between registers.
+ * From memory it would read three bytes too many, so 8-bit operands are
+ * loaded into a register first. */
+#define CMOV_OPSZ(opsz) ((opsz) == JIT_8BIT ? JIT_32BIT : (opsz))
+
+uint8_t*
+jit_emit__cmovcc_reg_to_reg(uint8_t *p, size_t opsz, int cc,
+        jit_host_reg regin, jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, CMOV_OPSZ(opsz), regout, regin);
+    *p++ = 0x0f;
+    *p++ = 0x40 + cc;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__cmovcc_regptr_to_reg(uint8_t *p, size_t opsz, int cc,
+        struct jit_host_ptr *rp, jit_host_reg regout)
+{
+    return jit_emit__regptr_op(p, CMOV_OPSZ(opsz), 0x0f40 + cc, regout, rp);
+}
+
+uint8_t*
+jit_emit__cmovcc_m_to_reg(uint8_t *p, size_t opsz, int cc, void *m,
+        jit_host_reg regout)
+{
+    return jit_emit__memop_m(p, CMOV_OPSZ(opsz), 0x0f40 + cc, regout, m);
+}
+
+/* jmp to the address held at [rp]: ff /4. */
+uint8_t*
+jit_emit__jmp_regptr(uint8_t *p, struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, JIT_32BIT, 0xff, (jit_host_reg)4, rp);
+}
+
+/* The prefixes of an operation on opsz bytes with reg in the ModRM reg field
+ * and rm in r/m (either may be JIT_HOST_REG_INVALID): the operand-size
+ * override for 16 bits, and a REX prefix for 64 bits, for r8-r15, and for
+ * spl, bpl, sil and dil, which are only addressable with one. */
+uint8_t*
+jit_emit__rex_opsz(uint8_t *p, size_t opsz, jit_host_reg reg, jit_host_reg rm)
+{
+    int r = reg != JIT_HOST_REG_INVALID && NEED_REX(reg);
+    int b = rm != JIT_HOST_REG_INVALID && NEED_REX(rm);
+    int byte = opsz == JIT_8BIT && ((reg >= rsp && reg <= rdi) ||
+            (rm >= rsp && rm <= rdi));
+
+    if(opsz == JIT_16BIT) *p++ = 0x66;
+    if(opsz == JIT_64BIT || r || b || byte)
+        *p++ = REX(opsz == JIT_64BIT, r, 0, b);
+    return p;
+}
+
+/* The two-operand ALU instructions in their r/m, reg form, with regin in
+ * reg and regout in r/m. opc is the 16/32/64-bit opcode; the 8-bit one is
+ * the one before it. */
+uint8_t*
+jit_emit__alu_reg_to_reg(uint8_t *p, size_t opsz, uint8_t opc,
+        jit_host_reg regin, jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, opsz, regin, regout);
+    *p++ = (opsz == JIT_8BIT) ? opc - 1 : opc;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regin), HOSTREG(regout));
+    return p;
+}
+
+/* The two-operand ALU instructions with a memory operand, [rp] or
+ * RIP-relative to m. opc is the 16/32/64-bit opcode, of the form writing
+ * memory (01, 09, 21, 29, 31, 39) or reading it (03, 0b, 23, 2b, 33, 3b);
+ * the 8-bit one is the one before it. */
+uint8_t*
+jit_emit__alu_regptr(uint8_t *p, size_t opsz, uint8_t opc, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, opsz, (opsz == JIT_8BIT) ? opc - 1 : opc,
+            reg, rp);
+}
+
+uint8_t*
+jit_emit__alu_m(uint8_t *p, size_t opsz, uint8_t opc, jit_host_reg reg,
+        void *m)
+{
+    return jit_emit__memop_m(p, opsz, (opsz == JIT_8BIT) ? opc - 1 : opc,
+            reg, m);
+}
+
+/* The immediate of the group below on memory: 8 bits when it fits, which
+ * it does for the byte form, else as wide as the operand up to 32 bits. */
+static uint8_t*
+jit_emit__grp1_imm(uint8_t *p, size_t opsz, int32_t imm)
+{
+    if(opsz == JIT_8BIT || (imm >= INT8_MIN && imm <= INT8_MAX)) {
+        *(int8_t *)p++ = (int8_t)imm;
+    } else if(opsz == JIT_16BIT) {
+        *(int16_t *)p = (int16_t)imm;
+        p += sizeof(int16_t);
+    } else {
+        *(int32_t *)p = imm;
+        p += sizeof(int32_t);
+    }
+    return p;
+}
+
+/* Opcode of the group on opsz bytes of memory. Its prefixes are those of
+ * a 32-bit operation for the byte form: the opcode extension in the reg
+ * field is no register that would need a REX prefix. */
+#define GRP1_MEM_OPC(opsz,imm) ((opsz) == JIT_8BIT ? 0x80 : \
+        ((imm) >= INT8_MIN && (imm) <= INT8_MAX) ? 0x83 : 0x81)
+#define GRP1_MEM_OPSZ(opsz) ((opsz) == JIT_8BIT ? JIT_32BIT : (opsz))
+
+uint8_t*
+jit_emit__grp1_imm_to_regptr(uint8_t *p, size_t opsz, int ox, int32_t imm,
+        struct jit_host_ptr *rp)
+{
+    p = jit_emit__regptr_op(p, GRP1_MEM_OPSZ(opsz), GRP1_MEM_OPC(opsz, imm),
+            (jit_host_reg)ox, rp);
+    return jit_emit__grp1_imm(p, opsz, imm);
+}
+
+uint8_t*
+jit_emit__grp1_imm_to_m(uint8_t *p, size_t opsz, int ox, int32_t imm,
+        void *m)
+{
+    uint8_t *end;
+
+    p = jit_emit__memop_m(p, GRP1_MEM_OPSZ(opsz), GRP1_MEM_OPC(opsz, imm),
+            (jit_host_reg)ox, m);
+    end = jit_emit__grp1_imm(p, opsz, imm);
+    // The displacement counts from the end of the instruction.
+    *(int32_t *)(p - sizeof(int32_t)) -= (int32_t)(end - p);
+    return end;
+}
+
+/* The add/or/and/sub/xor/cmp imm32 group, taking the sign-extended imm8 form
+ * when the immediate fits. */
+uint8_t*
+jit_emit__grp1_imm32_to_reg(uint8_t *p, int ox, int32_t imm,
+        jit_host_reg regout)
+{
+    if(NEED_REX(regout)) *p++ = REX_B;
+    if(imm >= INT8_MIN && imm <= INT8_MAX) {
+        *p++ = 0x83;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int8_t *)p++ = (int8_t)imm;
+    } else {
+        *p++ = 0x81;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int32_t *)p = imm;
+        p += sizeof(int32_t);
+    }
+
+    return p;
+}
+
+/* As above, on the whole register, the immediate being sign-extended. */
+uint8_t*
+jit_emit__grp1_imm32_to_reg64(uint8_t *p, int ox, int32_t imm,
+        jit_host_reg regout)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(regout));
+    if(imm >= INT8_MIN && imm <= INT8_MAX) {
+        *p++ = 0x83;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int8_t *)p++ = (int8_t)imm;
+    } else {
+        *p++ = 0x81;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int32_t *)p = imm;
+        p += sizeof(int32_t);
+    }
+
+    return p;
+}
+
+uint8_t*
+jit_emit__grp1_imm16_to_reg(uint8_t *p, int ox, int16_t imm,
+        jit_host_reg regout)
+{
+    *p++ = 0x66;
+    if(NEED_REX(regout)) *p++ = REX_B;
+    if(imm >= INT8_MIN && imm <= INT8_MAX) {
+        *p++ = 0x83;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int8_t *)p++ = (int8_t)imm;
+    } else {
+        *p++ = 0x81;
+        *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+        *(int16_t *)p = imm;
+        p += sizeof(int16_t);
+    }
+
+    return p;
+}
+
+uint8_t*
+jit_emit__grp1_imm8_to_reg(uint8_t *p, int ox, int8_t imm,
+        jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, JIT_8BIT, JIT_HOST_REG_INVALID, regout);
+    *p++ = 0x80;
+    *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+    *(int8_t *)p++ = imm;
+
+    return p;
+}
@@ -26,7 +26,7 @@
 uint8_t*
 jit_emit__mov_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg reg)
 {
-    if(NEED_REX(reg)) *p++ = REX_R;
+    if(NEED_REX(reg)) *p++ = REX_B;
     *p++ = 0xb8 + HOSTREG(reg);
     *(int32_t *)p = imm;
     p += sizeof(int32_t);
@@ -38,7 +38,7 @@ uint8_t*
 jit_emit__mov_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg reg)
 {
     *p++ = 0x66;
-    if(NEED_REX(reg)) *p++ = REX_R;
+    if(NEED_REX(reg)) *p++ = REX_B;
     *p++ = 0xb8 + HOSTREG(reg);
     *(int16_t *)p = imm;
     p += sizeof(int16_t);
@@ -49,11 +49,23 @@ jit_emit__mov_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg reg)
 uint8_t*
 jit_emit__mov_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg reg)
 {
-    if(NEED_REX(reg)) *p++ = REX_R;
+    p = jit_emit__rex_opsz(p, JIT_8BIT, JIT_HOST_REG_INVALID, reg);
     *p++ = 0xb0 + HOSTREG(reg);
+    *(int8_t *)p++ = imm;
+
+    return p;
+}
+
+/* mov r/m64, imm32: the immediate is sign-extended. */
+uint8_t*
+jit_emit__mov_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xc7;
+    *p++ = MODRM(MOD_REGDIRECT, 0, HOSTREG(reg));
     *(int32_t *)p = imm;
     p += sizeof(int32_t);
-    
+
     return p;
 }
 
@@ -100,12 +112,13 @@ jit_emit__mov_m8_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg)
     return p;
 }
 
+/* The address is a full 64-bit one. */
 uint8_t*
 jit_emit__lea_immdisp32_to_reg(uint8_t *p, void *m, jit_host_reg reg)
 {
-    size_t ibs = !!(NEED_REX(reg)) + 1 + 1 + sizeof(int32_t);
+    size_t ibs = 1 + 1 + 1 + sizeof(int32_t);
     int32_t disp = (int32_t)((int64_t)m - (int64_t)p - ibs);
-    if(NEED_REX(reg)) *p++ = REX_R;
+    *p++ = REX(1, NEED_REX(reg), 0, 0);
     *p++ = 0x8d;
     *p++ = MODRM(MOD_RIP_SIB, HOSTREG(reg), RM_DISP32);
     *(int32_t *)p = disp;
@@ -114,20 +127,6 @@ jit_emit__lea_immdisp32_to_reg(uint8_t *p, void *m, jit_host_reg reg)
     return p;
 }
 
-uint8_t*
-jit_emit__mov_regptr32_to_reg(uint8_t *p, struct jit_host_ptr *rp,
-        jit_host_reg reg)
-{
-    *p++ = 0x67;
-    if(NEED_REX(reg) || NEED_REX(rp->base) || NEED_REX(rp->index))
-        *p++ = REX(0, NEED_REX(reg), NEED_REX(rp->index),
-                NEED_REX(rp->base));
-    *p++ = 0x8b;
-    *p++ = MODRM(MOD_DISP8, HOSTREG(reg), HOSTREG(rp->base));
-    *p++ = (int8_t) rp->offset;
-    return p;
-}
-
 uint8_t*
 jit_emit__mov_reg32_to_m(uint8_t *p, jit_host_reg reg, int32_t *m)
 {
@@ -180,3 +179,481 @@ jit_emit__mov_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
     *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regin), HOSTREG(regout));
     return p;
 }
+
+uint8_t*
+jit_emit__mov_imm64_to_reg(uint8_t *p, int64_t imm, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xb8 + HOSTREG(reg);
+    *(int64_t *)p = imm;
+    p += sizeof(int64_t);
+
+    return p;
+}
+
+/* Encode the ModRM (and SIB/disp) bytes for a [base] memory operand. rsp and
+ * r12 need a SIB byte, rbp and r13 can only be encoded with a displacement. */
+static uint8_t*
+jit_emit__modrm_ind(uint8_t *p, int reg, jit_host_reg base)
+{
+    if(HOSTREG(base) == rbp) {
+        *p++ = MODRM(MOD_DISP8, HOSTREG(reg), HOSTREG(base));
+        *p++ = 0;
+    } else {
+        *p++ = MODRM(MOD_RIP_SIB, HOSTREG(reg), HOSTREG(base));
+        if(HOSTREG(base) == rsp) {
+            *p++ = 0x24;
+        }
+    }
+    return p;
+}
+
+uint8_t*
+jit_emit__mov_ind32_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    if(NEED_REX(reg) || NEED_REX(base))
+        *p++ = REX(0, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x8b;
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__mov_ind16_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    *p++ = 0x66;
+    return jit_emit__mov_ind32_to_reg(p, base, reg);
+}
+
+uint8_t*
+jit_emit__mov_ind8_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    // spl, bpl, sil and dil are only addressable with a REX prefix.
+    if(NEED_REX(reg) || NEED_REX(base) || (reg >= rsp && reg <= rdi))
+        *p++ = REX(0, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x8a;
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__mov_reg32_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base)
+{
+    if(NEED_REX(reg) || NEED_REX(base))
+        *p++ = REX(0, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x89;
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__mov_reg16_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base)
+{
+    *p++ = 0x66;
+    return jit_emit__mov_reg32_to_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__mov_reg8_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base)
+{
+    if(NEED_REX(reg) || NEED_REX(base) || (reg >= rsp && reg <= rdi))
+        *p++ = REX(0, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x88;
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+/* As above, for a [base + disp] memory operand. */
+static uint8_t*
+jit_emit__modrm_disp(uint8_t *p, int reg, jit_host_reg base, int32_t disp)
+{
+    int d8 = (disp >= INT8_MIN && disp <= INT8_MAX);
+
+    *p++ = MODRM(d8 ? MOD_DISP8 : MOD_DISP32, HOSTREG(reg), HOSTREG(base));
+    if(HOSTREG(base) == rsp) {
+        *p++ = 0x24;
+    }
+    if(d8) {
+        *(int8_t *)p++ = (int8_t)disp;
+    } else {
+        *(int32_t *)p = disp;
+        p += sizeof(int32_t);
+    }
+    return p;
+}
+
+uint8_t*
+jit_emit__mov_disp64_to_reg(uint8_t *p, jit_host_reg base, int32_t disp,
+        jit_host_reg reg)
+{
+    *p++ = REX(1, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x8b;
+    return jit_emit__modrm_disp(p, reg, base, disp);
+}
+
+uint8_t*
+jit_emit__mov_reg64_to_disp(uint8_t *p, jit_host_reg reg, jit_host_reg base,
+        int32_t disp)
+{
+    *p++ = REX(1, NEED_REX(reg), 0, NEED_REX(base));
+    *p++ = 0x89;
+    return jit_emit__modrm_disp(p, reg, base, disp);
+}
+
+/* The REX prefix addressing [rp] with reg in the ModRM reg field needs, if
+ * any. */
+uint8_t*
+jit_emit__rex_regptr(uint8_t *p, int w, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    int r = reg != JIT_HOST_REG_INVALID && NEED_REX(reg);
+    int x = rp->index != JIT_HOST_REG_INVALID && NEED_REX(rp->index);
+    int b = rp->base != JIT_HOST_REG_INVALID && NEED_REX(rp->base);
+
+    if(w || r || x || b) *p++ = REX(w, r, x, b);
+    return p;
+}
+
+/* The ModRM and SIB bytes and the displacement for [base + index << scale +
+ * offset], in the shortest form. Either register may be missing; the index
+ * cannot be rsp. */
+uint8_t*
+jit_emit__regptr_operand(uint8_t *p, jit_host_reg reg, struct jit_host_ptr *rp)
+{
+    int has_index = rp->index != JIT_HOST_REG_INVALID;
+    int scale = (has_index && rp->scale > 0) ? rp->scale : 0;
+    int mod;
+
+    if(rp->base == JIT_HOST_REG_INVALID) {
+        // No base: [index << scale + disp32], or plain [disp32].
+        *p++ = MODRM(MOD_RIP_SIB, HOSTREG(reg), 4);
+        *p++ = MODRM(scale, has_index ? HOSTREG(rp->index) : 4, RM_DISP32);
+        *(int32_t *)p = rp->offset;
+        return p + sizeof(int32_t);
+    }
+
+    // rbp and r13 as base have no form without a displacement.
+    if(rp->offset == 0 && HOSTREG(rp->base) != RM_DISP32) {
+        mod = MOD_RIP_SIB;
+    } else if(rp->offset >= INT8_MIN && rp->offset <= INT8_MAX) {
+        mod = MOD_DISP8;
+    } else {
+        mod = MOD_DISP32;
+    }
+    // rsp and r12 as base need a SIB byte, as does an index.
+    if(has_index || HOSTREG(rp->base) == 4) {
+        *p++ = MODRM(mod, HOSTREG(reg), 4);
+        *p++ = MODRM(scale, has_index ? HOSTREG(rp->index) : 4,
+                HOSTREG(rp->base));
+    } else {
+        *p++ = MODRM(mod, HOSTREG(reg), HOSTREG(rp->base));
+    }
+    if(mod == MOD_DISP8) {
+        *(int8_t *)p++ = (int8_t)rp->offset;
+    } else if(mod == MOD_DISP32) {
+        *(int32_t *)p = rp->offset;
+        p += sizeof(int32_t);
+    }
+    return p;
+}
+
+uint8_t*
+jit_emit__lea_regptr32_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    p = jit_emit__rex_regptr(p, 0, reg, rp);
+    *p++ = 0x8d;
+    return jit_emit__regptr_operand(p, reg, rp);
+}
+
+uint8_t*
+jit_emit__lea_regptr64_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    p = jit_emit__rex_regptr(p, 1, reg, rp);
+    *p++ = 0x8d;
+    return jit_emit__regptr_operand(p, reg, rp);
+}
+
+/* Sign-extend the low 32 bits of regin into regout. */
+uint8_t*
+jit_emit__movsxd_reg32_to_reg64(uint8_t *p, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x63;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__mov_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_8BIT, 0x89, regin, regout);
+}
+
+uint8_t*
+jit_emit__mov_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_16BIT, 0x89, regin, regout);
+}
+
+uint8_t*
+jit_emit__mov_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_64BIT, 0x89, regin, regout);
+}
+
+/* Loads and stores of opsz bytes, and the zero- (0f b6/b7) and sign-
+ * extending (0f be/bf, 63) loads, as prefixes and opcode then the memory
+ * operand. A two-byte opcode is given with its 0x0f escape in the high
+ * byte. */
+static uint8_t*
+jit_emit__memop(uint8_t *p, size_t opsz, uint16_t opc, jit_host_reg reg,
+        jit_host_reg base)
+{
+    p = jit_emit__rex_opsz(p, opsz, reg, base);
+    if(opc > 0xff) *p++ = opc >> 8;
+    *p++ = opc & 0xff;
+    return p;
+}
+
+/* As above, RIP-relative to m. */
+uint8_t*
+jit_emit__memop_m(uint8_t *p, size_t opsz, uint16_t opc, jit_host_reg reg,
+        void *m)
+{
+    p = jit_emit__memop(p, opsz, opc, reg, JIT_HOST_REG_INVALID);
+    *p++ = MODRM(MOD_RIP_SIB, HOSTREG(reg), RM_DISP32);
+    *(int32_t *)p = (int32_t)((int64_t)m - (int64_t)(p + sizeof(int32_t)));
+    return p + sizeof(int32_t);
+}
+
+uint8_t*
+jit_emit__mov_m64_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_64BIT, 0x8b, reg, m);
+}
+
+uint8_t*
+jit_emit__mov_reg64_to_m(uint8_t *p, jit_host_reg reg, int32_t *m)
+{
+    return jit_emit__memop_m(p, JIT_64BIT, 0x89, reg, m);
+}
+
+uint8_t*
+jit_emit__movzx_m8_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_32BIT, 0x0fb6, reg, m);
+}
+
+uint8_t*
+jit_emit__movzx_m16_to_reg(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_32BIT, 0x0fb7, reg, m);
+}
+
+uint8_t*
+jit_emit__movsx_m8_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_64BIT, 0x0fbe, reg, m);
+}
+
+uint8_t*
+jit_emit__movsx_m16_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_64BIT, 0x0fbf, reg, m);
+}
+
+uint8_t*
+jit_emit__movsxd_m32_to_reg64(uint8_t *p, int32_t *m, jit_host_reg reg)
+{
+    return jit_emit__memop_m(p, JIT_64BIT, 0x63, reg, m);
+}
+
+uint8_t*
+jit_emit__mov_ind64_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_64BIT, 0x8b, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__mov_reg64_to_ind(uint8_t *p, jit_host_reg reg, jit_host_reg base)
+{
+    p = jit_emit__memop(p, JIT_64BIT, 0x89, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__movzx_ind8_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_32BIT, 0x0fb6, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__movzx_ind16_to_reg(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_32BIT, 0x0fb7, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__movsx_ind8_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_64BIT, 0x0fbe, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__movsx_ind16_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_64BIT, 0x0fbf, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+uint8_t*
+jit_emit__movsxd_ind32_to_reg64(uint8_t *p, jit_host_reg base, jit_host_reg reg)
+{
+    p = jit_emit__memop(p, JIT_64BIT, 0x63, reg, base);
+    return jit_emit__modrm_ind(p, reg, base);
+}
+
+/* Zero-extend the low 8 or 16 bits of regin into regout (writing the 32-bit
+ * register clears the rest), or sign-extend them into all of regout. */
+uint8_t*
+jit_emit__movzx_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, JIT_8BIT, regout, regin);
+    *p++ = 0x0f;
+    *p++ = 0xb6;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__movzx_reg16_to_reg(uint8_t *p, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, JIT_32BIT, regout, regin);
+    *p++ = 0x0f;
+    *p++ = 0xb7;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__movsx_reg8_to_reg64(uint8_t *p, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x0f;
+    *p++ = 0xbe;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__movsx_reg16_to_reg64(uint8_t *p, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x0f;
+    *p++ = 0xbf;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+/* Loads from and stores to [base + index << scale + offset], as for
+ * jit_emit__memop. The byte registers spl..dil need a REX prefix to be
+ * told from ah..bh. */
+uint8_t*
+jit_emit__regptr_op(uint8_t *p, size_t opsz, uint16_t opc, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    int r = NEED_REX(reg);
+    int x = rp->index != JIT_HOST_REG_INVALID && NEED_REX(rp->index);
+    int b = rp->base != JIT_HOST_REG_INVALID && NEED_REX(rp->base);
+    int byte = opsz == JIT_8BIT && reg >= rsp && reg <= rdi;
+
+    if(opsz == JIT_16BIT) *p++ = 0x66;
+    if(opsz == JIT_64BIT || r || x || b || byte)
+        *p++ = REX(opsz == JIT_64BIT, r, x, b);
+    if(opc > 0xff) *p++ = opc >> 8;
+    *p++ = opc & 0xff;
+    return jit_emit__regptr_operand(p, reg, rp);
+}
+
+uint8_t*
+jit_emit__movzx_regptr8_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_32BIT, 0x0fb6, reg, rp);
+}
+
+uint8_t*
+jit_emit__movzx_regptr16_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_32BIT, 0x0fb7, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_regptr32_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_32BIT, 0x8b, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_regptr64_to_reg(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_64BIT, 0x8b, reg, rp);
+}
+
+uint8_t*
+jit_emit__movsx_regptr8_to_reg64(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_64BIT, 0x0fbe, reg, rp);
+}
+
+uint8_t*
+jit_emit__movsx_regptr16_to_reg64(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_64BIT, 0x0fbf, reg, rp);
+}
+
+uint8_t*
+jit_emit__movsxd_regptr32_to_reg64(uint8_t *p, struct jit_host_ptr *rp,
+        jit_host_reg reg)
+{
+    return jit_emit__regptr_op(p, JIT_64BIT, 0x63, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_reg8_to_regptr(uint8_t *p, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, JIT_8BIT, 0x88, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_reg16_to_regptr(uint8_t *p, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, JIT_16BIT, 0x89, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_reg32_to_regptr(uint8_t *p, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, JIT_32BIT, 0x89, reg, rp);
+}
+
+uint8_t*
+jit_emit__mov_reg64_to_regptr(uint8_t *p, jit_host_reg reg,
+        struct jit_host_ptr *rp)
+{
+    return jit_emit__regptr_op(p, JIT_64BIT, 0x89, reg, rp);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2015 Tim Kelsall.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "jit_x86_64.h"
+
+uint8_t*
+jit_emit__imul_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    if(NEED_REX(regin) || NEED_REX(regout)) *p++ =
+        REX(0, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x0f;
+    *p++ = 0xaf;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__imul_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    *p++ = 0x0f;
+    *p++ = 0xaf;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+/* regout = regin * imm, taking the imm8 form when the immediate fits. */
+uint8_t*
+jit_emit__imul_imm32_reg_to_reg(uint8_t *p, int32_t imm, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    if(NEED_REX(regin) || NEED_REX(regout)) *p++ =
+        REX(0, NEED_REX(regout), 0, NEED_REX(regin));
+    if(imm >= INT8_MIN && imm <= INT8_MAX) {
+        *p++ = 0x6b;
+        *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+        *(int8_t *)p++ = (int8_t)imm;
+    } else {
+        *p++ = 0x69;
+        *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+        *(int32_t *)p = imm;
+        p += sizeof(int32_t);
+    }
+    return p;
+}
+
+/* The same on 64 bits. */
+uint8_t*
+jit_emit__imul_imm32_reg64_to_reg(uint8_t *p, int32_t imm, jit_host_reg regin,
+        jit_host_reg regout)
+{
+    *p++ = REX(1, NEED_REX(regout), 0, NEED_REX(regin));
+    if(imm >= INT8_MIN && imm <= INT8_MAX) {
+        *p++ = 0x6b;
+        *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+        *(int8_t *)p++ = (int8_t)imm;
+    } else {
+        *p++ = 0x69;
+        *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+        *(int32_t *)p = imm;
+        p += sizeof(int32_t);
+    }
+    return p;
+}
+
+/* rdx:rax = rax * reg, unsigned. */
+uint8_t*
+jit_emit__mul_wide_reg64(uint8_t *p, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 4, HOSTREG(reg));
+    return p;
+}
+
+/* The same, signed. */
+uint8_t*
+jit_emit__imul_wide_reg64(uint8_t *p, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 5, HOSTREG(reg));
+    return p;
+}
+
+/* edx:eax / reg, unsigned: quotient in eax, remainder in edx. */
+uint8_t*
+jit_emit__div_reg32(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 6, HOSTREG(reg));
+    return p;
+}
+
+/* The same, signed. */
+uint8_t*
+jit_emit__idiv_reg32(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 7, HOSTREG(reg));
+    return p;
+}
+
+/* Sign-extend eax into edx. */
+uint8_t*
+jit_emit__cdq(uint8_t *p)
+{
+    *p++ = 0x99;
+    return p;
+}
+
+/* rdx:rax / reg, unsigned: quotient in rax, remainder in rdx. */
+uint8_t*
+jit_emit__div_reg64(uint8_t *p, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 6, HOSTREG(reg));
+    return p;
+}
+
+/* The same, signed. */
+uint8_t*
+jit_emit__idiv_reg64(uint8_t *p, jit_host_reg reg)
+{
+    *p++ = REX(1, 0, 0, NEED_REX(reg));
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 7, HOSTREG(reg));
+    return p;
+}
+
+/* Sign-extend rax into rdx. */
+uint8_t*
+jit_emit__cqo(uint8_t *p)
+{
+    *p++ = REX_W;
+    *p++ = 0x99;
+    return p;
+}
@@ -25,7 +25,7 @@
 uint8_t*
 jit_emit__shr_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
+    if(NEED_REX(regout)) *p++ = REX_B;
     *p++ = 0xc1;
     *p++ = MODRM(MOD_REGDIRECT, OX_SHR, HOSTREG(regout));
     *(int8_t *)p++ = (int8_t)imm;
@@ -36,7 +36,7 @@ jit_emit__shr_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 uint8_t*
 jit_emit__shl_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
+    if(NEED_REX(regout)) *p++ = REX_B;
     *p++ = 0xc1;
     *p++ = MODRM(MOD_REGDIRECT, OX_SHL, HOSTREG(regout));
     *(int8_t *)p++ = (int8_t)imm;
@@ -47,10 +47,156 @@ jit_emit__shl_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 uint8_t*
 jit_emit__sar_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
+    if(NEED_REX(regout)) *p++ = REX_B;
     *p++ = 0xc1;
     *p++ = MODRM(MOD_REGDIRECT, OX_SAR, HOSTREG(regout));
     *(int8_t *)p++ = (int8_t)imm;
     
     return p;
 }
+
+/* BMI2 shlx/shrx/sarx: regout = regin shifted by regcount, flags untouched.
+ * pp selects the shift (the mandatory prefix of the legacy encoding), and w
+ * the 64-bit form. */
+static uint8_t*
+jit_emit__bmi2_shift(uint8_t *p, int w, int pp, jit_host_reg regin,
+        jit_host_reg regcount, jit_host_reg regout)
+{
+    *p++ = 0xc4;
+    *p++ = (!NEED_REX(regout) << 7) | (1 << 6) | (!NEED_REX(regin) << 5) |
+        0x02;
+    *p++ = (!!w << 7) | ((~regcount & 0xf) << 3) | pp;
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, HOSTREG(regout), HOSTREG(regin));
+    return p;
+}
+
+uint8_t*
+jit_emit__shlx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 0, 1, regin, regcount, regout);
+}
+
+uint8_t*
+jit_emit__sarx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 0, 2, regin, regcount, regout);
+}
+
+uint8_t*
+jit_emit__shrx_reg32(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 0, 3, regin, regcount, regout);
+}
+
+uint8_t*
+jit_emit__shlx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 1, 1, regin, regcount, regout);
+}
+
+uint8_t*
+jit_emit__sarx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 1, 2, regin, regcount, regout);
+}
+
+uint8_t*
+jit_emit__shrx_reg64(uint8_t *p, jit_host_reg regin, jit_host_reg regcount,
+        jit_host_reg regout)
+{
+    return jit_emit__bmi2_shift(p, 1, 3, regin, regcount, regout);
+}
+
+/* Shifts by an immediate of an 8-bit (c0), 16 or 64-bit (c1) register. */
+static uint8_t*
+jit_emit__shift_imm_to_reg(uint8_t *p, size_t opsz, int ox, int8_t imm,
+        jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, opsz, JIT_HOST_REG_INVALID, regout);
+    *p++ = (opsz == JIT_8BIT) ? 0xc0 : 0xc1;
+    *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+    *(int8_t *)p++ = imm;
+    return p;
+}
+
+uint8_t*
+jit_emit__shl_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_64BIT, OX_SHL, imm, regout);
+}
+
+uint8_t*
+jit_emit__shr_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_64BIT, OX_SHR, imm, regout);
+}
+
+uint8_t*
+jit_emit__sar_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_64BIT, OX_SAR, imm, regout);
+}
+
+uint8_t*
+jit_emit__shl_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_16BIT, OX_SHL, imm, regout);
+}
+
+uint8_t*
+jit_emit__shr_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_16BIT, OX_SHR, imm, regout);
+}
+
+uint8_t*
+jit_emit__sar_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_16BIT, OX_SAR, imm, regout);
+}
+
+uint8_t*
+jit_emit__shl_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_8BIT, OX_SHL, imm, regout);
+}
+
+uint8_t*
+jit_emit__shr_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_8BIT, OX_SHR, imm, regout);
+}
+
+uint8_t*
+jit_emit__sar_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__shift_imm_to_reg(p, JIT_8BIT, OX_SAR, imm, regout);
+}
+
+/* Shifts of an 8, 16, 32 or 64-bit register by cl. */
+uint8_t*
+jit_emit__shift_cl_to_reg(uint8_t *p, size_t opsz, int ox, jit_host_reg regout)
+{
+    p = jit_emit__rex_opsz(p, opsz, JIT_HOST_REG_INVALID, regout);
+    *p++ = (opsz == JIT_8BIT) ? 0xd2 : 0xd3;
+    *p++ = MODRM(MOD_REGDIRECT, ox, HOSTREG(regout));
+    return p;
+}
+
+/* CF = bit imm of regout. */
+uint8_t*
+jit_emit__bt_imm8_reg32(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    if(NEED_REX(regout)) *p++ = REX_B;
+    *p++ = 0x0f;
+    *p++ = 0xba;
+    *p++ = MODRM(MOD_REGDIRECT, 4, HOSTREG(regout));
+    *(int8_t *)p++ = imm;
+    return p;
+}
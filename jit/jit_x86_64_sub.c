@@ -35,13 +35,7 @@ jit_emit__sub_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 uint8_t*
 jit_emit__sub_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x81;
-    *p++ = MODRM(MOD_REGDIRECT, OX_SUB, HOSTREG(regout));
-    *(int32_t *)p = imm;
-    p += sizeof(int32_t);
-
-    return p;
+    return jit_emit__grp1_imm32_to_reg(p, OX_SUB, imm, regout);
 }
 
 uint8_t*
@@ -57,11 +51,127 @@ jit_emit__cmp_reg32_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
 uint8_t*
 jit_emit__cmp_imm32_to_reg(uint8_t *p, int32_t imm, jit_host_reg regout)
 {
-    if(NEED_REX(regout)) *p++ = REX_R;
-    *p++ = 0x81;
-    *p++ = MODRM(MOD_REGDIRECT, OX_CMP, HOSTREG(regout));
-    *(int32_t *)p = imm;
-    p += sizeof(int32_t);
+    return jit_emit__grp1_imm32_to_reg(p, OX_CMP, imm, regout);
+}
+
+uint8_t*
+jit_emit__sub_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm32_to_reg64(p, OX_SUB, imm, regout);
+}
+
+uint8_t*
+jit_emit__neg_reg32(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 3, HOSTREG(reg));
 
     return p;
 }
+
+uint8_t*
+jit_emit__neg_reg8(uint8_t *p, jit_host_reg reg)
+{
+    p = jit_emit__rex_opsz(p, JIT_8BIT, JIT_HOST_REG_INVALID, reg);
+    *p++ = 0xf6;
+    *p++ = MODRM(MOD_REGDIRECT, 3, HOSTREG(reg));
+
+    return p;
+}
+
+uint8_t*
+jit_emit__neg_reg16(uint8_t *p, jit_host_reg reg)
+{
+    p = jit_emit__rex_opsz(p, JIT_16BIT, JIT_HOST_REG_INVALID, reg);
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 3, HOSTREG(reg));
+
+    return p;
+}
+
+uint8_t*
+jit_emit__neg_reg64(uint8_t *p, jit_host_reg reg)
+{
+    p = jit_emit__rex_opsz(p, JIT_64BIT, JIT_HOST_REG_INVALID, reg);
+    *p++ = 0xf7;
+    *p++ = MODRM(MOD_REGDIRECT, 3, HOSTREG(reg));
+
+    return p;
+}
+
+uint8_t*
+jit_emit__dec_reg32(uint8_t *p, jit_host_reg reg)
+{
+    if(NEED_REX(reg)) *p++ = REX_B;
+    *p++ = 0xff;
+    *p++ = MODRM(MOD_REGDIRECT, 1, HOSTREG(reg));
+
+    return p;
+}
+
+uint8_t*
+jit_emit__sub_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_16BIT, 0x29, regin, regout);
+}
+
+uint8_t*
+jit_emit__sub_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_8BIT, 0x29, regin, regout);
+}
+
+uint8_t*
+jit_emit__sub_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_64BIT, 0x29, regin, regout);
+}
+
+uint8_t*
+jit_emit__sub_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm16_to_reg(p, OX_SUB, imm, regout);
+}
+
+uint8_t*
+jit_emit__sub_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm8_to_reg(p, OX_SUB, imm, regout);
+}
+
+uint8_t*
+jit_emit__cmp_reg16_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_16BIT, 0x39, regin, regout);
+}
+
+uint8_t*
+jit_emit__cmp_reg8_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_8BIT, 0x39, regin, regout);
+}
+
+uint8_t*
+jit_emit__cmp_reg64_to_reg(uint8_t *p, jit_host_reg regin, jit_host_reg regout)
+{
+    return jit_emit__alu_reg_to_reg(p, JIT_64BIT, 0x39, regin, regout);
+}
+
+uint8_t*
+jit_emit__cmp_imm16_to_reg(uint8_t *p, int16_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm16_to_reg(p, OX_CMP, imm, regout);
+}
+
+uint8_t*
+jit_emit__cmp_imm8_to_reg(uint8_t *p, int8_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm8_to_reg(p, OX_CMP, imm, regout);
+}
+
+uint8_t*
+jit_emit__cmp_imm32_to_reg64(uint8_t *p, int32_t imm, jit_host_reg regout)
+{
+    return jit_emit__grp1_imm32_to_reg64(p, OX_CMP, imm, regout);
+}
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <unistd.h>
 #include <sys/mman.h>
 
 #include "libjit.h"
+#include "jit/jit_ir.h"
 
 typedef int (*p_fn)(void);
+typedef int64_t (*p_fn64)(void);
 
 int dummyfn0(void) { return 1; }
 int dummyfn1(int a) { return a + 1; }
@@ -16,6 +20,31 @@ jit_error test_call(void);
 jit_error test_move(void);
 jit_error test_regs(void);
 jit_error test_opsz(void);
+jit_error test_codecache(void);
+jit_error test_growbuf(void);
+jit_error test_measure(void);
+jit_error test_arena(void);
+jit_error test_ir(void);
+jit_error test_liveness(void);
+jit_error test_linscan(void);
+jit_error test_frame(void);
+jit_error test_regmap(void);
+jit_error test_trace(void);
+jit_error test_branch(void);
+jit_error test_cfg(void);
+jit_error test_fold(void);
+jit_error test_dce(void);
+jit_error test_cse(void);
+jit_error test_peephole(void);
+jit_error test_lea(void);
+jit_error test_muldiv(void);
+jit_error test_widths(void);
+jit_error test_sib(void);
+jit_error test_memops(void);
+jit_error test_select(void);
+jit_error test_guest_flags(void);
+jit_error test_blockcache(void);
+jit_error test_smc(void);
 
 
 int main(int argc, char *argv[])
@@ -29,6 +58,56 @@ int main(int argc, char *argv[])
     printf("---- test_regs() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
     e = (test_opsz());
     printf("---- test_opsz() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_codecache());
+    printf("---- test_codecache() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_growbuf());
+    printf("---- test_growbuf() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_measure());
+    printf("---- test_measure() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_arena());
+    printf("---- test_arena() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_ir());
+    printf("---- test_ir() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_liveness());
+    printf("---- test_liveness() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_linscan());
+    printf("---- test_linscan() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_frame());
+    printf("---- test_frame() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_regmap());
+    printf("---- test_regmap() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_trace());
+    printf("---- test_trace() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_branch());
+    printf("---- test_branch() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_cfg());
+    printf("---- test_cfg() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_fold());
+    printf("---- test_fold() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_dce());
+    printf("---- test_dce() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_cse());
+    printf("---- test_cse() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_peephole());
+    printf("---- test_peephole() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_lea());
+    printf("---- test_lea() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_muldiv());
+    printf("---- test_muldiv() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_widths());
+    printf("---- test_widths() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_sib());
+    printf("---- test_sib() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_memops());
+    printf("---- test_memops() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_select());
+    printf("---- test_select() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_guest_flags());
+    printf("---- test_guest_flags() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_blockcache());
+    printf("---- test_blockcache() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
+    e = (test_smc());
+    printf("---- test_smc() %s\n\n", SUCCESS(e) ? GREEN("pass!") : REDBOLD("fail"));
 l_exit:
     return e;
 }
@@ -249,3 +328,3777 @@ jit_error test_opsz(void)
     return e;
 }
 
+
+jit_error test_codecache(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 2
+    jit_state *s;
+    struct jit_codecache *c;
+    struct jit_instr *i[NUM_INSTRS];
+    jit_error e = JIT_SUCCESS;
+    int res = 0;
+
+    void *code = NULL;
+    void *code2 = NULL;
+    void *blk[3];
+    size_t n;
+
+    printf("-- test_codecache: "UL("Testing W^X code cache blocks")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    e = jit_codecache_create(&c, 0);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    for(n = 0; n < NUM_INSTRS; n++) {
+        i[n] = jit_instr_new(s);
+    }
+
+    CALL_M(i[0], (int32_t*)dummyfn0, JIT_32BIT);
+    RET(i[1]);
+
+    jit_codecache_alloc(c, 64, &code);
+    jit_begin_block_mapped(s, jit_codecache_rw(c, code), code, 64);
+    jit_emit_all(s);
+    jit_end_block(s);
+
+    printf("executing code at %p (written at %p)\n", code,
+            jit_codecache_rw(c, code));
+    res = ((p_fn)code)();
+    printf(BOLD("@ expected return %d\n"), dummyfn0());
+    e = (res == dummyfn0()) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+    printf(BOLD("@ jit code returned %d\n"), res);
+
+    // A freed block should be handed out again.
+    jit_codecache_free(c, code);
+    jit_codecache_alloc(c, 32, &code2);
+    if(code2 != code) {
+        printf(BOLD("@ freed block %p was not reused (got %p)\n"), code, code2);
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+    // Neighbours freed in any order merge, and what ends up at the top of
+    // the region goes back to it.
+    jit_codecache_alloc(c, 64, &blk[0]);
+    jit_codecache_alloc(c, 64, &blk[1]);
+    jit_codecache_alloc(c, 64, &blk[2]);
+    jit_codecache_free(c, blk[1]);
+    jit_codecache_free(c, blk[0]);
+    jit_codecache_alloc(c, 128, &code);
+    if(code != blk[0]) {
+        printf(BOLD("@ freed neighbours were not merged\n"));
+        e = JIT_ERROR_UNKNOWN;
+    }
+    jit_codecache_free(c, blk[2]);
+    jit_codecache_free(c, code);
+    jit_codecache_alloc(c, 4096, &code);
+    if(code != blk[0]) {
+        printf(BOLD("@ freed top of the region was not given back\n"));
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+    jit_codecache_destroy(c);
+    jit_destroy(s);
+
+l_exit:
+    return e;
+}
+
+jit_error test_growbuf(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 5
+    jit_state *s;
+    struct jit_codecache *c;
+    struct jit_instr *i[NUM_INSTRS];
+    jit_error e = JIT_SUCCESS;
+    jit_reg r[2];
+    int res = 0;
+
+    static int32_t data = 0x1000;
+    uint8_t small[16 + 4];
+    void *code = NULL;
+    size_t n;
+
+    printf("-- test_growbuf: "UL("Testing buffer overflow and relocation")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    e = jit_codecache_create(&c, 0);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    for(n = 0; n < NUM_INSTRS; n++) {
+        i[n] = jit_instr_new(s);
+    }
+
+    CALL_M(i[0], (int32_t*)dummyfn0, JIT_32BIT);
+        r[0] = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        r[1] = jit_reg_new(s);
+    MOVE_M_R(i[1], &data, r[1], JIT_32BIT);
+    ADD_R_R_R(i[2], r[1], r[0], r[0], JIT_32BIT);
+    MOVE_R_M(i[3], r[0], &data, JIT_32BIT);
+    RET(i[4]);
+
+    // Give the emitter far too little room, and check it stays inside it.
+    memset(small, 0xcc, sizeof(small));
+    jit_begin_block_sized(s, small, 16);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+    for(n = 16; n < sizeof(small); n++) {
+        if(small[n] != 0xcc) {
+            printf(BOLD("@ emitter wrote past the end of the buffer\n"));
+            e = JIT_ERROR_UNKNOWN;
+        }
+    }
+    if(FAILURE(e) || s->p_bufstart == small) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    jit_codecache_alloc(c, s->blk_nb, &code);
+    jit_copy_block(s, jit_codecache_rw(c, code), code);
+
+    printf("executing code at %p\n", code);
+    res = ((p_fn)code)();
+    printf(BOLD("@ expected return %d\n"), 0x1001);
+    e = (res == 0x1001 && data == 0x1001) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+    printf(BOLD("@ jit code returned %d\n"), res);
+
+l_cleanup:
+    jit_codecache_destroy(c);
+    jit_destroy(s);
+
+l_exit:
+    return e;
+}
+
+jit_error test_measure(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 19
+    jit_state *s;
+    struct jit_codecache *c;
+    struct jit_instr *i[NUM_INSTRS];
+    jit_error e = JIT_SUCCESS;
+    jit_reg r[NUM_INSTRS - 1];
+    int res = 0;
+
+    static int32_t data = 0x2000;
+    uint8_t *buffer = NULL;
+    void *code = NULL;
+    size_t n, nb = 0;
+
+    printf("-- test_measure: "UL("Testing exact code size pre-pass")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    e = jit_codecache_create(&c, 0);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    for(n = 0; n < 5; n++) {
+        i[n] = jit_instr_new(s);
+    }
+
+    CALL_M(i[0], (int32_t*)dummyfn0, JIT_32BIT);
+        r[0] = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        r[1] = jit_reg_new(s);
+    MOVE_M_R(i[1], &data, r[1], JIT_32BIT);
+    ADD_R_R_R(i[2], r[1], r[0], r[0], JIT_32BIT);
+    MOVE_R_M(i[3], r[0], &data, JIT_32BIT);
+    RET(i[4]);
+
+    e = jit_measure_all(s, jit_codecache_top(c), &nb);
+    printf("measured %zu bytes\n", nb);
+    jit_codecache_alloc(c, nb, &code);
+    jit_begin_block_mapped(s, jit_codecache_rw(c, code), code, nb);
+    jit_emit_all(s);
+    jit_end_block(s);
+    if(FAILURE(e) || s->blk_nb != nb || s->p_bufexec != code) {
+        printf(BOLD("@ measured %zu bytes, emitted %zu\n"), nb, s->blk_nb);
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    printf("executing code at %p\n", code);
+    res = ((p_fn)code)();
+    printf(BOLD("@ expected return %d\n"), 0x2001);
+    e = (res == 0x2001) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+    printf(BOLD("@ jit code returned %d\n"), res);
+    jit_destroy(s);
+
+    // A block under register pressure: the spill and restore code must be
+    // accounted for too.
+    jit_create(&s, JIT_FLAG_NONE);
+    for(n = 0; n < NUM_INSTRS; n++) {
+        i[n] = jit_instr_new(s);
+    }
+    jit_reg_new_fixed(s, JIT_REGMAP_SP);
+    r[0] = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    for(n = 1; n < NUM_INSTRS - 1; n++) {
+        r[n] = jit_reg_new(s);
+    }
+    MOVE_I_R(i[0], 0xdeadbeef, r[0], JIT_32BIT);
+    for(n = 1; n < NUM_INSTRS - 1; n++) {
+        MOVE_R_R(i[n], r[n-1], r[n], JIT_32BIT);
+    }
+    MOVE_R_R(i[17], r[1], r[0], JIT_32BIT);
+    RET(i[18]);
+
+    buffer = malloc(4096);
+    jit_measure_all(s, buffer, &nb);
+    jit_begin_block(s, buffer);
+    jit_emit_all(s);
+    jit_end_block(s);
+    printf(BOLD("@ measured %zu bytes, emitted %zu\n"), nb, s->blk_nb);
+    if(s->blk_nb != nb) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    free(buffer);
+
+l_cleanup:
+    jit_codecache_destroy(c);
+    jit_destroy(s);
+
+l_exit:
+    return e;
+}
+
+jit_error test_arena(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 1000
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *first, *i;
+    jit_reg r;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t n = 0;
+    int res = -1;
+
+    printf("-- test_arena: "UL("Testing instruction arena and block reset")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+
+    // Enough instructions to span several slabs; earlier pointers must
+    // remain valid while later ones are created.
+    r = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    first = jit_instr_new(s);
+    MOVE_I_R(first, 0, r, JIT_32BIT);
+    for(n = 1; n < NUM_INSTRS - 1; n++) {
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1, r, r, JIT_32BIT);
+    }
+    RET(jit_instr_new(s));
+    for(i = s->blk_is, n = 0; i != NULL; i = i->next, n++);
+    if(first != s->blk_is || first->in1.imm32 != 0 || n != NUM_INSTRS) {
+        printf(BOLD("@ instruction list broken (%zu instrs)\n"), n);
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    // Start again: the slabs must be recycled.
+    jit_reset_block(s);
+    r = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    i = jit_instr_new(s);
+    if(i != first) {
+        printf(BOLD("@ slab not reused after reset\n"));
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    MOVE_I_R(i, 42, r, JIT_32BIT);
+    RET(jit_instr_new(s));
+
+    jit_begin_block(s, abuffer);
+    jit_emit_all(s);
+    jit_end_block(s);
+
+    mprotect(abuffer, 4096, PROT_READ | PROT_WRITE | PROT_EXEC);
+    printf("executing code at %p\n", abuffer);
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ expected return %d\n"), 42);
+    e = (res == 42 && s->blk_ni == 2) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+    printf(BOLD("@ jit code returned %d\n"), res);
+
+l_cleanup:
+    free(buffer);
+    jit_destroy(s);
+
+    return e;
+}
+
+jit_error test_ir(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 8
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i[NUM_INSTRS], d;
+    struct jit_ir *ir;
+    jit_reg r[3];
+    int32_t data = 0;
+    size_t n, start, end, irbytes;
+
+    printf("-- test_ir: "UL("Testing the compact IR layout")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    for(n = 0; n < NUM_INSTRS; n++) {
+        i[n] = jit_instr_new(s);
+    }
+    for(n = 0; n < 3; n++) {
+        r[n] = jit_reg_new(s);
+    }
+    MOVE_I_R(i[0], -5, r[0], JIT_32BIT);
+    MOVE_M_R(i[1], &data, r[1], JIT_32BIT);
+    ADD_R_R_R(i[2], r[0], r[1], r[2], JIT_32BIT);
+    MOVE_RP_R(i[3], r[2], r[0], 4, 16, r[1], JIT_32BIT);
+    SHL_I_R_R(i[4], 3, r[1], r[1], JIT_32BIT);
+    MOVE_R_RP(i[5], r[1], r[2], JIT_REG_INVALID, 1, -8, JIT_16BIT);
+    MOVE_R_M(i[6], r[1], &data, JIT_32BIT);
+    RET(i[7]);
+
+    e = jit_ir_build(s);
+    ir = s->p_ir;
+    if(FAILURE(e) || ir->n != NUM_INSTRS) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_exit;
+    }
+    for(n = 0; n < NUM_INSTRS; n++) {
+        jit_ir_get(ir, n, &d);
+        if(d.op != i[n]->op || d.opsz != i[n]->opsz ||
+                d.in1_type != i[n]->in1_type || d.in2_type != i[n]->in2_type ||
+                d.out_type != i[n]->out_type ||
+                (d.in1_type == JIT_OPERAND_REG && d.in1.reg != i[n]->in1.reg) ||
+                (d.in1_type == JIT_OPERAND_IMM && d.in1.imm32 != i[n]->in1.imm32) ||
+                (d.in1_type == JIT_OPERAND_IMMPTR && d.in1.ptr != i[n]->in1.ptr) ||
+                (d.in1_type == JIT_OPERAND_REGPTR &&
+                 memcmp(&d.in1.regptr, &i[n]->in1.regptr, sizeof(struct jit_ptr))) ||
+                (d.out_type == JIT_OPERAND_REGPTR &&
+                 memcmp(&d.out.regptr, &i[n]->out.regptr, sizeof(struct jit_ptr)))) {
+            printf(BOLD("@ instruction %zu does not round-trip\n"), n);
+            e = JIT_ERROR_UNKNOWN;
+        }
+    }
+
+    irbytes = 2 + JIT_IR_NSLOTS * (sizeof(int8_t) + sizeof(int32_t));
+    printf(BOLD("@ %zu bytes per instruction, was %zu (+%zu per wide operand)\n"),
+            irbytes, sizeof(struct jit_instr), sizeof(jit_operand_union));
+    if(3 * irbytes > sizeof(struct jit_instr)) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+    jit_reg_life(s, r[0], &start, &end);
+    if(start != 0 || end != 3) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_exit:
+    jit_destroy(s);
+
+    return e;
+}
+
+jit_error test_liveness(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 6
+#define NUM_LONG 5000
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i[NUM_INSTRS];
+    struct jit_liveness *l;
+    struct jit_live_range *lr;
+    jit_reg r[3];
+    size_t n;
+
+    printf("-- test_liveness: "UL("Testing live ranges of all registers")"\n--\n");
+    e = jit_create(&s, JIT_FLAG_NONE);
+    for(n = 0; n < NUM_INSTRS; n++) {
+        i[n] = jit_instr_new(s);
+    }
+    for(n = 0; n < 3; n++) {
+        r[n] = jit_reg_new(s);
+    }
+    MOVE_I_R(i[0], 1, r[0], JIT_32BIT);
+    ADD_I_R_R(i[1], 2, r[0], r[0], JIT_32BIT);
+    ADD_R_R_R(i[2], r[0], r[1], r[0], JIT_32BIT);
+    MOVE_I_R(i[3], 5, r[0], JIT_32BIT);
+    ADD_R_R_R(i[4], r[0], r[0], r[2], JIT_32BIT);
+    RET(i[5]);
+
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_liveness(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    l = s->p_live;
+
+    // r0 is redefined at 3, so it has two ranges; updates in place do not
+    // split a range. r1 is live on entry, r2 is written but never read.
+    lr = &l->ranges[l->first[r[0]]];
+    printf(BOLD("@ r0: [%u,%u]"), lr->start, lr->end);
+    if(lr->start != 0 || lr->end != 2 || lr->next == JIT_LIVE_NONE) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_exit;
+    }
+    lr = &l->ranges[lr->next];
+    printf(BOLD(" [%u,%u]\n"), lr->start, lr->end);
+    if(lr->start != 3 || lr->end != 4 || lr->next != JIT_LIVE_NONE) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    lr = jit_live_range_at(l, r[1], 1);
+    if(lr == NULL || lr->start != 0 || lr->end != 2) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    lr = jit_live_range_at(l, r[2], 4);
+    if(lr == NULL || lr->start != 4 || lr->end != 4 ||
+            jit_live_range_at(l, r[0], 5) != NULL) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    jit_destroy(s);
+
+    // A long trace over many registers, each redefined every 100 instrs.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    for(n = 0; n < 100; n++) {
+        jit_reg_new(s);
+    }
+    for(n = 0; n < NUM_LONG; n++) {
+        struct jit_instr *in = jit_instr_new(s);
+        if(n % 100 < 50) {
+            MOVE_I_R(in, (int32_t)n, (jit_reg)(n % 50), JIT_32BIT);
+        } else {
+            ADD_R_R_R(in, (jit_reg)(n % 50), (jit_reg)(n % 50), 50 + n % 50,
+                    JIT_32BIT);
+        }
+    }
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_liveness(s);
+    }
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    l = s->p_live;
+    printf(BOLD("@ %u ranges over %u instructions\n"), l->nranges, NUM_LONG);
+    if(l->nranges != NUM_LONG) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_exit:
+    jit_destroy(s);
+
+    return e;
+}
+
+jit_error test_linscan(void)
+{
+#undef NUM_INSTRS
+#define NUM_INSTRS 40
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg r[NUM_INSTRS], ret;
+    size_t nb_age = 0, nb_ls = 0;
+    jit_flags flags;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t n = 0;
+    int res = -1;
+
+    printf("-- test_linscan: "UL("Testing the linear scan register allocator")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+
+    // More values live at once than there are registers, across a call:
+    // some go to callee-saved registers, the rest are split to memory.
+    e = jit_create(&s, JIT_FLAG_LINEAR_SCAN);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    for(n = 0; n < 20; n++) {
+        r[n] = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, (int32_t)n + 1, r[n], JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    CALL_M(i, (int32_t*)dummyfn0, JIT_32BIT);
+    i = jit_instr_new(s);
+    XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+    for(n = 0; n < 20; n++) {
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, r[n], ret, ret, JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    SUB_R_R_R(i, ret, r[0], ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    RET(i);
+
+    jit_begin_block(s, abuffer);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+    printf("executing code at %p\n", abuffer);
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ expected return %d\n"), 209);
+    printf(BOLD("@ jit code returned %d\n"), res);
+    if(res != 209) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    jit_destroy(s);
+    s = NULL;
+
+    // A chain of short-lived values: registers are released as values die,
+    // so nothing needs spilling. The age-based allocator has to.
+    for(flags = JIT_FLAG_NONE; SUCCESS(e) && flags <= JIT_FLAG_LINEAR_SCAN;
+            flags += JIT_FLAG_LINEAR_SCAN) {
+        e = jit_create(&s, flags);
+        jit_reg_new_fixed(s, JIT_REGMAP_SP);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        r[0] = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, r[0], JIT_32BIT);
+        for(n = 1; n < NUM_INSTRS; n++) {
+            r[n] = jit_reg_new(s);
+            i = jit_instr_new(s);
+            MOVE_R_R(i, r[n-1], r[n], JIT_32BIT);
+            i = jit_instr_new(s);
+            ADD_I_R_R(i, 1, r[n], r[n], JIT_32BIT);
+        }
+        i = jit_instr_new(s);
+        MOVE_R_R(i, r[NUM_INSTRS-1], ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+
+        e = jit_measure_all(s, abuffer, flags ? &nb_ls : &nb_age);
+        if(SUCCESS(e) && flags) {
+            jit_begin_block(s, abuffer);
+            e = jit_emit_all(s);
+            jit_end_block(s);
+            res = ((p_fn)abuffer)();
+            printf(BOLD("@ chain returned %d, expected %d\n"), res,
+                    NUM_INSTRS - 1);
+            if(res != NUM_INSTRS - 1 || s->blk_nb != nb_ls) {
+                e = JIT_ERROR_UNKNOWN;
+            }
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    printf(BOLD("@ chain: %zu bytes with linear scan, %zu age-based\n"),
+            nb_ls, nb_age);
+    if(nb_ls >= nb_age) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_frame_base;
+static int g_frame_depth;
+static int g_frame_inner = -1;
+static p_fn g_frame_fn;
+
+/* Called from the middle of the block: runs the block once more, with other
+ * values, while the outer run has its spilled values on the stack. */
+int frame_reenter(void)
+{
+    if(g_frame_depth++ == 0) {
+        g_frame_base = 1000;
+        g_frame_inner = g_frame_fn();
+    }
+    return 0;
+}
+
+jit_error test_frame(void)
+{
+#undef NUM_VALUES
+#define NUM_VALUES 40
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg r[NUM_VALUES], ret;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t n = 0;
+    int res = -1;
+
+    printf("-- test_frame: "UL("Testing spill slots in the stack frame")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // Far more values live at once than there are registers, with the
+    // age-based allocator: every spill needs its own slot.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    jit_reg_new_fixed(s, JIT_REGMAP_SP);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    for(n = 0; n < NUM_VALUES; n++) {
+        r[n] = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, (int32_t)n + 1, r[n], JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+    for(n = 0; n < NUM_VALUES; n++) {
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, r[n], ret, ret, JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    RET(i);
+
+    jit_begin_block(s, abuffer);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ %d values: returned %d, expected %d\n"), NUM_VALUES, res,
+            NUM_VALUES * (NUM_VALUES + 1) / 2);
+    if(res != NUM_VALUES * (NUM_VALUES + 1) / 2) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    jit_destroy(s);
+    s = NULL;
+
+    // With spilled values live across a call that re-enters the block, the
+    // inner run must not clobber the outer one's slots.
+    e = jit_create(&s, JIT_FLAG_LINEAR_SCAN);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    for(n = 0; n < 20; n++) {
+        r[n] = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_frame_base, r[n], JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, (int32_t)n, r[n], r[n], JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    CALL_M(i, (int32_t*)frame_reenter, JIT_32BIT);
+    i = jit_instr_new(s);
+    XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+    for(n = 0; n < 20; n++) {
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, r[n], ret, ret, JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    RET(i);
+
+    jit_begin_block(s, abuffer);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    g_frame_fn = (p_fn)abuffer;
+    res = g_frame_fn();
+    printf(BOLD("@ re-entered: outer returned %d, inner %d\n"), res,
+            g_frame_inner);
+    if(res != 190 || g_frame_inner != 20190) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+jit_error test_regmap(void)
+{
+#undef NUM_VALUES
+#define NUM_VALUES 2000
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg r, prev, ret, arg;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t n = 0;
+    int res = -1;
+
+    printf("-- test_regmap: "UL("Testing fixed mappings and the vreg lookup table")"\n--\n");
+    buffer = malloc(65536 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 65536, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // Pinning is checked against the register actually pinned to, and a
+    // cleared mapping frees it for the next one.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    arg = jit_reg_new(s);
+    e = jit_set_reg_mapping(s, arg, JIT_REGMAP_CALL_ARG4);
+    if(SUCCESS(e)) {
+        e = jit_set_reg_mapping(s, jit_reg_new(s), JIT_REGMAP_SP);
+    }
+    if(SUCCESS(e) && jit_set_reg_mapping(s, jit_reg_new(s),
+                JIT_REGMAP_CALL_ARG4) != JIT_ERROR_REG_BUSY) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    if(SUCCESS(e)) {
+        e = jit_clear_reg_mapping(s, arg);
+    }
+    if(SUCCESS(e)) {
+        e = jit_set_reg_mapping(s, jit_reg_new(s), JIT_REGMAP_CALL_ARG4);
+    }
+    if(SUCCESS(e) && jit_clear_reg_mapping(s, arg) !=
+            JIT_ERROR_VREG_NOT_FOUND) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+    printf(BOLD("@ pin, clear and re-pin: %s\n"), SUCCESS(e) ? "ok" : "failed");
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+
+    // Far more virtual registers than the tables start out with.
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    prev = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, prev, JIT_32BIT);
+    for(n = 1; n < NUM_VALUES; n++) {
+        r = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_R_R(i, prev, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1, r, r, JIT_32BIT);
+        prev = r;
+    }
+    i = jit_instr_new(s);
+    MOVE_R_R(i, prev, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    RET(i);
+
+    jit_begin_block_sized(s, abuffer, 65536);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ %d vregs: returned %d, expected %d\n"), NUM_VALUES, res,
+            NUM_VALUES - 1);
+    if(res != NUM_VALUES - 1) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    jit_destroy(s);
+
+    return e;
+}
+
+struct trace_count {
+    int n[JIT_TRACE_ALLOC + 1];
+    char last[64];
+};
+
+void count_trace(void *ctx, jit_trace_level level, const char *msg)
+{
+    struct trace_count *c = (struct trace_count *)ctx;
+
+    c->n[level]++;
+    strncpy(c->last, msg, sizeof(c->last) - 1);
+}
+
+jit_error test_trace(void)
+{
+    jit_state *s;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    struct trace_count c;
+    jit_trace_level level, want;
+    jit_reg r;
+    uint8_t buffer[64];
+
+    printf("-- test_trace: "UL("Testing trace levels and sinks")"\n--\n");
+
+    // Each level adds its messages to those of the levels below.
+    for(level = JIT_TRACE_NONE; SUCCESS(e) && level <= JIT_TRACE_ALLOC;
+            level++) {
+        memset(&c, 0, sizeof(c));
+        e = jit_create(&s, JIT_FLAG_NONE);
+        jit_set_trace(s, level, count_trace, &c);
+        r = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 1, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        jit_begin_block(s, buffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        jit_destroy(s);
+
+        printf(BOLD("@ level %d: %d emit, %d alloc messages\n"), level,
+                c.n[JIT_TRACE_EMIT], c.n[JIT_TRACE_ALLOC]);
+        want = level;
+#ifdef JIT_NO_TRACE
+        // Built without tracing: nothing gets through, whatever the level.
+        want = JIT_TRACE_NONE;
+#endif
+        // Both instructions, then the prologue and epilogue frame
+        // adjustments once patched.
+        if(c.n[JIT_TRACE_EMIT] != (want >= JIT_TRACE_EMIT ? 4 : 0) ||
+                c.n[JIT_TRACE_ALLOC] != (want >= JIT_TRACE_ALLOC ? 1 : 0)) {
+            e = JIT_ERROR_UNKNOWN;
+        }
+    }
+    if(SUCCESS(e) && c.n[JIT_TRACE_EMIT] && (strncmp(c.last, "> frame:", 8) ||
+                strstr(c.last, "ff ff ff 7f") != NULL)) {
+        printf(BOLD("@ last emit message: %s"), c.last);
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+    return e;
+}
+
+static char g_branch_jx[64];
+static int32_t g_branch_val;
+
+void jx_trace(void *ctx, jit_trace_level level, const char *msg)
+{
+    if(strncmp(msg, "> jx:", 5) == 0) {
+        strncpy(g_branch_jx, msg, sizeof(g_branch_jx) - 1);
+    }
+}
+
+#ifdef JIT_NO_TRACE
+// Built without tracing: the jump bytes cannot be checked.
+#define JX_IS(x) 1
+#else
+#define JX_IS(x) (strncmp(g_branch_jx + 6, (x), strlen(x)) == 0)
+#endif
+
+/* Sum 0..99 in a loop, with npad no-op adds in the body to push the jump
+ * back out of rel8 reach. Returns the sum, and the opcode of the jump in
+ * g_branch_jx. */
+static int branch_loop(void *buffer, int npad)
+{
+    jit_state *s;
+    struct jit_instr *i;
+    jit_reg ret, cnt;
+    jit_label top;
+    int n, res = -1;
+
+    jit_create(&s, JIT_FLAG_NONE);
+    jit_set_trace(s, JIT_TRACE_EMIT, jx_trace, NULL);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    cnt = jit_reg_new_fixed(s, JIT_REGMAP_CALL_ARG0);
+    i = jit_instr_new(s);
+    XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, cnt, JIT_32BIT);
+    top = jit_label_here(s);
+    i = jit_instr_new(s);
+    ADD_R_R_R(i, cnt, ret, ret, JIT_32BIT);
+    for(n = 0; n < npad; n++) {
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 0, ret, ret, JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, cnt, cnt, JIT_32BIT);
+    i = jit_instr_new(s);
+    CMP_I_R(i, 100, cnt, JIT_32BIT);
+    i = jit_instr_new(s);
+    JUMP_IF(i, JIT_COND_LT, top);
+    i = jit_instr_new(s);
+    RET(i);
+
+    g_branch_jx[0] = '\0';
+    jit_begin_block(s, buffer);
+    if(SUCCESS(jit_emit_all(s))) {
+        jit_end_block(s);
+        res = ((p_fn)buffer)();
+    }
+    jit_destroy(s);
+    return res;
+}
+
+jit_error test_branch(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i, *j_eq, *j_end;
+    jit_reg r[20], ret, v, cnt;
+    jit_label top;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t n = 0, nb = 0;
+    int flags, res = -1, res2 = -1;
+
+    printf("-- test_branch: "UL("Testing jumps, compares and branch relaxation")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // A backward jump in reach takes the two-byte form, one out of reach
+    // the long one.
+    res = branch_loop(abuffer, 0);
+    printf(BOLD("@ loop: returned %d, jump %s"), res, g_branch_jx + 5);
+    if(res != 4950 || !JX_IS("7c ")) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    res = branch_loop(abuffer, 60);
+    printf(BOLD("@ long loop: returned %d, jump %s"), res, g_branch_jx + 5);
+    if(res != 4950 || !JX_IS("0f 8c ")) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    // Forward jumps around the two arms of an if/else, with either
+    // allocator asked for.
+    for(flags = JIT_FLAG_NONE; flags <= JIT_FLAG_LINEAR_SCAN;
+            flags += JIT_FLAG_LINEAR_SCAN) {
+        e = jit_create(&s, flags);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        v = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_branch_val, v, JIT_32BIT);
+        i = jit_instr_new(s);
+        CMP_I_R(i, 0, v, JIT_32BIT);
+        j_eq = jit_instr_new(s);
+        JUMP_IF(j_eq, JIT_COND_EQ, 0);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 1, ret, JIT_32BIT);
+        j_end = jit_instr_new(s);
+        JUMP(j_end, 0);
+        JUMP_TO(j_eq, jit_label_here(s));
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 2, ret, JIT_32BIT);
+        JUMP_TO(j_end, jit_label_here(s));
+        i = jit_instr_new(s);
+        RET(i);
+
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        g_branch_val = 0;
+        res = ((p_fn)abuffer)();
+        g_branch_val = 5;
+        res2 = ((p_fn)abuffer)();
+        printf(BOLD("@ if/else, flags %d: returned %d and %d\n"), flags, res,
+                res2);
+        if(res != 2 || res2 != 1) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    // More values live around the loop than there are registers: they
+    // must be in the same place on both paths into its head.
+    for(flags = JIT_FLAG_NONE; flags <= JIT_FLAG_LINEAR_SCAN;
+            flags += JIT_FLAG_LINEAR_SCAN) {
+        e = jit_create(&s, flags);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        for(n = 0; n < 20; n++) {
+            r[n] = jit_reg_new(s);
+            i = jit_instr_new(s);
+            MOVE_I_R(i, (int32_t)n, r[n], JIT_32BIT);
+        }
+        cnt = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, cnt, JIT_32BIT);
+        top = jit_label_here(s);
+        for(n = 0; n < 20; n++) {
+            i = jit_instr_new(s);
+            ADD_I_R_R(i, 1, r[n], r[n], JIT_32BIT);
+        }
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1, cnt, cnt, JIT_32BIT);
+        i = jit_instr_new(s);
+        CMP_I_R(i, 10, cnt, JIT_32BIT);
+        i = jit_instr_new(s);
+        JUMP_IF(i, JIT_COND_LT, top);
+        i = jit_instr_new(s);
+        XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+        for(n = 0; n < 20; n++) {
+            i = jit_instr_new(s);
+            ADD_R_R_R(i, r[n], ret, ret, JIT_32BIT);
+        }
+        i = jit_instr_new(s);
+        RET(i);
+
+        e = jit_measure_all(s, abuffer, &nb);
+        if(SUCCESS(e)) {
+            jit_begin_block(s, abuffer);
+            e = jit_emit_all(s);
+            jit_end_block(s);
+        }
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        res = ((p_fn)abuffer)();
+        printf(BOLD("@ 20 values around a loop, flags %d: returned %d, expected 390\n"),
+                flags, res);
+        printf(BOLD("@ measured %zu bytes, emitted %zu\n"), nb, s->blk_nb);
+        if(res != 390 || nb != s->blk_nb) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+/* for(cnt = 0; cnt < 100; cnt++) acc += (cnt < 50) ? 1 : 2; return acc; */
+static void cfg_loop(jit_state *s, jit_reg *acc, jit_reg *cnt)
+{
+    struct jit_instr *i, *j_else, *j_join;
+    jit_reg ret;
+    jit_label top;
+
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    *cnt = jit_reg_new(s);
+    *acc = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, *cnt, JIT_32BIT);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, *acc, JIT_32BIT);
+    top = jit_label_here(s);
+    i = jit_instr_new(s);
+    CMP_I_R(i, 50, *cnt, JIT_32BIT);
+    j_else = jit_instr_new(s);
+    JUMP_IF(j_else, JIT_COND_LT, 0);
+    i = jit_instr_new(s);
+    ADD_I_R_R(i, 2, *acc, *acc, JIT_32BIT);
+    j_join = jit_instr_new(s);
+    JUMP(j_join, 0);
+    JUMP_TO(j_else, jit_label_here(s));
+    i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, *acc, *acc, JIT_32BIT);
+    JUMP_TO(j_join, jit_label_here(s));
+    i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, *cnt, *cnt, JIT_32BIT);
+    i = jit_instr_new(s);
+    CMP_I_R(i, 100, *cnt, JIT_32BIT);
+    i = jit_instr_new(s);
+    JUMP_IF(i, JIT_COND_LT, top);
+    i = jit_instr_new(s);
+    MOVE_R_R(i, *acc, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    RET(i);
+}
+
+jit_error test_cfg(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_cfg *c;
+    struct jit_live_range *lr;
+    jit_reg acc, cnt;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t nb[2] = { 0, 0 };
+    int k, res = -1;
+
+    printf("-- test_cfg: "UL("Testing basic blocks and allocation across them")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // Entry, loop head, the two arms, the join with the back edge, exit.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    cfg_loop(s, &acc, &cnt);
+    e = jit_ir_build(s);
+    if(SUCCESS(e)) {
+        e = jit_liveness(s);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    c = s->p_cfg;
+    printf(BOLD("@ %u blocks, %u and %u predecessors at the loop head and the join\n"),
+            c->nblocks, c->blocks[1].npred, c->blocks[4].npred);
+    if(c->nblocks != 6 || c->blocks[1].npred != 2 ||
+            c->blocks[4].npred != 2 || c->blocks[3].nsucc != 1 ||
+            c->blocks[5].nsucc != 0) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    // The counter is live around the whole loop, back edge included.
+    lr = &s->p_live->ranges[s->p_live->first[cnt]];
+    printf(BOLD("@ cnt: [%u,%u]%s\n"), lr->start, lr->end,
+            lr->cross ? ", across edges" : "");
+    if(lr->start != 0 || lr->end != 9 || !lr->cross ||
+            lr->next != JIT_LIVE_NONE) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    jit_destroy(s);
+    s = NULL;
+
+    // The linear scan keeps both values in registers through the loop, where
+    // the age-based allocator writes them back at every edge.
+    for(k = 0; k < 2; k++) {
+        e = jit_create(&s, k ? JIT_FLAG_LINEAR_SCAN : JIT_FLAG_NONE);
+        cfg_loop(s, &acc, &cnt);
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        res = ((p_fn)abuffer)();
+        nb[k] = s->blk_nb;
+        printf(BOLD("@ %s: returned %d, expected 150, %zu bytes\n"),
+                k ? "linear scan" : "age-based", res, nb[k]);
+        if(res != 150) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    if(nb[1] >= nb[0]) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_fold_val = 100;
+
+jit_error test_fold(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i, *is[8], *loop_add;
+    jit_reg a, b, c, d, x, f, ret;
+    jit_label top;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int k, res = -1;
+
+    printf("-- test_fold: "UL("Testing constant folding")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // Returns g + 72 either way; folded, the constants go into the
+    // instructions using them. The moves they came from stay, for dead code
+    // elimination to remove.
+    for(k = 0; k < 2; k++) {
+        e = jit_create(&s, JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        a = jit_reg_new(s);
+        b = jit_reg_new(s);
+        c = jit_reg_new(s);
+        x = jit_reg_new(s);
+        d = jit_reg_new(s);
+        f = jit_reg_new(s);
+        is[0] = i = jit_instr_new(s);
+        MOVE_I_R(i, 6, a, JIT_32BIT);
+        is[1] = i = jit_instr_new(s);
+        SHL_I_R_R(i, 2, a, b, JIT_32BIT);
+        is[2] = i = jit_instr_new(s);
+        AND_I_R_R(i, 0xff, b, c, JIT_32BIT);
+        is[3] = i = jit_instr_new(s);
+        MOVE_M_R(i, &g_fold_val, x, JIT_32BIT);
+        is[4] = i = jit_instr_new(s);
+        SUB_R_R_R(i, x, c, d, JIT_32BIT);
+        is[5] = i = jit_instr_new(s);
+        ADD_R_R_R(i, c, x, a, JIT_32BIT);
+        is[6] = i = jit_instr_new(s);
+        SUB_R_R_R(i, c, x, f, JIT_32BIT);
+        is[7] = i = jit_instr_new(s);
+        SUB_R_R_R(i, c, x, x, JIT_32BIT);
+        i = jit_instr_new(s);
+        XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, d, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, a, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, a, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, f, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, x, ret, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+
+        if(k == 1) {
+            e = jit_opt_fold(s);
+            if(FAILURE(e) || is[1]->op != JIT_OP_MOVE ||
+                    is[1]->in1.imm32 != 24 || is[2]->op != JIT_OP_MOVE ||
+                    is[2]->in1.imm32 != 24 ||
+                    is[4]->in1_type != JIT_OPERAND_IMM ||
+                    is[4]->in2.reg != x ||
+                    is[5]->in1_type != JIT_OPERAND_IMM ||
+                    is[6]->in1_type != JIT_OPERAND_REG ||
+                    is[7]->in1_type != JIT_OPERAND_REG) {
+                printf(BOLD("@ instructions not folded as expected\n"));
+                e = JIT_ERROR_UNKNOWN;
+                goto l_cleanup;
+            }
+        }
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        res = ((p_fn)abuffer)();
+        printf(BOLD("@ %s: returned %d, expected %d\n"),
+                k ? "folded" : "as is", res, g_fold_val + 72);
+        if(res != g_fold_val + 72) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    // Nothing is known at a jump target, where the back edge joins in.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, ret, JIT_32BIT);
+    top = jit_label_here(s);
+    loop_add = i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, ret, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    CMP_I_R(i, 10, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    JUMP_IF(i, JIT_COND_LT, top);
+    i = jit_instr_new(s);
+    RET(i);
+    e = jit_opt_fold(s);
+    if(SUCCESS(e)) {
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ loop: returned %d, expected 10\n"), res);
+    if(res != 10 || loop_add->op != JIT_OP_ADD) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_dce_val;
+
+jit_error test_dce(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i, *is[8], *j_eq, *j_end;
+    jit_reg t, u, v, x, ret;
+    jit_label top;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t nb[2] = { 0, 0 };
+    int k, res = -1, res2 = -1;
+
+    printf("-- test_dce: "UL("Testing dead code elimination")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // An overwritten move, an unread sum and an unread compare go; the
+    // store and the pinned return register stay.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    t = jit_reg_new(s);
+    u = jit_reg_new(s);
+    is[0] = i = jit_instr_new(s);
+    MOVE_I_R(i, 1, t, JIT_32BIT);
+    is[1] = i = jit_instr_new(s);
+    MOVE_I_R(i, 2, t, JIT_32BIT);
+    is[2] = i = jit_instr_new(s);
+    ADD_I_R_R(i, 5, t, u, JIT_32BIT);
+    is[3] = i = jit_instr_new(s);
+    MOVE_R_M(i, t, &g_dce_val, JIT_32BIT);
+    is[4] = i = jit_instr_new(s);
+    XOR_R_R_R(i, ret, ret, ret, JIT_32BIT);
+    is[5] = i = jit_instr_new(s);
+    ADD_I_R_R(i, 3, t, ret, JIT_32BIT);
+    is[6] = i = jit_instr_new(s);
+    CMP_I_R(i, 0, t, JIT_32BIT);
+    is[7] = i = jit_instr_new(s);
+    RET(i);
+    e = jit_opt_dce(s);
+    for(k = 0; SUCCESS(e) && k < 8; k++) {
+        if((is[k]->op == JIT_OP_NOP) != (k == 0 || k == 2 || k == 6)) {
+            printf(BOLD("@ instruction %d wrongly %s\n"), k,
+                    is[k]->op == JIT_OP_NOP ? "removed" : "kept");
+            e = JIT_ERROR_UNKNOWN;
+        }
+    }
+    if(SUCCESS(e)) {
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    res = ((p_fn)abuffer)();
+    printf(BOLD("@ straight line: returned %d, stored %d, expected 5 and 2\n"),
+            res, g_dce_val);
+    if(res != 5 || g_dce_val != 2) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    jit_destroy(s);
+    s = NULL;
+
+    // A difference nobody reads still sets the flags a jump tests. Across
+    // the loop, a value only feeding a dead one goes with it.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    v = jit_reg_new(s);
+    u = jit_reg_new(s);
+    t = jit_reg_new(s);
+    x = jit_reg_new(s);
+    is[0] = i = jit_instr_new(s);
+    MOVE_I_R(i, 5, t, JIT_32BIT);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, x, JIT_32BIT);
+    top = jit_label_here(s);
+    is[1] = i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, t, u, JIT_32BIT);
+    i = jit_instr_new(s);
+    ADD_I_R_R(i, 1, x, x, JIT_32BIT);
+    i = jit_instr_new(s);
+    CMP_I_R(i, 3, x, JIT_32BIT);
+    i = jit_instr_new(s);
+    JUMP_IF(i, JIT_COND_LT, top);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, &g_dce_val, v, JIT_32BIT);
+    is[2] = i = jit_instr_new(s);
+    SUB_I_R_R(i, 2, v, u, JIT_32BIT);
+    j_eq = jit_instr_new(s);
+    JUMP_IF(j_eq, JIT_COND_EQ, 0);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 1, ret, JIT_32BIT);
+    j_end = jit_instr_new(s);
+    JUMP(j_end, 0);
+    JUMP_TO(j_eq, jit_label_here(s));
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 7, ret, JIT_32BIT);
+    JUMP_TO(j_end, jit_label_here(s));
+    i = jit_instr_new(s);
+    RET(i);
+    e = jit_opt_dce(s);
+    if(SUCCESS(e)) {
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    g_dce_val = 2;
+    res = ((p_fn)abuffer)();
+    g_dce_val = 3;
+    res2 = ((p_fn)abuffer)();
+    printf(BOLD("@ branches: returned %d and %d, expected 7 and 1\n"), res,
+            res2);
+    if(res != 7 || res2 != 1 || is[0]->op != JIT_OP_NOP ||
+            is[1]->op != JIT_OP_NOP || is[2]->op != JIT_OP_SUB) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+    jit_destroy(s);
+    s = NULL;
+
+    // After folding, the constants it used up go too.
+    for(k = 0; k < 2; k++) {
+        e = jit_create(&s, JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        t = jit_reg_new(s);
+        u = jit_reg_new(s);
+        v = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 6, t, JIT_32BIT);
+        i = jit_instr_new(s);
+        SHL_I_R_R(i, 2, t, u, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_dce_val, v, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, u, v, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        if(k == 1) {
+            e = jit_opt_fold(s);
+            if(SUCCESS(e)) {
+                e = jit_opt_dce(s);
+            }
+        }
+        if(SUCCESS(e)) {
+            jit_begin_block(s, abuffer);
+            e = jit_emit_all(s);
+            jit_end_block(s);
+        }
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        g_dce_val = 10;
+        res = ((p_fn)abuffer)();
+        nb[k] = s->blk_nb;
+        printf(BOLD("@ %s: returned %d, expected 34, %zu bytes\n"),
+                k ? "folded" : "as is", res, nb[k]);
+        if(res != 34) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    if(nb[1] >= nb[0]) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_cse_val;
+static int32_t g_cse_step;
+
+static void cse_bump(void)
+{
+    g_cse_val += g_cse_step;
+}
+
+jit_error test_cse(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i, *is[8];
+    jit_reg a, b, c, d, x, ret;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t nb[2] = { 0, 0 };
+    int k, res = -1, res2 = -1;
+
+    printf("-- test_cse: "UL("Testing common subexpression elimination")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // The same load and sum twice, the second time through a copy, and a
+    // sum with its operands the other way round.
+    for(k = 0; k < 2; k++) {
+        e = jit_create(&s, JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        a = jit_reg_new(s);
+        b = jit_reg_new(s);
+        c = jit_reg_new(s);
+        d = jit_reg_new(s);
+        x = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_cse_val, a, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 4, a, b, JIT_32BIT);
+        is[0] = i = jit_instr_new(s);
+        MOVE_M_R(i, &g_cse_val, c, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_R_R(i, c, x, JIT_32BIT);
+        is[1] = i = jit_instr_new(s);
+        ADD_I_R_R(i, 4, x, d, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, b, d, c, JIT_32BIT);
+        is[2] = i = jit_instr_new(s);
+        ADD_R_R_R(i, d, b, x, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, c, x, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        if(k == 1) {
+            e = jit_opt_cse(s);
+            if(SUCCESS(e)) {
+                e = jit_opt_dce(s);
+            }
+            if(SUCCESS(e) && (is[0]->op != JIT_OP_NOP ||
+                        is[1]->op != JIT_OP_NOP ||
+                        is[2]->op != JIT_OP_NOP)) {
+                printf(BOLD("@ recomputations left in\n"));
+                e = JIT_ERROR_UNKNOWN;
+            }
+        }
+        if(SUCCESS(e)) {
+            jit_begin_block(s, abuffer);
+            e = jit_emit_all(s);
+            jit_end_block(s);
+        }
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        g_cse_val = 6;
+        res = ((p_fn)abuffer)();
+        nb[k] = s->blk_nb;
+        printf(BOLD("@ %s: returned %d, expected 40, %zu bytes\n"),
+                k ? "numbered" : "as is", res, nb[k]);
+        if(res != 40) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    if(nb[1] >= nb[0]) {
+        e = JIT_ERROR_UNKNOWN;
+        goto l_cleanup;
+    }
+
+    // A store forwards to the next load, a call forgets it, and a
+    // difference whose flags a jump reads stays.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    a = jit_reg_new(s);
+    b = jit_reg_new(s);
+    c = jit_reg_new(s);
+    d = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 7, a, JIT_32BIT);
+    i = jit_instr_new(s);
+    MOVE_R_M(i, a, &g_cse_val, JIT_32BIT);
+    is[0] = i = jit_instr_new(s);
+    MOVE_M_R(i, &g_cse_val, b, JIT_32BIT);
+    i = jit_instr_new(s);
+    CALL_M(i, (int32_t*)cse_bump, JIT_32BIT);
+    is[1] = i = jit_instr_new(s);
+    MOVE_M_R(i, &g_cse_val, c, JIT_32BIT);
+    i = jit_instr_new(s);
+    SUB_I_R_R(i, 107, c, d, JIT_32BIT);
+    is[2] = i = jit_instr_new(s);
+    SUB_I_R_R(i, 107, c, d, JIT_32BIT);
+    is[3] = i = jit_instr_new(s);
+    JUMP_IF(i, JIT_COND_EQ, 0);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 1, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    RET(i);
+    JUMP_TO(is[3], jit_label_here(s));
+    i = jit_instr_new(s);
+    ADD_R_R_R(i, b, c, ret, JIT_32BIT);
+    i = jit_instr_new(s);
+    RET(i);
+    e = jit_opt_cse(s);
+    if(SUCCESS(e) && (is[0]->op != JIT_OP_MOVE ||
+                is[0]->in1_type != JIT_OPERAND_REG || is[0]->in1.reg != a ||
+                is[1]->in1_type != JIT_OPERAND_IMMPTR ||
+                is[2]->op != JIT_OP_SUB)) {
+        printf(BOLD("@ loads or flags not handled as expected\n"));
+        e = JIT_ERROR_UNKNOWN;
+    }
+    if(SUCCESS(e)) {
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    g_cse_step = 100;
+    res = ((p_fn)abuffer)();
+    g_cse_step = 0;
+    res2 = ((p_fn)abuffer)();
+    printf(BOLD("@ memory: returned %d and %d, expected 114 and 1\n"), res,
+            res2);
+    if(res != 114 || res2 != 1) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_peep_val;
+
+jit_error test_peephole(void)
+{
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i, *j;
+    jit_reg a, b, c, m, x, z, ret;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t nb[2] = { 0, 0 };
+    int k, res = -1;
+
+    printf("-- test_peephole: "UL("Testing shorter encodings from the context")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // inc, dec, a zeroing xor and a move back dropped, but none of it where
+    // a jump reads the flags.
+    for(k = 0; k < 2; k++) {
+        e = jit_create(&s, k ? JIT_FLAG_NO_PEEPHOLE : JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        a = jit_reg_new(s);
+        b = jit_reg_new(s);
+        c = jit_reg_new(s);
+        m = jit_reg_new(s);
+        x = jit_reg_new(s);
+        z = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_peep_val, b, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1, b, b, JIT_32BIT);
+        i = jit_instr_new(s);
+        SUB_I_R_R(i, 1, b, c, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, a, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_R_R(i, c, x, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_R_R(i, x, c, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, -1, m, JIT_32BIT);
+        i = jit_instr_new(s);
+        CMP_R_R(i, a, a, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1, m, m, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, z, JIT_32BIT);
+        j = jit_instr_new(s);
+        JUMP_IF(j, JIT_COND_LTU, 0);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 99, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        JUMP_TO(j, jit_label_here(s));
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, b, c, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, ret, z, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, ret, x, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, ret, a, ret, JIT_32BIT);
+        i = jit_instr_new(s);
+        RET(i);
+
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        g_peep_val = 41;
+        res = ((p_fn)abuffer)();
+        nb[k] = s->blk_nb;
+        printf(BOLD("@ %s: returned %d, expected 124, %zu bytes\n"),
+                k ? "plain" : "peephole", res, nb[k]);
+        if(res != 124) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    // xor: 3 bytes less, inc and dec: 1 each, the move back: 2.
+    if(nb[0] + 7 > nb[1]) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int32_t g_lea_vals[10] = { 3, 40, 500, 6000, 7, -8, 9, 11, 5, -1024 };
+
+jit_error test_lea(void)
+{
+    static const jit_flags flags[3] = {
+        JIT_FLAG_NONE, JIT_FLAG_NO_PEEPHOLE, JIT_FLAG_LINEAR_SCAN,
+    };
+    static const char *names[3] = { "selected", "plain", "linear scan" };
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg v[10], r[9], ret;
+    int32_t *g = g_lea_vals;
+    uint32_t u;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    size_t nb[3] = { 0, 0, 0 };
+    int k, n, res = -1, expect;
+
+    printf("-- test_lea: "UL("Testing three-operand arithmetic")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // Everything stays live to the end, for the high registers to be used.
+    expect = 0;
+    for(n = 0; n < 10; n++) {
+        expect += g[n];
+    }
+    expect += (g[0] + g[1]) + (g[2] + 1000) + (g[3] - 7) + g[4] * 2 +
+        g[5] * 4 + g[6] * 8;
+    u = (uint32_t)g[9];
+    expect += (g[7] << g[8]) + (int32_t)(u >> g[8]) + (g[9] >> g[8]);
+
+    for(k = 0; k < 3; k++) {
+        e = jit_create(&s, flags[k]);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        for(n = 0; n < 10; n++) {
+            v[n] = jit_reg_new(s);
+            i = jit_instr_new(s);
+            MOVE_M_R(i, &g[n], v[n], JIT_32BIT);
+        }
+        for(n = 0; n < 9; n++) {
+            r[n] = jit_reg_new(s);
+        }
+        i = jit_instr_new(s);
+        ADD_R_R_R(i, v[0], v[1], r[0], JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, 1000, v[2], r[1], JIT_32BIT);
+        i = jit_instr_new(s);
+        SUB_I_R_R(i, 7, v[3], r[2], JIT_32BIT);
+        i = jit_instr_new(s);
+        SHL_I_R_R(i, 1, v[4], r[3], JIT_32BIT);
+        i = jit_instr_new(s);
+        SHL_I_R_R(i, 2, v[5], r[4], JIT_32BIT);
+        i = jit_instr_new(s);
+        SHL_I_R_R(i, 3, v[6], r[5], JIT_32BIT);
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_SHL, v[7], v[8], r[6], JIT_32BIT);
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_SHR, v[9], v[8], r[7], JIT_32BIT);
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_SAR, v[9], v[8], r[8], JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, ret, JIT_32BIT);
+        for(n = 0; n < 10; n++) {
+            i = jit_instr_new(s);
+            ADD_R_R_R(i, ret, v[n], ret, JIT_32BIT);
+        }
+        for(n = 0; n < 9; n++) {
+            i = jit_instr_new(s);
+            ADD_R_R_R(i, ret, r[n], ret, JIT_32BIT);
+        }
+        i = jit_instr_new(s);
+        RET(i);
+
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        res = ((p_fn)abuffer)();
+        nb[k] = s->blk_nb;
+        printf(BOLD("@ %s: returned %d, expected %d, %zu bytes\n"),
+                names[k], res, expect, nb[k]);
+        if(res != expect) {
+            e = JIT_ERROR_UNKNOWN;
+            goto l_cleanup;
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+    if(nb[0] >= nb[1]) {
+        e = JIT_ERROR_UNKNOWN;
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+/* Test blocks are built around one operation, with ret returning the
+ * result. Under pressure, two sets of TEST_NLIVE values are kept live: one
+ * across the loads of the operation's inputs, which leaves the inputs
+ * spilled, and one across the operation itself, which leaves its output
+ * spilled too. Their sum, TEST_LIVE_SUM, is added to the result. */
+#define TEST_NLIVE 13
+#define TEST_LIVE_SUM 182
+
+struct test_block {
+    jit_state *s;
+    int pressure;
+    jit_reg acc;
+    jit_reg live[TEST_NLIVE];
+    void *arg;
+};
+
+/* Append the operation under test, calling test_block_cross between the
+ * loads of its inputs and the operation, and set *res to the register
+ * holding the result, or JIT_REG_INVALID for none. */
+typedef jit_error (*test_body)(struct test_block *t, jit_reg *res);
+
+static void test_block_live(struct test_block *t)
+{
+    struct jit_instr *i;
+    int k;
+
+    for(k = 0; k < TEST_NLIVE; k++) {
+        t->live[k] = jit_reg_new(t->s);
+        i = jit_instr_new(t->s);
+        MOVE_I_R(i, k + 1, t->live[k], JIT_64BIT);
+    }
+}
+
+static void test_block_sum(struct test_block *t)
+{
+    struct jit_instr *i;
+    int k;
+
+    for(k = 0; k < TEST_NLIVE; k++) {
+        i = jit_instr_new(t->s);
+        OP_R_R_R(i, JIT_OP_ADD, t->acc, t->live[k], t->acc, JIT_64BIT);
+    }
+}
+
+/* Between the inputs and the operation: retire the first set of live
+ * values, and bring in the second. */
+static void test_block_cross(struct test_block *t)
+{
+    if(t->pressure) {
+        test_block_sum(t);
+        test_block_live(t);
+    }
+}
+
+/* Build the block of body into buf, after the optimization passes if opt
+ * is set. On failure, the state is destroyed and *ps left NULL. */
+static jit_error test_block(jit_state **ps, jit_flags flags, int pressure,
+        int opt, test_body body, void *arg, void *buf)
+{
+    struct test_block t;
+    jit_state *s;
+    jit_error e;
+    struct jit_instr *i;
+    jit_reg ret, res = JIT_REG_INVALID;
+
+    e = jit_create(ps, flags);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    s = *ps;
+    t.s = s;
+    t.pressure = pressure;
+    t.arg = arg;
+    ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+    if(pressure) {
+        t.acc = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, t.acc, JIT_64BIT);
+        test_block_live(&t);
+    }
+    e = body(&t, &res);
+    if(FAILURE(e)) {
+        goto l_exit;
+    }
+    if(pressure) {
+        test_block_sum(&t);
+        i = jit_instr_new(s);
+        if(res != JIT_REG_INVALID) {
+            OP_R_R_R(i, JIT_OP_ADD, res, t.acc, ret, JIT_64BIT);
+        } else {
+            MOVE_R_R(i, t.acc, ret, JIT_64BIT);
+        }
+    } else {
+        i = jit_instr_new(s);
+        if(res != JIT_REG_INVALID) {
+            MOVE_R_R(i, res, ret, JIT_64BIT);
+        } else {
+            MOVE_I_R(i, 0, ret, JIT_64BIT);
+        }
+    }
+    i = jit_instr_new(s);
+    RET(i);
+
+    if(opt) {
+        e = jit_opt_fold(s);
+        if(SUCCESS(e)) {
+            e = jit_opt_cse(s);
+        }
+        if(SUCCESS(e)) {
+            e = jit_opt_flags(s);
+        }
+        if(SUCCESS(e)) {
+            e = jit_opt_dce(s);
+        }
+        if(FAILURE(e)) {
+            goto l_exit;
+        }
+    }
+    jit_begin_block(s, buf);
+    e = jit_emit_all(s);
+    jit_end_block(s);
+
+l_exit:
+    if(FAILURE(e) && *ps != NULL) {
+        jit_destroy(*ps);
+        *ps = NULL;
+    }
+    return e;
+}
+
+static int64_t g_md_x, g_md_y;
+
+struct muldiv_args {
+    jit_op op;
+    size_t sz;
+    int imm;
+    int alias;
+    int64_t c;
+};
+
+/* x op c, or x op y with c in y, the output aliasing x with alias. */
+static jit_error muldiv_body(struct test_block *t, jit_reg *res)
+{
+    struct muldiv_args *a = (struct muldiv_args *)t->arg;
+    jit_state *s = t->s;
+    struct jit_instr *i;
+    jit_reg x, y = JIT_REG_INVALID, r;
+
+    x = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_md_x, x, JIT_64BIT);
+    if(!a->imm) {
+        y = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, (int32_t *)&g_md_y, y, JIT_64BIT);
+    }
+    r = a->alias ? x : jit_reg_new(s);
+    test_block_cross(t);
+    i = jit_instr_new(s);
+    if(a->imm) {
+        OP_I_R_R(i, a->op, a->c, x, r, a->sz);
+    } else {
+        OP_R_R_R(i, a->op, x, y, r, a->sz);
+    }
+    *res = r;
+    return JIT_SUCCESS;
+}
+
+/* What op on sz bytes gives, in those bytes: the operands are taken signed
+ * for DIV and REM and unsigned otherwise. */
+static uint64_t muldiv_ref(jit_op op, size_t sz, uint64_t x, uint64_t y)
+{
+    uint64_t m = (sz == JIT_64BIT) ? ~(uint64_t)0 :
+        ((uint64_t)1 << (8 * sz)) - 1;
+    int64_t sx = (int64_t)(x << (64 - 8 * sz)) >> (64 - 8 * sz);
+    int64_t sy = (int64_t)(y << (64 - 8 * sz)) >> (64 - 8 * sz);
+
+    switch(op) {
+        case JIT_OP_MUL: return (x * y) & m;
+        case JIT_OP_DIV: return (uint64_t)(sx / sy) & m;
+        case JIT_OP_DIVU: return (x & m) / (y & m);
+        case JIT_OP_REM: return (uint64_t)(sx % sy) & m;
+        default: return (x & m) % (y & m);
+    }
+}
+
+jit_error test_muldiv(void)
+{
+    static const int64_t cs[] = {
+        0, 1, -1, 2, -2, 3, -3, 5, 6, 7, -7, 9, 10, 12, 16, -16, 25, 40, 45,
+        100, 200, 255, 641, 1000, 0x8000, 0xffff, 65537, INT32_MAX,
+        INT32_MIN, (int32_t)0x80000001, (int32_t)0xfffffffe, 0x40000000,
+        0x100000000ll, 0x123456789ll, 1000000007, -(1ll << 40),
+        INT64_MAX, INT64_MIN, (int64_t)0x8000000000000001ull,
+        (int64_t)0xfffffffffffffffeull, (int64_t)0xc000000000000000ull,
+    };
+    static const int64_t xs[] = {
+        0, 1, -1, 7, -7, 100, -100, 0x7f, 0x80, 0xff, 0x8000, 0xffff, 12345,
+        -12345, 999999999, INT32_MAX, INT32_MIN, (int32_t)0x80000001,
+        (int32_t)0xfffffff0, 0x123456789abcdef0ll, -0x123456789abcdefll,
+        INT64_MAX, INT64_MIN,
+    };
+    static const jit_op ops[5] = {
+        JIT_OP_MUL, JIT_OP_DIV, JIT_OP_DIVU, JIT_OP_REM, JIT_OP_REMU,
+    };
+    static const char *names[5] = { "mul", "div", "divu", "rem", "remu" };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    struct muldiv_args ma;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    uint64_t m, want, got;
+    int64_t x, c, sx, sc;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int o, z, k, f, imm, n, nok, nrun;
+
+    printf("-- test_muldiv: "UL("Testing multiplication and division")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    for(o = 0; o < 5; o++) {
+        nok = nrun = 0;
+        for(z = 0; z < 4; z++) {
+            m = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                ((uint64_t)1 << (8 * szs[z])) - 1;
+            for(k = 0; k < (int)(sizeof(cs) / sizeof(cs[0])); k++) {
+                c = cs[k];
+                sc = (int64_t)((uint64_t)c << (64 - 8 * szs[z])) >>
+                    (64 - 8 * szs[z]);
+                if(sc == 0 && ops[o] != JIT_OP_MUL) {
+                    continue;
+                }
+                // By register and by immediate, with either allocator, the
+                // output aliasing x or not, and under register pressure.
+                for(f = 0; f < 16; f++) {
+                    imm = f & 1;
+                    ma.op = ops[o];
+                    ma.sz = szs[z];
+                    ma.imm = imm;
+                    ma.alias = (f & 4) != 0;
+                    ma.c = c;
+                    e = test_block(&s, (f & 2) ? JIT_FLAG_LINEAR_SCAN :
+                            JIT_FLAG_NONE, f & 8, 0, muldiv_body, &ma,
+                            abuffer);
+                    if(FAILURE(e)) {
+                        printf(BOLD("@ %s by %lld, %zu bytes: emission "
+                                    "failed\n"), names[o], (long long)c,
+                                szs[z]);
+                        goto l_cleanup;
+                    }
+                    for(n = 0; n < (int)(sizeof(xs) / sizeof(xs[0])); n++) {
+                        x = xs[n];
+                        sx = (int64_t)((uint64_t)x << (64 - 8 * szs[z])) >>
+                            (64 - 8 * szs[z]);
+                        // The hardware traps on an overflowing quotient;
+                        // only those of 32 and 64 bits are computed there.
+                        if(szs[z] >= JIT_32BIT && sc == -1 &&
+                                sx == (int64_t)~(m >> 1) &&
+                                (ops[o] == JIT_OP_DIV ||
+                                 ops[o] == JIT_OP_REM)) {
+                            continue;
+                        }
+                        want = muldiv_ref(ops[o], szs[z], (uint64_t)x,
+                                (uint64_t)c);
+                        g_md_x = x;
+                        g_md_y = c;
+                        got = (uint64_t)((p_fn64)abuffer)();
+                        if(f & 8) {
+                            got -= TEST_LIVE_SUM;
+                        }
+                        nrun++;
+                        if((got & m) == want) {
+                            nok++;
+                        } else if(nrun - nok < 5) {
+                            printf(BOLD("@ %#llx %s %#llx (%zu bytes, %s, "
+                                        "flags %d): got %#llx, expected "
+                                        "%#llx\n"), (unsigned long long)x,
+                                    names[o], (unsigned long long)c, szs[z],
+                                    imm ? "imm" : "reg", f,
+                                    (unsigned long long)(got & m),
+                                    (unsigned long long)want);
+                        }
+                    }
+                    jit_destroy(s);
+                    s = NULL;
+                }
+            }
+        }
+        printf(BOLD("@ %s: %d of %d right\n"), names[o], nok, nrun);
+        if(nok != nrun) {
+            e = JIT_ERROR_UNKNOWN;
+        }
+    }
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static int64_t g_w_a, g_w_b;
+
+/* What op on sz bytes gives, zero-extended, with shifts masking the count
+ * as x86 does. */
+static uint64_t width_ref(jit_op op, size_t sz, uint64_t x, uint64_t y)
+{
+    uint64_t m = (sz == JIT_64BIT) ? ~(uint64_t)0 :
+        ((uint64_t)1 << (8 * sz)) - 1;
+    int64_t sx = (sz == JIT_64BIT) ? (int64_t)x :
+        ((int64_t)(x << (64 - 8 * sz)) >> (64 - 8 * sz));
+    unsigned c = (unsigned)(y & ((sz == JIT_64BIT) ? 63 : 31));
+
+    switch(op) {
+        case JIT_OP_ADD: return (x + y) & m;
+        case JIT_OP_SUB: return (x - y) & m;
+        case JIT_OP_AND: return (x & y) & m;
+        case JIT_OP_OR: return (x | y) & m;
+        case JIT_OP_XOR: return (x ^ y) & m;
+        case JIT_OP_SHL: return (x << c) & m;
+        case JIT_OP_SHR: return ((x & m) >> c) & m;
+        default: return (uint64_t)(sx >> c) & m;
+    }
+}
+
+struct width_args {
+    jit_op op;
+    size_t sz;
+    int imm;
+    int alias;
+    int64_t c;
+};
+
+/* zx(a op b) or zx(a op imm), with out aliasing a (alias 1), b (alias 2)
+ * or neither. */
+static jit_error width_body(struct test_block *t, jit_reg *res)
+{
+    struct width_args *w = (struct width_args *)t->arg;
+    jit_state *s = t->s;
+    struct jit_instr *i;
+    jit_reg a, b, out;
+
+    a = jit_reg_new(s);
+    b = jit_reg_new(s);
+    out = (w->alias == 1) ? a : (w->alias == 2) ? b : jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_a, a, JIT_64BIT);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_b, b, JIT_64BIT);
+    test_block_cross(t);
+    i = jit_instr_new(s);
+    if(w->imm) {
+        OP_I_R_R(i, w->op, w->c, a, out, w->sz);
+    } else {
+        OP_R_R_R(i, w->op, a, b, out, w->sz);
+    }
+    *res = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVZX_R_R(i, out, *res, w->sz);
+    return JIT_SUCCESS;
+}
+
+jit_error test_widths(void)
+{
+    static const uint64_t xs[] = {
+        0, 1, ~(uint64_t)0, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0x12345678,
+        0x80000000, 0xfedcba9876543210ull, 0x8000000000000000ull,
+        0x7fffffffffffffffull, 0x1ffffffffull, 0x21, 0x3f,
+    };
+    static const int64_t imms[] = {
+        0, 1, -1, 0x7f, -128, 0x1234, 0x7fffffff, INT32_MIN,
+        0x123456789ll, INT64_MIN, 3, 7, 15, 31, 33, 63,
+    };
+    static const jit_op ops[8] = {
+        JIT_OP_ADD, JIT_OP_SUB, JIT_OP_AND, JIT_OP_OR, JIT_OP_XOR,
+        JIT_OP_SHL, JIT_OP_SHR, JIT_OP_SAR,
+    };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    static const int64_t movs[] = {
+        0, -1, 0xffffffffll, 0x7fffffff, 0x80000000ll, -0x80000000ll,
+        0x123456789abcdef0ll, INT64_MIN, 42,
+    };
+    struct width_args wa;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg r, ret;
+    uint64_t want, got, mem[3];
+    int64_t c;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int o, z, k, f, imm, shift, alias, n, sign, nok = 0, nrun = 0;
+
+    printf("-- test_widths: "UL("Testing 8, 16, 32 and 64-bit operations")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    // The ALU operations and shifts at every size, by register and by
+    // immediate, with the output aliasing either input or neither, and
+    // with more values live across the operation than there are registers.
+    for(o = 0; o < 8; o++) {
+        for(z = 0; z < 4; z++) {
+            for(k = -1; k < (int)(sizeof(imms) / sizeof(imms[0])); k++) {
+                imm = (k >= 0);
+                c = imm ? imms[k] : 0;
+                shift = (ops[o] >= JIT_OP_SHL && ops[o] <= JIT_OP_SAR);
+                if(shift && imm && (c < 0 || c >= 8 * (int64_t)szs[z])) {
+                    continue;
+                }
+                if(imm && szs[z] != JIT_64BIT && (c < INT32_MIN ||
+                            c > INT32_MAX)) {
+                    continue;
+                }
+                // Shifts by a register go through cl without BMI2.
+                for(f = 0; f < 24; f++) {
+                    alias = f % 3;
+                    if((imm && alias == 2) || (f >= 12 && (imm || !shift))) {
+                        continue;
+                    }
+                    wa.op = ops[o];
+                    wa.sz = szs[z];
+                    wa.imm = imm;
+                    wa.alias = alias;
+                    wa.c = c;
+                    e = test_block(&s, (((f / 3) & 1) ?
+                                JIT_FLAG_LINEAR_SCAN : JIT_FLAG_NONE) |
+                            (f >= 12 ? JIT_FLAG_NO_BMI2 : JIT_FLAG_NONE),
+                            (f % 12) >= 6, 0, width_body, &wa, abuffer);
+                    if(FAILURE(e)) {
+                        printf(BOLD("@ op %d, %zu bytes: emission failed\n"),
+                                ops[o], szs[z]);
+                        goto l_cleanup;
+                    }
+                    for(n = 0; n < (int)(sizeof(xs) / sizeof(xs[0])); n++) {
+                        g_w_a = (int64_t)xs[n];
+                        g_w_b = (int64_t)xs[(n * 7 + 3) %
+                            (sizeof(xs) / sizeof(xs[0]))];
+                        want = width_ref(ops[o], szs[z], (uint64_t)g_w_a,
+                                imm ? (uint64_t)c : (uint64_t)g_w_b);
+                        want += ((f % 12) >= 6) ? TEST_LIVE_SUM : 0;
+                        got = (uint64_t)((p_fn64)abuffer)();
+                        nrun++;
+                        if(got == want) {
+                            nok++;
+                        } else if(nrun - nok < 5) {
+                            printf(BOLD("@ op %d, %zu bytes, %s, flags %d: "
+                                        "%#llx, %#llx gave %#llx, "
+                                        "expected %#llx\n"), ops[o], szs[z],
+                                    imm ? "imm" : "reg", f,
+                                    (unsigned long long)g_w_a,
+                                    (unsigned long long)(imm ? c : g_w_b),
+                                    (unsigned long long)got,
+                                    (unsigned long long)want);
+                        }
+                    }
+                    jit_destroy(s);
+                    s = NULL;
+                }
+            }
+        }
+    }
+    printf(BOLD("@ alu: %d of %d right\n"), nok, nrun);
+
+    // 64-bit immediates, whatever encoding they take.
+    for(k = 0; k < (int)(sizeof(movs) / sizeof(movs[0])); k++) {
+        e = jit_create(&s, JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, movs[k], ret, JIT_64BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        got = (uint64_t)((p_fn64)abuffer)();
+        nrun++;
+        if(SUCCESS(e) && got == (uint64_t)movs[k]) {
+            nok++;
+        } else {
+            printf(BOLD("@ mov %#llx gave %#llx\n"),
+                    (unsigned long long)movs[k], (unsigned long long)got);
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    // Comparisons only see opsz bytes: ret = (a <u b) + 2 * (a == b), and
+    // the same against b as an immediate.
+    for(z = 0; z < 4; z++) {
+        for(k = 0; k < 2; k++) {
+            struct jit_instr *j_lt, *j_eq;
+            jit_reg a, b;
+            e = jit_create(&s, JIT_FLAG_NONE);
+            ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+            a = jit_reg_new(s);
+            b = jit_reg_new(s);
+            i = jit_instr_new(s);
+            MOVE_M_R(i, (int32_t *)&g_w_a, a, JIT_64BIT);
+            i = jit_instr_new(s);
+            MOVE_M_R(i, (int32_t *)&g_w_b, b, JIT_64BIT);
+            i = jit_instr_new(s);
+            MOVE_I_R(i, 0, ret, JIT_32BIT);
+            i = jit_instr_new(s);
+            if(k) {
+                CMP_I_R(i, 0x1234567890ll, a, szs[z]);
+            } else {
+                CMP_R_R(i, a, b, szs[z]);
+            }
+            j_lt = jit_instr_new(s);
+            JUMP_IF(j_lt, JIT_COND_LTU, 0);
+            j_eq = jit_instr_new(s);
+            JUMP_IF(j_eq, JIT_COND_EQ, 0);
+            i = jit_instr_new(s);
+            RET(i);
+            JUMP_TO(j_lt, jit_label_here(s));
+            i = jit_instr_new(s);
+            MOVE_I_R(i, 1, ret, JIT_32BIT);
+            i = jit_instr_new(s);
+            RET(i);
+            JUMP_TO(j_eq, jit_label_here(s));
+            i = jit_instr_new(s);
+            MOVE_I_R(i, 2, ret, JIT_32BIT);
+            i = jit_instr_new(s);
+            RET(i);
+            jit_begin_block(s, abuffer);
+            e = jit_emit_all(s);
+            jit_end_block(s);
+            for(n = 0; n < (int)(sizeof(xs) / sizeof(xs[0])); n++) {
+                uint64_t m = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                    ((uint64_t)1 << (8 * szs[z])) - 1;
+                uint64_t y = k ? (szs[z] == JIT_64BIT ? 0x1234567890ull :
+                        0x34567890ull) : xs[(n + 5) % (sizeof(xs) /
+                            sizeof(xs[0]))];
+                // The 64-bit immediate exercises the same bits as the 32-bit
+                // one, bar the ones that do not fit.
+                g_w_a = (int64_t)(n % 3 ? xs[n] : (y ^ 0xff00000000ull));
+                g_w_b = (int64_t)y;
+                want = (((uint64_t)g_w_a & m) < (y & m)) ? 1 :
+                    (((uint64_t)g_w_a & m) == (y & m)) ? 2 : 0;
+                got = (uint64_t)((p_fn64)abuffer)();
+                nrun++;
+                if(SUCCESS(e) && got == want) {
+                    nok++;
+                } else if(nrun - nok < 10) {
+                    printf(BOLD("@ cmp %zu bytes (%s) of %#llx, %#llx gave "
+                                "%llu, expected %llu\n"), szs[z],
+                            k ? "imm" : "reg", (unsigned long long)g_w_a,
+                            (unsigned long long)y, (unsigned long long)got,
+                            (unsigned long long)want);
+                }
+            }
+            jit_destroy(s);
+            s = NULL;
+        }
+    }
+
+    // Extensions, from a register and from memory, and stores that leave
+    // the bytes around them alone.
+    for(z = 0; z < 4; z++) {
+        for(sign = 0; sign < 2; sign++) {
+            for(k = 0; k < 2; k++) {
+                e = jit_create(&s, JIT_FLAG_NONE);
+                ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+                r = jit_reg_new(s);
+                i = jit_instr_new(s);
+                if(k) {
+                    if(sign) {
+                        MOVSX_M_R(i, (int32_t *)&g_w_a, ret, szs[z]);
+                    } else {
+                        MOVZX_M_R(i, (int32_t *)&g_w_a, ret, szs[z]);
+                    }
+                } else {
+                    MOVE_M_R(i, (int32_t *)&g_w_a, r, JIT_64BIT);
+                    i = jit_instr_new(s);
+                    if(sign) {
+                        MOVSX_R_R(i, r, ret, szs[z]);
+                    } else {
+                        MOVZX_R_R(i, r, ret, szs[z]);
+                    }
+                }
+                i = jit_instr_new(s);
+                MOVE_R_M(i, ret, (int32_t *)&mem[1], szs[z]);
+                i = jit_instr_new(s);
+                RET(i);
+                jit_begin_block(s, abuffer);
+                e = jit_emit_all(s);
+                jit_end_block(s);
+                for(n = 0; n < (int)(sizeof(xs) / sizeof(xs[0])); n++) {
+                    uint64_t m = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                        ((uint64_t)1 << (8 * szs[z])) - 1;
+                    g_w_a = (int64_t)xs[n];
+                    want = xs[n] & m;
+                    if(sign && szs[z] != JIT_64BIT &&
+                            (want >> (8 * szs[z] - 1))) {
+                        want |= ~m;
+                    }
+                    mem[0] = mem[1] = mem[2] = 0x5a5a5a5a5a5a5a5aull;
+                    got = (uint64_t)((p_fn64)abuffer)();
+                    nrun++;
+                    if(SUCCESS(e) && got == want && mem[0] == mem[2] &&
+                            mem[1] == ((mem[2] & ~m) | (want & m))) {
+                        nok++;
+                    } else if(nrun - nok < 10) {
+                        printf(BOLD("@ mov%s %zu bytes from %s of %#llx "
+                                    "gave %#llx, stored %#llx\n"),
+                                sign ? "sx" : "zx", szs[z],
+                                k ? "memory" : "a register",
+                                (unsigned long long)xs[n],
+                                (unsigned long long)got,
+                                (unsigned long long)mem[1]);
+                    }
+                }
+                jit_destroy(s);
+                s = NULL;
+            }
+        }
+    }
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static uint64_t g_sib[64];
+
+struct sib_args {
+    int kind;
+    size_t sz;
+    int has_base;
+    int has_index;
+    int32_t scale;
+    int32_t off;
+};
+
+/* A load (kinds 0 to 2: move, zero- and sign-extending) or store (kind 3)
+ * of sz bytes at [base + index * scale + off], base being &g_sib[32] and
+ * the index g_w_b, storing g_w_a. The result is what was loaded, or none. */
+static jit_error sib_body(struct test_block *t, jit_reg *res)
+{
+    struct sib_args *a = (struct sib_args *)t->arg;
+    jit_state *s = t->s;
+    struct jit_instr *i;
+    jit_reg b = JIT_REG_INVALID, x = JIT_REG_INVALID, v;
+
+    if(a->has_base) {
+        b = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, (int64_t)(uintptr_t)&g_sib[32], b, JIT_64BIT);
+    }
+    if(a->has_index) {
+        x = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_M_R(i, (int32_t *)&g_w_b, x, JIT_64BIT);
+    }
+    v = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_a, v, JIT_64BIT);
+    test_block_cross(t);
+    i = jit_instr_new(s);
+    switch(a->kind) {
+        case 0: MOVE_RP_R(i, b, x, a->scale, a->off, v, a->sz); break;
+        case 1: MOVZX_RP_R(i, b, x, a->scale, a->off, v, a->sz); break;
+        case 2: MOVSX_RP_R(i, b, x, a->scale, a->off, v, a->sz); break;
+        default: MOVE_R_RP(i, v, b, x, a->scale, a->off, a->sz); break;
+    }
+    if(a->kind == 0) {
+        i = jit_instr_new(s);
+        MOVZX_R_R(i, v, v, a->sz);
+    }
+    *res = (a->kind == 3) ? JIT_REG_INVALID : v;
+    return JIT_SUCCESS;
+}
+
+jit_error test_sib(void)
+{
+    /* Base and index, base alone, index alone. */
+    static const struct { int base, index; int32_t scale; } modes[] = {
+        {1, 1, 0}, {1, 1, 1}, {1, 1, 2}, {1, 1, 4}, {1, 1, 8},
+        {1, 0, 1}, {0, 1, 1}, {0, 1, 2}, {0, 1, 4}, {0, 1, 8},
+    };
+    static const int32_t offs[] = { 0, 5, -16, 130, -200 };
+    static const int64_t idxs[] = { 0, 3, -2 };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    struct sib_args sa;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    uint8_t ref[sizeof(g_sib)], *pat = (uint8_t *)g_sib, *at;
+    uint64_t want, got, m;
+    int64_t sc;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int md, kind, z, o, f, n, k, nok = 0, nrun = 0;
+
+    printf("-- test_sib: "UL("Testing [base + index * scale + disp] loads and stores")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    for(md = 0; md < (int)(sizeof(modes) / sizeof(modes[0])); md++) {
+        sc = modes[md].scale ? modes[md].scale : 1;
+        for(kind = 0; kind < 4; kind++) {
+            for(z = 0; z < 4; z++) {
+                for(o = 0; o < (int)(sizeof(offs) / sizeof(offs[0])); o++) {
+                    for(f = 0; f < 4; f++) {
+                        sa.kind = kind;
+                        sa.sz = szs[z];
+                        sa.has_base = modes[md].base;
+                        sa.has_index = modes[md].index;
+                        sa.scale = modes[md].scale;
+                        sa.off = offs[o];
+                        e = test_block(&s, (f & 1) ? JIT_FLAG_LINEAR_SCAN :
+                                JIT_FLAG_NONE, f & 2, 0, sib_body, &sa,
+                                abuffer);
+                        if(FAILURE(e)) {
+                            printf(BOLD("@ mode %d, kind %d, %zu bytes: "
+                                        "emission failed\n"), md, kind,
+                                    szs[z]);
+                            goto l_cleanup;
+                        }
+                        for(n = 0; n < 3; n++) {
+                            // Without a base, the index holds the address.
+                            at = (uint8_t *)&g_sib[32] + offs[o] +
+                                (modes[md].index ? idxs[n] * sc : 0);
+                            g_w_b = modes[md].base ? idxs[n] :
+                                (int64_t)((uintptr_t)&g_sib[32] / sc) +
+                                idxs[n];
+                            g_w_a = (int64_t)0x8899aabbccddeeffull;
+                            for(k = 0; k < (int)sizeof(g_sib); k++) {
+                                pat[k] = (uint8_t)(k * 0x9d + 0x3b);
+                            }
+                            memcpy(ref, pat, sizeof(ref));
+                            m = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                                ((uint64_t)1 << (8 * szs[z])) - 1;
+                            want = 0;
+                            if(kind == 3) {
+                                memcpy(ref + (at - pat), &g_w_a, szs[z]);
+                            } else {
+                                memcpy(&want, at, szs[z]);
+                                if(kind == 2 && szs[z] != JIT_64BIT &&
+                                        (want >> (8 * szs[z] - 1))) {
+                                    want |= ~m;
+                                }
+                            }
+                            want += (f & 2) ? TEST_LIVE_SUM : 0;
+                            got = (uint64_t)((p_fn64)abuffer)();
+                            nrun++;
+                            if(got == want && !memcmp(ref, pat, sizeof(ref))) {
+                                nok++;
+                            } else if(nrun - nok < 10) {
+                                printf(BOLD("@ mode %d, kind %d, %zu bytes, "
+                                            "offset %d, index %lld, flags %d:"
+                                            " gave %#llx, expected %#llx\n"),
+                                        md, kind, szs[z], offs[o],
+                                        (long long)idxs[n], f,
+                                        (unsigned long long)got,
+                                        (unsigned long long)want);
+                            }
+                        }
+                        jit_destroy(s);
+                        s = NULL;
+                    }
+                }
+            }
+        }
+    }
+
+    // Scales x86 cannot encode are refused.
+    sa.kind = 0;
+    sa.sz = JIT_32BIT;
+    sa.has_base = sa.has_index = 1;
+    sa.scale = 3;
+    sa.off = 0;
+    e = test_block(&s, JIT_FLAG_NONE, 0, 0, sib_body, &sa, abuffer);
+    nrun++;
+    if(FAILURE(e)) {
+        nok++;
+    } else {
+        printf(BOLD("@ scale 3 was accepted\n"));
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static uint64_t g_mem[3];
+
+struct memop_args {
+    jit_op op;
+    size_t sz;
+    int form;
+    int rp;
+    int alias;
+    int lt;
+    int64_t c;
+};
+
+/* An ALU operation with g_mem[1] as an operand, either at its address or
+ * as [base + index * 8] with base &g_mem[0] and index 1, the register
+ * input being g_w_b:
+ *   0: out = [m] op b, 1: out = b op [m], 2: out = [m] op imm,
+ *   3: [m] = [m] op b, 4: [m] = b op [m], 5: [m] = [m] op imm,
+ *   6 to 8: compare [m] with b, b with [m], [m] with imm.
+ * The result is out zero-extended, none for updates, and for comparisons
+ * (lhs <u rhs) + 2 * (lhs == rhs); with lt, it is the LTU condition the
+ * operation left instead. The output aliases b (alias 1), the base
+ * (alias 2) or b as the base too (alias 3). */
+static jit_error memop_body(struct test_block *t, jit_reg *res)
+{
+    struct memop_args *a = (struct memop_args *)t->arg;
+    jit_state *s = t->s;
+    struct jit_instr *i, *j_lt, *j_eq, *j_end[2];
+    jit_reg b, base = JIT_REG_INVALID, x = JIT_REG_INVALID, out, r;
+    int32_t *m = (int32_t *)&g_mem[1];
+
+    b = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_b, b, JIT_64BIT);
+    if(a->rp) {
+        base = (a->alias == 3) ? b : jit_reg_new(s);
+        x = jit_reg_new(s);
+        if(a->alias != 3) {
+            i = jit_instr_new(s);
+            MOVE_I_R(i, (int64_t)(uintptr_t)&g_mem[0], base, JIT_64BIT);
+        }
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 1, x, JIT_64BIT);
+    }
+    out = (a->alias == 1 || a->alias == 3) ? b : (a->alias == 2) ? base :
+        jit_reg_new(s);
+    test_block_cross(t);
+    i = jit_instr_new(s);
+    switch(a->form) {
+        case 0: OP_M_R_R(i, a->op, m, b, out, a->sz); break;
+        case 1: OP_R_M_R(i, a->op, b, m, out, a->sz); break;
+        case 2: OP_I_M_R(i, a->op, a->c, m, out, a->sz); break;
+        case 3: OP_M_R_M(i, a->op, m, b, a->sz); break;
+        case 4:
+            OP_R_M_R(i, a->op, b, m, out, a->sz);
+            i->out_type = JIT_OPERAND_IMMPTR;
+            i->out.m32ptr = m;
+            break;
+        case 5: OP_I_M_M(i, a->op, a->c, m, a->sz); break;
+        case 6: CMP_M_R(i, m, b, a->sz); break;
+        case 7: CMP_R_M(i, b, m, a->sz); break;
+        default: CMP_I_M(i, a->c, m, a->sz); break;
+    }
+    if(a->rp) {
+        if(i->in1_type == JIT_OPERAND_IMMPTR) {
+            OPND_RP(i, in1, base, x, 8, 0);
+        }
+        if(i->in2_type == JIT_OPERAND_IMMPTR) {
+            OPND_RP(i, in2, base, x, 8, 0);
+        }
+        if(i->out_type == JIT_OPERAND_IMMPTR) {
+            OPND_RP(i, out, base, x, 8, 0);
+        }
+    }
+    if(a->form >= 6) {
+        r = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, r, JIT_32BIT);
+        j_lt = jit_instr_new(s);
+        JUMP_IF(j_lt, JIT_COND_LTU, 0);
+        j_eq = jit_instr_new(s);
+        JUMP_IF(j_eq, JIT_COND_EQ, 0);
+        j_end[0] = jit_instr_new(s);
+        JUMP(j_end[0], 0);
+        JUMP_TO(j_lt, jit_label_here(s));
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 1, r, JIT_32BIT);
+        j_end[1] = jit_instr_new(s);
+        JUMP(j_end[1], 0);
+        JUMP_TO(j_eq, jit_label_here(s));
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 2, r, JIT_32BIT);
+        // The block goes on after the body.
+        JUMP_TO(j_end[0], jit_label_here(s));
+        JUMP_TO(j_end[1], jit_label_here(s));
+        *res = r;
+    } else if(a->form >= 3) {
+        *res = JIT_REG_INVALID;
+    } else if(a->lt) {
+        r = jit_reg_new(s);
+        i = jit_instr_new(s);
+        SET_IF(i, JIT_COND_LTU, r, JIT_32BIT);
+        *res = r;
+    } else {
+        i = jit_instr_new(s);
+        MOVZX_R_R(i, out, out, a->sz);
+        *res = out;
+    }
+    return JIT_SUCCESS;
+}
+
+jit_error test_memops(void)
+{
+    static const uint64_t xs[] = {
+        0, 1, ~(uint64_t)0, 0x7f, 0x80, 0xff, 0x8000, 0x12345678,
+        0x80000000, 0xfedcba9876543210ull, 0x8000000000000000ull,
+    };
+    static const int64_t imms[] = { 1, -1, 0x7f, -128, 0x1234, INT32_MIN };
+    static const jit_op ops[5] = {
+        JIT_OP_ADD, JIT_OP_SUB, JIT_OP_AND, JIT_OP_OR, JIT_OP_XOR,
+    };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    struct memop_args ma;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    uint64_t want, got, mask, res, lhs, rhs, mem;
+    int64_t c;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    void *code;
+    uint8_t *far = MAP_FAILED;
+    int o, z, form, k, f, rp, alias, lt, n, nok = 0, nrun = 0;
+
+    printf("-- test_memops: "UL("Testing ALU operations on memory")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+    // Code mapped apart from the data cannot reach g_mem from rip.
+    far = mmap(NULL, 8192, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(far == MAP_FAILED) {
+        e = JIT_ERROR_MMAP;
+        goto l_cleanup;
+    }
+
+    for(o = 0; o < 5; o++) {
+        for(z = 0; z < 4; z++) {
+            for(form = 0; form < 9; form++) {
+                // The comparisons once, under the guise of SUB.
+                if((form >= 6 && ops[o] != JIT_OP_SUB) ||
+                        (form == 4 && ops[o] == JIT_OP_SUB)) {
+                    continue;
+                }
+                for(k = 0; k < (int)(sizeof(imms) / sizeof(imms[0])); k++) {
+                    if(k > 0 && form != 2 && form != 5 && form != 8) {
+                        break;
+                    }
+                    c = imms[k];
+                    // Subtractions also leave the condition of a real sub.
+                    for(f = 0; f < 128; f++) {
+                        rp = f & 1;
+                        alias = (f >> 1) & 3;
+                        lt = (f & 32) != 0;
+                        if((alias && form >= 3) || (alias >= 2 && !rp) ||
+                                (alias == 1 && form == 2) || (lt &&
+                                    (form > 1 || ops[o] != JIT_OP_SUB))) {
+                            continue;
+                        }
+                        ma.op = ops[o];
+                        ma.sz = szs[z];
+                        ma.form = form;
+                        ma.rp = rp;
+                        ma.alias = alias;
+                        ma.lt = lt;
+                        ma.c = c;
+                        code = (f & 64) ? (void *)far : abuffer;
+                        e = test_block(&s, (f & 8) ? JIT_FLAG_LINEAR_SCAN :
+                                JIT_FLAG_NONE, f & 16, 0, memop_body, &ma,
+                                code);
+                        if(FAILURE(e)) {
+                            printf(BOLD("@ op %d, %zu bytes, form %d: "
+                                        "emission failed\n"), ops[o], szs[z],
+                                    form);
+                            goto l_cleanup;
+                        }
+                        for(n = 0; n < (int)(sizeof(xs) / sizeof(xs[0]));
+                                n++) {
+                            mask = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                                ((uint64_t)1 << (8 * szs[z])) - 1;
+                            mem = xs[n];
+                            g_w_b = (int64_t)xs[(n * 5 + 2) %
+                                (sizeof(xs) / sizeof(xs[0]))];
+                            // With out as the base, b is the address.
+                            if(alias >= 2) {
+                                g_w_b = (int64_t)(uintptr_t)&g_mem[0];
+                            }
+                            g_mem[0] = g_mem[2] = 0x5a5a5a5a5a5a5a5aull;
+                            g_mem[1] = mem;
+                            lhs = (form == 1 || form == 4 || form == 7) ?
+                                (uint64_t)g_w_b : mem;
+                            rhs = (form == 1 || form == 4 || form == 7) ? mem :
+                                (form == 2 || form == 5 || form == 8) ?
+                                (uint64_t)c : (uint64_t)g_w_b;
+                            res = width_ref(ops[o], szs[z], lhs, rhs);
+                            if(form >= 6) {
+                                want = ((lhs & mask) < (rhs & mask)) ? 1 :
+                                    ((lhs & mask) == (rhs & mask)) ? 2 : 0;
+                            } else if(lt) {
+                                want = (lhs & mask) < (rhs & mask);
+                            } else {
+                                want = (form >= 3) ? 0 : res;
+                            }
+                            want += (f & 16) ? TEST_LIVE_SUM : 0;
+                            got = (uint64_t)((p_fn64)code)();
+                            nrun++;
+                            if(got == want && g_mem[0] == g_mem[2] &&
+                                    g_mem[1] == ((form < 3 || form >= 6) ?
+                                        mem : (mem & ~mask) | res)) {
+                                nok++;
+                            } else if(nrun - nok < 10) {
+                                printf(BOLD("@ op %d, %zu bytes, form %d, "
+                                            "flags %d: %#llx, %#llx gave "
+                                            "%#llx (%#llx in memory), "
+                                            "expected %#llx\n"), ops[o],
+                                        szs[z], form, f,
+                                        (unsigned long long)lhs,
+                                        (unsigned long long)rhs,
+                                        (unsigned long long)got,
+                                        (unsigned long long)g_mem[1],
+                                        (unsigned long long)want);
+                            }
+                        }
+                        jit_destroy(s);
+                        s = NULL;
+                    }
+                }
+            }
+        }
+    }
+
+    // Memory outputs have to be one of the inputs.
+    e = jit_create(&s, JIT_FLAG_NONE);
+    if(SUCCESS(e)) {
+        struct jit_instr *i;
+        jit_reg r = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 1, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_ADD, r, r, 0, JIT_32BIT);
+        i->out_type = JIT_OPERAND_IMMPTR;
+        i->out.m32ptr = (int32_t *)&g_mem[1];
+        i = jit_instr_new(s);
+        RET(i);
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        nrun++;
+        if(FAILURE(e)) {
+            nok++;
+        } else {
+            printf(BOLD("@ a memory output unrelated to the inputs was "
+                        "accepted\n"));
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    free(buffer);
+    if(far != MAP_FAILED) {
+        munmap(far, 8192);
+    }
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+#define SELECT_OUT_INIT ((int64_t)0x5a5a5a5a5a5a5a5aull)
+
+struct select_args {
+    size_t sz;
+    int form;
+    jit_cond c;
+    int64_t imm;
+};
+
+/* Compare g_w_a with g_w_b, clear a register, then on condition c:
+ *   0: set out, 1 to 4: move into out from a register, an immediate, an
+ *   address or [base + index * 8], the value being imm or g_mem[1].
+ * The result is out zero-extended, plus the cleared register. */
+static jit_error select_body(struct test_block *t, jit_reg *res)
+{
+    struct select_args *a = (struct select_args *)t->arg;
+    jit_state *s = t->s;
+    struct jit_instr *i;
+    jit_reg ra, rb, src = JIT_REG_INVALID, base, x, out, z;
+    size_t sz = a->sz;
+
+    ra = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_a, ra, JIT_64BIT);
+    rb = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_b, rb, JIT_64BIT);
+    if(a->form == 1) {
+        src = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, a->imm, src, JIT_64BIT);
+    }
+    base = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, (int64_t)(uintptr_t)&g_mem[0], base, JIT_64BIT);
+    x = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 1, x, JIT_64BIT);
+    out = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, SELECT_OUT_INIT, out, JIT_64BIT);
+    test_block_cross(t);
+    i = jit_instr_new(s);
+    CMP_R_R(i, ra, rb, sz);
+    // Between the comparison and its use, so not with xor.
+    z = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_I_R(i, 0, z, JIT_32BIT);
+    i = jit_instr_new(s);
+    switch(a->form) {
+        case 0: SET_IF(i, a->c, out, sz); break;
+        case 1: MOVE_IF_R_R(i, a->c, src, out, sz); break;
+        case 2: MOVE_IF_I_R(i, a->c, a->imm, out, sz); break;
+        case 3: MOVE_IF_M_R(i, a->c, (int32_t *)&g_mem[1], out, sz); break;
+        default: MOVE_IF_RP_R(i, a->c, base, x, 8, 0, out, sz); break;
+    }
+    i = jit_instr_new(s);
+    MOVZX_R_R(i, out, out, sz);
+    i = jit_instr_new(s);
+    OP_R_R_R(i, JIT_OP_ADD, out, z, out, JIT_64BIT);
+    *res = out;
+    return JIT_SUCCESS;
+}
+
+/* Whether condition c holds between the low sz bytes of a and b. */
+static int select_ref(jit_cond c, size_t sz, uint64_t a, uint64_t b)
+{
+    int sh = 64 - 8 * (int)sz;
+    uint64_t ua = (a << sh) >> sh, ub = (b << sh) >> sh;
+    int64_t sa = (int64_t)(a << sh) >> sh, sb = (int64_t)(b << sh) >> sh;
+    // The difference, at the top of 64 bits so that its sign is bit 63.
+    uint64_t ta = a << sh, tb = b << sh, d = ta - tb;
+
+    switch(c) {
+        case JIT_COND_EQ: return ua == ub;
+        case JIT_COND_NE: return ua != ub;
+        case JIT_COND_LT: return sa < sb;
+        case JIT_COND_LE: return sa <= sb;
+        case JIT_COND_GT: return sa > sb;
+        case JIT_COND_GE: return sa >= sb;
+        case JIT_COND_LTU: return ua < ub;
+        case JIT_COND_LEU: return ua <= ub;
+        case JIT_COND_GTU: return ua > ub;
+        case JIT_COND_GEU: return ua >= ub;
+        case JIT_COND_NEG: return (int64_t)d < 0;
+        case JIT_COND_NNEG: return (int64_t)d >= 0;
+        case JIT_COND_OV: return (int64_t)((ta ^ tb) & (ta ^ d)) < 0;
+        default: return (int64_t)((ta ^ tb) & (ta ^ d)) >= 0;
+    }
+}
+
+jit_error test_select(void)
+{
+    static const uint64_t xs[] = {
+        0, 1, ~(uint64_t)0, 0x7f, 0x80, 0xff, 0x8000, 0x80000000,
+        0xfedcba9876543210ull, 0x8000000000000000ull,
+    };
+    static const int64_t imms[] = {
+        0x1234, -2, (int64_t)0x89abcdef01234567ull,
+    };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    struct select_args sa;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    jit_reg ret, r, base;
+    uint64_t want, got, mask, val;
+    int64_t imm;
+    uint8_t *edge = MAP_FAILED;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int z, form, c, f, n, m, nok = 0, nrun = 0;
+    int nx = (int)(sizeof(xs) / sizeof(xs[0]));
+
+    printf("-- test_select: "UL("Testing SET_IF and MOVE_IF")"\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    for(z = 0; z < 4; z++) {
+        for(form = 0; form < 5; form++) {
+            for(c = 0; c < JIT_NUM_CONDS; c++) {
+                for(f = 0; f < 8; f++) {
+                    imm = imms[(form + c + f) % 3];
+                    sa.sz = szs[z];
+                    sa.form = form;
+                    sa.c = (jit_cond)c;
+                    sa.imm = imm;
+                    e = test_block(&s, (f & 1) ? JIT_FLAG_LINEAR_SCAN :
+                            JIT_FLAG_NONE, f & 2, f & 4, select_body, &sa,
+                            abuffer);
+                    if(FAILURE(e)) {
+                        printf(BOLD("@ %zu bytes, form %d, condition %d: "
+                                    "emission failed\n"), szs[z], form, c);
+                        goto l_cleanup;
+                    }
+                    for(n = 0; n < nx; n++) {
+                        for(m = 0; m < nx; m += 3) {
+                            mask = (szs[z] == JIT_64BIT) ? ~(uint64_t)0 :
+                                ((uint64_t)1 << (8 * szs[z])) - 1;
+                            g_w_a = (int64_t)xs[n];
+                            g_w_b = (int64_t)xs[(n + m) % nx];
+                            g_mem[1] = 0x0f1e2d3c4b5a6978ull ^ xs[m];
+                            val = (form >= 3) ? g_mem[1] : (uint64_t)imm;
+                            if(form == 0) {
+                                want = select_ref(c, szs[z], g_w_a, g_w_b);
+                            } else {
+                                want = (select_ref(c, szs[z], g_w_a, g_w_b) ?
+                                    val : (uint64_t)SELECT_OUT_INIT) & mask;
+                            }
+                            want += (f & 2) ? TEST_LIVE_SUM : 0;
+                            got = (uint64_t)((p_fn64)abuffer)();
+                            nrun++;
+                            if(got == want) {
+                                nok++;
+                            } else if(nrun - nok < 10) {
+                                printf(BOLD("@ %zu bytes, form %d, "
+                                            "condition %d, flags %d: "
+                                            "%#llx, %#llx gave %#llx, "
+                                            "expected %#llx\n"), szs[z],
+                                        form, c, f,
+                                        (unsigned long long)g_w_a,
+                                        (unsigned long long)g_w_b,
+                                        (unsigned long long)got,
+                                        (unsigned long long)want);
+                            }
+                        }
+                    }
+                    jit_destroy(s);
+                    s = NULL;
+                }
+            }
+        }
+    }
+
+    // A byte moved from just before an unmapped page, from an address and
+    // from [base], must be read alone.
+    edge = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(edge == MAP_FAILED) {
+        e = JIT_ERROR_MMAP;
+        goto l_cleanup;
+    }
+    mprotect(edge + page, page, PROT_NONE);
+    edge[page - 1] = 0xa7;
+    for(f = 0; f < 4; f++) {
+        e = jit_create(&s, (f & 2) ? JIT_FLAG_LINEAR_SCAN : JIT_FLAG_NONE);
+        ret = jit_reg_new_fixed(s, JIT_REGMAP_CALL_RET);
+        r = jit_reg_new(s);
+        base = jit_reg_new(s);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, SELECT_OUT_INIT, ret, JIT_64BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, (int64_t)(uintptr_t)&edge[page - 1], base, JIT_64BIT);
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 0, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        CMP_R_R(i, r, r, JIT_8BIT);
+        i = jit_instr_new(s);
+        if(f & 1) {
+            MOVE_IF_RP_R(i, JIT_COND_EQ, base, JIT_REG_INVALID, 0, 0, ret,
+                    JIT_8BIT);
+        } else {
+            MOVE_IF_M_R(i, JIT_COND_EQ, (int32_t *)&edge[page - 1], ret,
+                    JIT_8BIT);
+        }
+        i = jit_instr_new(s);
+        MOVZX_R_R(i, ret, ret, JIT_8BIT);
+        i = jit_instr_new(s);
+        RET(i);
+        jit_begin_block(s, abuffer);
+        e = jit_emit_all(s);
+        jit_end_block(s);
+        if(FAILURE(e)) {
+            printf(BOLD("@ byte before a guard page: emission failed\n"));
+            goto l_cleanup;
+        }
+        got = (uint64_t)((p_fn64)abuffer)();
+        nrun++;
+        if(got == 0xa7) {
+            nok++;
+        } else {
+            printf(BOLD("@ byte before a guard page, flags %d: gave %#llx\n"),
+                    f, (unsigned long long)got);
+        }
+        jit_destroy(s);
+        s = NULL;
+    }
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    free(buffer);
+    if(edge != MAP_FAILED) {
+        munmap(edge, 2 * page);
+    }
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+static struct jit_guest_flags_record g_flags_rec;
+
+struct guest_flags_args {
+    size_t sz;
+    jit_op op;
+    int form;
+    int clobber;
+    int64_t imm;
+};
+
+/* x = g_w_a op g_w_b (form 0), g_w_a op imm (1), g_w_a op [g_w_b] (2) or
+ * g_w_b op g_w_a into the right operand (3), as defining the guest flags,
+ * maybe followed by y = g_w_b + 1 setting the host ones. The guest flags
+ * are then read back with SET_IF, and stored to g_flags_rec. The result is
+ * them packed as the JIT_GUEST_ bits, plus y. */
+static jit_error guest_flags_body(struct test_block *t, jit_reg *res)
+{
+    static const jit_cond conds[4] = {
+        JIT_COND_LTU, JIT_COND_EQ, JIT_COND_NEG, JIT_COND_OV,
+    };
+    struct guest_flags_args *a = (struct guest_flags_args *)t->arg;
+    jit_state *s = t->s;
+    jit_error e;
+    struct jit_instr *i;
+    struct jit_guest_flags f;
+    jit_reg ra, rb, x, y = JIT_REG_INVALID, bits[4];
+    size_t sz = a->sz;
+    int k;
+
+    e = jit_guest_flags_init(s, &f);
+    if(FAILURE(e)) {
+        return e;
+    }
+    ra = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_a, ra, JIT_64BIT);
+    rb = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_M_R(i, (int32_t *)&g_w_b, rb, JIT_64BIT);
+    x = jit_reg_new(s);
+    i = jit_instr_new(s);
+    MOVE_R_R(i, ra, x, JIT_64BIT);
+    test_block_cross(t);
+
+    i = jit_instr_new(s);
+    switch(a->form) {
+        case 0: OP_R_R_R(i, a->op, x, rb, x, sz); break;
+        case 1: OP_I_R_R(i, a->op, a->imm, x, x, sz); break;
+        case 2: OP_R_M_R(i, a->op, x, (int32_t *)&g_w_b, x, sz); break;
+        default: OP_R_R_R(i, a->op, rb, x, x, sz); break;
+    }
+    if(a->op == JIT_OP_CMP) {
+        i->out_type = JIT_OPERAND_INVALID;
+    }
+    e = jit_guest_flags_set(s, &f);
+    if(FAILURE(e)) {
+        return e;
+    }
+    if(a->clobber) {
+        y = jit_reg_new(s);
+        i = jit_instr_new(s);
+        OP_I_R_R(i, JIT_OP_ADD, 1, rb, y, JIT_64BIT);
+    }
+    e = jit_guest_flags_get(s, &f);
+    if(FAILURE(e)) {
+        return e;
+    }
+    for(k = 0; k < 4; k++) {
+        bits[k] = jit_reg_new(s);
+        i = jit_instr_new(s);
+        SET_IF(i, conds[k], bits[k], JIT_32BIT);
+    }
+    for(k = 1; k < 4; k++) {
+        i = jit_instr_new(s);
+        OP_I_R_R(i, JIT_OP_SHL, k, bits[k], bits[k], JIT_32BIT);
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_OR, bits[0], bits[k], bits[0], JIT_32BIT);
+    }
+    if(a->clobber) {
+        i = jit_instr_new(s);
+        OP_R_R_R(i, JIT_OP_ADD, bits[0], y, bits[0], JIT_64BIT);
+    }
+    e = jit_guest_flags_store(s, &f, &g_flags_rec);
+    *res = bits[0];
+    return e;
+}
+
+/* The JIT_GUEST_ flags of a op b on sz bytes, as x86 sets them. */
+static uint32_t guest_flags_ref(jit_op op, size_t sz, uint64_t a, uint64_t b)
+{
+    int sh = 64 - 8 * (int)sz;
+    uint64_t r;
+    uint32_t fl = 0;
+
+    // Worked at the top of 64 bits, where the carry and sign are those of
+    // the narrower operation.
+    a <<= sh;
+    b <<= sh;
+    switch(op) {
+        case JIT_OP_ADD:
+            r = a + b;
+            fl |= (r < a) ? JIT_GUEST_CARRY : 0;
+            fl |= ((int64_t)((a ^ r) & (b ^ r)) < 0) ? JIT_GUEST_OVERFLOW : 0;
+            break;
+        case JIT_OP_SUB:
+        case JIT_OP_CMP:
+            r = a - b;
+            fl |= (a < b) ? JIT_GUEST_CARRY : 0;
+            fl |= ((int64_t)((a ^ b) & (a ^ r)) < 0) ? JIT_GUEST_OVERFLOW : 0;
+            break;
+        case JIT_OP_AND: r = a & b; break;
+        case JIT_OP_OR: r = a | b; break;
+        default: r = a ^ b; break;
+    }
+    fl |= (r == 0) ? JIT_GUEST_ZERO : 0;
+    fl |= ((int64_t)r < 0) ? JIT_GUEST_NEG : 0;
+    return fl;
+}
+
+jit_error test_guest_flags(void)
+{
+    static const uint64_t xs[] = {
+        0, 1, ~(uint64_t)0, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0x7fffffff,
+        0x80000000, 0xfedcba9876543210ull, 0x8000000000000000ull,
+    };
+    static const int64_t imms[] = {
+        1, -1, 0x80, 0x7fffffff, (int64_t)0x89abcdef01234567ull,
+    };
+    static const jit_op ops[6] = {
+        JIT_OP_ADD, JIT_OP_SUB, JIT_OP_CMP, JIT_OP_AND, JIT_OP_OR, JIT_OP_XOR,
+    };
+    static const size_t szs[4] = {
+        JIT_8BIT, JIT_16BIT, JIT_32BIT, JIT_64BIT,
+    };
+    struct guest_flags_args ga;
+    jit_state *s = NULL;
+    jit_error e = JIT_SUCCESS;
+    struct jit_instr *i;
+    uint64_t b, want, got;
+    uint32_t stored;
+    int64_t imm;
+
+    void *buffer = NULL;
+    void *abuffer = NULL;
+    int z, o, form, cl, f, n, m, nflags, nok = 0, nrun = 0;
+    int nx = (int)(sizeof(xs) / sizeof(xs[0]));
+
+    printf("-- test_guest_flags: "UL("Testing lazily evaluated guest flags")
+            "\n--\n");
+    buffer = malloc(8192 * 2);
+    abuffer = (void *)(((uintptr_t)buffer + 4096 - 1) & ~(4096 - 1));
+    mprotect(abuffer, 8192, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    for(z = 0; z < 4; z++) {
+        for(o = 0; o < 6; o++) {
+            for(form = 0; form < 4; form++) {
+                for(cl = 0; cl < 2; cl++) {
+                    for(f = 0; f < 8; f++) {
+                        imm = imms[(z + o + form + f) % 5];
+                        ga.sz = szs[z];
+                        ga.op = ops[o];
+                        ga.form = form;
+                        ga.clobber = cl;
+                        ga.imm = imm;
+                        e = test_block(&s, (f & 1) ? JIT_FLAG_LINEAR_SCAN :
+                                JIT_FLAG_NONE, f & 2, f & 4, guest_flags_body,
+                                &ga, abuffer);
+                        if(FAILURE(e)) {
+                            printf(BOLD("@ %zu bytes, op %d, form %d: "
+                                        "emission failed\n"), szs[z], ops[o],
+                                    form);
+                            goto l_cleanup;
+                        }
+                        nflags = 0;
+                        for(i = s->blk_is; i != NULL; i = i->next) {
+                            nflags += (i->op == JIT_OP_FLAGS);
+                        }
+                        // Without another operation in between, the flags
+                        // are still the operation's own, unless it was a
+                        // SUB or CMP on memory.
+                        nrun++;
+                        if((f & 4) && nflags != (cl || (form == 2 &&
+                                        (ops[o] == JIT_OP_SUB ||
+                                         ops[o] == JIT_OP_CMP)))) {
+                            printf(BOLD("@ %zu bytes, op %d, form %d, "
+                                        "clobber %d: %d FLAGS left\n"),
+                                    szs[z], ops[o], form, cl, nflags);
+                        } else {
+                            nok++;
+                        }
+                        for(n = 0; n < nx; n++) {
+                            for(m = 0; m < nx; m += 5) {
+                                g_w_a = (int64_t)xs[n];
+                                g_w_b = (int64_t)xs[(n + m) % nx];
+                                b = (form == 1) ? (uint64_t)imm :
+                                    (uint64_t)g_w_b;
+                                want = (form == 3) ?
+                                    guest_flags_ref(ops[o], szs[z], b,
+                                            (uint64_t)g_w_a) :
+                                    guest_flags_ref(ops[o], szs[z],
+                                            (uint64_t)g_w_a, b);
+                                memset(&g_flags_rec, 0, sizeof(g_flags_rec));
+                                got = (uint64_t)((p_fn64)abuffer)() -
+                                    ((f & 2) ? TEST_LIVE_SUM : 0) - (cl ?
+                                            (uint64_t)g_w_b + 1 : 0);
+                                stored = jit_guest_flags_eval(&g_flags_rec);
+                                nrun++;
+                                if(got == want && stored == want) {
+                                    nok++;
+                                } else if(nrun - nok < 10) {
+                                    printf(BOLD("@ %zu bytes, op %d, "
+                                                "form %d, clobber %d, "
+                                                "flags %d: %#llx, %#llx "
+                                                "gave %#llx (stored %#x), "
+                                                "expected %#llx\n"), szs[z],
+                                            ops[o], form, cl, f,
+                                            (unsigned long long)g_w_a,
+                                            (unsigned long long)b,
+                                            (unsigned long long)got, stored,
+                                            (unsigned long long)want);
+                                }
+                            }
+                        }
+                        jit_destroy(s);
+                        s = NULL;
+                    }
+                }
+            }
+        }
+    }
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    free(buffer);
+    if(s != NULL) {
+        jit_destroy(s);
+    }
+
+    return e;
+}
+
+#define GUEST_LOOPS 1000
+
+static int64_t g_guest_count, g_guest_other, g_guest_next, g_guest_sum;
+
+/* Translate the guest block at pc, of a program that goes round 0x1000 and
+ * 0x2000 GUEST_LOOPS times, then to 0x3000, which leaves for the address
+ * in g_guest_next (0x4000, with pressure after adding 1 to 13 into
+ * g_guest_sum), which halts by leaving for 0. */
+static jit_error guest_translate(struct jit_blockcache *bc, uint64_t pc,
+        jit_flags flags, int pressure, void **code)
+{
+    jit_state *s;
+    jit_error e;
+    struct jit_instr *i, *j;
+    jit_reg r, acc, xs[13];
+    int k;
+
+    e = jit_create(&s, flags);
+    if(FAILURE(e)) {
+        return e;
+    }
+    r = jit_reg_new(s);
+    switch(pc) {
+        case 0x1000:
+            i = jit_instr_new(s);
+            MOVE_M_R(i, (int32_t *)&g_guest_count, r, JIT_64BIT);
+            i = jit_instr_new(s);
+            ADD_I_R_R(i, 1, r, r, JIT_64BIT);
+            i = jit_instr_new(s);
+            MOVE_R_M(i, r, (int32_t *)&g_guest_count, JIT_64BIT);
+            i = jit_instr_new(s);
+            CMP_I_R(i, GUEST_LOOPS, r, JIT_64BIT);
+            j = jit_instr_new(s);
+            JUMP_IF(j, JIT_COND_GEU, 0);
+            i = jit_instr_new(s);
+            EXIT_I(i, 0x2000);
+            JUMP_TO(j, jit_label_here(s));
+            i = jit_instr_new(s);
+            EXIT_I(i, 0x3000);
+            break;
+        case 0x2000:
+            i = jit_instr_new(s);
+            MOVE_M_R(i, (int32_t *)&g_guest_other, r, JIT_64BIT);
+            i = jit_instr_new(s);
+            ADD_I_R_R(i, 1, r, r, JIT_64BIT);
+            i = jit_instr_new(s);
+            MOVE_R_M(i, r, (int32_t *)&g_guest_other, JIT_64BIT);
+            i = jit_instr_new(s);
+            EXIT_I(i, 0x1000);
+            break;
+        case 0x3000:
+            i = jit_instr_new(s);
+            MOVE_M_R(i, (int32_t *)&g_guest_next, r, JIT_64BIT);
+            if(pressure) {
+                acc = jit_reg_new(s);
+                i = jit_instr_new(s);
+                MOVE_I_R(i, 0, acc, JIT_64BIT);
+                for(k = 0; k < 13; k++) {
+                    xs[k] = jit_reg_new(s);
+                    i = jit_instr_new(s);
+                    MOVE_I_R(i, k + 1, xs[k], JIT_64BIT);
+                }
+                for(k = 0; k < 13; k++) {
+                    i = jit_instr_new(s);
+                    ADD_R_R_R(i, acc, xs[k], acc, JIT_64BIT);
+                }
+                i = jit_instr_new(s);
+                MOVE_R_M(i, acc, (int32_t *)&g_guest_sum, JIT_64BIT);
+            }
+            i = jit_instr_new(s);
+            EXIT_R(i, r);
+            break;
+        default:
+            i = jit_instr_new(s);
+            EXIT_I(i, 0);
+            break;
+    }
+
+    e = jit_blockcache_add(bc, s, pc, code);
+    jit_destroy(s);
+    return e;
+}
+
+/* Run the guest program from 0x1000 until it halts, translating blocks as
+ * needed. */
+static jit_error guest_run(struct jit_blockcache *bc, jit_flags flags,
+        int pressure, int *nrounds, int *ntrans)
+{
+    jit_error e = JIT_SUCCESS;
+    uint64_t pc = 0x1000;
+    void *code;
+
+    g_guest_count = g_guest_other = g_guest_sum = 0;
+    g_guest_next = 0x4000;
+    *nrounds = *ntrans = 0;
+    while(pc != 0 && *nrounds < 4 * GUEST_LOOPS) {
+        code = jit_blockcache_lookup(bc, pc);
+        if(code == NULL) {
+            e = guest_translate(bc, pc, flags, pressure, &code);
+            if(FAILURE(e)) {
+                break;
+            }
+            (*ntrans)++;
+        }
+        pc = (uint64_t)((p_fn64)code)();
+        (*nrounds)++;
+    }
+    return e;
+}
+
+jit_error test_blockcache(void)
+{
+    /* Round trips and translations of a first run, one after dropping
+     * 0x2000, and one with every block there. */
+    static const int want_rounds[3] = { 4, 2, 1 };
+    static const int want_trans[3] = { 4, 1, 0 };
+    struct jit_codecache *c = NULL;
+    struct jit_blockcache *bc = NULL;
+    jit_error e = JIT_SUCCESS;
+    int f, run, nrounds, ntrans, nok = 0, nrun = 0;
+
+    printf("-- test_blockcache: "UL("Testing chained translated blocks")
+            "\n--\n");
+    for(f = 0; f < 4; f++) {
+        e = jit_codecache_create(&c, 0);
+        if(SUCCESS(e)) {
+            e = jit_blockcache_create(&bc, c, 64);
+        }
+        if(FAILURE(e)) {
+            goto l_cleanup;
+        }
+        for(run = 0; run < 3; run++) {
+            if(run == 1) {
+                jit_blockcache_invalidate(bc, 0x2000);
+                if(jit_blockcache_lookup(bc, 0x2000) != NULL) {
+                    printf(BOLD("@ 0x2000 still there\n"));
+                    e = JIT_ERROR_UNKNOWN;
+                    goto l_cleanup;
+                }
+            }
+            e = guest_run(bc, (f & 1) ? JIT_FLAG_LINEAR_SCAN :
+                    JIT_FLAG_NONE, f & 2, &nrounds, &ntrans);
+            nrun++;
+            if(SUCCESS(e) && nrounds == want_rounds[run] &&
+                    ntrans == want_trans[run] &&
+                    g_guest_count == GUEST_LOOPS &&
+                    g_guest_other == GUEST_LOOPS - 1 &&
+                    g_guest_sum == ((f & 2) ? 91 : 0)) {
+                nok++;
+            } else {
+                printf(BOLD("@ flags %d, run %d: %d round trips, %d "
+                            "translations, counts %lld and %lld\n"), f, run,
+                        nrounds, ntrans, (long long)g_guest_count,
+                        (long long)g_guest_other);
+            }
+        }
+        jit_blockcache_destroy(bc);
+        jit_codecache_destroy(c);
+        bc = NULL;
+        c = NULL;
+    }
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    if(bc != NULL) {
+        jit_blockcache_destroy(bc);
+    }
+    if(c != NULL) {
+        jit_codecache_destroy(c);
+    }
+
+    return e;
+}
+
+#define SMC_HALT 0x100000
+
+static uint8_t *g_smc_mem;
+static size_t g_smc_page;
+static int32_t g_smc_acc;
+
+/* Translate the guest block at pc: the ones at 0 and 4 add the word there
+ * into g_smc_acc, and go on to 4 and halt. The one on the next page stores
+ * 7 over the word at 4, and halts. */
+static jit_error smc_translate(struct jit_blockcache *bc, uint64_t pc,
+        void **code)
+{
+    jit_state *s;
+    jit_error e;
+    struct jit_instr *i;
+    jit_reg r;
+    int32_t v;
+
+    e = jit_create(&s, JIT_FLAG_NONE);
+    if(FAILURE(e)) {
+        return e;
+    }
+    r = jit_reg_new(s);
+    if(pc == g_smc_page) {
+        i = jit_instr_new(s);
+        MOVE_I_R(i, 7, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_R_M(i, r, (int32_t *)(g_smc_mem + 4), JIT_32BIT);
+    } else {
+        memcpy(&v, g_smc_mem + pc, sizeof(v));
+        i = jit_instr_new(s);
+        MOVE_M_R(i, &g_smc_acc, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        ADD_I_R_R(i, v, r, r, JIT_32BIT);
+        i = jit_instr_new(s);
+        MOVE_R_M(i, r, &g_smc_acc, JIT_32BIT);
+    }
+    i = jit_instr_new(s);
+    EXIT_I(i, pc == 0 ? 4 : SMC_HALT);
+
+    e = jit_blockcache_add(bc, s, pc, code);
+    if(SUCCESS(e)) {
+        e = jit_blockcache_watch(bc, pc, g_smc_mem + pc, sizeof(int32_t));
+    }
+    jit_destroy(s);
+    return e;
+}
+
+/* Run the guest program from pc until it halts, and check the sum and the
+ * number of translations it took. */
+static int smc_run(struct jit_blockcache *bc, uint64_t pc, int32_t want_acc,
+        int want_trans)
+{
+    jit_error e = JIT_SUCCESS;
+    int ntrans = 0, nrounds = 0;
+    void *code;
+
+    g_smc_acc = 0;
+    while(pc != SMC_HALT && nrounds++ < 8) {
+        code = jit_blockcache_lookup(bc, pc);
+        if(code == NULL) {
+            e = smc_translate(bc, pc, &code);
+            if(FAILURE(e)) {
+                break;
+            }
+            ntrans++;
+        }
+        pc = (uint64_t)((p_fn64)code)();
+    }
+    if(SUCCESS(e) && pc == SMC_HALT && g_smc_acc == want_acc &&
+            ntrans == want_trans) {
+        return 1;
+    }
+    printf(BOLD("@ sum %d, %d translations, wanted %d and %d\n"),
+            (int)g_smc_acc, ntrans, (int)want_acc, want_trans);
+    return 0;
+}
+
+jit_error test_smc(void)
+{
+    struct jit_codecache *c = NULL;
+    struct jit_blockcache *bc = NULL, *bc2 = NULL;
+    jit_error e = JIT_SUCCESS;
+    int32_t v;
+    int nok = 0, nrun = 0;
+
+    printf("-- test_smc: "UL("Testing self-modifying code invalidation")
+            "\n--\n");
+    g_smc_page = (size_t)sysconf(_SC_PAGESIZE);
+    g_smc_mem = mmap(NULL, 2 * g_smc_page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(g_smc_mem == MAP_FAILED) {
+        return JIT_ERROR_MMAP;
+    }
+    v = 3;
+    memcpy(g_smc_mem, &v, sizeof(v));
+    v = 5;
+    memcpy(g_smc_mem + 4, &v, sizeof(v));
+
+    e = jit_codecache_create(&c, 0);
+    if(SUCCESS(e)) {
+        e = jit_blockcache_create(&bc, c, 64);
+    }
+    if(SUCCESS(e)) {
+        e = jit_blockcache_protect(bc);
+    }
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+
+    // Both blocks get translated once, and then stay.
+    nok += smc_run(bc, 0, 8, 2);
+    nok += smc_run(bc, 0, 8, 0);
+    nrun += 2;
+
+    // Generated code writing to the first page drops the blocks there, but
+    // not the one doing the write.
+    nok += smc_run(bc, g_smc_page, 0, 1);
+    nok += (jit_blockcache_lookup(bc, 0) == NULL &&
+            jit_blockcache_lookup(bc, 4) == NULL &&
+            jit_blockcache_lookup(bc, g_smc_page) != NULL);
+    nok += smc_run(bc, 0, 10, 2);
+    nrun += 3;
+
+    // The page is protected again once retranslated: so are writes from C.
+    v = 4;
+    memcpy(g_smc_mem, &v, sizeof(v));
+    nok += smc_run(bc, 0, 11, 2);
+    nok += smc_run(bc, g_smc_page, 0, 0);
+    nok += (jit_blockcache_lookup(bc, 0) == NULL);
+    nrun += 3;
+
+    // With a write barrier instead, only the block written to goes.
+    e = jit_blockcache_create(&bc2, c, 64);
+    if(FAILURE(e)) {
+        goto l_cleanup;
+    }
+    nok += smc_run(bc2, 0, 11, 2);
+    v = 9;
+    memcpy(g_smc_mem + 4, &v, sizeof(v));
+    jit_blockcache_invalidate_range(bc2, g_smc_mem + 4, 1);
+    nok += (jit_blockcache_lookup(bc2, 0) != NULL &&
+            jit_blockcache_lookup(bc2, 4) == NULL);
+    nok += smc_run(bc2, 0, 13, 1);
+    nrun += 3;
+
+    printf(BOLD("@ %d of %d right\n"), nok, nrun);
+    e = (nok == nrun) ? JIT_SUCCESS : JIT_ERROR_UNKNOWN;
+
+l_cleanup:
+    if(bc2 != NULL) {
+        jit_blockcache_destroy(bc2);
+    }
+    if(bc != NULL) {
+        jit_blockcache_destroy(bc);
+    }
+    if(c != NULL) {
+        jit_codecache_destroy(c);
+    }
+    munmap(g_smc_mem, 2 * g_smc_page);
+
+    return e;
+}